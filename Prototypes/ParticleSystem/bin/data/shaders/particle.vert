@@ -15,7 +15,9 @@
 
 #pragma include <inc/view_info.glsl>
 
-uniform samplerBuffer uOffsetTex;
+// one texel per instance: position float bits, then the radius as a half float in the low
+// 16 bits and the octahedral 8:8 direction of travel in the high 16 bits
+uniform usamplerBuffer uOffsetTex;
 
 out vec4 vVertex;
 out vec3 vNormal;
@@ -42,6 +44,36 @@ out vec3 vNormal_ws;
 
 #define scale offset.w
 
+// unpackHalf2x16 needs 4.20, positive normal halfs are all the radius uses
+float decodeHalf( uint _half )
+{
+    uint exponent = ( _half >> 10 ) & 31u;
+    return exponent == 0u ? 0.0 : exp2( float( exponent ) - 15.0 ) * ( 1.0 + float( _half & 1023u ) / 1024.0 );
+}
+
+vec3 decodeDirection( uint _oct )
+{
+    vec2 e = vec2( float( _oct & 255u ), float( _oct >> 8 ) ) / 255.0 * 2.0 - 1.0;
+    vec3 v = vec3( e, 1.0 - abs( e.x ) - abs( e.y ) );
+    if ( v.z < 0.0 )
+    {
+        vec2 signs = vec2( v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0 );
+        v.xy = ( 1.0 - abs( v.yx ) ) * signs;
+    }
+    return normalize( v );
+}
+
+// the rotation of lookAt( 0, direction, up y ), identity when facing straight up or down
+mat3 createLookAtRotation( vec3 _dir )
+{
+    vec3 side = cross( _dir, vec3( 0.0, 1.0, 0.0 ) );
+    if ( dot( side, side ) < 1e-6 ) return mat3( 1.0 );
+
+    side = normalize( side );
+    vec3 up = cross( side, _dir );
+    return transpose( mat3( side, up, -_dir ) );
+}
+
 void main( void )
 {
 /*
@@ -66,12 +98,17 @@ void main( void )
     );
 */
 
-    int idx = gl_InstanceID * 4;
-    mat4 transform = mat4( 
-        texelFetch( uOffsetTex, idx ),
-        texelFetch( uOffsetTex, idx+1 ),
-        texelFetch( uOffsetTex, idx+2 ), 
-        texelFetch( uOffsetTex, idx+3 )
+    uvec4 instance = texelFetch( uOffsetTex, gl_InstanceID );
+    vec3 offset = uintBitsToFloat( instance.xyz );
+    float radius = decodeHalf( instance.w & 65535u );
+    mat3 rotation = radius * createLookAtRotation( decodeDirection( instance.w >> 16 ) );
+
+    // translate * scale * lookAt, as the cpu used to build it
+    mat4 transform = mat4(
+        vec4( rotation[ 0 ], 0.0 ),
+        vec4( rotation[ 1 ], 0.0 ),
+        vec4( rotation[ 2 ], 0.0 ),
+        vec4( offset, 1.0 )
     );
 
     mat4 mvMatrix = modelViewMatrix * transform;
@@ -1,35 +1,86 @@
 #include "ParticleSystem.h"
-#include "lb/util/RadixSort.h"
+#include "ofxNuma.h"
+#include "ofxProfiler.h"
 
-#include "glm/gtx/transform.hpp"
+#include <algorithm>
+#include <random>
 
 ParticleSystem::ParticleSystem()
-    : m_particlePool( nullptr )
+    : m_particlePool()
+    , m_maxParticles( 0 )
     , m_numParticles( 0 )
+    , m_binDims( 0, 0, 0 )
+    , m_numBins( 0 )
+    , m_bGpuUpload( true )
+    , m_neighborRange( 2 )
+    , m_instances( nullptr )
+    , m_forceAccumulation( OFX_ACCUMULATE_FLOAT )
+    , m_reorderInterval( 0 )
+    , m_reorderCurve( OFX_CURVE_HILBERT )
+    , m_updateCount( 0 )
+    , m_tempParticlePool()
+    , m_particleIds( nullptr )
+    , m_particleSlots( nullptr )
+    , m_particleIndices( nullptr )
+    , m_particleSortKeys( nullptr )
+    , m_bIncrementalBinning( false )
+    , m_maxMigrationRate( 0.02f )
+    , m_bBinKeysValid( false )
+    , m_numBinnedParticles( 0 )
+    , m_numBinMigrations( 0 )
+    , m_bBinningPatched( false )
+    , m_binPatchBackoff( 0 )
+    , m_tempParticleIndices( nullptr )
+    , m_bNeighborLists( false )
+    , m_bNeighborListsDirty( true )
+    , m_bUseNeighborLists( false )
+    , m_neighborSkin( 0.0f )
+    , m_neighborCutoff( 0.0f )
+    , m_numNeighborListBuilds( 0 )
+    , m_bFluid( false )
+    , m_fluidRestDensity( 0.0f )
+    , m_fluidTime( 0.0f )
+    , m_numFluidSubsteps( 0 )
 {}
 
 ParticleSystem::~ParticleSystem()
 {}
 
-void ParticleSystem::init( int _width, int _height, int _depth )
+void ParticleSystem::init( int _width, int _height, int _depth, uint32_t _maxParticles, const glm::ivec3& _binDims, bool _bGpuUpload )
 {
     m_halfWidth = _width / 2.0f;
     m_halfHeight = _height / 2.0f;
     m_halfDepth = _depth / 2.0f;
 
-    m_particlePool = new Particle[ MAX_PARTICLES ];
-    m_positions = new ParticleTboData[ MAX_PARTICLES ]();
-    
-    memset( m_particlePool, 0, sizeof( m_particlePool[0] ) * MAX_PARTICLES );
-    memset( m_positions, 0, sizeof( m_positions[0] ) * MAX_PARTICLES );
-    memset( m_particleBins, 0, sizeof( m_particleBins[0] ) * MAX_PARTICLES );
+    m_maxParticles = _maxParticles;
+    m_numParticles = 0;
+    m_bGpuUpload = _bGpuUpload;
+
+    // zeroed by the threads that update them, so the pages are local to their node
+    for ( float** field : m_particlePool.getFields() ) *field = ofxNumaAllocArray< float >( m_maxParticles );
+    for ( float** field : m_tempParticlePool.getFields() ) *field = ofxNumaAllocArray< float >( m_maxParticles );
+    m_instances = ofxNumaAllocArray< ParticleInstance >( m_maxParticles );
+    m_particleIds = ofxNumaAllocArray< uint32_t >( m_maxParticles );
+    m_particleSlots = ofxNumaAllocArray< uint32_t >( m_maxParticles );
+    m_particleIndices = ofxNumaAllocArray< uint32_t >( m_maxParticles );
+    m_particleSortKeys = ofxNumaAllocArray< uint32_t >( m_maxParticles );
+    m_tempParticleIndices = ofxNumaAllocArray< uint32_t >( m_maxParticles );
+    m_freeList.reset( m_maxParticles );
+
+    m_curveKeys.resize( m_maxParticles );
+    m_tempCurveKeys.resize( m_maxParticles );
+    m_curveOrder.resize( m_maxParticles );
+    m_tempCurveOrder.resize( m_maxParticles );
 
     glm::vec3 minBounds( -m_halfWidth, -m_halfHeight, -m_halfDepth );
     glm::vec3 maxBounds( m_halfWidth, m_halfHeight, m_halfDepth );
     glm::vec3 size = maxBounds - minBounds;
 
     m_invBoundsScale = 1.0f / ( maxBounds - minBounds );
-    m_binScale = glm::vec3( (float)BIN_DIMS_X, (float)BIN_DIMS_Y, (float)BIN_DIMS_Z ) * m_invBoundsScale;
+    m_baseBinDims = glm::max( _binDims, glm::ivec3( 1, 1, 1 ) );
+    setBinDims( m_baseBinDims );
+
+    if ( !m_bGpuUpload ) return;
 
     m_debugBoundsBox.disableNormals();
     m_debugBoundsBox.disableTextures();
@@ -46,260 +97,1686 @@ void ParticleSystem::init( int _width, int _height, int _depth )
     m_positionTbo.bind( GL_TEXTURE_BUFFER );
     m_positionTbo.unbind( GL_TEXTURE_BUFFER );
 
-    m_positionTbo.setData( sizeof( m_positions[ 0 ] ) * MAX_PARTICLES, m_positions, GL_DYNAMIC_DRAW );
-    m_positionTboTex.allocateAsBufferTexture( m_positionTbo, GL_RGBA32F );
+    m_positionTbo.setData( sizeof( m_instances[ 0 ] ) * m_maxParticles, m_instances, GL_DYNAMIC_DRAW );
+    m_positionTboTex.allocateAsBufferTexture( m_positionTbo, GL_RGBA32UI );
+}
+
+void ParticleSystem::setBinDims( const glm::ivec3& _binDims )
+{
+    m_binDims = glm::max( _binDims, glm::ivec3( 1, 1, 1 ) );
+    m_numBins = m_binDims.x * m_binDims.y * m_binDims.z;
+    m_binScale = glm::vec3( m_binDims ) * m_invBoundsScale;
+
+    m_particleBins.assign( m_numBins, ParticleBin{ 0, 0 } );
+    m_bNeighborListsDirty = true;
+    m_bBinKeysValid = false;
+
+    // neighbor bins +/- range, keeping the half that comes after the bin in z, y, x order.
+    // the other half sees this bin in its own shell, so every pair of bins is visited once
+    m_halfShellOffsets.clear();
+    m_halfShellBinOffsets.clear();
+    for ( int dz = -m_neighborRange; dz <= m_neighborRange; ++dz )
+        for ( int dy = -m_neighborRange; dy <= m_neighborRange; ++dy )
+            for ( int dx = -m_neighborRange; dx <= m_neighborRange; ++dx )
+            {
+                if ( dz > 0 || ( dz == 0 && ( dy > 0 || ( dy == 0 && dx > 0 ) ) ) )
+                {
+                    m_halfShellOffsets.push_back( glm::ivec3( dx, dy, dz ) );
+                    m_halfShellBinOffsets.push_back( ( dz * m_binDims.y + dy ) * m_binDims.x + dx );
+                }
+            }
+
+    // step() runs on the bins of the last update(), so the particles go into the new bins now
+    if ( m_numParticles > 0 ) binParticles( false, false );
 }
 
 void ParticleSystem::shutdown()
 {
-    delete[] m_particlePool;
-    delete[] m_positions;
+    for ( float** field : m_particlePool.getFields() ) ofxNumaFreeArray( *field, m_maxParticles );
+    for ( float** field : m_tempParticlePool.getFields() ) ofxNumaFreeArray( *field, m_maxParticles );
+    ofxNumaFreeArray( m_instances, m_maxParticles );
+    ofxNumaFreeArray( m_particleIds, m_maxParticles );
+    ofxNumaFreeArray( m_particleSlots, m_maxParticles );
+    ofxNumaFreeArray( m_particleIndices, m_maxParticles );
+    ofxNumaFreeArray( m_particleSortKeys, m_maxParticles );
+    ofxNumaFreeArray( m_tempParticleIndices, m_maxParticles );
+
+    m_particlePool = ParticlePool();
+    m_instances = nullptr;
+    m_tempParticlePool = ParticlePool();
+    m_particleIds = nullptr;
+    m_particleSlots = nullptr;
+    m_particleIndices = nullptr;
+    m_particleSortKeys = nullptr;
+    m_tempParticleIndices = nullptr;
+    m_freeList.reset( 0 );
+    m_bBinKeysValid = false;
+    m_numBinnedParticles = 0;
+
+    m_maxParticles = 0;
+    m_numParticles = 0;
 }
 
-void ParticleSystem::addParticle( const glm::vec3& _pos, const glm::vec3& _vel, float _mass, float _radius )
+size_t ParticleSystem::getMemoryUsage() const
 {
-    Particle& p = m_particlePool[ m_numParticles ];
-    p.position = _pos;
-    p.velocity = _vel;
-    p.mass = _mass;
-    p.radius = _radius;
+    // pools, instances, ids / slots / free ids, bin indices / keys / patch target and the curve reorder keys
+    size_t perParticle = sizeof( float ) * ParticlePool::NUM_FIELDS * 2 + sizeof( ParticleInstance ) + sizeof( uint32_t ) * 6
+        + sizeof( uint64_t ) * 2 + sizeof( uint32_t ) * 2;
+
+    // bins, plus the histograms and offsets of the counting sort
+    size_t perBin = sizeof( ParticleBin ) + sizeof( uint32_t ) * ( m_binSort.getNumChunks() + 1 );
+
+    // neighbor force sums and sorted positions, grown by step()
+    size_t accumulators = m_floatAccumulators.capacity() * sizeof( ofxFloatAccumulator )
+        + m_kahanAccumulators.capacity() * sizeof( ofxKahanAccumulator )
+        + m_doubleAccumulators.capacity() * sizeof( ofxDoubleAccumulator )
+        + m_binnedPositions.capacity() * sizeof( glm::vec4 );
 
-    ++m_numParticles;
+    // neighbor tasks, rebuilt by step()
+    size_t tasks = m_neighborTasks.capacity() * sizeof( ParticleNeighborTask )
+        + ( m_taskColors.capacity() + m_taskOrder.capacity() + m_taskNeighbors.capacity() ) * sizeof( uint32_t );
+
+    // neighbor lists, rebuilt by step() when enabled
+    size_t lists = m_listBins.capacity() * sizeof( ParticleBin ) + m_listPositions.capacity() * sizeof( glm::vec3 )
+        + ( m_listParticles.capacity() + m_listOffsets.capacity() + m_listNeighbors.capacity() ) * sizeof( uint32_t );
+
+    // fluid state per sorted slot, grown by step() with the fluid on
+    size_t fluid = m_fluidVelocities.capacity() * sizeof( glm::vec4 )
+        + ( m_fluidDensities.capacity() + m_fluidPressures.capacity() ) * sizeof( float );
+
+    return perParticle * m_maxParticles + perBin * m_numBins + accumulators + tasks + lists + fluid;
 }
 
-void ParticleSystem::addAttractor( const glm::vec3& _pos, float _strength )
+uint32_t ParticleSystem::addParticle( const glm::vec3& _pos, const glm::vec3& _vel, float _mass, float _radius, float _lifetime )
 {
-    Attractor& att = m_attractors[ m_numAttractors ];
-    att.position = _pos;
-    att.strength = _strength;
-    ++m_numAttractors;
+    uint32_t id, slot;
+    if ( m_freeList.acquire( 1, &id, &slot ) == 0 )
+    {
+        ofLogError( "ParticleSystem::addParticle" ) << "pool is full at " << m_maxParticles << " particles";
+        return UINT32_MAX;
+    }
+
+    setParticle( slot, id, _pos, _vel, _mass, _radius, _lifetime );
+    return id;
 }
 
-void ParticleSystem::addRepeller( const glm::vec3& _pos, float _strength )
+void ParticleSystem::setParticle( uint32_t _slot, uint32_t _id, const glm::vec3& _pos, const glm::vec3& _vel, float _mass, float _radius, float _lifetime )
 {
-    Repeller& rep = m_repellers[ m_numRepellers ];
-    rep.position = _pos;
-    rep.strength = _strength;
-    ++m_numRepellers;
+    ParticlePool& pool = m_particlePool;
+    pool.positionX[ _slot ] = _pos.x;
+    pool.positionY[ _slot ] = _pos.y;
+    pool.positionZ[ _slot ] = _pos.z;
+    pool.velocityX[ _slot ] = _vel.x;
+    pool.velocityY[ _slot ] = _vel.y;
+    pool.velocityZ[ _slot ] = _vel.z;
+    pool.mass[ _slot ] = _mass;
+    pool.radius[ _slot ] = _radius;
+    pool.age[ _slot ] = 0.0f;
+    pool.lifetime[ _slot ] = _lifetime > 0.0f ? _lifetime : FLT_MAX;
+
+    m_particleIds[ _slot ] = _id;
+    m_particleSlots[ _id ] = _slot;
 }
 
-void ParticleSystem::sortParticlesByBin()
+void ParticleSystem::moveParticle( uint32_t _src, uint32_t _dst )
 {
-    // sort the keys and values - this will give us the particle indices sorted by bin id 
-    lb::RadixSort16<uint16_t>( m_particleSortKeys, m_tempParticleSortKeys, m_particleIndices, m_tempParticleIndices, m_numParticles );
+    for ( float** field : m_particlePool.getFields() )
+    {
+        ( *field )[ _dst ] = ( *field )[ _src ];
+    }
+
+    const uint32_t id = m_particleIds[ _src ];
+    m_particleIds[ _dst ] = id;
+    m_particleSlots[ id ] = _dst;
 }
 
-void ParticleSystem::update()
+void ParticleSystem::killParticle( uint32_t _id )
+{
+    if ( _id >= m_maxParticles ) return;
+
+    // dead ids keep their last slot, which by now holds another particle or none
+    const uint32_t slot = m_particleSlots[ _id ];
+    if ( slot >= m_freeList.getNumUsed() || m_particleIds[ slot ] != _id ) return;
+
+    m_particlePool.lifetime[ slot ] = 0.0f;
+}
+
+uint32_t ParticleSystem::addEmitter( const ParticleEmitter& _emitter )
+{
+    m_emitters.push_back( _emitter );
+    m_emitterCarry.push_back( 0.0f );
+    m_emitterRandoms.push_back( std::mt19937( (uint32_t)m_emitters.size() ) );
+    return getNumEmitters() - 1;
+}
+
+void ParticleSystem::clearEmitters()
+{
+    m_emitters.clear();
+    m_emitterCarry.clear();
+    m_emitterRandoms.clear();
+}
+
+static inline glm::vec3 randomInSphere( std::mt19937& _random )
+{
+    std::uniform_real_distribution< float > unit( -1.0f, 1.0f );
+    float x, y, z;
+    do
+    {
+        x = unit( _random );
+        y = unit( _random );
+        z = unit( _random );
+    } while ( x*x + y*y + z*z > 1.0f );
+    return glm::vec3( x, y, z );
+}
+
+uint32_t ParticleSystem::retireParticles()
 {
-    memset( m_particleIndices, 0, sizeof( m_particleIndices[ 0 ] ) * MAX_PARTICLES );
-    memset( m_particleSortKeys, 0, sizeof( m_particleSortKeys[ 0 ] ) * MAX_PARTICLES );
-    memset( m_tempParticleSortKeys, 0, sizeof( m_tempParticleSortKeys[ 0 ] ) * MAX_PARTICLES );
-    memset( m_tempParticleIndices, 0, sizeof( m_tempParticleIndices[ 0 ] ) * MAX_PARTICLES );
-    memset( m_particleBins, 0, sizeof( m_particleBins[ 0 ] ) * MAX_PARTICLES );
+    OFX_PROFILE_SCOPE( "particles retire" );
+
+    // every particle in the pool, including ones added since the last update
+    const uint32_t numUsed = m_freeList.getNumUsed();
+    static const uint32_t CHUNK_SIZE = 16384;
+    const int numChunks = (int)( ( numUsed + CHUNK_SIZE - 1 ) / CHUNK_SIZE );
+    if ( (int)m_retiredSlots.size() < numChunks ) m_retiredSlots.resize( numChunks );
 
+    // each chunk ages its particles and keeps the slots that died, so the lists come out in slot order
 #ifdef TARGET_OSX
-    dispatch_apply(m_numParticles, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^(size_t idx) {
+    dispatch_apply(numChunks, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^(size_t chunk) {
 #else
-#pragma omp parallel for
-    for ( int idx = 0; idx < m_numParticles; ++idx ) {
+#pragma omp parallel for schedule( static )
+    for ( int chunk = 0; chunk < numChunks; ++chunk ) {
 #endif
-        Particle& p = m_particlePool[ idx ];
-        p.position += p.velocity;
-        p.velocity *= 0.9f;
+        std::vector< uint32_t >& retired = m_retiredSlots[ chunk ];
+        retired.clear();
 
-        // check walls
-        if ( p.position.x > m_halfWidth )
+        float* age = m_particlePool.age;
+        const float* lifetime = m_particlePool.lifetime;
+        const uint32_t end = std::min( ( (uint32_t)chunk + 1 ) * CHUNK_SIZE, numUsed );
+        for ( uint32_t idx = (uint32_t)chunk * CHUNK_SIZE; idx < end; ++idx )
         {
-            //p.position.x = -m_halfWidth + 10.0f;
-            p.position.x -= m_halfWidth * 2;
-        }
-        else if ( p.position.x < -m_halfWidth )
-        {
-            //p.position.x = m_halfWidth - 10.0f;
-            p.position.x += m_halfWidth * 2;
+            age[ idx ] += 1.0f;
+            if ( age[ idx ] >= lifetime[ idx ] ) retired.push_back( idx );
         }
+#ifdef TARGET_OSX
+    });
+#else
+    }
+#endif
 
-        if ( p.position.y > m_halfHeight)
-        {
-            //p.position.y = -m_halfHeight + 10.0f;
-            p.position.y -= m_halfHeight * 2;
-        }
-        else if ( p.position.y < -m_halfHeight )
-        {
-//            p.position.y = m_halfHeight - 10.0f;
-            p.position.y += m_halfHeight * 2;
-        }
+    uint32_t numRetired = 0;
+    for ( int chunk = 0; chunk < numChunks; ++chunk )
+    {
+        for ( uint32_t slot : m_retiredSlots[ chunk ] ) m_freeList.release( m_particleIds[ slot ] );
+        numRetired += (uint32_t)m_retiredSlots[ chunk ].size();
+    }
+    if ( numRetired == 0 ) return 0;
 
-        if ( p.position.z > m_halfDepth )
-        {
-            //p.position.z = -m_halfDepth + 10.0f;
-            p.position.z -= m_halfDepth * 2;
-        }
-        else if ( p.position.z < -m_halfDepth )
+    // the live particles above the new count fill the holes below it, taken from the top down.
+    // there are as many of them as holes, so this touches only the slots that change
+    const uint32_t numLive = numUsed - numRetired;
+    int tailChunk = numChunks - 1;
+    int tail = (int)m_retiredSlots[ tailChunk ].size();
+    uint32_t src = numUsed;
+
+    for ( int chunk = 0; chunk < numChunks; ++chunk )
+    {
+        for ( uint32_t hole : m_retiredSlots[ chunk ] )
         {
-            //p.position.z = m_halfDepth - 10.0f;
-            p.position.z += m_halfDepth * 2;
+            if ( hole >= numLive ) return numRetired;
+
+            // the next live slot from the top, skipping the retired ones at the tail of the lists
+            for ( ;; )
+            {
+                --src;
+                while ( tail == 0 && tailChunk > 0 ) tail = (int)m_retiredSlots[ --tailChunk ].size();
+                if ( tail == 0 || m_retiredSlots[ tailChunk ][ tail - 1 ] != src ) break;
+                --tail;
+            }
+
+            moveParticle( src, hole );
         }
+    }
+
+    return numRetired;
+}
 
-        const uint16_t px = (uint16_t)floorf( ( p.position.x + m_halfWidth ) * m_binScale.x );
-        const uint16_t py = (uint16_t)floorf( ( p.position.y + m_halfHeight ) * m_binScale.y );
-        const uint16_t pz = (uint16_t)floorf( ( p.position.z + m_halfDepth ) * m_binScale.z );
-        const uint16_t binId = binIdFromXYZ( px, py, pz );
+void ParticleSystem::emitParticles()
+{
+    const int numEmitters = (int)m_emitters.size();
+    if ( numEmitters == 0 ) return;
+
+    OFX_PROFILE_SCOPE( "particles emit" );
+
+#ifdef TARGET_OSX
+    dispatch_apply(numEmitters, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^(size_t idx) {
+#else
+#pragma omp parallel for schedule( dynamic, 1 )
+    for ( int idx = 0; idx < numEmitters; ++idx ) {
+#endif
+        const ParticleEmitter& emitter = m_emitters[ idx ];
+        if ( emitter.bEnabled )
+        {
+            std::mt19937& random = m_emitterRandoms[ idx ];
+            std::uniform_real_distribution< float > unit( -1.0f, 1.0f );
 
-        m_particleIndices[ idx ] = idx;
-        m_particleSortKeys[ idx ] = binId;
-        ++m_particleBins[ binId ].particleCount;
+            float& carry = m_emitterCarry[ idx ];
+            carry += std::max( emitter.rate, 0.0f );
+            uint32_t count = (uint32_t)carry;
+            carry -= count;
 
-        //     ofLogNotice() << "bin " << (uint16_t)binId << " ... " << px << ", " << py << ", " << pz << endl;
+            // one atomic per batch, the batch's slots are the dense range after the particles in use before it
+            static const uint32_t BATCH_SIZE = 256;
+            uint32_t ids[ BATCH_SIZE ];
+            while ( count > 0 )
+            {
+                uint32_t first;
+                const uint32_t taken = m_freeList.acquire( std::min( count, BATCH_SIZE ), ids, &first );
+                if ( taken == 0 ) break;
 
-        ParticleTboData& data = m_positions[ idx ];
-        data.transform = glm::translate( p.position )
-            * glm::scale( glm::vec3( p.radius, p.radius, p.radius ) )
-            * glm::lookAt( glm::vec3( 0.0f, 0.0f, 0.0f ), p.velocity, glm::vec3( 0.0f, 1.0f, 0.0f ) );
+                for ( uint32_t i = 0; i < taken; ++i )
+                {
+                    const float lifetime = emitter.lifetime * ( 1.0f + emitter.lifetimeSpread * unit( random ) );
+                    setParticle( first + i, ids[ i ],
+                                 emitter.position + emitter.positionSpread * randomInSphere( random ),
+                                 emitter.velocity + emitter.velocitySpread * randomInSphere( random ),
+                                 emitter.mass, emitter.radius, std::max( lifetime, 1.0f ) );
+                }
+                count -= taken;
+            }
+        }
 #ifdef TARGET_OSX
     });
 #else
     }
 #endif
+}
 
-    m_positionTbo.updateData( 0, sizeof( m_positions[ 0 ] ) * m_numParticles, m_positions );
+uint32_t ParticleSystem::addAttractor( const glm::vec3& _pos, float _strength, ForceFalloff _falloff, float _radius )
+{
+    ForceSources& sources = m_forceSources;
+    sources.x.push_back( _pos.x );
+    sources.y.push_back( _pos.y );
+    sources.z.push_back( _pos.z );
+    sources.strength.push_back( _strength );
+    sources.radius.push_back( std::max( _radius, 0.0f ) );
+    sources.falloff.push_back( _radius > 0.0f ? _falloff : FORCE_FALLOFF_INVERSE_SQUARE );
+    return getNumForceSources() - 1;
 }
 
-void ParticleSystem::step( float _dt )
+uint32_t ParticleSystem::addRepeller( const glm::vec3& _pos, float _strength, ForceFalloff _falloff, float _radius )
 {
-    for ( uint32_t idx = 0; idx < m_numParticles; ++idx )
-    {
-        Particle& p = m_particlePool[ idx ];
+    return addAttractor( _pos, -_strength, _falloff, _radius );
+}
 
-        glm::vec3 acc( 0.0f, 0.0f, 0.0f );
-        for ( int attIdx = 0; attIdx < m_numAttractors; ++attIdx )
-        {
-            const Attractor& att = m_attractors[ attIdx ];
-            const float eps = 1e-9f; // minimum dist for nbody interaction
+void ParticleSystem::setForceSource( uint32_t _idx, const glm::vec3& _pos, float _strength )
+{
+    if ( _idx >= getNumForceSources() ) return;
+
+    m_forceSources.x[ _idx ] = _pos.x;
+    m_forceSources.y[ _idx ] = _pos.y;
+    m_forceSources.z[ _idx ] = _pos.z;
+    m_forceSources.strength[ _idx ] = _strength;
+}
+
+void ParticleSystem::clearForceSources()
+{
+    m_forceSources = ForceSources();
+}
+
+void ParticleSystem::applyForceSources()
+{
+    const int numSources = (int)getNumForceSources();
+    if ( numSources == 0 ) return;
+
+    OFX_PROFILE_SCOPE( "particles sources" );
+
+    // particles go through the sources a tile at a time, the per-source loops run over the
+    // tile's plain arrays and vectorize. the kernel is picked once per source and tile
+    static const int TILE_SIZE = 16;
+    const int numTiles = ( m_numParticles + TILE_SIZE - 1 ) / TILE_SIZE;
+    const ForceSources& sources = m_forceSources;
 
-            glm::vec3 delta = att.position - p.position;
-            float distSqr = delta.x*delta.x + delta.y*delta.y + delta.z*delta.z + eps;
-            float invDist = 1.0f / sqrtf( distSqr );
-            float invDist3 = invDist * invDist * invDist;
-            float f = att.strength * invDist3;
+#ifdef TARGET_OSX
+    dispatch_apply(numTiles, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^(size_t tile) {
+#else
+#pragma omp parallel for schedule( static )
+    for ( int tile = 0; tile < numTiles; ++tile ) {
+#endif
+        const uint32_t begin = (uint32_t)tile * TILE_SIZE;
+        const int count = (int)std::min( (uint32_t)TILE_SIZE, m_numParticles - begin );
 
-            acc += f * delta;
+        // the last tile is padded with copies of its first particle
+        const ParticlePool& pool = m_particlePool;
+        float px[ TILE_SIZE ], py[ TILE_SIZE ], pz[ TILE_SIZE ];
+        float ax[ TILE_SIZE ], ay[ TILE_SIZE ], az[ TILE_SIZE ];
+        for ( int t = 0; t < TILE_SIZE; ++t )
+        {
+            const uint32_t idx = begin + ( t < count ? t : 0 );
+            px[ t ] = pool.positionX[ idx ];
+            py[ t ] = pool.positionY[ idx ];
+            pz[ t ] = pool.positionZ[ idx ];
+            ax[ t ] = ay[ t ] = az[ t ] = 0.0f;
         }
 
-        for ( int repIdx = 0; repIdx < m_numRepellers; ++repIdx )
+        for ( int src = 0; src < numSources; ++src )
         {
-            const Repeller& rep = m_repellers[ repIdx ];
+            const float sx = sources.x[ src ];
+            const float sy = sources.y[ src ];
+            const float sz = sources.z[ src ];
+            const float strength = sources.strength[ src ];
+            const float radius = sources.radius[ src ];
             const float eps = 1e-9f; // minimum dist for nbody interaction
 
-            glm::vec3 delta = p.position - rep.position;
-            float distSqr = delta.x*delta.x + delta.y*delta.y + delta.z*delta.z + eps;
-            float invDist = 1.0f / sqrtf( distSqr );
-            float invDist3 = invDist * invDist * invDist;
-            float f = rep.strength * invDist3;
-
-            acc += f * delta;
+            switch ( sources.falloff[ src ] )
+            {
+                default:
+                case FORCE_FALLOFF_INVERSE_SQUARE:
+                {
+                    const float radiusSqr = radius > 0.0f ? radius * radius : FLT_MAX;
+                    for ( int t = 0; t < TILE_SIZE; ++t )
+                    {
+                        float dx = sx - px[ t ];
+                        float dy = sy - py[ t ];
+                        float dz = sz - pz[ t ];
+                        float distSqr = dx*dx + dy*dy + dz*dz + eps;
+                        float invDist = 1.0f / sqrtf( distSqr );
+                        float inside = std::max( 0.0f, std::copysign( 1.0f, radiusSqr - distSqr ) ); // branch free, so it vectorizes
+                        float f = strength * invDist * invDist * invDist * inside;
+                        ax[ t ] += f * dx;
+                        ay[ t ] += f * dy;
+                        az[ t ] += f * dz;
+                    }
+                    break;
+                }
+                case FORCE_FALLOFF_LINEAR:
+                {
+                    const float invRadius = 1.0f / radius;
+                    for ( int t = 0; t < TILE_SIZE; ++t )
+                    {
+                        float dx = sx - px[ t ];
+                        float dy = sy - py[ t ];
+                        float dz = sz - pz[ t ];
+                        float distSqr = dx*dx + dy*dy + dz*dz + eps;
+                        float invDist = 1.0f / sqrtf( distSqr );
+                        float weight = std::max( 0.0f, 1.0f - distSqr * invDist * invRadius );
+                        float f = strength * weight * invDist;
+                        ax[ t ] += f * dx;
+                        ay[ t ] += f * dy;
+                        az[ t ] += f * dz;
+                    }
+                    break;
+                }
+                case FORCE_FALLOFF_SMOOTH:
+                {
+                    const float invRadiusSqr = 1.0f / ( radius * radius );
+                    for ( int t = 0; t < TILE_SIZE; ++t )
+                    {
+                        float dx = sx - px[ t ];
+                        float dy = sy - py[ t ];
+                        float dz = sz - pz[ t ];
+                        float distSqr = dx*dx + dy*dy + dz*dz + eps;
+                        float invDist = 1.0f / sqrtf( distSqr );
+                        float weight = std::max( 0.0f, 1.0f - distSqr * invRadiusSqr );
+                        float f = strength * weight * weight * invDist;
+                        ax[ t ] += f * dx;
+                        ay[ t ] += f * dy;
+                        az[ t ] += f * dz;
+                    }
+                    break;
+                }
+            }
         }
 
-        p.velocity += acc / p.mass;
+        for ( int t = 0; t < count; ++t )
+        {
+            const uint32_t idx = begin + t;
+            const float invMass = 1.0f / pool.mass[ idx ];
+            pool.velocityX[ idx ] += ax[ t ] * invMass;
+            pool.velocityY[ idx ] += ay[ t ] * invMass;
+            pool.velocityZ[ idx ] += az[ t ] * invMass;
+        }
+#ifdef TARGET_OSX
+    });
+#else
     }
+#endif
+}
 
-    sortParticlesByBin();
+void ParticleSystem::sortParticlesByBin()
+{
+    // prefix sum of the per-chunk bin histograms filled in update(), then each chunk scatters
+    // its particle indices - stable, so the order does not depend on the thread count
+    m_binSort.scatter( m_particleSortKeys, m_particleIndices );
 
-    uint16_t offset = 0;
-    for ( uint16_t binIdx = 0; binIdx < NUM_BINS; ++binIdx )
+#pragma omp parallel for schedule( static )
+    for ( int binIdx = 0; binIdx < (int)m_numBins; ++binIdx )
     {
         ParticleBin& bin = m_particleBins[ binIdx ];
-        if ( bin.particleCount > 0 )
+        bin.offset = m_binSort.getBinOffset( binIdx );
+        bin.particleCount = m_binSort.getBinCount( binIdx );
+    }
+}
+
+void ParticleSystem::setNeighborLists( bool _bEnabled, float _skin )
+{
+    m_bNeighborLists = _bEnabled;
+    m_neighborSkin = std::max( _skin, 0.0f );
+    m_bNeighborListsDirty = true;
+}
+
+void ParticleSystem::setIncrementalBinning( bool _bEnabled, float _maxMigrationRate )
+{
+    m_bIncrementalBinning = _bEnabled;
+    m_maxMigrationRate = std::max( _maxMigrationRate, 0.0f );
+    m_binPatchBackoff = 0;
+}
+
+void ParticleSystem::setReordering( uint32_t _interval, ofxSpaceFillingCurve _curve )
+{
+    m_reorderInterval = _interval;
+    m_reorderCurve = _curve;
+}
+
+void ParticleSystem::reorderParticles()
+{
+    if ( m_numParticles < 2 ) return;
+
+    // keys from the positions, interleaved into the binned positions - step() refills them anyway
+    m_binnedPositions.resize( m_numParticles );
+    const ParticlePool& pool = m_particlePool;
+
+#pragma omp parallel for schedule( static )
+    for ( int idx = 0; idx < (int)m_numParticles; ++idx )
+    {
+        m_binnedPositions[ idx ] = glm::vec4( pool.positionX[ idx ], pool.positionY[ idx ], pool.positionZ[ idx ], 0.0f );
+    }
+
+    ofxComputeCurveKeys( &m_binnedPositions[ 0 ].x, 4, m_numParticles, m_reorderCurve, m_curveKeys.data(), m_curveOrder.data() );
+    ofxRadixSortPairs( m_curveKeys.data(), m_curveOrder.data(), m_numParticles, m_tempCurveKeys.data(), m_tempCurveOrder.data() );
+
+    // gather into the temp pool, old ids go to the temp order
+    memcpy( m_tempCurveOrder.data(), m_particleIds, sizeof( m_particleIds[ 0 ] ) * m_numParticles );
+
+    std::array< float**, ParticlePool::NUM_FIELDS > srcFields = m_particlePool.getFields();
+    std::array< float**, ParticlePool::NUM_FIELDS > dstFields = m_tempParticlePool.getFields();
+
+#pragma omp parallel for schedule( static )
+    for ( int idx = 0; idx < (int)m_numParticles; ++idx )
+    {
+        const uint32_t src = m_curveOrder[ idx ];
+        for ( int field = 0; field < ParticlePool::NUM_FIELDS; ++field )
         {
-            bin.offset = offset;
-            offset += bin.particleCount;
+            ( *dstFields[ field ] )[ idx ] = ( *srcFields[ field ] )[ src ];
         }
+
+        const uint32_t id = m_tempCurveOrder[ src ];
+        m_particleIds[ idx ] = id;
+        m_particleSlots[ id ] = idx;
     }
 
-    // neighbor +/- {range} bins
-    const int range = 2;
+    std::swap( m_particlePool, m_tempParticlePool );
+
+    // the lists and the bin order hold pool slots
+    m_bNeighborListsDirty = true;
+    m_bBinKeysValid = false;
+}
 
-    // loop through all bins
-    for ( int binZ = 0; binZ < BIN_DIMS_Z; ++binZ )
+// moves one axis of a block by its velocity, damps the velocity and wraps at the walls.
+// the wall test is a mask rather than a branch, so the loop vectorizes
+static inline void integrateParticles( float* _pos, float* _vel, int _count, float _halfSize )
+{
+    const float size = _halfSize * 2.0f;
+    for ( int i = 0; i < _count; ++i )
     {
-        const uint16_t z0 = ( binZ - range ) < 0 ? 0 : binZ - range;
-        const uint16_t z1 = ( binZ + range ) > ( BIN_DIMS_Z - 1 ) ? BIN_DIMS_Z - 1 : binZ + range;
+        float p = _pos[ i ] + _vel[ i ];
+        p += size * ( float( p < -_halfSize ) - float( p > _halfSize ) );
+        _pos[ i ] = p;
+        _vel[ i ] *= 0.9f;
+    }
+}
 
-        for ( int binY = 0; binY < BIN_DIMS_Y; ++binY )
-        {
-            const uint16_t y0 = ( binY - range ) < 0 ? 0 : binY - range;
-            const uint16_t y1 = ( binY + range ) > ( BIN_DIMS_Y - 1 ) ? BIN_DIMS_Y - 1 : binY + range;
+static inline void computeBinCoords( const float* _pos, int _count, float _halfSize, float _binScale, int _binDim, uint32_t* _coords )
+{
+    for ( int i = 0; i < _count; ++i )
+    {
+        const int coord = (int)( ( _pos[ i ] + _halfSize ) * _binScale );
+        _coords[ i ] = (uint32_t)std::min( std::max( coord, 0 ), _binDim - 1 );
+    }
+}
 
-            for ( int binX = 0; binX < BIN_DIMS_X; ++binX )
-            {
-                // current bin
-                const uint16_t binIdx = binIdFromXYZ( binX, binY, binZ );
+// positive floats only, the mantissa is truncated. below the smallest normal half is 0,
+// above the largest it is clamped
+static inline uint32_t packHalf( float _value )
+{
+    uint32_t bits;
+    memcpy( &bits, &_value, sizeof( bits ) );
+
+    const int exponent = (int)( ( bits >> 23 ) & 0xff ) - 127 + 15;
+    const uint32_t half = ( (uint32_t)exponent << 10 ) | ( ( bits >> 13 ) & 0x3ff );
+    return exponent <= 0 ? 0 : ( exponent >= 31 ? 0x7bff : half );
+}
+
+// the instance records particle.vert reads. the direction of travel is octahedral encoded,
+// particles at rest face down -z, which the shader turns into the identity orientation
+static inline void packInstances( const float* _px, const float* _py, const float* _pz,
+                                  const float* _vx, const float* _vy, const float* _vz,
+                                  const float* _radius, int _count, ParticleInstance* _instances )
+{
+    for ( int i = 0; i < _count; ++i )
+    {
+        const float length = fabsf( _vx[ i ] ) + fabsf( _vy[ i ] ) + fabsf( _vz[ i ] );
+        const float rest = float( length < 1e-20f );
+        const float invLength = 1.0f / ( length + rest );
+
+        const float ox = _vx[ i ] * invLength;
+        const float oy = _vy[ i ] * invLength;
+        const float oz = _vz[ i ] * invLength - rest;
+
+        // the lower half folds out over the diagonals
+        const float fold = float( oz < 0.0f );
+        const float ex = ox + fold * ( ( 1.0f - fabsf( oy ) ) * std::copysign( 1.0f, ox ) - ox );
+        const float ey = oy + fold * ( ( 1.0f - fabsf( ox ) ) * std::copysign( 1.0f, oy ) - oy );
+
+        // [-1, 1] to [0, 255], rounded
+        const uint32_t qx = (uint32_t)(int)( ex * 127.5f + 128.0f );
+        const uint32_t qy = (uint32_t)(int)( ey * 127.5f + 128.0f );
+
+        ParticleInstance& instance = _instances[ i ];
+        instance.position = glm::vec3( _px[ i ], _py[ i ], _pz[ i ] );
+        instance.radiusAndDirection = packHalf( _radius[ i ] ) | ( qx << 16 ) | ( qy << 24 );
+    }
+}
+
+void ParticleSystem::update()
+{
+    OFX_PROFILE_SCOPE( "particles update" );
+
+    ofxNuma::applyThreadPinning();
+
+    // deaths, then births into the freed ids, so the reorder and the passes below run on the final dense set
+    {
+        const uint32_t numRetired = retireParticles();
+        emitParticles();
+
+        const uint32_t numParticles = m_freeList.getNumUsed();
+        if ( numRetired > 0 || numParticles != m_numParticles ) m_bNeighborListsDirty = true;
+        m_numParticles = numParticles;
+    }
+
+    if ( m_reorderInterval > 0 && ( m_updateCount % m_reorderInterval ) == 0 )
+    {
+        OFX_PROFILE_SCOPE( "particles reorder" );
+        reorderParticles();
+    }
+    ++m_updateCount;
+
+    // the fluid has already moved in step()
+    binParticles( !m_bFluid, true );
+
+    if ( !m_bGpuUpload ) return;
+
+    OFX_PROFILE_SCOPE( "particles upload" );
+    m_positionTbo.updateData( 0, sizeof( m_instances[ 0 ] ) * m_numParticles, m_instances );
+}
 
-                const uint16_t x0 = ( binX - range ) < 0 ? 0 : binX - range;
-                const uint16_t x1 = ( binX + range ) > ( BIN_DIMS_X - 1 ) ? BIN_DIMS_X - 1 : binX + range;
-                //   ofLogNotice() << "bin " << binX << ", " << binY << ", " << binZ << " min: " << x0 << ", " << y0 << ", " << z0 << " .. max: " << x1 << ", " << y1 << ", " << z1;
+static const int BIN_BLOCK_SIZE = 1024;
+
+void ParticleSystem::binBlock( uint32_t _begin, int _count, bool _bIntegrate, bool _bPackInstances, uint32_t* _binIds )
+{
+    // one loop per pass over the block's fields. the passes are branch free, so each loop vectorizes
+    uint32_t binX[ BIN_BLOCK_SIZE ], binY[ BIN_BLOCK_SIZE ], binZ[ BIN_BLOCK_SIZE ];
+
+    float* px = m_particlePool.positionX + _begin;
+    float* py = m_particlePool.positionY + _begin;
+    float* pz = m_particlePool.positionZ + _begin;
+    float* vx = m_particlePool.velocityX + _begin;
+    float* vy = m_particlePool.velocityY + _begin;
+    float* vz = m_particlePool.velocityZ + _begin;
+    const float* radius = m_particlePool.radius + _begin;
+
+    if ( _bIntegrate )
+    {
+        integrateParticles( px, vx, _count, m_halfWidth );
+        integrateParticles( py, vy, _count, m_halfHeight );
+        integrateParticles( pz, vz, _count, m_halfDepth );
+    }
+
+    // a particle sitting exactly on the max wall would land one bin past the grid
+    computeBinCoords( px, _count, m_halfWidth, m_binScale.x, m_binDims.x, binX );
+    computeBinCoords( py, _count, m_halfHeight, m_binScale.y, m_binDims.y, binY );
+    computeBinCoords( pz, _count, m_halfDepth, m_binScale.z, m_binDims.z, binZ );
+
+    for ( int i = 0; i < _count; ++i )
+    {
+        _binIds[ i ] = binIdFromXYZ( binX[ i ], binY[ i ], binZ[ i ] );
+    }
+
+    if ( _bPackInstances ) packInstances( px, py, pz, vx, vy, vz, radius, _count, m_instances + _begin );
+}
+
+void ParticleSystem::binParticles( bool _bIntegrate, bool _bPackInstances )
+{
+    // after a failed patch the next few binnings sort straight away, rather than paying for both while the churn lasts
+    const bool bPatch = m_bIncrementalBinning && m_bBinKeysValid && m_binPatchBackoff == 0;
+    if ( m_binPatchBackoff > 0 ) --m_binPatchBackoff;
+    m_bBinningPatched = bPatch && patchParticleBins( _bIntegrate, _bPackInstances );
+
+    if ( !m_bBinningPatched )
+    {
+        if ( bPatch )
+        {
+            // too many particles changed bins to patch, the new keys are in place for the full sort
+            static const uint32_t BIN_PATCH_BACKOFF = 8;
+            m_binPatchBackoff = BIN_PATCH_BACKOFF;
+            m_binSort.begin( m_numParticles, m_numBins );
+            m_binSort.count( m_particleSortKeys );
+        }
+        else
+        {
+            m_numBinMigrations = 0;
 
-                const ParticleBin& bin = m_particleBins[ binIdx ];
+            // counts each chunk's bins into its own histogram, sortParticlesByBin() scatters from them
+            m_binSort.begin( m_numParticles, m_numBins );
+            const int numChunks = m_binSort.getNumChunks();
 
-                // loop through all particles in bin
 #ifdef TARGET_OSX
-                dispatch_apply(bin.particleCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^(size_t idx) {
+            dispatch_apply(numChunks, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^(size_t chunk) {
 #else
-#pragma omp parallel for
-                for ( int idx = 0; idx < bin.particleCount; ++idx ) {
+            // one contiguous chunk per thread, each thread walks the same particles it first touched
+#pragma omp parallel for schedule( static, 1 )
+            for ( int chunk = 0; chunk < numChunks; ++chunk ) {
 #endif
-                    uint16_t particleIdx = m_particleIndices[ bin.offset + idx ];
-                    Particle& p = m_particlePool[ particleIdx ];
-
-                    glm::vec3 acc( 0.0f, 0.0f, 0.0f );
-
-                    // loop through neighbor bins
-                    for ( int nz = z0; nz < z1; ++nz )
-                        for ( int ny = y0; ny < y1; ++ny )
-                            for ( int nx = x0; nx < x1; ++nx )
-                            {
-                                const ParticleBin& nbin = m_particleBins[ binIdFromXYZ( nx, ny, nz ) ];
-                                for ( uint16_t neighborIdx = 0; neighborIdx < nbin.particleCount; ++neighborIdx )
-                                {
-                                    // n-body euler integration
-                                    particleIdx = m_particleIndices[ nbin.offset + neighborIdx ];
-                                    Particle& neighborP = m_particlePool[ particleIdx ];
-
-                                    const float eps = 0.1f; // minimum dist for nbody interaction
-
-                                    glm::vec3 delta = neighborP.position - p.position;
-                                    float distSqr = delta.x*delta.x + delta.y*delta.y + delta.z*delta.z + eps;
-                                    float invDist = 1.0f / sqrtf( distSqr );
-                                    float invDist3 = invDist * invDist * invDist;
-                                    float f = neighborP.mass * invDist3;
-
-                                    acc += f * delta;
-                                }
-                            }
-
-                    p.velocity += _dt * acc / p.mass;
+                uint32_t* histogram = m_binSort.getHistogram( chunk );
+                const uint32_t chunkEnd = (uint32_t)m_binSort.getChunkEnd( chunk );
+
+                for ( uint32_t blockBegin = (uint32_t)m_binSort.getChunkBegin( chunk ); blockBegin < chunkEnd; blockBegin += BIN_BLOCK_SIZE )
+                {
+                    const int count = (int)std::min( (uint32_t)BIN_BLOCK_SIZE, chunkEnd - blockBegin );
+                    uint32_t* sortKeys = m_particleSortKeys + blockBegin;
+                    binBlock( blockBegin, count, _bIntegrate, _bPackInstances, sortKeys );
+
+                    for ( int i = 0; i < count; ++i )
+                    {
+                        ++histogram[ sortKeys[ i ] ];
+                    }
+                }
 #ifdef TARGET_OSX
-                });
+            });
 #else
-                }
-#endif
             }
+#endif
         }
+
+        OFX_PROFILE_SCOPE( "particles sort" );
+        sortParticlesByBin();
     }
-}
 
-void ParticleSystem::debugDrawWorldBounds()
-{
-    ofDisableDepthTest();
-    glDisable( GL_CULL_FACE );
-    m_debugBoundsBox.drawWireframe();
-    ofEnableDepthTest();
+    m_bBinKeysValid = true;
+    m_numBinnedParticles = m_numParticles;
 }
 
-void ParticleSystem::debugDrawParticles()
+bool ParticleSystem::patchParticleBins( bool _bIntegrate, bool _bPackInstances )
 {
-    glEnable( GL_DEPTH_TEST );
-    glEnable( GL_CULL_FACE );
-    glCullFace( GL_BACK );
-    m_sphereMesh.drawInstanced( OF_MESH_FILL, m_numParticles );
+    OFX_PROFILE_SCOPE( "particles patch bins" );
+
+    static const uint32_t NO_BIN = UINT32_MAX;
+    const uint32_t numParticles = m_numParticles;
+    const uint32_t numBinned = m_numBinnedParticles;
+
+    static const uint32_t CHUNK_SIZE = 16384;
+    const int numChunks = (int)( ( numParticles + CHUNK_SIZE - 1 ) / CHUNK_SIZE );
+    if ( (int)m_binMigrations.size() < numChunks ) m_binMigrations.resize( numChunks );
+
+    // each chunk keeps the slots whose bin changed, in slot order. slots past the last binning
+    // were born since and have no bin to leave
+#ifdef TARGET_OSX
+    dispatch_apply(numChunks, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^(size_t chunk) {
+#else
+#pragma omp parallel for schedule( static )
+    for ( int chunk = 0; chunk < numChunks; ++chunk ) {
+#endif
+        std::vector< ParticleMigration >& migrations = m_binMigrations[ chunk ];
+        migrations.clear();
+
+        uint32_t binIds[ BIN_BLOCK_SIZE ];
+        const uint32_t chunkEnd = std::min( ( (uint32_t)chunk + 1 ) * CHUNK_SIZE, numParticles );
+        for ( uint32_t blockBegin = (uint32_t)chunk * CHUNK_SIZE; blockBegin < chunkEnd; blockBegin += BIN_BLOCK_SIZE )
+        {
+            const int count = (int)std::min( (uint32_t)BIN_BLOCK_SIZE, chunkEnd - blockBegin );
+            binBlock( blockBegin, count, _bIntegrate, _bPackInstances, binIds );
+
+            uint32_t* sortKeys = m_particleSortKeys + blockBegin;
+            for ( int i = 0; i < count; ++i )
+            {
+                const uint32_t slot = blockBegin + i;
+                const uint32_t fromBin = slot < numBinned ? sortKeys[ i ] : NO_BIN;
+                if ( binIds[ i ] != fromBin ) migrations.push_back( ParticleMigration{ slot, fromBin, binIds[ i ] } );
+                sortKeys[ i ] = binIds[ i ];
+            }
+        }
+#ifdef TARGET_OSX
+    });
+#else
+    }
+#endif
+
+    // slots past the count lost their particles to retirement, their keys are still the bins they leave
+    uint64_t numMigrations = numBinned > numParticles ? numBinned - numParticles : 0;
+    for ( int chunk = 0; chunk < numChunks; ++chunk ) numMigrations += m_binMigrations[ chunk ].size();
+    m_numBinMigrations = (uint32_t)numMigrations;
+
+    if ( numMigrations > (uint64_t)( m_maxMigrationRate * numParticles ) ) return false;
+    if ( numMigrations == 0 ) return true;
+
+    // arrivals and departures by bin, then by slot - the order the full sort leaves them in
+    m_binArrivals.clear();
+    m_binDepartures.clear();
+    for ( int chunk = 0; chunk < numChunks; ++chunk )
+    {
+        for ( const ParticleMigration& migration : m_binMigrations[ chunk ] )
+        {
+            if ( migration.fromBin != NO_BIN ) m_binDepartures.push_back( ( (uint64_t)migration.fromBin << 32 ) | migration.slot );
+            m_binArrivals.push_back( ( (uint64_t)migration.toBin << 32 ) | migration.slot );
+        }
+    }
+    for ( uint32_t slot = numParticles; slot < numBinned; ++slot )
+    {
+        m_binDepartures.push_back( ( (uint64_t)m_particleSortKeys[ slot ] << 32 ) | slot );
+    }
+
+    std::sort( m_binArrivals.begin(), m_binArrivals.end() );
+    std::sort( m_binDepartures.begin(), m_binDepartures.end() );
+
+    // one patch per bin that changed, in bin order. the unchanged bins between two patches
+    // all move by the change in count of the bins before them
+    m_binPatches.clear();
+    const size_t numArrivals = m_binArrivals.size();
+    const size_t numDepartures = m_binDepartures.size();
+    size_t arrival = 0;
+    size_t departure = 0;
+    int32_t shift = 0;
+    while ( arrival < numArrivals || departure < numDepartures )
+    {
+        const uint32_t arrivalBin = arrival < numArrivals ? (uint32_t)( m_binArrivals[ arrival ] >> 32 ) : NO_BIN;
+        const uint32_t departureBin = departure < numDepartures ? (uint32_t)( m_binDepartures[ departure ] >> 32 ) : NO_BIN;
+
+        ParticleBinPatch patch;
+        patch.bin = std::min( arrivalBin, departureBin );
+        patch.oldOffset = m_particleBins[ patch.bin ].offset;
+        patch.oldCount = m_particleBins[ patch.bin ].particleCount;
+        patch.shift = shift;
+        patch.arrivalsBegin = (uint32_t)arrival;
+        while ( arrival < numArrivals && (uint32_t)( m_binArrivals[ arrival ] >> 32 ) == patch.bin ) ++arrival;
+        patch.arrivalsEnd = (uint32_t)arrival;
+
+        patch.departuresBegin = (uint32_t)departure;
+        while ( departure < numDepartures && (uint32_t)( m_binDepartures[ departure ] >> 32 ) == patch.bin ) ++departure;
+        patch.departuresEnd = (uint32_t)departure;
+
+        shift += (int32_t)( patch.arrivalsEnd - patch.arrivalsBegin ) - (int32_t)( patch.departuresEnd - patch.departuresBegin );
+        m_binPatches.push_back( patch );
+    }
+
+    const uint32_t* src = m_particleIndices;
+    uint32_t* dst = m_tempParticleIndices;
+    const int numPatches = (int)m_binPatches.size();
+
+    // the bins before the first patch keep their slots
+    memcpy( dst, src, sizeof( uint32_t ) * m_binPatches[ 0 ].oldOffset );
+
+#ifdef TARGET_OSX
+    dispatch_apply(numPatches, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^(size_t patchIdx) {
+#else
+#pragma omp parallel for schedule( static )
+    for ( int patchIdx = 0; patchIdx < numPatches; ++patchIdx ) {
+#endif
+        const ParticleBinPatch& patch = m_binPatches[ patchIdx ];
+
+        // the bin's slots minus its departures, merged with its arrivals. all three are in slot order
+        const uint32_t* in = src + patch.oldOffset;
+        const uint32_t* inEnd = in + patch.oldCount;
+        const uint64_t* departures = m_binDepartures.data() + patch.departuresBegin;
+        const uint64_t* departuresEnd = m_binDepartures.data() + patch.departuresEnd;
+        const uint64_t* arrivals = m_binArrivals.data() + patch.arrivalsBegin;
+        const uint64_t* arrivalsEnd = m_binArrivals.data() + patch.arrivalsEnd;
+        uint32_t* out = dst + patch.oldOffset + patch.shift;
+        uint32_t count = 0;
+
+        while ( in < inEnd || arrivals < arrivalsEnd )
+        {
+            if ( in < inEnd && departures < departuresEnd && *in == (uint32_t)*departures )
+            {
+                ++in;
+                ++departures;
+                continue;
+            }
+
+            if ( arrivals == arrivalsEnd || ( in < inEnd && *in < (uint32_t)*arrivals ) ) out[ count++ ] = *in++;
+            else out[ count++ ] = (uint32_t)*arrivals++;
+        }
+
+        ParticleBin& bin = m_particleBins[ patch.bin ];
+        bin.offset = patch.oldOffset + patch.shift;
+        bin.particleCount = count;
+
+        // the unchanged bins up to the next patch move as one block
+        const bool bLast = patchIdx + 1 == numPatches;
+        const int32_t gapShift = patch.shift + (int32_t)count - (int32_t)patch.oldCount;
+        const uint32_t gapBegin = patch.oldOffset + patch.oldCount;
+        const uint32_t gapEnd = bLast ? numBinned : m_binPatches[ patchIdx + 1 ].oldOffset;
+        memcpy( dst + gapBegin + gapShift, src + gapBegin, sizeof( uint32_t ) * ( gapEnd - gapBegin ) );
+
+        const uint32_t binEnd = bLast ? m_numBins : m_binPatches[ patchIdx + 1 ].bin;
+        if ( gapShift != 0 )
+        {
+            for ( uint32_t binIdx = patch.bin + 1; binIdx < binEnd; ++binIdx ) m_particleBins[ binIdx ].offset += gapShift;
+        }
+#ifdef TARGET_OSX
+    });
+#else
+    }
+#endif
+
+    std::swap( m_particleIndices, m_tempParticleIndices );
+    return true;
+}
+
+template< typename Accumulator >
+inline void addPairForce( const glm::vec4& _pa, const glm::vec4& _pb, Accumulator& _accA, Accumulator& _accB )
+{
+    // each pair once, the force on the neighbor is equal and opposite
+    const float eps = 0.1f; // minimum dist for nbody interaction
+
+    float dx = _pb.x - _pa.x;
+    float dy = _pb.y - _pa.y;
+    float dz = _pb.z - _pa.z;
+    float distSqr = dx*dx + dy*dy + dz*dz + eps;
+    float invDist = 1.0f / sqrtf( distSqr );
+    float invDist3 = invDist * invDist * invDist;
+
+    float fa = _pb.w * invDist3;
+    float fb = -_pa.w * invDist3;
+    _accA.add( fa * dx, fa * dy, fa * dz );
+    _accB.add( fb * dx, fb * dy, fb * dz );
+}
+
+template< typename Accumulator >
+inline void addPairForces( const glm::vec4* _binned, uint32_t _a, uint32_t _bBegin, uint32_t _bEnd, Accumulator* _accumulators )
+{
+    const glm::vec4 pa = _binned[ _a ];
+    for ( uint32_t b = _bBegin; b < _bEnd; ++b )
+    {
+        addPairForce( pa, _binned[ b ], _accumulators[ _a ], _accumulators[ b ] );
+    }
+}
+
+template< typename Accumulator >
+void ParticleSystem::sumBinPairForces( const ParticleNeighborTask& _task, Accumulator* _accumulators )
+{
+    const glm::vec4* binned = m_binnedPositions.data();
+    const ParticleBin& bin = m_particleBins[ _task.bin ];
+    const uint32_t binEnd = bin.offset + bin.particleCount;
+
+    // pairs within the bin
+    for ( uint32_t a = bin.offset; a < binEnd; ++a )
+    {
+        addPairForces( binned, a, a + 1, binEnd, _accumulators );
+    }
+
+    // pairs with the non-empty bins of the forward half shell
+    for ( uint32_t neighbor = _task.neighborBegin; neighbor < _task.neighborEnd; ++neighbor )
+    {
+        const ParticleBin& nbin = m_particleBins[ m_taskNeighbors[ neighbor ] ];
+        for ( uint32_t a = bin.offset; a < binEnd; ++a )
+        {
+            addPairForces( binned, a, nbin.offset, nbin.offset + nbin.particleCount, _accumulators );
+        }
+    }
+}
+
+template< typename Accumulator >
+void ParticleSystem::sumListPairForces( const ParticleNeighborTask& _task, Accumulator* _accumulators )
+{
+    const glm::vec4* binned = m_binnedPositions.data();
+    const ParticleBin& bin = m_listBins[ _task.bin ];
+    const uint32_t binEnd = bin.offset + bin.particleCount;
+    const float cutoffSqr = m_neighborCutoff * m_neighborCutoff;
+
+    // streams each row of the bin, pairs that drifted past the cutoff since the build are skipped
+    for ( uint32_t a = bin.offset; a < binEnd; ++a )
+    {
+        const glm::vec4 pa = binned[ a ];
+        const uint32_t rowEnd = m_listOffsets[ a + 1 ];
+        for ( uint32_t pair = m_listOffsets[ a ]; pair < rowEnd; ++pair )
+        {
+            const uint32_t b = m_listNeighbors[ pair ];
+            const glm::vec4& pb = binned[ b ];
+
+            float dx = pb.x - pa.x;
+            float dy = pb.y - pa.y;
+            float dz = pb.z - pa.z;
+            if ( dx*dx + dy*dy + dz*dz > cutoffSqr ) continue;
+
+            addPairForce( pa, pb, _accumulators[ a ], _accumulators[ b ] );
+        }
+    }
+}
+
+void ParticleSystem::gatherBinnedPositions()
+{
+    // positions and masses in sorted order, the pair loops then read neighbors without the index indirection
+    m_binnedPositions.resize( m_numParticles );
+
+#pragma omp parallel for schedule( static )
+    for ( int slot = 0; slot < (int)m_numParticles; ++slot )
+    {
+        const uint32_t idx = m_particleIndices[ slot ];
+        const ParticlePool& pool = m_particlePool;
+        m_binnedPositions[ slot ] = glm::vec4( pool.positionX[ idx ], pool.positionY[ idx ], pool.positionZ[ idx ], pool.mass[ idx ] );
+    }
+}
+
+bool ParticleSystem::gatherListPositions()
+{
+    if ( m_bNeighborListsDirty || m_listParticles.size() != m_numParticles ) return true;
+
+    // pairs are kept out to cutoff + skin, so no pair can get inside the cutoff unseen
+    // until some particle has moved half the skin. wrapping at a wall counts as a move
+    const float maxMoveSqr = 0.25f * m_neighborSkin * m_neighborSkin;
+    int moved = 0;
+
+#pragma omp parallel for schedule( static ) reduction( |: moved )
+    for ( int row = 0; row < (int)m_numParticles; ++row )
+    {
+        const uint32_t idx = m_listParticles[ row ];
+        const ParticlePool& pool = m_particlePool;
+        const glm::vec4 p( pool.positionX[ idx ], pool.positionY[ idx ], pool.positionZ[ idx ], pool.mass[ idx ] );
+        m_binnedPositions[ row ] = p;
+
+        glm::vec3 delta = glm::vec3( p ) - m_listPositions[ row ];
+        if ( delta.x*delta.x + delta.y*delta.y + delta.z*delta.z > maxMoveSqr ) moved = 1;
+    }
+
+    return moved != 0;
+}
+
+void ParticleSystem::buildNeighborLists()
+{
+    OFX_PROFILE_SCOPE( "particles lists" );
+
+    // the bins cover at least range bins in every direction, the lists reach cutoff + skin
+    const glm::vec3 binSize = 1.0f / m_binScale;
+    m_neighborCutoff = std::max( 0.0f, m_neighborRange * std::min( binSize.x, std::min( binSize.y, binSize.z ) ) - m_neighborSkin );
+    const float listRadius = m_neighborCutoff + m_neighborSkin;
+    const float listRadiusSqr = listRadius * listRadius;
+
+    m_listOffsets.assign( m_numParticles + 1, 0 );
+
+    // count each row, then scan and fill, rows belong to a single bin so tasks can run in any order
+#pragma omp parallel for schedule( dynamic, 64 )
+    for ( int binIdx = 0; binIdx < (int)m_numBins; ++binIdx )
+    {
+        const ParticleNeighborTask& task = m_neighborTasks[ binIdx ];
+        const ParticleBin& bin = m_particleBins[ binIdx ];
+        for ( uint32_t a = bin.offset; a < bin.offset + bin.particleCount; ++a )
+        {
+            uint32_t count = 0;
+            forEachPairWithin( task, a, listRadiusSqr, [ & ]( uint32_t ) { ++count; } );
+            m_listOffsets[ a + 1 ] = count;
+        }
+    }
+
+    for ( uint32_t row = 0; row < m_numParticles; ++row )
+    {
+        m_listOffsets[ row + 1 ] += m_listOffsets[ row ];
+    }
+    m_listNeighbors.resize( m_listOffsets[ m_numParticles ] );
+
+#pragma omp parallel for schedule( dynamic, 64 )
+    for ( int binIdx = 0; binIdx < (int)m_numBins; ++binIdx )
+    {
+        const ParticleNeighborTask& task = m_neighborTasks[ binIdx ];
+        const ParticleBin& bin = m_particleBins[ binIdx ];
+        for ( uint32_t a = bin.offset; a < bin.offset + bin.particleCount; ++a )
+        {
+            uint32_t next = m_listOffsets[ a ];
+            forEachPairWithin( task, a, listRadiusSqr, [ & ]( uint32_t _b ) { m_listNeighbors[ next++ ] = _b; } );
+        }
+    }
+
+    // the tasks were built for these bins and keep using them until the next build
+    m_listBins = m_particleBins;
+    m_listParticles.assign( m_particleIndices, m_particleIndices + m_numParticles );
+    m_listPositions.resize( m_numParticles );
+
+#pragma omp parallel for schedule( static )
+    for ( int row = 0; row < (int)m_numParticles; ++row )
+    {
+        m_listPositions[ row ] = glm::vec3( m_binnedPositions[ row ] );
+    }
+
+    m_bNeighborListsDirty = false;
+    ++m_numNeighborListBuilds;
+}
+
+void ParticleSystem::buildNeighborTasks()
+{
+    OFX_PROFILE_SCOPE( "particles tasks" );
+
+    const int period = 2 * m_neighborRange + 1;
+    const uint32_t numColors = period * period * period;
+
+    m_neighborTasks.resize( m_numBins );
+    m_taskColors.resize( m_numBins );
+    m_taskOrder.resize( m_numBins );
+
+    // color and number of non-empty neighbors of each bin, empty bins get no neighbors
+#pragma omp parallel for schedule( static )
+    for ( int binIdx = 0; binIdx < (int)m_numBins; ++binIdx )
+    {
+        const int binX = binIdx % m_binDims.x;
+        const int binY = ( binIdx / m_binDims.x ) % m_binDims.y;
+        const int binZ = binIdx / ( m_binDims.x * m_binDims.y );
+        m_taskColors[ binIdx ] = ( ( binZ % period ) * period + ( binY % period ) ) * period + ( binX % period );
+
+        uint32_t numNeighbors = 0;
+        if ( m_particleBins[ binIdx ].particleCount > 0 )
+        {
+            forEachHalfShellNeighbor( binX, binY, binZ, [ & ]( uint32_t ) { ++numNeighbors; } );
+        }
+        m_neighborTasks[ binIdx ].neighborBegin = numNeighbors;
+    }
+
+    uint32_t numNeighbors = 0;
+    for ( uint32_t binIdx = 0; binIdx < m_numBins; ++binIdx )
+    {
+        ParticleNeighborTask& task = m_neighborTasks[ binIdx ];
+        const uint32_t count = task.neighborBegin;
+        task.neighborBegin = numNeighbors;
+        numNeighbors += count;
+        task.neighborEnd = numNeighbors;
+    }
+    m_taskNeighbors.resize( numNeighbors );
+
+    // neighbor lists, and the cost of each task in pair interactions
+#pragma omp parallel for schedule( static )
+    for ( int binIdx = 0; binIdx < (int)m_numBins; ++binIdx )
+    {
+        ParticleNeighborTask& task = m_neighborTasks[ binIdx ];
+        const uint64_t count = m_particleBins[ binIdx ].particleCount;
+
+        task.bin = binIdx;
+        task.cost = count * ( count - ( count > 0 ) ) / 2;
+        if ( count == 0 ) continue;
+
+        const int binX = binIdx % m_binDims.x;
+        const int binY = ( binIdx / m_binDims.x ) % m_binDims.y;
+        const int binZ = binIdx / ( m_binDims.x * m_binDims.y );
+
+        uint32_t next = task.neighborBegin;
+        forEachHalfShellNeighbor( binX, binY, binZ, [ & ]( uint32_t _neighborIdx )
+        {
+            m_taskNeighbors[ next++ ] = _neighborIdx;
+            task.cost += count * m_particleBins[ _neighborIdx ].particleCount;
+        } );
+    }
+
+    // group the tasks by color, the sort is stable so each color stays in bin order
+    m_taskSort.sort( m_taskColors.data(), m_numBins, numColors, m_taskOrder.data() );
+    m_colorTaskBegins.resize( numColors );
+    m_colorTaskEnds.resize( numColors );
+
+#pragma omp parallel for schedule( dynamic, 1 )
+    for ( int color = 0; color < (int)numColors; ++color )
+    {
+        uint32_t* order = m_taskOrder.data();
+        const uint32_t begin = m_taskSort.getBinOffset( color );
+        uint32_t end = begin + m_taskSort.getBinCount( color );
+
+        // bins without pairs are never scheduled
+        end = (uint32_t)( std::stable_partition( order + begin, order + end, [ this ]( uint32_t _bin )
+        {
+            return m_neighborTasks[ _bin ].cost > 0;
+        } ) - order );
+
+        // dense bins go first so they do not start last and hold up the color's barrier,
+        // the rest keep bin order so neighboring tasks share cache lines
+        uint64_t totalCost = 0;
+        for ( uint32_t idx = begin; idx < end; ++idx ) totalCost += m_neighborTasks[ order[ idx ] ].cost;
+        const uint64_t heavyCost = 4 * totalCost / std::max( end - begin, 1u );
+        std::stable_partition( order + begin, order + end, [ this, heavyCost ]( uint32_t _bin )
+        {
+            return m_neighborTasks[ _bin ].cost > heavyCost;
+        } );
+
+        m_colorTaskBegins[ color ] = begin;
+        m_colorTaskEnds[ color ] = end;
+    }
+}
+
+template< typename Accumulator >
+void ParticleSystem::sumNeighborForces( float _dt, std::vector< Accumulator >& _accumulators )
+{
+    // one accumulator per sorted slot (or list row), so a bin's sums are contiguous
+    _accumulators.assign( m_numParticles, Accumulator() );
+    Accumulator* accumulators = _accumulators.data();
+    const bool bLists = m_bUseNeighborLists;
+
+    runNeighborTasks( [ & ]( const ParticleNeighborTask& _task )
+    {
+        if ( bLists ) sumListPairForces( _task, accumulators );
+        else sumBinPairForces( _task, accumulators );
+    } );
+
+    const uint32_t* slotParticles = bLists ? m_listParticles.data() : m_particleIndices;
+
+#pragma omp parallel for schedule( static )
+    for ( int slot = 0; slot < (int)m_numParticles; ++slot )
+    {
+        float sum[ 3 ];
+        accumulators[ slot ].get( sum );
+
+        const uint32_t idx = slotParticles[ slot ];
+        const float scale = _dt / m_particlePool.mass[ idx ];
+        m_particlePool.velocityX[ idx ] += scale * sum[ 0 ];
+        m_particlePool.velocityY[ idx ] += scale * sum[ 1 ];
+        m_particlePool.velocityZ[ idx ] += scale * sum[ 2 ];
+    }
+}
+
+void ParticleSystem::step( float _dt )
+{
+    OFX_PROFILE_SCOPE( "particles step" );
+
+    ofxNuma::applyThreadPinning();
+
+    applyForceSources();
+
+    if ( m_bFluid )
+    {
+        stepFluid( _dt );
+        return;
+    }
+
+    // bins were built by the last update(), the sources only changed velocities
+    OFX_PROFILE_SCOPE( "particles neighbors" );
+
+    // with lists, most steps only gather positions and stream the cached pairs
+    m_bUseNeighborLists = m_bNeighborLists && !gatherListPositions();
+    if ( !m_bUseNeighborLists )
+    {
+        buildNeighborTasks();
+        gatherBinnedPositions();
+        if ( m_bNeighborLists )
+        {
+            buildNeighborLists();
+            m_bUseNeighborLists = true;
+        }
+    }
+
+    switch ( m_forceAccumulation )
+    {
+        default:
+        case OFX_ACCUMULATE_FLOAT:
+            sumNeighborForces( _dt, m_floatAccumulators );
+            break;
+        case OFX_ACCUMULATE_KAHAN:
+            sumNeighborForces( _dt, m_kahanAccumulators );
+            break;
+        case OFX_ACCUMULATE_DOUBLE:
+            sumNeighborForces( _dt, m_doubleAccumulators );
+            break;
+    }
+}
+
+void ParticleSystem::setFluid( bool _bEnabled, const ParticleFluid& _fluid )
+{
+    m_bFluid = _bEnabled;
+    m_fluid = _fluid;
+    m_fluid.smoothingRadius = std::max( m_fluid.smoothingRadius, 1e-3f );
+
+    // bins of h / range, so the half shell reaches just past the smoothing radius instead of
+    // testing mostly pairs outside it. capped at a few bins per particle, past that h is clamped
+    glm::ivec3 binDims = m_baseBinDims;
+    if ( m_bFluid )
+    {
+        const glm::vec3 size = 1.0f / m_invBoundsScale;
+        const glm::vec3 dims = glm::max( glm::floor( size * ( m_neighborRange / m_fluid.smoothingRadius ) ), glm::vec3( 1.0f ) );
+        const float maxBins = (float)std::max( (uint64_t)m_baseBinDims.x * m_baseBinDims.y * m_baseBinDims.z, (uint64_t)m_maxParticles * 4 );
+        const float scale = std::min( 1.0f, std::cbrt( maxBins / ( dims.x * dims.y * dims.z ) ) );
+        binDims = glm::ivec3( glm::max( glm::floor( dims * scale ), glm::vec3( 1.0f ) ) );
+    }
+    if ( binDims != m_binDims ) setBinDims( binDims );
+
+    // the neighbor bins only reach range bins in every direction
+    const glm::vec3 binSize = 1.0f / m_binScale;
+    const float maxRadius = m_neighborRange * std::min( binSize.x, std::min( binSize.y, binSize.z ) );
+    m_fluid.smoothingRadius = std::min( m_fluid.smoothingRadius, maxRadius );
+    m_fluid.timeStep = std::max( m_fluid.timeStep, 1e-5f );
+    m_fluid.maxSubsteps = std::max( m_fluid.maxSubsteps, 1 );
+
+    // left at 0, the next density pass calibrates it
+    m_fluidRestDensity = m_fluid.restDensity;
+    m_fluidTime = 0.0f;
+    m_numFluidSubsteps = 0;
+}
+
+void ParticleSystem::stepFluid( float _dt )
+{
+    OFX_PROFILE_SCOPE( "particles fluid" );
+
+    // whole substeps of the time so far, the remainder carries over. past the limit the fluid
+    // falls behind real time instead of taking longer and longer steps
+    m_fluidTime += std::max( _dt, 0.0f );
+    int numSubsteps = (int)( m_fluidTime / m_fluid.timeStep );
+    if ( numSubsteps > m_fluid.maxSubsteps )
+    {
+        numSubsteps = m_fluid.maxSubsteps;
+        m_fluidTime = 0.0f;
+    }
+    else
+    {
+        m_fluidTime -= numSubsteps * m_fluid.timeStep;
+    }
+    m_numFluidSubsteps = numSubsteps;
+    m_bUseNeighborLists = false;
+
+    for ( int substep = 0; substep < numSubsteps; ++substep )
+    {
+        // the first substep runs on the bins of the last update()
+        if ( substep > 0 ) binParticles( false, false );
+
+        buildNeighborTasks();
+        gatherBinnedPositions();
+        sumFluidDensities();
+        sumFluidForces();
+        integrateFluid( m_fluid.timeStep );
+    }
+}
+
+template< typename Func >
+void ParticleSystem::forEachFluidPair( const ParticleNeighborTask& _task, float _radiusSqr, const Func& _func ) const
+{
+    const glm::vec4* binned = m_binnedPositions.data();
+    const ParticleBin& bin = m_particleBins[ _task.bin ];
+    const uint32_t binEnd = bin.offset + bin.particleCount;
+
+    auto test = [ & ]( uint32_t _a, uint32_t _bBegin, uint32_t _bEnd )
+    {
+        const glm::vec4 pa = binned[ _a ];
+        for ( uint32_t b = _bBegin; b < _bEnd; ++b )
+        {
+            const glm::vec4& pb = binned[ b ];
+            float dx = pb.x - pa.x;
+            float dy = pb.y - pa.y;
+            float dz = pb.z - pa.z;
+            float distSqr = dx*dx + dy*dy + dz*dz;
+            if ( distSqr < _radiusSqr ) _func( _a, b, dx, dy, dz, distSqr );
+        }
+    };
+
+    for ( uint32_t a = bin.offset; a < binEnd; ++a )
+    {
+        test( a, a + 1, binEnd );
+    }
+
+    for ( uint32_t neighbor = _task.neighborBegin; neighbor < _task.neighborEnd; ++neighbor )
+    {
+        const ParticleBin& nbin = m_particleBins[ m_taskNeighbors[ neighbor ] ];
+        for ( uint32_t a = bin.offset; a < binEnd; ++a )
+        {
+            test( a, nbin.offset, nbin.offset + nbin.particleCount );
+        }
+    }
+}
+
+void ParticleSystem::sumFluidDensities()
+{
+    OFX_PROFILE_SCOPE( "particles density" );
+
+    // poly6 kernel, ( h^2 - r^2 )^3
+    const float h = m_fluid.smoothingRadius;
+    const float hSqr = h * h;
+    const float poly6 = 315.0f / ( 64.0f * (float)PI * powf( h, 9.0f ) );
+
+    const int numParticles = (int)m_numParticles;
+    const glm::vec4* binned = m_binnedPositions.data();
+    m_fluidDensities.resize( numParticles );
+    float* densities = m_fluidDensities.data();
+
+    // each particle's own weight, then every pair adds to both sides
+    const float selfWeight = poly6 * hSqr * hSqr * hSqr;
+
+#pragma omp parallel for schedule( static )
+    for ( int slot = 0; slot < numParticles; ++slot )
+    {
+        densities[ slot ] = binned[ slot ].w * selfWeight;
+    }
+
+    runNeighborTasks( [ & ]( const ParticleNeighborTask& _task )
+    {
+        forEachFluidPair( _task, hSqr, [ & ]( uint32_t _a, uint32_t _b, float, float, float, float _distSqr )
+        {
+            const float diff = hSqr - _distSqr;
+            const float weight = poly6 * diff * diff * diff;
+            densities[ _a ] += binned[ _b ].w * weight;
+            densities[ _b ] += binned[ _a ].w * weight;
+        } );
+    } );
+
+    // switched on without a rest density, the fluid starts at rest at its current spread
+    if ( m_fluidRestDensity <= 0.0f && numParticles > 0 )
+    {
+        double sum = 0.0;
+
+#pragma omp parallel for schedule( static ) reduction( +: sum )
+        for ( int slot = 0; slot < numParticles; ++slot )
+        {
+            sum += densities[ slot ];
+        }
+
+        m_fluidRestDensity = (float)( sum / numParticles );
+    }
+
+    // pressure only pushes, neighbors are pulled together by the cohesion term alone
+    const float stiffness = m_fluid.stiffness;
+    const float restDensity = m_fluidRestDensity;
+    m_fluidPressures.resize( numParticles );
+    float* pressures = m_fluidPressures.data();
+
+#pragma omp parallel for schedule( static )
+    for ( int slot = 0; slot < numParticles; ++slot )
+    {
+        const float density = std::max( densities[ slot ], 1e-30f );
+        densities[ slot ] = density;
+        pressures[ slot ] = stiffness * std::max( density - restDensity, 0.0f ) / ( density * density );
+    }
+}
+
+void ParticleSystem::sumFluidForces()
+{
+    OFX_PROFILE_SCOPE( "particles fluid forces" );
+
+    // spiky gradient for the pressure, ( h - r )^2, and the viscosity laplacian, ( h - r ), share a constant.
+    // cohesion is the spline of Akinci et al. 2013
+    const float h = m_fluid.smoothingRadius;
+    const float hSqr = h * h;
+    const float spiky = 45.0f / ( (float)PI * powf( h, 6.0f ) );
+    const float cohesion = 32.0f / ( (float)PI * powf( h, 9.0f ) );
+    const float cohesionOffset = powf( h, 6.0f ) / 64.0f;
+    const float minDist = 1e-4f * h;
+
+    const float restDensity = m_fluidRestDensity;
+    const float viscosity = m_fluid.viscosity;
+    const float tension = restDensity > 0.0f ? m_fluid.surfaceTension / restDensity : 0.0f;
+
+    const int numParticles = (int)m_numParticles;
+    const glm::vec4* binned = m_binnedPositions.data();
+    const float* densities = m_fluidDensities.data();
+    const float* pressures = m_fluidPressures.data();
+
+    m_fluidVelocities.resize( numParticles );
+    glm::vec4* velocities = m_fluidVelocities.data();
+
+#pragma omp parallel for schedule( static )
+    for ( int slot = 0; slot < numParticles; ++slot )
+    {
+        const uint32_t idx = m_particleIndices[ slot ];
+        velocities[ slot ] = glm::vec4( m_particlePool.velocityX[ idx ], m_particlePool.velocityY[ idx ], m_particlePool.velocityZ[ idx ], 0.0f );
+    }
+
+    m_floatAccumulators.assign( numParticles, ofxFloatAccumulator() );
+    ofxFloatAccumulator* accelerations = m_floatAccumulators.data();
+
+    // every term is a force along the pair or the velocity difference, equal and opposite on the two particles
+    runNeighborTasks( [ & ]( const ParticleNeighborTask& _task )
+    {
+        forEachFluidPair( _task, hSqr, [ & ]( uint32_t _a, uint32_t _b, float _dx, float _dy, float _dz, float _distSqr )
+        {
+            const float dist = std::max( sqrtf( _distSqr ), minDist );
+            const float invDist = 1.0f / dist;
+            const float hr = h - dist;
+            const float sumDensity = densities[ _a ] + densities[ _b ];
+
+            // pressure apart, cohesion together, both along d = b - a
+            const float hr3 = hr * hr * hr;
+            const float r3 = dist * dist * dist;
+            const float spline = 2.0f * dist > h ? hr3 * r3 : 2.0f * hr3 * r3 - cohesionOffset;
+            const float along = ( tension * cohesion * spline * 2.0f * restDensity / sumDensity
+                                - spiky * hr * hr * ( pressures[ _a ] + pressures[ _b ] ) ) * invDist;
+
+            // viscosity towards the neighbor's velocity
+            const float drag = viscosity * spiky * hr * 2.0f / sumDensity;
+            const glm::vec4& va = velocities[ _a ];
+            const glm::vec4& vb = velocities[ _b ];
+
+            const float fx = along * _dx + drag * ( vb.x - va.x );
+            const float fy = along * _dy + drag * ( vb.y - va.y );
+            const float fz = along * _dz + drag * ( vb.z - va.z );
+
+            const float ma = binned[ _a ].w;
+            const float mb = binned[ _b ].w;
+            accelerations[ _a ].add( mb * fx, mb * fy, mb * fz );
+            accelerations[ _b ].add( -ma * fx, -ma * fy, -ma * fz );
+        } );
+    } );
+}
+
+// the fluid's position update, bouncing off the bounds rather than wrapping around. branch free like integrateParticles
+static inline void advanceFluid( float* _pos, float* _vel, int _count, float _dt, float _halfSize, float _restitution )
+{
+    for ( int i = 0; i < _count; ++i )
+    {
+        const float p = _pos[ i ] + _vel[ i ] * _dt;
+        const float outside = float( p < -_halfSize ) + float( p > _halfSize );
+        _pos[ i ] = std::min( std::max( p, -_halfSize ), _halfSize );
+        _vel[ i ] *= 1.0f - outside * ( 1.0f + _restitution );
+    }
+}
+
+void ParticleSystem::integrateFluid( float _dt )
+{
+    const int numParticles = (int)m_numParticles;
+    const ofxFloatAccumulator* accelerations = m_floatAccumulators.data();
+    const glm::vec3 gravity = m_fluid.gravity;
+    ParticlePool& pool = m_particlePool;
+
+#pragma omp parallel for schedule( static )
+    for ( int slot = 0; slot < numParticles; ++slot )
+    {
+        float sum[ 3 ];
+        accelerations[ slot ].get( sum );
+
+        const uint32_t idx = m_particleIndices[ slot ];
+        pool.velocityX[ idx ] += _dt * ( sum[ 0 ] + gravity.x );
+        pool.velocityY[ idx ] += _dt * ( sum[ 1 ] + gravity.y );
+        pool.velocityZ[ idx ] += _dt * ( sum[ 2 ] + gravity.z );
+    }
+
+    // then the positions in pool order, a block per thread
+    static const int BLOCK_SIZE = 1024;
+    const int numBlocks = ( numParticles + BLOCK_SIZE - 1 ) / BLOCK_SIZE;
+    const float restitution = m_fluid.wallRestitution;
+
+#ifdef TARGET_OSX
+    dispatch_apply(numBlocks, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^(size_t block) {
+#else
+#pragma omp parallel for schedule( static )
+    for ( int block = 0; block < numBlocks; ++block ) {
+#endif
+        const int begin = (int)block * BLOCK_SIZE;
+        const int count = std::min( BLOCK_SIZE, numParticles - begin );
+        advanceFluid( pool.positionX + begin, pool.velocityX + begin, count, _dt, m_halfWidth, restitution );
+        advanceFluid( pool.positionY + begin, pool.velocityY + begin, count, _dt, m_halfHeight, restitution );
+        advanceFluid( pool.positionZ + begin, pool.velocityZ + begin, count, _dt, m_halfDepth, restitution );
+#ifdef TARGET_OSX
+    });
+#else
+    }
+#endif
+}
+
+void ParticleSystem::debugDrawWorldBounds()
+{
+    ofDisableDepthTest();
+    glDisable( GL_CULL_FACE );
+    m_debugBoundsBox.drawWireframe();
+    ofEnableDepthTest();
+}
+
+void ParticleSystem::debugDrawParticles()
+{
+    glEnable( GL_DEPTH_TEST );
+    glEnable( GL_CULL_FACE );
+    glCullFace( GL_BACK );
+    m_sphereMesh.drawInstanced( OF_MESH_FILL, m_numParticles );
+}
+
+int ParticleSystem::runBenchmark( int _repetitions )
+{
+    const uint32_t particleCounts[] = { 40000, 400000, 4000000 };
+    const int worldSize = 1600;
+
+    printf( "best of %d, world %d^3\n", _repetitions, worldSize );
+    printf( "%10s  %14s  %12s  %14s  %12s  %10s  %10s  %8s\n", "particles", "bins", "MB", "bytes/particle", "update ms", "step ms", "lists ms", "builds" );
+
+    for ( uint32_t numParticles : particleCounts )
+    {
+        // same particles per bin as the 40K / 20^3 default
+        const int dim = (int)roundf( 20.0f * cbrtf( numParticles / 40000.0f ) );
+
+        ParticleSystem system;
+        system.init( worldSize, worldSize, worldSize, numParticles, glm::ivec3( dim, dim, dim ), false );
+
+        std::mt19937 random( 1 );
+        // half a bin from the walls, like the app a particle wrapping around would rebuild the lists
+        const float margin = 0.5f * worldSize / dim;
+        std::uniform_real_distribution< float > position( -worldSize * 0.5f + margin, worldSize * 0.5f - margin );
+        std::uniform_real_distribution< float > velocity( -1.0f, 1.0f );
+        std::uniform_real_distribution< float > mass( 0.01f, 0.1f );
+        for ( uint32_t idx = 0; idx < numParticles; ++idx )
+        {
+            float m = mass( random );
+            system.addParticle( glm::vec3( position( random ), position( random ), position( random ) ),
+                                glm::vec3( velocity( random ), velocity( random ), velocity( random ) ),
+                                m, ofMap( m, 0.01f, 0.1f, 1.0f, 6.0f ) );
+        }
+
+        // first update builds the bins step() reads
+        system.update();
+
+        double updateMs = DBL_MAX;
+        double stepMs = DBL_MAX;
+        for ( int rep = 0; rep < _repetitions; ++rep )
+        {
+            uint64_t startTime = ofGetElapsedTimeMicros();
+            system.step( 1.0f / 60.0f );
+            stepMs = std::min( stepMs, ( ofGetElapsedTimeMicros() - startTime ) / 1000.0 );
+
+            startTime = ofGetElapsedTimeMicros();
+            system.update();
+            updateMs = std::min( updateMs, ( ofGetElapsedTimeMicros() - startTime ) / 1000.0 );
+        }
+
+        // cached pairs with a quarter bin of skin, the first step builds the lists
+        system.setNeighborLists( true, 0.25f * worldSize / dim );
+        system.step( 1.0f / 60.0f );
+        system.update();
+
+        double listMs = DBL_MAX;
+        for ( int rep = 0; rep < _repetitions; ++rep )
+        {
+            uint64_t startTime = ofGetElapsedTimeMicros();
+            system.step( 1.0f / 60.0f );
+            listMs = std::min( listMs, ( ofGetElapsedTimeMicros() - startTime ) / 1000.0 );
+            system.update();
+        }
+
+        const size_t bytes = system.getMemoryUsage();
+        printf( "%10u  %14u  %12.1f  %14.1f  %12.3f  %10.3f  %10.3f  %8u\n", numParticles, system.m_numBins,
+                bytes / ( 1024.0 * 1024.0 ), (double)bytes / numParticles, updateMs, stepMs, listMs, system.getNumNeighborListBuilds() );
+
+        system.shutdown();
+    }
+
+    return 0;
+}
+
+int ParticleSystem::runRebinBenchmark( int _repetitions )
+{
+    const uint32_t particleCounts[] = { 40000, 400000, 4000000 };
+    const float migrationRates[] = { 0.0f, 0.001f, 0.005f, 0.01f, 0.02f, 0.05f, 0.1f, 0.2f, 0.5f };
+    const int worldSize = 1600;
+
+    printf( "best of %d, world %d^3, the patch is forced at every rate\n", _repetitions, worldSize );
+    printf( "%10s  %10s  %12s  %12s  %12s  %8s\n", "particles", "jumped", "migrations", "full ms", "patch ms", "speedup" );
+
+    bool bMatch = true;
+    for ( uint32_t numParticles : particleCounts )
+    {
+        // same particles per bin as the 40K / 20^3 default
+        const int dim = (int)roundf( 20.0f * cbrtf( numParticles / 40000.0f ) );
+
+        ParticleSystem system;
+        system.init( worldSize, worldSize, worldSize, numParticles, glm::ivec3( dim, dim, dim ), false );
+        system.setIncrementalBinning( true, 1.0f );
+
+        std::mt19937 random( 1 );
+        std::uniform_real_distribution< float > position( -worldSize * 0.5f, worldSize * 0.5f );
+        std::uniform_int_distribution< uint32_t > slot( 0, numParticles - 1 );
+        for ( uint32_t idx = 0; idx < numParticles; ++idx )
+        {
+            system.addParticle( glm::vec3( position( random ), position( random ), position( random ) ), glm::vec3( 0.0f ), 0.05f, 2.0f );
+        }
+        system.update();
+
+        std::vector< uint32_t > patchedIndices( numParticles );
+        std::vector< ParticleBin > patchedBins;
+        for ( float rate : migrationRates )
+        {
+            double fullMs = DBL_MAX;
+            double patchMs = DBL_MAX;
+            uint64_t numMigrations = 0;
+            for ( int rep = 0; rep < _repetitions; ++rep )
+            {
+                // the rate's share of the particles jump to random positions, the rest stay where they are
+                const uint32_t numMoved = (uint32_t)( rate * numParticles );
+                for ( uint32_t idx = 0; idx < numMoved; ++idx )
+                {
+                    const uint32_t moved = slot( random );
+                    system.m_particlePool.positionX[ moved ] = position( random );
+                    system.m_particlePool.positionY[ moved ] = position( random );
+                    system.m_particlePool.positionZ[ moved ] = position( random );
+                }
+
+                // patched from the last binning, then sorted from scratch over the same positions
+                uint64_t startTime = ofGetElapsedTimeMicros();
+                system.binParticles( false, false );
+                patchMs = std::min( patchMs, ( ofGetElapsedTimeMicros() - startTime ) / 1000.0 );
+                numMigrations += system.getNumBinMigrations();
+                memcpy( patchedIndices.data(), system.m_particleIndices, sizeof( uint32_t ) * numParticles );
+                patchedBins = system.m_particleBins;
+
+                system.m_bBinKeysValid = false;
+                startTime = ofGetElapsedTimeMicros();
+                system.binParticles( false, false );
+                fullMs = std::min( fullMs, ( ofGetElapsedTimeMicros() - startTime ) / 1000.0 );
+
+                if ( memcmp( patchedIndices.data(), system.m_particleIndices, sizeof( uint32_t ) * numParticles ) != 0
+                    || memcmp( patchedBins.data(), system.m_particleBins.data(), sizeof( ParticleBin ) * system.m_numBins ) != 0 )
+                {
+                    ofLogError( "ParticleSystem::runRebinBenchmark", "%u particles at %g migrated do not match the full sort", numParticles, rate );
+                    bMatch = false;
+                }
+            }
+            patchMs = std::max( patchMs, 1e-3 );
+
+            printf( "%10u  %9.1f%%  %12.1f  %12.3f  %12.3f  %8.2f\n", numParticles, rate * 100.0f, (double)numMigrations / _repetitions,
+                    fullMs, patchMs, fullMs / patchMs );
+        }
+
+        system.shutdown();
+    }
+
+    return bMatch ? 0 : 1;
 }
@@ -1,71 +1,365 @@
 #pragma once
 
 #include "glm/glm.hpp"
+#include <array>
+#include <random>
 #include "ofMain.h"
+#include "ofxCountingSort.h"
+#include "ofxForceAccumulator.h"
+#include "ofxFreeList.h"
+#include "ofxSpaceFillingCurve.h"
 
-struct Particle
+// particles as one array per field, so the per-particle kernels stream each field and vectorize
+struct ParticlePool
 {
-    glm::vec3 position;
-    float     mass;
-    glm::vec3 velocity;
-    float     radius;
+    float * positionX;
+    float * positionY;
+    float * positionZ;
+    float * velocityX;
+    float * velocityY;
+    float * velocityZ;
+    float * mass;
+    float * radius;
+    float * age; // in updates
+    float * lifetime; // FLT_MAX for particles that live until killed
+
+    static const int NUM_FIELDS = 10;
+
+    // every field, for allocating and moving them all the same way
+    inline std::array< float**, NUM_FIELDS > getFields()
+    {
+        return { { &positionX, &positionY, &positionZ, &velocityX, &velocityY, &velocityZ, &mass, &radius, &age, &lifetime } };
+    }
 };
 
-struct ParticleTboData
+// per-instance upload, one RGBA32UI texel. the position as float bits, then the radius as a
+// half float in the low 16 bits and the velocity direction, octahedral 8:8, in the high 16 bits
+struct ParticleInstance
 {
-    glm::mat4 transform;
+    glm::vec3 position;
+    uint32_t  radiusAndDirection;
 };
 
 struct ParticleBin
 {
-    uint16_t offset;
-    uint16_t particleCount;
+    uint32_t offset;
+    uint32_t particleCount;
 };
 
-struct Attractor
+// a particle whose bin changed since the last binning, UINT32_MAX for a slot that had no bin
+struct ParticleMigration
 {
-    glm::vec3 position;
-    float     strength;
+    uint32_t slot;
+    uint32_t fromBin;
+    uint32_t toBin;
 };
 
-struct Repeller
+// a bin whose particles changed, with its ranges of m_binArrivals and m_binDepartures. shift is
+// how far the bin moves in the sorted indices, the change in count of the bins before it
+struct ParticleBinPatch
 {
-    glm::vec3 position;
-    float     strength;
+    uint32_t bin;
+    uint32_t oldOffset;
+    uint32_t oldCount;
+    int32_t  shift;
+    uint32_t arrivalsBegin;
+    uint32_t arrivalsEnd;
+    uint32_t departuresBegin;
+    uint32_t departuresEnd;
 };
 
-class ParticleSystem
+// a bin's pairs with itself and with its non-empty half-shell neighbors, which are
+// m_taskNeighbors[ neighborBegin, neighborEnd ). cost is the number of pair interactions
+struct ParticleNeighborTask
+{
+    uint32_t bin;
+    uint32_t neighborBegin;
+    uint32_t neighborEnd;
+    uint64_t cost;
+};
+
+// how the pull of a force source changes with distance d, for sources with a radius the
+// force is zero past it. the radius kernels need a radius and fall back to inverse square without one
+enum ForceFalloff
+{
+    FORCE_FALLOFF_INVERSE_SQUARE, // strength / d^2
+    FORCE_FALLOFF_LINEAR, // strength * ( 1 - d / radius )
+    FORCE_FALLOFF_SMOOTH, // strength * ( 1 - ( d / radius )^2 )^2
+
+    FORCE_NUM_FALLOFFS
+};
+
+// attractors and repellers as separate arrays, repellers have negative strength.
+// a tile of particles runs through them in order with no gathers
+struct ForceSources
 {
-    static const uint16_t BIN_DIMS_X = 20;
-    static const uint16_t BIN_DIMS_Y = 20;
-    static const uint16_t BIN_DIMS_Z = 20;
-    static const uint16_t NUM_BINS = BIN_DIMS_X * BIN_DIMS_Y * BIN_DIMS_Z;
+    std::vector< float > x;
+    std::vector< float > y;
+    std::vector< float > z;
+    std::vector< float > strength;
+    std::vector< float > radius; // 0 = unbounded
+    std::vector< int >   falloff;
+};
+
+// spawns particles around a point every update(). rates and lifetimes count updates,
+// the same step the particles move by their velocity in
+struct ParticleEmitter
+{
+    glm::vec3 position       = glm::vec3( 0.0f, 0.0f, 0.0f );
+    float     positionSpread = 0.0f; // spawn inside this radius
+    glm::vec3 velocity       = glm::vec3( 0.0f, 0.0f, 0.0f );
+    float     velocitySpread = 1.0f; // plus a random velocity up to this length
+    float     rate           = 10.0f; // particles per update, fractions carry over
+    float     lifetime       = 120.0f;
+    float     lifetimeSpread = 0.0f; // +/- this fraction of the lifetime
+    float     mass           = 0.05f;
+    float     radius         = 2.0f;
+    bool      bEnabled       = true;
+};
 
-    static const uint16_t MAX_PARTICLES = 40000;
-    static const uint16_t MAX_ATTRACTORS = 10;
-    static const uint16_t MAX_REPELLERS = 10;
+// SPH fluid parameters, times in seconds. the pair terms are symmetric, so the fluid uses the
+// same half-shell tasks as the gravity pass and each pair is visited once per pass
+struct ParticleFluid
+{
+    float     smoothingRadius = 40.0f; // capped at the distance the neighbor bins cover
+    float     restDensity     = 0.0f; // 0 = the mean density of the particles when the fluid is switched on
+    float     stiffness       = 40000.0f; // pressure per density above rest, the square of the speed of sound
+    float     viscosity       = 200.0f; // kinematic, in units^2 / s
+    float     surfaceTension  = 0.0f; // cohesion acceleration between neighbors, 0 = off
+    glm::vec3 gravity         = glm::vec3( 0.0f, 0.0f, 0.0f );
+    float     wallRestitution = 0.5f; // the fluid bounces off the bounds instead of wrapping around
+    float     timeStep        = 1.0f / 120.0f; // fixed substep
+    int       maxSubsteps     = 4; // time past this many substeps per step() is dropped
+};
 
+class ParticleSystem
+{
 public:
     ParticleSystem();
     ~ParticleSystem();
 
-    void init( int _width, int _height, int _depth );
+    // particle indices and bin ids are 32 bit, so capacity and bin dims are only limited by memory.
+    // _bGpuUpload = false skips the position buffer, for headless runs without a GL context
+    void init( int _width, int _height, int _depth, uint32_t _maxParticles = 40000, const glm::ivec3& _binDims = glm::ivec3( 20, 20, 20 ), bool _bGpuUpload = true );
     void shutdown();
 
+    // bytes held for particles, bins and force sums, divide by getMaxParticles() for the cost per particle
+    size_t getMemoryUsage() const;
+    inline uint32_t getMaxParticles() const { return m_maxParticles; }
+    inline uint32_t getNumParticles() const { return m_numParticles; }
+    inline const glm::ivec3& getBinDims() const { return m_binDims; }
+
+    // headless update() + step() timings (bins and cached lists) and memory per particle at 40K, 400K and 4M particles,
+    // bin dims grow with the count to keep the particles per bin of the 40K / 20^3 default
+    static int runBenchmark( int _repetitions = 5 );
+    // headless binning of the same positions with the full sort and patched, as a growing share of the particles
+    // jump to new bins. checks the patched order matches and prints a table. returns the exit code
+    static int runRebinBenchmark( int _repetitions = 10 );
+
+    // builds m_particleIndices and the bin offsets from the keys and histograms of the last update()
     void sortParticlesByBin();
 
+    // sorts the particle pool along a space-filling curve every _interval updates (0 = never),
+    // so particles that share a bin also share cache lines in the force loops
+    void setReordering( uint32_t _interval, ofxSpaceFillingCurve _curve = OFX_CURVE_HILBERT );
+    void reorderParticles();
+
+    // with the fluid on, _dt is in seconds and is run in fixed substeps
     void step( float _dt );
+
+    // caches the pairs within cutoff + _skin in CSR lists and reuses them until a particle has moved
+    // more than _skin / 2, a reorder or new particles also rebuild them. with lists on, pairs further
+    // apart than the cutoff are dropped, the cutoff being the distance the neighbor bins always cover minus the skin
+    void setNeighborLists( bool _bEnabled, float _skin );
+    inline uint32_t getNumNeighborPairs() const { return m_bUseNeighborLists ? (uint32_t)m_listNeighbors.size() : 0; }
+    inline uint32_t getNumNeighborListBuilds() const { return m_numNeighborListBuilds; }
+
+    // precision of the per-particle neighbor force sums, pair math stays in float
+    void setForceAccumulation( ofxForceAccumulation _accumulation ) { m_forceAccumulation = _accumulation; }
+
+    // pair forces between each particle and the particles within m_neighborRange bins, each pair once
+    template< typename Accumulator >
+    void sumNeighborForces( float _dt, std::vector< Accumulator >& _accumulators );
+    template< typename Accumulator >
+    void sumBinPairForces( const ParticleNeighborTask& _task, Accumulator* _accumulators );
+    template< typename Accumulator >
+    void sumListPairForces( const ParticleNeighborTask& _task, Accumulator* _accumulators );
+
+    // runs _func( task ) for every neighbor task. a task writes to the bins within range of its bin, so
+    // tasks of the same color, a period apart on every axis, never touch the same slots and run without atomics
+    template< typename Func >
+    inline void runNeighborTasks( const Func& _func )
+    {
+        const ParticleNeighborTask* tasks = m_neighborTasks.data();
+        const uint32_t* order = m_taskOrder.data();
+        const int numColors = (int)m_colorTaskEnds.size();
+
+#ifdef TARGET_OSX
+        for ( int color = 0; color < numColors; ++color )
+        {
+            const uint32_t begin = m_colorTaskBegins[ color ];
+            dispatch_apply(m_colorTaskEnds[ color ] - begin, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^(size_t idx) {
+                _func( tasks[ order[ begin + idx ] ] );
+            });
+        }
+#else
+        // one team for all colors, each color is a dynamic loop over its tasks and ends at the loop's barrier
+#pragma omp parallel
+        for ( int color = 0; color < numColors; ++color )
+        {
+            const int begin = m_colorTaskBegins[ color ];
+            const int end = m_colorTaskEnds[ color ];
+
+#pragma omp for schedule( dynamic, 1 )
+            for ( int idx = begin; idx < end; ++idx )
+            {
+                _func( tasks[ order[ idx ] ] );
+            }
+        }
+#endif
+    }
+
+    // SPH fluid in place of the pairwise gravity. neighbor lists and the force accumulation modes only apply to gravity
+    void setFluid( bool _bEnabled, const ParticleFluid& _fluid = ParticleFluid() );
+    inline bool isFluid() const { return m_bFluid; }
+    inline const ParticleFluid& getFluid() const { return m_fluid; }
+    inline float getFluidRestDensity() const { return m_fluidRestDensity; }
+    inline int getNumFluidSubsteps() const { return m_numFluidSubsteps; } // run by the last step()
+
+    // fixed substeps for the time since the last step(), rebinning between them
+    void stepFluid( float _dt );
+    // density per sorted slot, then the pressure term p / density^2
+    void sumFluidDensities();
+    // pressure, viscosity and cohesion accelerations per sorted slot
+    void sumFluidForces();
+    // velocities from the accelerations, then positions, bounced off the bounds
+    void integrateFluid( float _dt );
+    // calls _func( a, b, dx, dy, dz, distSqr ) for the pairs of the task within _radiusSqr, d = b - a
+    template< typename Func >
+    void forEachFluidPair( const ParticleNeighborTask& _task, float _radiusSqr, const Func& _func ) const;
+
+    // positions and masses per sorted slot for the bin pass
+    void gatherBinnedPositions();
+    // positions and masses per list row, returns true if the lists have to be rebuilt first
+    bool gatherListPositions();
+    // lists of the tasks built for the current bins, from the positions of gatherBinnedPositions()
+    void buildNeighborLists();
+
+    // calls _func( b ) for the slots b paired with slot _a by the bin's task that are within _radiusSqr
+    template< typename Func >
+    inline void forEachPairWithin( const ParticleNeighborTask& _task, uint32_t _a, float _radiusSqr, const Func& _func ) const
+    {
+        const glm::vec4 pa = m_binnedPositions[ _a ];
+        auto test = [ & ]( uint32_t _bBegin, uint32_t _bEnd )
+        {
+            for ( uint32_t b = _bBegin; b < _bEnd; ++b )
+            {
+                const glm::vec4& pb = m_binnedPositions[ b ];
+                float dx = pb.x - pa.x;
+                float dy = pb.y - pa.y;
+                float dz = pb.z - pa.z;
+                if ( dx*dx + dy*dy + dz*dz < _radiusSqr ) _func( b );
+            }
+        };
+
+        const ParticleBin& bin = m_particleBins[ _task.bin ];
+        test( _a + 1, bin.offset + bin.particleCount );
+        for ( uint32_t neighbor = _task.neighborBegin; neighbor < _task.neighborEnd; ++neighbor )
+        {
+            const ParticleBin& nbin = m_particleBins[ m_taskNeighbors[ neighbor ] ];
+            test( nbin.offset, nbin.offset + nbin.particleCount );
+        }
+    }
+
+    // one task per bin with pairs, grouped by bin color with the dense ones first, from the bins of the last update()
+    void buildNeighborTasks();
+
+    // calls _func( neighborBinId ) for the non-empty, in-bounds bins of the forward half shell
+    template< typename Func >
+    inline void forEachHalfShellNeighbor( int _binX, int _binY, int _binZ, const Func& _func ) const
+    {
+        // most bins are at least range from every wall and skip the bounds checks
+        const int r = m_neighborRange;
+        if ( _binX >= r && _binX < m_binDims.x - r && _binY >= r && _binY < m_binDims.y - r && _binZ >= r && _binZ < m_binDims.z - r )
+        {
+            const uint32_t binIdx = binIdFromXYZ( _binX, _binY, _binZ );
+            for ( int offset : m_halfShellBinOffsets )
+            {
+                const uint32_t neighborIdx = binIdx + offset;
+                if ( m_particleBins[ neighborIdx ].particleCount > 0 ) _func( neighborIdx );
+            }
+            return;
+        }
+
+        for ( const glm::ivec3& offset : m_halfShellOffsets )
+        {
+            const int nx = _binX + offset.x;
+            const int ny = _binY + offset.y;
+            const int nz = _binZ + offset.z;
+            if ( nx < 0 || nx >= m_binDims.x || ny < 0 || ny >= m_binDims.y || nz < 0 || nz >= m_binDims.z ) continue;
+
+            const uint32_t neighborIdx = binIdFromXYZ( nx, ny, nz );
+            if ( m_particleBins[ neighborIdx ].particleCount > 0 ) _func( neighborIdx );
+        }
+    }
     void update();
+    // bin keys per chunk, optionally moving the particles and packing the instances first, then the sort or the patch
+    void binParticles( bool _bIntegrate, bool _bPackInstances );
+    void binBlock( uint32_t _begin, int _count, bool _bIntegrate, bool _bPackInstances, uint32_t* _binIds );
+    // moves the particles that changed bins within the last binning's order, with the same result as the
+    // full sort. returns false without touching the order when more than the max migration rate moved
+    bool patchParticleBins( bool _bIntegrate, bool _bPackInstances );
+    void setBinDims( const glm::ivec3& _binDims );
 
-    void addParticle( const glm::vec3& _pos, const glm::vec3& _vel, float _mass, float _radius );
-    void addAttractor( const glm::vec3& _pos, float _strength );
-    void addRepeller( const glm::vec3& _pos, float _strength );
+    // most particles stay in their bin from one update to the next, so the bins can be patched with the ones
+    // that moved instead of sorted again. more than _maxMigrationRate of the particles changing bins, a
+    // reorder or new bin dims take the full sort, as do the next few binnings after too many moved.
+    // births and deaths are patched like any other move
+    void setIncrementalBinning( bool _bEnabled, float _maxMigrationRate = 0.02f );
+    inline bool isIncrementalBinning() const { return m_bIncrementalBinning; }
+    // particles that changed bins in the last binning, counted only when incremental, and whether it was patched
+    inline uint32_t getNumBinMigrations() const { return m_numBinMigrations; }
+    inline bool wasBinningPatched() const { return m_bBinningPatched; }
+
+    // returns the particle id, or UINT32_MAX when the pool is full. ids and slots come from a lock-free
+    // free list, so threads can add at the same time, but not during update(). new particles join the
+    // simulation at the next update(). _lifetime is in updates, 0 lives until killed
+    uint32_t addParticle( const glm::vec3& _pos, const glm::vec3& _vel, float _mass, float _radius, float _lifetime = 0.0f );
+    // the particle dies in the next update() and its id goes back to the pool. ids that are not alive are
+    // ignored, but an id handed out again belongs to the new particle
+    void killParticle( uint32_t _id );
+
+    // returns the emitter index, which stays valid until clearEmitters()
+    uint32_t addEmitter( const ParticleEmitter& _emitter );
+    inline ParticleEmitter& getEmitter( uint32_t _idx ) { return m_emitters[ _idx ]; }
+    void clearEmitters();
+    inline uint32_t getNumEmitters() const { return (uint32_t)m_emitters.size(); }
+
+    // ages the particles and fills the slots of the dead ones from the top of the pool, so the live
+    // particles stay dense in [ 0, getNumParticles() ). returns the number that died
+    uint32_t retireParticles();
+    // every emitter spawns its particles for this update in parallel, straight from the free list
+    void emitParticles();
+    // writes a new particle into a slot taken from the free list
+    void setParticle( uint32_t _slot, uint32_t _id, const glm::vec3& _pos, const glm::vec3& _vel, float _mass, float _radius, float _lifetime );
+    void moveParticle( uint32_t _src, uint32_t _dst );
+
+    // return the source index, which stays valid until clearForceSources()
+    uint32_t addAttractor( const glm::vec3& _pos, float _strength, ForceFalloff _falloff = FORCE_FALLOFF_INVERSE_SQUARE, float _radius = 0.0f );
+    uint32_t addRepeller( const glm::vec3& _pos, float _strength, ForceFalloff _falloff = FORCE_FALLOFF_INVERSE_SQUARE, float _radius = 0.0f );
+    // moves a source and sets its strength (negative repels), e.g. from animation tracks every frame
+    void setForceSource( uint32_t _idx, const glm::vec3& _pos, float _strength );
+    void clearForceSources();
+    inline uint32_t getNumForceSources() const { return (uint32_t)m_forceSources.strength.size(); }
+
+    // velocity change of every particle from the force sources
+    void applyForceSources();
 
     inline const ofTexture& getPositionTexture() const { return m_positionTboTex; };
 
-    inline uint16_t binIdFromXYZ( uint16_t _x, uint16_t _y, uint16_t _z )
+    inline uint32_t binIdFromXYZ( uint32_t _x, uint32_t _y, uint32_t _z ) const
     {
-        return _z * BIN_DIMS_X * BIN_DIMS_Y + _y * BIN_DIMS_X + _x;
+        return ( _z * m_binDims.y + _y ) * m_binDims.x + _x;
     }
 
     void debugDrawWorldBounds();
@@ -75,16 +369,22 @@ public:
     float           m_halfHeight;
     float           m_halfDepth;
 
-    Particle *      m_particlePool;
-    Attractor       m_attractors[ MAX_ATTRACTORS ];
-    Repeller        m_repellers[ MAX_REPELLERS ];
+    ParticlePool    m_particlePool;
+    ForceSources    m_forceSources;
 
+    uint32_t        m_maxParticles;
     uint32_t        m_numParticles;
-    uint32_t        m_numAttractors;
-    uint32_t        m_numRepellers;
 
     glm::vec3       m_invBoundsScale;
     glm::vec3       m_binScale;
+    glm::ivec3      m_binDims;
+    glm::ivec3      m_baseBinDims;  // from init(), the fluid swaps in bins sized to its radius
+    uint32_t        m_numBins;
+    bool            m_bGpuUpload;
+
+    int                        m_neighborRange; // neighbor bins +/- range on each axis
+    std::vector< glm::ivec3 >  m_halfShellOffsets;
+    std::vector< int >         m_halfShellBinOffsets; // the same offsets as bin id deltas
 
     ofBoxPrimitive  m_debugBoundsBox;
     ofVboMesh       m_sphereMesh;
@@ -92,14 +392,80 @@ public:
 
     ofTexture       m_positionTboTex;
     ofBufferObject  m_positionTbo;
-    ParticleTboData * m_positions;
+    ParticleInstance * m_instances;
+
+    ofxForceAccumulation       m_forceAccumulation;
+    std::vector< ofxFloatAccumulator >  m_floatAccumulators; // per sorted slot, only the active mode's is filled
+    std::vector< ofxKahanAccumulator >  m_kahanAccumulators;
+    std::vector< ofxDoubleAccumulator > m_doubleAccumulators;
+    std::vector< glm::vec4 >            m_binnedPositions; // position and mass per sorted slot
+
+    uint32_t                   m_reorderInterval;
+    ofxSpaceFillingCurve       m_reorderCurve;
+    uint32_t                   m_updateCount;
+
+    ParticlePool               m_tempParticlePool; // reorder target, swapped with the pool
+    uint32_t *                 m_particleIds; // pool slot -> id
+    uint32_t *                 m_particleSlots; // id -> pool slot
+    ofxFreeList                m_freeList; // free ids, the used count is the end of the dense slots
+
+    std::vector< ParticleEmitter > m_emitters;
+    std::vector< float >       m_emitterCarry; // fraction of a particle left over from the last update
+    std::vector< std::mt19937 > m_emitterRandoms;
+    std::vector< std::vector< uint32_t > > m_retiredSlots; // per chunk of the pool, in slot order
+
+    std::vector< uint64_t >    m_curveKeys;
+    std::vector< uint64_t >    m_tempCurveKeys;
+    std::vector< uint32_t >    m_curveOrder;
+    std::vector< uint32_t >    m_tempCurveOrder;
+
+    std::vector< ParticleBin > m_particleBins;
+    uint32_t *                 m_particleIndices; // particle pool indices sorted by bin
+    uint32_t *                 m_particleSortKeys; // bin ID of each particle pool index
+
+    ofxCountingSort            m_binSort; // per-thread bin histograms and offsets
+
+    bool                       m_bIncrementalBinning;
+    float                      m_maxMigrationRate;
+    bool                       m_bBinKeysValid; // the keys and indices are the bins of the first m_numBinnedParticles slots
+    uint32_t                   m_numBinnedParticles;
+    uint32_t                   m_numBinMigrations;
+    bool                       m_bBinningPatched;
+    uint32_t                   m_binPatchBackoff; // binnings left to sort without trying the patch
+    uint32_t *                 m_tempParticleIndices; // patch target, swapped with the indices
+    std::vector< std::vector< ParticleMigration > > m_binMigrations; // per chunk of the pool, in slot order
+    std::vector< uint64_t >    m_binArrivals; // bin << 32 | slot, sorted
+    std::vector< uint64_t >    m_binDepartures; // bin << 32 | slot of the bins left, sorted
+    std::vector< ParticleBinPatch > m_binPatches;
+
+    std::vector< ParticleNeighborTask > m_neighborTasks; // per bin
+    std::vector< uint32_t >    m_taskNeighbors; // neighbor bin ids of all tasks
+    std::vector< uint32_t >    m_taskColors; // color of each bin
+    std::vector< uint32_t >    m_taskOrder; // bins sorted by color, then by cost
+    std::vector< uint32_t >    m_colorTaskBegins; // range of each color's tasks in m_taskOrder
+    std::vector< uint32_t >    m_colorTaskEnds;
+    ofxCountingSort            m_taskSort;
 
-    ParticleBin                m_particleBins[ NUM_BINS ];
-    uint16_t                   m_particleIndices[ MAX_PARTICLES ]; // unsorted list of particle indices (just particle pool index)
-    uint16_t                   m_particleSortKeys[ MAX_PARTICLES ]; // list of bin keys (bin ID)
+    bool                       m_bNeighborLists;
+    bool                       m_bNeighborListsDirty; // set when pool slots or the particle count change
+    bool                       m_bUseNeighborLists; // this step sums over the lists
+    float                      m_neighborSkin;
+    float                      m_neighborCutoff;
+    uint32_t                   m_numNeighborListBuilds;
+    std::vector< ParticleBin > m_listBins; // bins, particle order and positions when the lists were built,
+    std::vector< uint32_t >    m_listParticles; // the tasks keep running on these until the next build
+    std::vector< glm::vec3 >   m_listPositions;
+    std::vector< uint32_t >    m_listOffsets; // row per sorted slot, numParticles + 1 entries
+    std::vector< uint32_t >    m_listNeighbors; // slots of the later particle of each pair
 
-    uint16_t                   m_tempParticleIndices[ MAX_PARTICLES ]; // temp list for radix sort
-    uint16_t                   m_tempParticleSortKeys[ MAX_PARTICLES ]; // temp list for radix sort
+    bool                       m_bFluid;
+    ParticleFluid              m_fluid;
+    float                      m_fluidRestDensity; // calibrated when the parameters leave it at 0
+    float                      m_fluidTime; // not yet simulated, less than one substep
+    int                        m_numFluidSubsteps;
+    std::vector< glm::vec4 >   m_fluidVelocities; // per sorted slot
+    std::vector< float >       m_fluidDensities;
+    std::vector< float >       m_fluidPressures; // p / density^2
 
 
 };
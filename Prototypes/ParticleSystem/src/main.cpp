@@ -1,11 +1,34 @@
 #include "ofMain.h"
 #include "ofApp.h"
+#include "ofxCountingSort.h"
+#include "ParticleSystem.h"
 
 //#define TWO_1080P_SCREENS
 
 //========================================================================
-int main()
+int main( int argc, char *argv[] )
 {
+    // ParticleSystem --binning-benchmark [repetitions]
+    if ( argc > 1 && string( argv[ 1 ] ) == "--binning-benchmark" )
+    {
+        int repetitions = ( argc > 2 ) ? ofToInt( argv[ 2 ] ) : 10;
+        return ofxCountingSort::runBenchmark( 20 * 20 * 20, repetitions );
+    }
+
+    // ParticleSystem --particle-benchmark [repetitions]
+    if ( argc > 1 && string( argv[ 1 ] ) == "--particle-benchmark" )
+    {
+        int repetitions = ( argc > 2 ) ? ofToInt( argv[ 2 ] ) : 5;
+        return ParticleSystem::runBenchmark( repetitions );
+    }
+
+    // ParticleSystem --rebin-benchmark [repetitions]
+    if ( argc > 1 && string( argv[ 1 ] ) == "--rebin-benchmark" )
+    {
+        int repetitions = ( argc > 2 ) ? ofToInt( argv[ 2 ] ) : 10;
+        return ParticleSystem::runRebinBenchmark( repetitions );
+    }
+
 	ofGLFWWindowSettings settings;
 	settings.setGLVersion(4,1);
     //settings.windowMode = OF_FULLSCREEN;
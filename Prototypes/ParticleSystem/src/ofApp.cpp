@@ -4,6 +4,8 @@
 #include "lb/gl/GLError.h"
 #include "lb/math/MatrixTools.h"
 #include "lb/camera/CameraTools.h"
+#include "ofxNuma.h"
+#include "ofxProfiler.h"
 
 using namespace glm;
 
@@ -53,7 +55,41 @@ void ofApp::setup()
 
     lb::CheckGLError();
 
-    m_particleSystem.init( 1600, 1600, 1600 );
+    // set before init so the particle arrays are placed for this policy
+    m_threadPinning = OFX_THREAD_PINNING_NONE;
+    ofxNuma::setThreadPinning( (ofxThreadPinning)m_threadPinning );
+
+    m_particleSystem.init( 1600, 1600, 1600, 40000, glm::ivec3( 20, 20, 20 ) );
+
+    m_reorderInterval = 30;
+    m_particleSystem.setReordering( m_reorderInterval );
+
+    m_forceAccumulation = OFX_ACCUMULATE_FLOAT;
+    m_particleSystem.setForceAccumulation( (ofxForceAccumulation)m_forceAccumulation );
+
+    m_bNeighborLists = false;
+    m_neighborSkin = 20.0f;
+    m_particleSystem.setNeighborLists( m_bNeighborLists, m_neighborSkin );
+
+    m_bIncrementalBinning = true;
+    m_particleSystem.setIncrementalBinning( m_bIncrementalBinning );
+
+    // a fountain at the center, off until its rate is raised in the gui
+    m_emitterRate = 0.0f;
+    m_emitterLifetime = 240.0f;
+    ParticleEmitter emitter;
+    emitter.positionSpread = 20.0f;
+    emitter.velocity = glm::vec3( 0.0f, 4.0f, 0.0f );
+    emitter.velocitySpread = 3.0f;
+    emitter.rate = m_emitterRate;
+    emitter.lifetime = m_emitterLifetime;
+    emitter.lifetimeSpread = 0.25f;
+    m_emitter = m_particleSystem.addEmitter( emitter );
+
+    // the soup as a fluid, off until switched on in the gui
+    m_bFluid = false;
+    m_fluid.smoothingRadius = 60.0f;
+    m_fluid.surfaceTension = 2000.0f;
 
 
 
@@ -199,6 +235,57 @@ void ofApp::imGui()
         ImGui::SliderFloat( "Exposure", &m_exposure, 0.01f, 10.0f );
         ImGui::SliderFloat( "Gamma", &m_gamma, 0.01f, 10.0f );
 
+        ImGui::Separator();
+        ImGui::Text( "Simulation" );
+        if ( ImGui::Combo( "Thread Pinning", &m_threadPinning, "None\0Compact\0Scatter\0\0" ) )
+        {
+            ofxNuma::setThreadPinning( (ofxThreadPinning)m_threadPinning );
+        }
+        ImGui::Text( "NUMA Nodes: %d, CPUs: %d", ofxNuma::getNumNodes(), ofxNuma::getNumCpus() );
+        ImGui::Text( "Particles: %u / %u, Bins: %d x %d x %d", m_particleSystem.getNumParticles(), m_particleSystem.getMaxParticles(),
+                     m_particleSystem.getBinDims().x, m_particleSystem.getBinDims().y, m_particleSystem.getBinDims().z );
+        ImGui::Text( "Memory: %.1f MB (%.0f bytes/particle)", m_particleSystem.getMemoryUsage() / ( 1024.0 * 1024.0 ),
+                     (double)m_particleSystem.getMemoryUsage() / std::max( m_particleSystem.getMaxParticles(), 1u ) );
+        if ( ImGui::SliderInt( "Reorder Interval", &m_reorderInterval, 0, 120 ) )
+        {
+            m_particleSystem.setReordering( m_reorderInterval );
+        }
+        if ( ImGui::Combo( "Force Accumulation", &m_forceAccumulation, "Float\0Kahan\0Double\0\0" ) )
+        {
+            m_particleSystem.setForceAccumulation( (ofxForceAccumulation)m_forceAccumulation );
+        }
+        bool bListsChanged = ImGui::Checkbox( "Neighbor Lists", &m_bNeighborLists );
+        bListsChanged |= ImGui::SliderFloat( "Neighbor Skin", &m_neighborSkin, 0.0f, 80.0f );
+        if ( bListsChanged )
+        {
+            m_particleSystem.setNeighborLists( m_bNeighborLists, m_neighborSkin );
+        }
+        ImGui::Text( "Neighbor Pairs: %u, List Builds: %u", m_particleSystem.getNumNeighborPairs(), m_particleSystem.getNumNeighborListBuilds() );
+        if ( ImGui::Checkbox( "Incremental Binning", &m_bIncrementalBinning ) )
+        {
+            m_particleSystem.setIncrementalBinning( m_bIncrementalBinning );
+        }
+        ImGui::Text( "Bin Migrations: %u (%s)", m_particleSystem.getNumBinMigrations(), m_particleSystem.wasBinningPatched() ? "patched" : "sorted" );
+        bool bEmitterChanged = ImGui::SliderFloat( "Emitter Rate", &m_emitterRate, 0.0f, 2000.0f );
+        bEmitterChanged |= ImGui::SliderFloat( "Emitter Lifetime", &m_emitterLifetime, 1.0f, 600.0f );
+        if ( bEmitterChanged )
+        {
+            ParticleEmitter& emitter = m_particleSystem.getEmitter( m_emitter );
+            emitter.rate = m_emitterRate;
+            emitter.lifetime = m_emitterLifetime;
+        }
+        bool bFluidChanged = ImGui::Checkbox( "Fluid", &m_bFluid );
+        bFluidChanged |= ImGui::SliderFloat( "Smoothing Radius", &m_fluid.smoothingRadius, 10.0f, 160.0f );
+        bFluidChanged |= ImGui::SliderFloat( "Stiffness", &m_fluid.stiffness, 0.0f, 200000.0f );
+        bFluidChanged |= ImGui::SliderFloat( "Viscosity", &m_fluid.viscosity, 0.0f, 2000.0f );
+        bFluidChanged |= ImGui::SliderFloat( "Surface Tension", &m_fluid.surfaceTension, 0.0f, 20000.0f );
+        bFluidChanged |= ImGui::SliderFloat( "Gravity", &m_fluid.gravity.y, -500.0f, 500.0f );
+        if ( bFluidChanged )
+        {
+            m_particleSystem.setFluid( m_bFluid, m_fluid );
+        }
+        ImGui::Text( "Fluid Substeps: %d, Rest Density: %g", m_particleSystem.getNumFluidSubsteps(), m_particleSystem.getFluidRestDensity() );
+
         ImGui::BeginGroup();
         ImGui::Text( "Stats" );
         ImGui::Text( "Visible Lights: %u", m_lightSystem.GetNumVisibleLights() );
@@ -208,6 +295,19 @@ void ofApp::imGui()
         ImGui::Text( "Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate );
         ImGui::EndGroup();
 
+        ImGui::Separator();
+        ImGui::Text( "Timings (ms, last 2s)" );
+        std::vector< ofxProfiler::Stats > timings;
+        ofxProfiler::getStats( timings );
+        for ( const auto& timer : timings )
+        {
+            ImGui::Text( "%-20s mean %7.3f  p50 %7.3f  p99 %7.3f  max %7.3f", timer.name.c_str(), timer.mean, timer.p50, timer.p99, timer.max );
+        }
+        if ( ImGui::Button( "Save Timings" ) )
+        {
+            ofxProfiler::writeCSV( "profile.csv" );
+        }
+
         ImGui::Separator();
         ImGui::Text( "Lights" );
 
@@ -329,7 +429,12 @@ void ofApp::update()
 
     m_bMouseOverGui = false;
 
-    if ( ofGetFrameNum() % 2 == 0 )
+    if ( m_particleSystem.isFluid() )
+    {
+        // the fluid runs fixed substeps for the real time since the last frame
+        m_particleSystem.step( (float)ofGetLastFrameTime() );
+    }
+    else if ( ofGetFrameNum() % 2 == 0 )
     {
         m_particleSystem.step( ( 1.0f / 60.0f * 1000.0f ) * 2.0f );
     }
@@ -90,4 +90,15 @@ private:
     bool                        m_bMouseOverGui;
 
     ParticleSystem              m_particleSystem;
+    int                         m_threadPinning;
+    int                         m_reorderInterval;
+    int                         m_forceAccumulation;
+    bool                        m_bNeighborLists;
+    float                       m_neighborSkin;
+    bool                        m_bIncrementalBinning;
+    uint32_t                    m_emitter;
+    float                       m_emitterRate;
+    float                       m_emitterLifetime;
+    bool                        m_bFluid;
+    ParticleFluid               m_fluid;
 };
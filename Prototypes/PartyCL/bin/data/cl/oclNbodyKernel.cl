@@ -167,7 +167,7 @@ REAL3 computeBodyAccel_MT(REAL4 bodyPos,
         barrier(CLK_LOCAL_MEM_FENCE);//__syncthreads();
 
         // Save the result in global memory for the integration step
-        if (get_local_id(0) == 0) 
+        if (get_local_id(1) == 0) 
         {
             for (unsigned int i = 1; i < blockDimy; i++) 
             {
@@ -249,6 +249,9 @@ __kernel void integrateBodies_MT(
     REAL4 pos = oldPos[index];   
     REAL3 accel = computeBodyAccel_MT(pos, oldPos, numBodies, softeningSquared, sharedPos);
 
+    // Only the first row holds the full sum, the other rows share its bodies.
+    if (threadIdxy != 0) return;
+
     // acceleration = force \ mass; 
     // new velocity = old velocity + acceleration * deltaTime
     // note we factor out the body's mass from the equation, here and in bodyBodyInteraction 
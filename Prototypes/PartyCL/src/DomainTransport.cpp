@@ -0,0 +1,585 @@
+//
+//  DomainTransport.cpp
+//  PartyCL
+//
+
+#include "DomainTransport.h"
+
+#include "ofMain.h"
+
+// Both transports are built on POSIX shared memory and sockets.
+#if !defined(TARGET_WIN32)
+#include <cerrno>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#endif
+
+namespace entropy
+{
+#if !defined(TARGET_WIN32)
+    // How long ranks wait for each other to show up.
+    static const int CONNECT_TIMEOUT_MS = 30000;
+
+    // Sleeping barrier polls between checks that the other ranks are alive.
+    static const int LIVENESS_CHECK_SPINS = 200;
+
+    //--------------------------------------------------------------
+    // Spawned workers are children of rank 0 and stay zombies until they are
+    // reaped, which kill() can't tell apart from a running process.
+    static bool isProcessAlive(int pid)
+    {
+        int status;
+        pid_t result = waitpid(pid, &status, WNOHANG);
+        if (result == pid) return false;
+        if (result == 0) return true;
+        return kill(pid, 0) == 0 || errno != ESRCH;
+    }
+
+    //--------------------------------------------------------------
+    DomainTransport* DomainTransport::create(const std::string& spec, const std::string& session, int rank, int numRanks)
+    {
+        if (spec.compare(0, 4, "tcp:") == 0) {
+            return new DomainTransportSocket(ofToInt(spec.substr(4)), rank, numRanks);
+        }
+        return new DomainTransportShm(session, rank, numRanks);
+    }
+
+    //--------------------------------------------------------------
+    DomainTransportShm::DomainTransportShm(const std::string& session, int rank, int numRanks)
+    : DomainTransport(rank, numRanks)
+    , _session(session)
+    , _controlFd(-1)
+    , _control(nullptr)
+    , _barrierSense(0)
+    , _bAborted(false)
+    {}
+
+    //--------------------------------------------------------------
+    DomainTransportShm::~DomainTransportShm()
+    {
+        close();
+    }
+
+    //--------------------------------------------------------------
+    std::string DomainTransportShm::_segmentName(int rank) const
+    {
+        if (rank < 0) return "/" + _session + ".ctl";
+        return "/" + _session + ".r" + ofToString(rank);
+    }
+
+    //--------------------------------------------------------------
+    bool DomainTransportShm::open()
+    {
+        if (_numRanks > MAX_RANKS) {
+            ofLogError("DomainTransportShm::open", "At most %d ranks are supported", MAX_RANKS);
+            return false;
+        }
+
+        std::string controlName = _segmentName(-1);
+        if (_rank == 0) {
+            // Clear out whatever a crashed run left behind.
+            shm_unlink(controlName.c_str());
+            _controlFd = shm_open(controlName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+            if (_controlFd < 0 || ftruncate(_controlFd, sizeof(Control)) != 0) {
+                ofLogError("DomainTransportShm::open", "Could not create %s", controlName.c_str());
+                return false;
+            }
+            void* mapped = mmap(nullptr, sizeof(Control), PROT_READ | PROT_WRITE, MAP_SHARED, _controlFd, 0);
+            if (mapped == MAP_FAILED) return false;
+
+            _control = new (mapped) Control();
+            _control->numRanks = _numRanks;
+            _control->aborted.store(0);
+            _control->barrierCount.store(0);
+            _control->barrierSense.store(0);
+            memset(_control->pids, 0, sizeof(_control->pids));
+            memset(_control->segmentSizes, 0, sizeof(_control->segmentSizes));
+            memset(_control->messageSizes, 0, sizeof(_control->messageSizes));
+            _control->pids[0] = getpid();
+
+            _segments.assign(_numRanks, Segment());
+            shm_unlink(_segmentName(_rank).c_str());
+            if (!_mapSegment(_rank, 4096, true)) {
+                return false;
+            }
+
+            // Workers only touch the control segment once it is initialized.
+            _control->ready.store(1);
+        }
+        else {
+            // Wait for rank 0 to create and size the control segment.
+            uint64_t startTime = ofGetElapsedTimeMillis();
+            while (_control == nullptr) {
+                _controlFd = shm_open(controlName.c_str(), O_RDWR, 0600);
+                struct stat info;
+                if (_controlFd >= 0 && fstat(_controlFd, &info) == 0 && info.st_size >= (off_t)sizeof(Control)) {
+                    void* mapped = mmap(nullptr, sizeof(Control), PROT_READ | PROT_WRITE, MAP_SHARED, _controlFd, 0);
+                    if (mapped != MAP_FAILED) {
+                        _control = (Control *)mapped;
+                        break;
+                    }
+                }
+                if (_controlFd >= 0) {
+                    ::close(_controlFd);
+                    _controlFd = -1;
+                }
+                if (ofGetElapsedTimeMillis() - startTime > CONNECT_TIMEOUT_MS) {
+                    ofLogError("DomainTransportShm::open", "Timed out waiting for %s", controlName.c_str());
+                    return false;
+                }
+                usleep(10000);
+            }
+
+            while (_control->ready.load() == 0) {
+                if (ofGetElapsedTimeMillis() - startTime > CONNECT_TIMEOUT_MS) {
+                    ofLogError("DomainTransportShm::open", "Timed out waiting for rank 0");
+                    return false;
+                }
+                usleep(1000);
+            }
+            _control->pids[_rank] = getpid();
+
+            _segments.assign(_numRanks, Segment());
+            shm_unlink(_segmentName(_rank).c_str());
+            if (!_mapSegment(_rank, 4096, true)) {
+                _abort();
+                return false;
+            }
+        }
+
+        // Everyone counts in. A rank that never starts or exits right away
+        // fails the barrier for all of them.
+        if (!_barrier(CONNECT_TIMEOUT_MS)) {
+            ofLogError("DomainTransportShm::open", "Not every rank joined session %s", _session.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+    //--------------------------------------------------------------
+    void DomainTransportShm::close()
+    {
+        for (int r = 0; r < (int)_segments.size(); ++r) {
+            _unmapSegment(r);
+        }
+        if (!_segments.empty()) {
+            shm_unlink(_segmentName(_rank).c_str());
+            _segments.clear();
+        }
+
+        if (_control) {
+            munmap(_control, sizeof(Control));
+            _control = nullptr;
+        }
+        if (_controlFd >= 0) {
+            ::close(_controlFd);
+            _controlFd = -1;
+            if (_rank == 0) {
+                shm_unlink(_segmentName(-1).c_str());
+            }
+        }
+    }
+
+    //--------------------------------------------------------------
+    bool DomainTransportShm::_mapSegment(int rank, uint64_t size, bool create)
+    {
+        Segment& segment = _segments[rank];
+        if (segment.data && segment.size == size) return true;
+
+        _unmapSegment(rank);
+
+        std::string name = _segmentName(rank);
+        segment.fd = shm_open(name.c_str(), create ? (O_CREAT | O_RDWR) : O_RDONLY, 0600);
+        if (segment.fd < 0) {
+            ofLogError("DomainTransportShm", "Could not open %s", name.c_str());
+            return false;
+        }
+        if (create) {
+            if (ftruncate(segment.fd, size) != 0) {
+                ofLogError("DomainTransportShm", "Could not resize %s to %llu bytes", name.c_str(), (unsigned long long)size);
+                return false;
+            }
+            _control->segmentSizes[rank] = size;
+        }
+
+        void* mapped = mmap(nullptr, size, create ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, segment.fd, 0);
+        if (mapped == MAP_FAILED) {
+            ofLogError("DomainTransportShm", "Could not map %s", name.c_str());
+            return false;
+        }
+        segment.data = (uint8_t *)mapped;
+        segment.size = size;
+        return true;
+    }
+
+    //--------------------------------------------------------------
+    void DomainTransportShm::_unmapSegment(int rank)
+    {
+        Segment& segment = _segments[rank];
+        if (segment.data) {
+            munmap(segment.data, segment.size);
+        }
+        if (segment.fd >= 0) {
+            ::close(segment.fd);
+        }
+        segment = Segment();
+    }
+
+    //--------------------------------------------------------------
+    bool DomainTransportShm::_barrier(int timeoutMs)
+    {
+        if (_bAborted || _control->aborted.load()) {
+            _bAborted = true;
+            return false;
+        }
+
+        // Sense reversing barrier on plain atomics, which work across processes
+        // on every platform we run on (unlike process shared pthread objects).
+        _barrierSense ^= 1;
+        if (_control->barrierCount.fetch_add(1) == _numRanks - 1) {
+            _control->barrierCount.store(0);
+            _control->barrierSense.store(_barrierSense);
+            return true;
+        }
+
+        uint64_t startTime = ofGetElapsedTimeMillis();
+        int spins = 0;
+        while (_control->barrierSense.load() != _barrierSense) {
+            if (++spins < 1000) {
+                std::this_thread::yield();
+                continue;
+            }
+            usleep(50);
+
+            if ((spins % LIVENESS_CHECK_SPINS) != 0) continue;
+            if (_control->aborted.load()) {
+                _bAborted = true;
+                return false;
+            }
+            if (!_ranksAlive() || (timeoutMs >= 0 && ofGetElapsedTimeMillis() - startTime > (uint64_t)timeoutMs)) {
+                _abort();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    //--------------------------------------------------------------
+    bool DomainTransportShm::_ranksAlive() const
+    {
+        for (int r = 0; r < _numRanks; ++r) {
+            int pid = _control->pids[r];
+            if (r != _rank && pid > 0 && !isProcessAlive(pid)) {
+                ofLogError("DomainTransportShm", "Rank %d went away", r);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    //--------------------------------------------------------------
+    void DomainTransportShm::_abort()
+    {
+        _bAborted = true;
+        _control->aborted.store(1);
+    }
+
+    //--------------------------------------------------------------
+    bool DomainTransportShm::allToAll(const std::vector<Buffer>& send, std::vector<Buffer>& recv)
+    {
+        recv.assign(_numRanks, Buffer());
+        if (_bAborted) return false;
+
+        // Write the outgoing messages back to back into this rank's segment.
+        uint64_t total = 0;
+        for (int q = 0; q < _numRanks; ++q) {
+            uint64_t size = (q == _rank) ? 0 : send[q].size();
+            _control->messageSizes[_rank][q] = size;
+            total += size;
+        }
+        if (total > _segments[_rank].size) {
+            // Grow geometrically so resizes stay rare. The old mapping is gone
+            // either way, so a failure takes every rank out of the collective.
+            if (!_mapSegment(_rank, MAX(total, _segments[_rank].size * 2), true)) {
+                _abort();
+                return false;
+            }
+        }
+        uint64_t offset = 0;
+        for (int q = 0; q < _numRanks; ++q) {
+            if (q == _rank) continue;
+            memcpy(_segments[_rank].data + offset, send[q].data(), send[q].size());
+            offset += send[q].size();
+        }
+
+        if (!_barrier(-1)) return false;
+
+        for (int p = 0; p < _numRanks; ++p) {
+            if (p == _rank) {
+                recv[p] = send[p];
+                continue;
+            }
+
+            uint64_t begin = 0;
+            for (int q = 0; q < _rank; ++q) {
+                begin += _control->messageSizes[p][q];
+            }
+            uint64_t size = _control->messageSizes[p][_rank];
+
+            recv[p].resize(size);
+            if (size == 0) continue;
+            if (!_mapSegment(p, _control->segmentSizes[p], false)) {
+                _abort();
+                recv.assign(_numRanks, Buffer());
+                return false;
+            }
+            memcpy(recv[p].data(), _segments[p].data + begin, size);
+        }
+
+        // Senders may not overwrite their segment until everyone has read it.
+        if (!_barrier(-1)) {
+            recv.assign(_numRanks, Buffer());
+            return false;
+        }
+        return true;
+    }
+
+    // A peer that went away must fail the send, not raise SIGPIPE and take
+    // the whole process down. macOS has no MSG_NOSIGNAL, it sets SO_NOSIGPIPE
+    // on each socket in configureSocket() instead.
+#if defined(MSG_NOSIGNAL)
+    static const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+    static const int SEND_FLAGS = 0;
+#endif
+
+    //--------------------------------------------------------------
+    static void configureSocket(int socket)
+    {
+        int enable = 1;
+        setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+#if defined(SO_NOSIGPIPE)
+        setsockopt(socket, SOL_SOCKET, SO_NOSIGPIPE, &enable, sizeof(enable));
+#endif
+    }
+
+    //--------------------------------------------------------------
+    static bool sendAll(int socket, const void* data, size_t size)
+    {
+        const uint8_t* bytes = (const uint8_t *)data;
+        while (size > 0) {
+            ssize_t sent = ::send(socket, bytes, size, SEND_FLAGS);
+            if (sent <= 0) return false;
+            bytes += sent;
+            size -= sent;
+        }
+        return true;
+    }
+
+    //--------------------------------------------------------------
+    static bool recvAll(int socket, void* data, size_t size)
+    {
+        uint8_t* bytes = (uint8_t *)data;
+        while (size > 0) {
+            ssize_t received = ::recv(socket, bytes, size, 0);
+            if (received <= 0) return false;
+            bytes += received;
+            size -= received;
+        }
+        return true;
+    }
+
+    //--------------------------------------------------------------
+    static bool sendBuffer(int socket, const DomainTransport::Buffer& buffer)
+    {
+        uint64_t size = buffer.size();
+        return sendAll(socket, &size, sizeof(size)) && sendAll(socket, buffer.data(), buffer.size());
+    }
+
+    //--------------------------------------------------------------
+    static bool recvBuffer(int socket, DomainTransport::Buffer& buffer)
+    {
+        uint64_t size = 0;
+        if (!recvAll(socket, &size, sizeof(size))) return false;
+        buffer.resize(size);
+        return recvAll(socket, buffer.data(), size);
+    }
+
+    //--------------------------------------------------------------
+    DomainTransportSocket::DomainTransportSocket(int port, int rank, int numRanks)
+    : DomainTransport(rank, numRanks)
+    , _port(port)
+    , _listenSocket(-1)
+    {}
+
+    //--------------------------------------------------------------
+    DomainTransportSocket::~DomainTransportSocket()
+    {
+        close();
+    }
+
+    //--------------------------------------------------------------
+    bool DomainTransportSocket::open()
+    {
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = htons(_port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        _sockets.assign(_numRanks, -1);
+
+        if (_rank == 0) {
+            _listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+            int reuse = 1;
+            setsockopt(_listenSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+            if (bind(_listenSocket, (sockaddr *)&address, sizeof(address)) != 0 || listen(_listenSocket, _numRanks) != 0) {
+                ofLogError("DomainTransportSocket::open", "Could not listen on port %d", _port);
+                return false;
+            }
+
+            uint64_t startTime = ofGetElapsedTimeMillis();
+            for (int i = 1; i < _numRanks; ++i) {
+                // Workers that never start would block accept() forever.
+                pollfd pending = { _listenSocket, POLLIN, 0 };
+                int remaining = CONNECT_TIMEOUT_MS - (int)(ofGetElapsedTimeMillis() - startTime);
+                if (remaining <= 0 || poll(&pending, 1, remaining) <= 0) {
+                    ofLogError("DomainTransportSocket::open", "Timed out waiting for the workers on port %d", _port);
+                    return false;
+                }
+
+                int connection = accept(_listenSocket, nullptr, nullptr);
+                uint32_t rank = 0;
+                if (connection < 0 || !recvAll(connection, &rank, sizeof(rank)) || rank == 0 || rank >= (uint32_t)_numRanks) {
+                    ofLogError("DomainTransportSocket::open", "Bad connection from a worker");
+                    return false;
+                }
+                configureSocket(connection);
+                _sockets[rank] = connection;
+            }
+        }
+        else {
+            uint64_t startTime = ofGetElapsedTimeMillis();
+            while (true) {
+                int connection = socket(AF_INET, SOCK_STREAM, 0);
+                if (connect(connection, (sockaddr *)&address, sizeof(address)) == 0) {
+                    configureSocket(connection);
+                    _sockets[0] = connection;
+                    break;
+                }
+                ::close(connection);
+                if (ofGetElapsedTimeMillis() - startTime > CONNECT_TIMEOUT_MS) {
+                    ofLogError("DomainTransportSocket::open", "Timed out connecting to port %d", _port);
+                    return false;
+                }
+                usleep(10000);
+            }
+
+            uint32_t rank = _rank;
+            if (!sendAll(_sockets[0], &rank, sizeof(rank))) return false;
+        }
+
+        return true;
+    }
+
+    //--------------------------------------------------------------
+    void DomainTransportSocket::close()
+    {
+        for (int connection : _sockets) {
+            if (connection >= 0) ::close(connection);
+        }
+        _sockets.clear();
+
+        if (_listenSocket >= 0) {
+            ::close(_listenSocket);
+            _listenSocket = -1;
+        }
+    }
+
+    //--------------------------------------------------------------
+    bool DomainTransportSocket::allToAll(const std::vector<Buffer>& send, std::vector<Buffer>& recv)
+    {
+        recv.assign(_numRanks, Buffer());
+        if (_sockets.empty()) return false;
+
+        if (_rank != 0) {
+            // Everything goes through rank 0, addressed by destination.
+            bool ok = true;
+            for (int q = 0; q < _numRanks && ok; ++q) {
+                ok = sendBuffer(_sockets[0], (q == _rank) ? Buffer() : send[q]);
+            }
+            for (int p = 0; p < _numRanks && ok; ++p) {
+                if (p == _rank) {
+                    recv[p] = send[p];
+                }
+                else {
+                    ok = recvBuffer(_sockets[0], recv[p]);
+                }
+            }
+            if (!ok) {
+                ofLogError("DomainTransportSocket::allToAll", "Lost the connection to rank 0");
+                recv.assign(_numRanks, Buffer());
+            }
+            return ok;
+        }
+
+        // Rank 0 collects the full message table, then hands out columns.
+        bool ok = true;
+        std::vector<std::vector<Buffer>> table(_numRanks);
+        table[0] = send;
+        for (int p = 1; p < _numRanks && ok; ++p) {
+            table[p].resize(_numRanks);
+            for (int q = 0; q < _numRanks && ok; ++q) {
+                ok = recvBuffer(_sockets[p], table[p][q]);
+                if (!ok) {
+                    ofLogError("DomainTransportSocket::allToAll", "Lost the connection to rank %d", p);
+                }
+            }
+        }
+        if (!ok) {
+            // Closing the connections releases the workers still waiting.
+            close();
+            recv.assign(_numRanks, Buffer());
+            return false;
+        }
+
+        for (int q = 1; q < _numRanks && ok; ++q) {
+            for (int p = 0; p < _numRanks && ok; ++p) {
+                if (p == q) continue;
+                ok = sendBuffer(_sockets[q], table[p][q]);
+                if (!ok) {
+                    ofLogError("DomainTransportSocket::allToAll", "Lost the connection to rank %d", q);
+                }
+            }
+        }
+        if (!ok) {
+            close();
+            recv.assign(_numRanks, Buffer());
+            return false;
+        }
+
+        for (int p = 0; p < _numRanks; ++p) {
+            recv[p].swap(table[p][0]);
+        }
+        return true;
+    }
+#else
+    //--------------------------------------------------------------
+    DomainTransport* DomainTransport::create(const std::string& spec, const std::string& session, int rank, int numRanks)
+    {
+        ofLogError("DomainTransport::create", "No transport for \"%s\" on this platform", spec.c_str());
+        return nullptr;
+    }
+#endif
+}
@@ -0,0 +1,138 @@
+//
+//  DomainTransport.h
+//  PartyCL
+//
+//  Message passing between the processes of a domain decomposed run. The only
+//  collective is a variable sized all-to-all, every other exchange (gather,
+//  scatter, broadcast) is built from it. All ranks must call it together.
+//
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace entropy
+{
+    class DomainTransport
+    {
+    public:
+        typedef std::vector<uint8_t> Buffer;
+
+        DomainTransport(int rank, int numRanks)
+        : _rank(rank)
+        , _numRanks(numRanks)
+        {}
+
+        virtual ~DomainTransport()
+        {}
+
+        // Connects to the other ranks, returns false on failure or timeout.
+        virtual bool open() = 0;
+        virtual void close() = 0;
+
+        // send[q] goes to rank q, recv[p] is filled with what rank p sent here.
+        // Returns false with empty buffers if a rank went away, the transport
+        // is unusable after that.
+        virtual bool allToAll(const std::vector<Buffer>& send, std::vector<Buffer>& recv) = 0;
+
+        int getRank() const
+        { return _rank; }
+        int getNumRanks() const
+        { return _numRanks; }
+
+        // Parses "shm" or "tcp:<port>". Returns null on platforms without
+        // POSIX shared memory and sockets (Windows).
+        static DomainTransport* create(const std::string& spec, const std::string& session, int rank, int numRanks);
+
+    protected:
+        int _rank;
+        int _numRanks;
+    };
+
+    //--------------------------------------------------------------
+    // POSIX shared memory. A control segment holds the message size table and
+    // a barrier, and each rank writes its outgoing messages to its own data
+    // segment which the receivers copy from.
+    class DomainTransportShm
+    : public DomainTransport
+    {
+    public:
+        DomainTransportShm(const std::string& session, int rank, int numRanks);
+        virtual ~DomainTransportShm();
+
+        virtual bool open();
+        virtual void close();
+
+        virtual bool allToAll(const std::vector<Buffer>& send, std::vector<Buffer>& recv);
+
+        static const int MAX_RANKS = 64;
+
+    protected:
+        struct Control
+        {
+            std::atomic<uint32_t> ready;
+            // Set by the first rank to give up, releases the others.
+            std::atomic<uint32_t> aborted;
+            uint32_t numRanks;
+            // Process ids the waiting ranks check on, 0 until a rank shows up.
+            int32_t pids[MAX_RANKS];
+            std::atomic<int> barrierCount;
+            std::atomic<int> barrierSense;
+            uint64_t segmentSizes[MAX_RANKS];
+            uint64_t messageSizes[MAX_RANKS][MAX_RANKS];
+        };
+
+        struct Segment
+        {
+            Segment()
+            : fd(-1)
+            , data(nullptr)
+            , size(0)
+            {}
+
+            int fd;
+            uint8_t* data;
+            uint64_t size;
+        };
+
+        std::string _segmentName(int rank) const;
+        bool _mapSegment(int rank, uint64_t size, bool create);
+        void _unmapSegment(int rank);
+        // Waits for every rank, or fails after timeoutMs (< 0 waits as long as
+        // the other ranks are alive).
+        bool _barrier(int timeoutMs);
+        bool _ranksAlive() const;
+        void _abort();
+
+        std::string _session;
+        int _controlFd;
+        Control* _control;
+        std::vector<Segment> _segments;
+        int _barrierSense;
+        bool _bAborted;
+    };
+
+    //--------------------------------------------------------------
+    // Loopback TCP. Rank 0 listens on the port and relays every message, so
+    // each worker only holds one connection.
+    class DomainTransportSocket
+    : public DomainTransport
+    {
+    public:
+        DomainTransportSocket(int port, int rank, int numRanks);
+        virtual ~DomainTransportSocket();
+
+        virtual bool open();
+        virtual void close();
+
+        virtual bool allToAll(const std::vector<Buffer>& send, std::vector<Buffer>& recv);
+
+    protected:
+        int _port;
+        int _listenSocket;
+        // Indexed by rank on rank 0, a single connection to rank 0 elsewhere.
+        std::vector<int> _sockets;
+    };
+}
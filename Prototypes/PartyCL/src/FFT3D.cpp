@@ -0,0 +1,149 @@
+//
+//  FFT3D.cpp
+//  PartyCL
+//
+
+#include "FFT3D.h"
+#include "Parallel.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace entropy
+{
+    //--------------------------------------------------------------
+    FFT3D::FFT3D()
+    : _size(0)
+    , _log2Size(0)
+    {}
+
+    //--------------------------------------------------------------
+    void FFT3D::setup(int size)
+    {
+        if (size == _size || !isPowerOfTwo(size)) return;
+
+        _size = size;
+        _log2Size = 0;
+        while ((1 << _log2Size) < size) ++_log2Size;
+
+        _bitReverse.resize(size);
+        for (int i = 0; i < size; ++i) {
+            int reversed = 0;
+            for (int b = 0; b < _log2Size; ++b) {
+                reversed |= ((i >> b) & 1) << (_log2Size - 1 - b);
+            }
+            _bitReverse[i] = reversed;
+        }
+
+        // exp(-2 pi i k / size) for k in [0, size / 2), computed in double so
+        // the large transforms stay accurate.
+        _twiddles.resize(std::max(1, size / 2));
+        for (int k = 0; k < size / 2; ++k) {
+            double angle = -2.0 * 3.14159265358979323846 * k / size;
+            _twiddles[k] = Complex((float)cos(angle), (float)sin(angle));
+        }
+    }
+
+    //--------------------------------------------------------------
+    void FFT3D::forward(Complex* data)
+    {
+        _transform(data, false);
+    }
+
+    //--------------------------------------------------------------
+    void FFT3D::inverse(Complex* data)
+    {
+        _transform(data, true);
+
+        const int total = _size * _size * _size;
+        const float scale = 1.0f / total;
+        parallelFor(_size * _size, [&](int line) {
+            Complex* values = data + line * _size;
+            for (int i = 0; i < _size; ++i) {
+                values[i] *= scale;
+            }
+        });
+    }
+
+    //--------------------------------------------------------------
+    void FFT3D::_transform(Complex* data, bool inverse)
+    {
+        const int n = _size;
+
+        // Along x the lines are contiguous.
+        parallelFor(n * n, [&](int line) {
+            _transformLine(data + line * n, inverse);
+        });
+
+        // Along y and z, transform the n lines of a plane together so the
+        // inner loop runs over contiguous x values instead of striding.
+        parallelFor(n, [&](int z) {
+            _transformColumns(data + z * n * n, n, inverse);
+        });
+        parallelFor(n, [&](int y) {
+            _transformColumns(data + y * n, n * n, inverse);
+        });
+    }
+
+    //--------------------------------------------------------------
+    void FFT3D::_transformLine(Complex* line, bool inverse) const
+    {
+        const int n = _size;
+
+        for (int i = 0; i < n; ++i) {
+            int j = _bitReverse[i];
+            if (i < j) std::swap(line[i], line[j]);
+        }
+
+        for (int half = 1, step = n / 2; half < n; half *= 2, step /= 2) {
+            for (int start = 0; start < n; start += half * 2) {
+                for (int k = 0; k < half; ++k) {
+                    const Complex& w = _twiddles[k * step];
+                    float wr = w.real();
+                    float wi = inverse ? -w.imag() : w.imag();
+
+                    // Spelled out, std::complex multiplication goes through a
+                    // slow NaN-checking path without -ffast-math.
+                    Complex a = line[start + k];
+                    Complex c = line[start + k + half];
+                    Complex b(c.real() * wr - c.imag() * wi, c.real() * wi + c.imag() * wr);
+                    line[start + k] = a + b;
+                    line[start + k + half] = a - b;
+                }
+            }
+        }
+    }
+
+    //--------------------------------------------------------------
+    void FFT3D::_transformColumns(Complex* data, int stride, bool inverse) const
+    {
+        const int n = _size;
+
+        for (int i = 0; i < n; ++i) {
+            int j = _bitReverse[i];
+            if (i < j) {
+                std::swap_ranges(data + i * stride, data + i * stride + n, data + j * stride);
+            }
+        }
+
+        for (int half = 1, step = n / 2; half < n; half *= 2, step /= 2) {
+            for (int start = 0; start < n; start += half * 2) {
+                for (int k = 0; k < half; ++k) {
+                    const Complex& w = _twiddles[k * step];
+                    float wr = w.real();
+                    float wi = inverse ? -w.imag() : w.imag();
+
+                    Complex* rowA = data + (start + k) * stride;
+                    Complex* rowB = data + (start + k + half) * stride;
+                    for (int x = 0; x < n; ++x) {
+                        Complex a = rowA[x];
+                        Complex c = rowB[x];
+                        Complex b(c.real() * wr - c.imag() * wi, c.real() * wi + c.imag() * wr);
+                        rowA[x] = a + b;
+                        rowB[x] = a - b;
+                    }
+                }
+            }
+        }
+    }
+}
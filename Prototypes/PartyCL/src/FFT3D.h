@@ -0,0 +1,49 @@
+//
+//  FFT3D.h
+//  PartyCL
+//
+//  In-place complex FFT on a cubic, power of two grid. Each axis is done as a
+//  batch of independent radix-2 line transforms spread across threads.
+//
+
+#pragma once
+
+#include <complex>
+#include <vector>
+
+namespace entropy
+{
+    class FFT3D
+    {
+    public:
+        typedef std::complex<float> Complex;
+
+        FFT3D();
+
+        // size must be a power of two.
+        void setup(int size);
+
+        int getSize() const
+        { return _size; }
+
+        // data holds size^3 values, x varying fastest. The forward transform is
+        // unnormalized, the inverse divides by size^3 so a round trip is exact.
+        void forward(Complex* data);
+        void inverse(Complex* data);
+
+        static bool isPowerOfTwo(int value)
+        { return value > 0 && (value & (value - 1)) == 0; }
+
+    protected:
+        void _transform(Complex* data, bool inverse);
+        void _transformLine(Complex* line, bool inverse) const;
+        // Transforms n contiguous lines at once, element i of every line is
+        // stride values after element i - 1.
+        void _transformColumns(Complex* data, int stride, bool inverse) const;
+
+        int _size;
+        int _log2Size;
+        std::vector<int> _bitReverse;
+        std::vector<Complex> _twiddles;
+    };
+}
@@ -0,0 +1,138 @@
+//
+//  InitialConditions.cpp
+//  PartyCL
+//
+
+#include "InitialConditions.h"
+
+#include "Parallel.h"
+
+namespace entropy
+{
+    //--------------------------------------------------------------
+    // Uniform point in the unit ball, sampled directly from the radial CDF.
+    static ofVec3f randomInUnitBall(Random& random)
+    {
+        return random.nextDirection() * cbrtf(random.nextFloat());
+    }
+
+    //--------------------------------------------------------------
+    // Radius within [inner, outer) with uniform density in the shell.
+    static float randomShellRadius(Random& random, float inner, float outer)
+    {
+        float inner3 = inner * inner * inner;
+        float outer3 = outer * outer * outer;
+        return cbrtf(inner3 + (outer3 - inner3) * random.nextFloat());
+    }
+
+    //--------------------------------------------------------------
+    // Plummer sphere (Aarseth, Henon & Wielen 1974) with G = 1, total mass
+    // totalMass and scale radius a. Truncated at 10a.
+    static void samplePlummer(Random& random, float totalMass, float a, ofVec3f& pos, ofVec3f& vel)
+    {
+        float r;
+        do {
+            float m = random.nextFloat();
+            r = a / sqrtf(powf(MAX(m, 1e-6f), -2.0f / 3.0f) - 1.0f);
+        } while (r > 10.0f * a);
+
+        // Speed as a fraction q of the escape speed, g(q) = q^2 (1 - q^2)^3.5
+        // is at most ~0.092 so the rejection box is [0, 1] x [0, 0.1].
+        float q, g;
+        do {
+            q = random.nextFloat();
+            g = 0.1f * random.nextFloat();
+        } while (g > q * q * powf(1.0f - q * q, 3.5f));
+
+        float escape = sqrtf(2.0f * totalMass) * powf(r * r + a * a, -0.25f);
+
+        pos = random.nextDirection() * r;
+        vel = random.nextDirection() * (q * escape);
+    }
+
+    //--------------------------------------------------------------
+    // Hernquist (1990) profile with G = 1. Velocities are drawn from a local
+    // Maxwellian with the isotropic Jeans dispersion, capped below the escape
+    // speed. Truncated at 20a.
+    static void sampleHernquist(Random& random, float totalMass, float a, ofVec3f& pos, ofVec3f& vel)
+    {
+        double r;
+        do {
+            // M(r) = M r^2 / (r + a)^2
+            double s = sqrt(random.nextFloat());
+            r = a * s / (1.0 - s);
+        } while (r > 20.0 * a);
+        r = MAX(r, 1e-4 * a);
+
+        double x = r / a;
+        double dispersion2 = totalMass / (12.0 * a) *
+            (12.0 * x * pow(x + 1.0, 3.0) * log((x + 1.0) / x) -
+             x / (x + 1.0) * (25.0 + 52.0 * x + 42.0 * x * x + 12.0 * x * x * x));
+        float sigma = (float)sqrt(MAX(dispersion2, 0.0));
+        float maxSpeed = 0.95f * (float)sqrt(2.0 * totalMass / (r + a));
+
+        do {
+            vel.set(random.nextGaussian(), random.nextGaussian(), random.nextGaussian());
+            vel *= sigma;
+        } while (vel.length() > maxSpeed);
+
+        pos = random.nextDirection() * (float)r;
+    }
+
+    //--------------------------------------------------------------
+    void generateInitialConditions(NBodyConfig config, int numBodies, float clusterScale, float velocityScale, uint32_t seed, ofVec4f* positions, ofVec4f* velocities)
+    {
+        float scaleN = MAX(1.0f, numBodies / 1024.0f);
+        float totalMass = (float)numBodies;  // unit mass per body
+
+        parallelFor(numBodies, [&](int i) {
+            Random random(seed, i);
+            ofVec3f pos;
+            ofVec3f vel;
+
+            switch (config)
+            {
+                default:
+                case NBODY_CONFIG_RANDOM:
+                {
+                    pos = randomInUnitBall(random) * (clusterScale * scaleN);
+                    vel = randomInUnitBall(random) * (velocityScale * clusterScale * scaleN);
+                }
+                    break;
+
+                case NBODY_CONFIG_SHELL:
+                {
+                    ofVec3f dir = random.nextDirection();
+                    pos = dir * randomShellRadius(random, 2.5f * clusterScale, 4.0f * clusterScale);
+
+                    // Spin around z, or around an axis in the xy plane near the poles.
+                    ofVec3f axis(0.0f, 0.0f, 1.0f);
+                    if (1.0f - fabsf(dir.z) < 1e-6) {
+                        axis.set(1.0f, 0.0f, 0.0f);
+                    }
+                    vel = pos.getCrossed(axis) * (clusterScale * velocityScale);
+                }
+                    break;
+
+                case NBODY_CONFIG_EXPAND:
+                {
+                    ofVec3f point = randomInUnitBall(random);
+                    pos = point * (clusterScale * scaleN);
+                    vel = point * (clusterScale * scaleN * velocityScale);
+                }
+                    break;
+
+                case NBODY_CONFIG_PLUMMER:
+                    samplePlummer(random, totalMass, clusterScale, pos, vel);
+                    break;
+
+                case NBODY_CONFIG_HERNQUIST:
+                    sampleHernquist(random, totalMass, clusterScale, pos, vel);
+                    break;
+            }
+
+            positions[i].set(pos.x, pos.y, pos.z, 1.0f);   // mass
+            velocities[i].set(vel.x, vel.y, vel.z, 1.0f);  // inverse mass
+        });
+    }
+}
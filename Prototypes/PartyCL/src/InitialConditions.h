@@ -0,0 +1,120 @@
+//
+//  InitialConditions.h
+//  PartyCL
+//
+//  Seeded generators for the NBODY_CONFIG_* distributions. Every body draws
+//  from its own counter-based stream, so bodies are generated in parallel and
+//  the same seed always produces the same bodies, on every platform and with
+//  any number of threads.
+//
+
+#pragma once
+
+#include "ofMain.h"
+
+#include "NBodySystem.h"
+
+namespace entropy
+{
+    // Philox4x32-10 (Salmon et al., "Parallel Random Numbers: As Easy as 1, 2, 3").
+    // Maps a 128-bit counter and 64-bit key to 128 random bits with no state,
+    // so any draw of any stream can be computed independently.
+    class Philox4x32
+    {
+    public:
+        static void generate(const uint32_t counter[4], const uint32_t key[2], uint32_t result[4])
+        {
+            uint32_t c[4] = { counter[0], counter[1], counter[2], counter[3] };
+            uint32_t k[2] = { key[0], key[1] };
+            for (int round = 0; round < 10; ++round) {
+                uint64_t p0 = (uint64_t)0xD2511F53 * c[0];
+                uint64_t p1 = (uint64_t)0xCD9E8D57 * c[2];
+                uint32_t next[4] = {
+                    (uint32_t)(p1 >> 32) ^ c[1] ^ k[0],
+                    (uint32_t)p1,
+                    (uint32_t)(p0 >> 32) ^ c[3] ^ k[1],
+                    (uint32_t)p0
+                };
+                c[0] = next[0]; c[1] = next[1]; c[2] = next[2]; c[3] = next[3];
+                k[0] += 0x9E3779B9;
+                k[1] += 0xBB67AE85;
+            }
+            result[0] = c[0]; result[1] = c[1]; result[2] = c[2]; result[3] = c[3];
+        }
+    };
+
+    // One random stream per (seed, stream) pair, typically one per body.
+    class Random
+    {
+    public:
+        Random(uint64_t seed, uint64_t stream = 0)
+        : _block(0)
+        , _index(4)
+        {
+            _key[0] = (uint32_t)seed;
+            _key[1] = (uint32_t)(seed >> 32);
+            _stream[0] = (uint32_t)stream;
+            _stream[1] = (uint32_t)(stream >> 32);
+        }
+
+        uint32_t nextUInt()
+        {
+            if (_index == 4) {
+                uint32_t counter[4] = { _block++, _stream[0], _stream[1], 0 };
+                Philox4x32::generate(counter, _key, _values);
+                _index = 0;
+            }
+            return _values[_index++];
+        }
+
+        // Uniform in [0, 1).
+        float nextFloat()
+        { return (nextUInt() >> 8) * (1.0f / 16777216.0f); }
+
+        // Uniform in (0, 1), safe to take the log of.
+        double nextOpenDouble()
+        { return ((nextUInt() >> 8) + 0.5) * (1.0 / 16777216.0); }
+
+        // Uniform in [-1, 1), same range as ofRandomf().
+        float nextSignedFloat()
+        { return nextFloat() * 2.0f - 1.0f; }
+
+        float nextRange(float min, float max)
+        { return min + (max - min) * nextFloat(); }
+
+        // Standard normal (Box-Muller).
+        float nextGaussian()
+        {
+            double u = nextOpenDouble();
+            double v = nextFloat();
+            return (float)(sqrt(-2.0 * log(u)) * cos(TWO_PI * v));
+        }
+
+        // Uniform on the unit sphere.
+        ofVec3f nextDirection()
+        {
+            float z = nextSignedFloat();
+            float phi = (float)TWO_PI * nextFloat();
+            float r = sqrtf(MAX(0.0f, 1.0f - z * z));
+            return ofVec3f(r * cosf(phi), r * sinf(phi), z);
+        }
+
+    protected:
+        uint32_t _key[2];
+        uint32_t _stream[2];
+        uint32_t _block;
+        uint32_t _values[4];
+        int _index;
+    };
+
+    //--------------------------------------------------------------
+    // Fills positions (xyz, mass in w) and velocities (xyz, inverse mass in w)
+    // for numBodies bodies.
+    //
+    // RANDOM, SHELL and EXPAND keep their original shapes but sample them
+    // directly, so exactly numBodies bodies are written with no rejection.
+    // PLUMMER and HERNQUIST are isotropic clusters in equilibrium with
+    // clusterScale as the scale radius. Their velocities follow from the mass
+    // (unit mass per body) and velocityScale is not used.
+    void generateInitialConditions(NBodyConfig config, int numBodies, float clusterScale, float velocityScale, uint32_t seed, ofVec4f* positions, ofVec4f* velocities);
+}
@@ -0,0 +1,547 @@
+//
+//  NBodyBenchmark.cpp
+//  PartyCL
+//
+
+#include "NBodyBenchmark.h"
+
+#include "InitialConditions.h"
+#include "NBodySystemCPU.h"
+#include "NBodySystemFMM.h"
+#include "NBodySystemOpenCLEmu.h"
+#include "NBodySystemPM.h"
+#include "Parallel.h"
+#include "UploadAllocator.h"
+
+#include "ofxProfiler.h"
+
+namespace entropy
+{
+    //--------------------------------------------------------------
+    static const char* getConfigName(NBodyConfig config)
+    {
+        switch (config)
+        {
+            case NBODY_CONFIG_RANDOM:    return "random";
+            case NBODY_CONFIG_SHELL:     return "shell";
+            case NBODY_CONFIG_EXPAND:    return "expand";
+            case NBODY_CONFIG_PLUMMER:   return "plummer";
+            case NBODY_CONFIG_HERNQUIST: return "hernquist";
+            default:                     return "unknown";
+        }
+    }
+
+    //--------------------------------------------------------------
+    static int getMaxThreads()
+    {
+#if defined(_OPENMP) && !defined(TARGET_OSX)
+        return omp_get_max_threads();
+#else
+        return 1;
+#endif
+    }
+
+    //--------------------------------------------------------------
+    static void setNumThreads(int numThreads)
+    {
+#if defined(_OPENMP) && !defined(TARGET_OSX)
+        omp_set_num_threads(numThreads);
+#endif
+    }
+
+    //--------------------------------------------------------------
+    // The direct sum and the emulated OpenCL kernel do all pairs.
+    static bool isDirectBackend(const string& backend)
+    {
+        return backend == "cpu" || backend.compare(0, 2, "cl") == 0;
+    }
+
+    //--------------------------------------------------------------
+    BenchmarkSettings::BenchmarkSettings()
+    : numSteps(10)
+    , numWarmupSteps(1)
+    , timestep(0.016f)
+    , clusterScale(1.54f)
+    , velocityScale(8.0f)
+    , softening(0.1f)
+    , seed(1)
+    , maxDirectBodies(65536)
+    , maxEnergyBodies(65536)
+    , weakBaseBodies(4096)
+    , gridSize(128)
+    , boxSize(0.0f)
+    , reorderCurve(OFX_CURVE_HILBERT)
+    , format("csv")
+    {
+        backends.push_back("cpu");
+        backends.push_back("fmm");
+
+        for (int n = 1024; n <= 1024 * 1024; n *= 4) {
+            bodyCounts.push_back(n);
+        }
+
+        configs.push_back(NBODY_CONFIG_RANDOM);
+        configs.push_back(NBODY_CONFIG_SHELL);
+        configs.push_back(NBODY_CONFIG_EXPAND);
+
+        reorderIntervals.push_back(0);
+
+        accumulations.push_back(OFX_ACCUMULATE_FLOAT);
+
+        // Powers of two up to the core count, plus the core count itself.
+        int maxThreads = getMaxThreads();
+        for (int t = 1; t < maxThreads; t *= 2) {
+            threadCounts.push_back(t);
+        }
+        threadCounts.push_back(maxThreads);
+    }
+
+    //--------------------------------------------------------------
+    bool BenchmarkSettings::parse(int argc, char *argv[], int first)
+    {
+        for (int i = first; i < argc; i += 2) {
+            string name = argv[i];
+            if (i + 1 >= argc) {
+                ofLogError("BenchmarkSettings::parse", "Missing value for %s", name.c_str());
+                return false;
+            }
+            string value = argv[i + 1];
+            vector<string> values = ofSplitString(value, ",", true, true);
+
+            if (name == "--backends") {
+                backends = values;
+            }
+            else if (name == "--bodies") {
+                bodyCounts.clear();
+                for (auto& v : values) bodyCounts.push_back(ofToInt(v));
+            }
+            else if (name == "--configs") {
+                configs.clear();
+                for (auto& v : values) {
+                    if (v == "random") configs.push_back(NBODY_CONFIG_RANDOM);
+                    else if (v == "shell") configs.push_back(NBODY_CONFIG_SHELL);
+                    else if (v == "expand") configs.push_back(NBODY_CONFIG_EXPAND);
+                    else if (v == "plummer") configs.push_back(NBODY_CONFIG_PLUMMER);
+                    else if (v == "hernquist") configs.push_back(NBODY_CONFIG_HERNQUIST);
+                    else {
+                        ofLogError("BenchmarkSettings::parse", "Unknown config %s", v.c_str());
+                        return false;
+                    }
+                }
+            }
+            else if (name == "--threads") {
+                threadCounts.clear();
+                for (auto& v : values) threadCounts.push_back(MAX(1, ofToInt(v)));
+            }
+            else if (name == "--steps") numSteps = MAX(1, ofToInt(value));
+            else if (name == "--warmup") numWarmupSteps = MAX(0, ofToInt(value));
+            else if (name == "--timestep") timestep = ofToFloat(value);
+            else if (name == "--softening") softening = ofToFloat(value);
+            else if (name == "--seed") seed = ofToInt(value);
+            else if (name == "--max-direct") maxDirectBodies = ofToInt(value);
+            else if (name == "--max-energy") maxEnergyBodies = ofToInt(value);
+            else if (name == "--weak-base") weakBaseBodies = ofToInt(value);
+            else if (name == "--grid") gridSize = ofToInt(value);
+            else if (name == "--box") boxSize = ofToFloat(value);
+            else if (name == "--reorder") {
+                reorderIntervals.clear();
+                for (auto& v : values) reorderIntervals.push_back(MAX(0, ofToInt(v)));
+            }
+            else if (name == "--curve") {
+                if (value == "hilbert") reorderCurve = OFX_CURVE_HILBERT;
+                else if (value == "morton") reorderCurve = OFX_CURVE_MORTON;
+                else {
+                    ofLogError("BenchmarkSettings::parse", "Unknown curve %s", value.c_str());
+                    return false;
+                }
+            }
+            else if (name == "--accumulation") {
+                accumulations.clear();
+                for (auto& v : values) {
+                    if (v == "float") accumulations.push_back(OFX_ACCUMULATE_FLOAT);
+                    else if (v == "kahan") accumulations.push_back(OFX_ACCUMULATE_KAHAN);
+                    else if (v == "double") accumulations.push_back(OFX_ACCUMULATE_DOUBLE);
+                    else {
+                        ofLogError("BenchmarkSettings::parse", "Unknown accumulation %s", v.c_str());
+                        return false;
+                    }
+                }
+            }
+            else if (name == "--format") format = value;
+            else if (name == "--output") outputPath = value;
+            else if (name == "--profile") profilePath = value;
+            else {
+                ofLogError("BenchmarkSettings::parse", "Unknown option %s", name.c_str());
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    //--------------------------------------------------------------
+    NBodyBenchmark::NBodyBenchmark(const BenchmarkSettings& settings)
+    : _settings(settings)
+    {}
+
+    //--------------------------------------------------------------
+    void NBodyBenchmark::run()
+    {
+        _results.clear();
+
+        int defaultThreads = getMaxThreads();
+
+        for (auto& backend : _settings.backends) {
+            for (auto config : _settings.configs) {
+                for (auto reorder : _settings.reorderIntervals) {
+                    for (auto accumulation : _settings.accumulations) {
+                        if (backend != "cpu" && accumulation != _settings.accumulations.front()) continue;
+
+                        // Strong scaling: same problem, more threads.
+                        for (auto numBodies : _settings.bodyCounts) {
+                            if (isDirectBackend(backend) && numBodies > _settings.maxDirectBodies) {
+                                ofLogNotice("NBodyBenchmark::run", "Skipping %s with %d bodies (--max-direct %d)", backend.c_str(), numBodies, _settings.maxDirectBodies);
+                                continue;
+                            }
+
+                            for (auto numThreads : _settings.threadCounts) {
+                                BenchmarkResult result = _runOne(backend, config, numBodies, numThreads, reorder, accumulation);
+                                result.kind = "sweep";
+                                _results.push_back(result);
+                            }
+                        }
+
+                        // Weak scaling: the work per thread stays constant. The direct
+                        // solver does N^2 work so N grows with the square root of the
+                        // thread count, the tree code is close enough to linear.
+                        for (auto numThreads : _settings.threadCounts) {
+                            double growth = isDirectBackend(backend) ? sqrt((double)numThreads) : (double)numThreads;
+                            int numBodies = (int)(_settings.weakBaseBodies * growth + 0.5);
+                            if (isDirectBackend(backend) && numBodies > _settings.maxDirectBodies) continue;
+
+                            BenchmarkResult result = _runOne(backend, config, numBodies, numThreads, reorder, accumulation);
+                            result.kind = "weak";
+                            _results.push_back(result);
+                        }
+                    }
+                }
+            }
+        }
+
+        setNumThreads(defaultThreads);
+
+        _computeScaling();
+    }
+
+    //--------------------------------------------------------------
+    NBodySystemCPU* NBodyBenchmark::_createSystem(const string& backend, int numBodies, float extent)
+    {
+        // Headless, so uploads go to the mock allocator.
+        if (backend == "fmm") {
+            return new NBodySystemFMM(numBodies, 4, 0.6f, 64, new UploadAllocatorMock());
+        }
+        if (backend == "pm") {
+            // Twice the initial diameter unless set, leaving room to evolve.
+            float boxSize = (_settings.boxSize > 0.0f) ? _settings.boxSize : 4.0f * extent;
+            return new NBodySystemPM(numBodies, _settings.gridSize, boxSize, true, new UploadAllocatorMock());
+        }
+        if (backend.compare(0, 2, "cl") == 0) {
+            // cl:PxQ picks the work-group shape, the app's default otherwise.
+            unsigned int p = 256, q = 1;
+            if (backend.size() > 3) {
+                vector<string> dims = ofSplitString(backend.substr(3), "x");
+                p = ofToInt(dims[0]);
+                q = (dims.size() > 1) ? ofToInt(dims[1]) : 1;
+            }
+            return new NBodySystemOpenCLEmu(numBodies, p, q, new UploadAllocatorMock());
+        }
+        return new NBodySystemCPU(numBodies, new UploadAllocatorMock());
+    }
+
+    //--------------------------------------------------------------
+    BenchmarkResult NBodyBenchmark::_runOne(const string& backend, NBodyConfig config, int numBodies, int numThreads, int reorderInterval, ofxForceAccumulation accumulation)
+    {
+        setNumThreads(numThreads);
+
+        vector<ofVec4f> positions(numBodies);
+        vector<ofVec4f> velocities(numBodies);
+        generateInitialConditions(config, numBodies, _settings.clusterScale, _settings.velocityScale, _settings.seed, positions.data(), velocities.data());
+
+        float extent = 0.0f;
+        for (auto& p : positions) {
+            extent = MAX(extent, MAX(fabsf(p.x), MAX(fabsf(p.y), fabsf(p.z))));
+        }
+
+        NBodySystemCPU *system = _createSystem(backend, numBodies, extent);
+        system->setSoftening(_settings.softening);
+        system->setDamping(1.0f);  // damping would show up as energy error
+        system->setReordering(reorderInterval, _settings.reorderCurve);
+        system->setForceAccumulation(accumulation);
+        system->setArray(NBodySystem::ARRAY_POSITION, (float *)positions.data());
+        system->setArray(NBodySystem::ARRAY_VELOCITY, (float *)velocities.data());
+
+        bool measureEnergy = (numBodies <= _settings.maxEnergyBodies);
+        double forceRmsError = -1.0;
+        double forceMaxError = -1.0;
+        int warmupStep = 0;
+        if (measureEnergy) {
+            // The first step doubles as a warmup step, its forces are computed
+            // on the initial positions.
+            system->update(_settings.timestep);
+            system->synchronizeThreads();
+            ++warmupStep;
+
+            vector<double> reference;
+            computeReferenceForces((float *)positions.data(), numBodies, _settings.softening, reference);
+
+            const float* forces = system->getForces();
+            const vector<uint32_t>& ids = system->getBodyIds();
+            double errorSq = 0.0, normSq = 0.0;
+            forceMaxError = 0.0;
+            for (int slot = 0; slot < numBodies; ++slot) {
+                const double* f = &reference[ids[slot] * 3];
+                double bodyErrorSq = 0.0, bodyNormSq = 0.0;
+                for (int k = 0; k < 3; ++k) {
+                    double diff = forces[slot * 4 + k] - f[k];
+                    bodyErrorSq += diff * diff;
+                    bodyNormSq += f[k] * f[k];
+                }
+                errorSq += bodyErrorSq;
+                normSq += bodyNormSq;
+                if (bodyNormSq > 0.0) {
+                    forceMaxError = MAX(forceMaxError, sqrt(bodyErrorSq / bodyNormSq));
+                }
+            }
+            forceRmsError = sqrt(errorSq / MAX(normSq, 1e-300));
+        }
+
+        for (int i = warmupStep; i < _settings.numWarmupSteps; ++i) {
+            system->update(_settings.timestep);
+        }
+        system->synchronizeThreads();
+
+        double energyStart = 0.0;
+        if (measureEnergy) {
+            memcpy((float *)positions.data(), system->getArray(NBodySystem::ARRAY_POSITION), numBodies * sizeof(ofVec4f));
+            memcpy((float *)velocities.data(), system->getArray(NBodySystem::ARRAY_VELOCITY), numBodies * sizeof(ofVec4f));
+            energyStart = computeEnergy((float *)positions.data(), (float *)velocities.data(), numBodies, _settings.softening);
+        }
+
+        uint64_t startTime = ofGetElapsedTimeMicros();
+        for (int i = 0; i < _settings.numSteps; ++i) {
+            system->update(_settings.timestep);
+        }
+        system->synchronizeThreads();
+        double seconds = (ofGetElapsedTimeMicros() - startTime) / 1000000.0;
+
+        BenchmarkResult result;
+        result.backend = backend;
+        result.config = config;
+        result.numBodies = numBodies;
+        result.numThreads = numThreads;
+        result.numSteps = _settings.numSteps;
+        result.reorderInterval = reorderInterval;
+        result.accumulation = accumulation;
+        result.seconds = seconds;
+        result.msPerStep = seconds * 1000.0 / _settings.numSteps;
+        // Reported as all pairs for every backend, the usual N-body convention,
+        // so tree codes show up as a higher effective rate.
+        result.interactionsPerSecond = (double)numBodies * numBodies * _settings.numSteps / seconds;
+        result.nsPerBodyStep = seconds * 1e9 / ((double)numBodies * _settings.numSteps);
+        result.speedup = 0.0;
+        result.efficiency = 0.0;
+        result.energyError = -1.0;
+        result.forceRmsError = forceRmsError;
+        result.forceMaxError = forceMaxError;
+
+        if (measureEnergy) {
+            memcpy((float *)positions.data(), system->getArray(NBodySystem::ARRAY_POSITION), numBodies * sizeof(ofVec4f));
+            memcpy((float *)velocities.data(), system->getArray(NBodySystem::ARRAY_VELOCITY), numBodies * sizeof(ofVec4f));
+            double energyEnd = computeEnergy((float *)positions.data(), (float *)velocities.data(), numBodies, _settings.softening);
+            result.energyError = fabs(energyEnd - energyStart) / MAX(fabs(energyStart), 1e-30);
+        }
+
+        delete system;
+
+        ofLogNotice("NBodyBenchmark", "%s %s N=%d threads=%d reorder=%d %s: %.3f ms/step, %.3g interactions/s, force error %.3g", backend.c_str(), getConfigName(config), numBodies, numThreads, reorderInterval, ofxGetForceAccumulationName(accumulation), result.msPerStep, result.interactionsPerSecond, result.forceRmsError);
+
+        return result;
+    }
+
+    //--------------------------------------------------------------
+    void NBodyBenchmark::_computeScaling()
+    {
+        for (auto& result : _results) {
+            // Find the single thread run to compare against.
+            const BenchmarkResult *base = nullptr;
+            for (auto& other : _results) {
+                if (other.kind == result.kind && other.backend == result.backend &&
+                    other.config == result.config && other.numThreads == 1 &&
+                    other.reorderInterval == result.reorderInterval &&
+                    other.accumulation == result.accumulation &&
+                    (result.kind == "weak" || other.numBodies == result.numBodies)) {
+                    base = &other;
+                    break;
+                }
+            }
+            if (base == nullptr) continue;
+
+            if (result.kind == "sweep") {
+                result.speedup = base->seconds / result.seconds;
+                result.efficiency = result.speedup / result.numThreads;
+            }
+            else {
+                // Ideal weak scaling keeps the time constant.
+                result.efficiency = base->seconds / result.seconds;
+                result.speedup = result.efficiency * result.numThreads;
+            }
+        }
+    }
+
+    //--------------------------------------------------------------
+    double NBodyBenchmark::computeEnergy(const float* positions, const float* velocities, int numBodies, float softening)
+    {
+        double softeningSquared = (double)softening * softening;
+        vector<double> energy(numBodies);
+
+        // Each body sums the pairs it leads, so every pair is counted once.
+        parallelFor(numBodies, [&](int i) {
+            const float* pi = &positions[i*4];
+            const float* vi = &velocities[i*4];
+            double mass = pi[3];
+
+            double e = 0.5 * mass * ((double)vi[0] * vi[0] + (double)vi[1] * vi[1] + (double)vi[2] * vi[2]);
+            for (int j = i + 1; j < numBodies; ++j) {
+                const float* pj = &positions[j*4];
+                double dx = (double)pj[0] - pi[0];
+                double dy = (double)pj[1] - pi[1];
+                double dz = (double)pj[2] - pi[2];
+                e -= mass * pj[3] / sqrt(dx * dx + dy * dy + dz * dz + softeningSquared);
+            }
+            energy[i] = e;
+        });
+
+        double total = 0.0;
+        for (int i = 0; i < numBodies; ++i) {
+            total += energy[i];
+        }
+        return total;
+    }
+
+    //--------------------------------------------------------------
+    void NBodyBenchmark::computeReferenceForces(const float* positions, int numBodies, float softening, vector<double>& forces)
+    {
+        double softeningSquared = (double)softening * softening;
+        forces.assign(numBodies * 3, 0.0);
+
+        parallelFor(numBodies, [&](int i) {
+            const float* pi = &positions[i*4];
+            double f[3] = { 0.0, 0.0, 0.0 };
+            for (int j = 0; j < numBodies; ++j) {
+                const float* pj = &positions[j*4];
+                double r[3] = { (double)pj[0] - pi[0], (double)pj[1] - pi[1], (double)pj[2] - pi[2] };
+                double distSqr = r[0] * r[0] + r[1] * r[1] + r[2] * r[2] + softeningSquared;
+                double invDist = 1.0 / sqrt(distSqr);
+                double s = pj[3] * invDist * invDist * invDist;
+                for (int k = 0; k < 3; ++k) {
+                    f[k] += r[k] * s;
+                }
+            }
+            for (int k = 0; k < 3; ++k) {
+                forces[i * 3 + k] = f[k] * pi[3];
+            }
+        });
+    }
+
+    //--------------------------------------------------------------
+    bool NBodyBenchmark::write() const
+    {
+        if (_settings.outputPath.empty()) {
+            if (_settings.format == "json") _writeJSON(cout);
+            else _writeCSV(cout);
+            return true;
+        }
+
+        std::ofstream file(ofToDataPath(_settings.outputPath, true).c_str());
+        if (!file) {
+            ofLogError("NBodyBenchmark::write", "Could not open %s", _settings.outputPath.c_str());
+            return false;
+        }
+        if (_settings.format == "json") _writeJSON(file);
+        else _writeCSV(file);
+
+        return (bool)file;
+    }
+
+    //--------------------------------------------------------------
+    void NBodyBenchmark::_writeCSV(ostream& out) const
+    {
+        out << "kind,backend,config,bodies,threads,steps,reorder,accumulation,seconds,ms_per_step,interactions_per_sec,ns_per_body_step,speedup,efficiency,energy_error,force_rms_error,force_max_error\n";
+        for (auto& r : _results) {
+            out << r.kind << ',' << r.backend << ',' << getConfigName(r.config) << ','
+                << r.numBodies << ',' << r.numThreads << ',' << r.numSteps << ','
+                << r.reorderInterval << ',' << ofxGetForceAccumulationName(r.accumulation) << ','
+                << r.seconds << ',' << r.msPerStep << ',' << r.interactionsPerSecond << ','
+                << r.nsPerBodyStep << ',' << r.speedup << ',' << r.efficiency << ',';
+            if (r.energyError >= 0.0) out << r.energyError;
+            out << ',';
+            if (r.forceRmsError >= 0.0) out << r.forceRmsError;
+            out << ',';
+            if (r.forceMaxError >= 0.0) out << r.forceMaxError;
+            out << '\n';
+        }
+    }
+
+    //--------------------------------------------------------------
+    void NBodyBenchmark::_writeJSON(ostream& out) const
+    {
+        out << "{\n  \"results\": [\n";
+        for (size_t i = 0; i < _results.size(); ++i) {
+            const BenchmarkResult& r = _results[i];
+            out << "    { \"kind\": \"" << r.kind << "\", \"backend\": \"" << r.backend
+                << "\", \"config\": \"" << getConfigName(r.config)
+                << "\", \"bodies\": " << r.numBodies << ", \"threads\": " << r.numThreads
+                << ", \"steps\": " << r.numSteps << ", \"reorder\": " << r.reorderInterval
+                << ", \"accumulation\": \"" << ofxGetForceAccumulationName(r.accumulation) << "\""
+                << ", \"seconds\": " << r.seconds
+                << ", \"ms_per_step\": " << r.msPerStep
+                << ", \"interactions_per_sec\": " << r.interactionsPerSecond
+                << ", \"ns_per_body_step\": " << r.nsPerBodyStep
+                << ", \"speedup\": " << r.speedup << ", \"efficiency\": " << r.efficiency
+                << ", \"energy_error\": ";
+            if (r.energyError >= 0.0) out << r.energyError;
+            else out << "null";
+            out << ", \"force_rms_error\": ";
+            if (r.forceRmsError >= 0.0) out << r.forceRmsError;
+            else out << "null";
+            out << ", \"force_max_error\": ";
+            if (r.forceMaxError >= 0.0) out << r.forceMaxError;
+            else out << "null";
+            out << " }" << (i + 1 < _results.size() ? "," : "") << "\n";
+        }
+        out << "  ]\n}\n";
+    }
+
+    //--------------------------------------------------------------
+    int runHeadlessBenchmark(int argc, char *argv[], int first)
+    {
+        BenchmarkSettings settings;
+        if (!settings.parse(argc, argv, first)) {
+            return 1;
+        }
+
+        ofxProfiler::clear();
+
+        NBodyBenchmark benchmark(settings);
+        benchmark.run();
+        if (!benchmark.write()) {
+            return 1;
+        }
+
+        // The window covers the whole sweep, the rings still cap it per thread.
+        if (!settings.profilePath.empty()) {
+            return ofxProfiler::writeCSV(settings.profilePath, false, FLT_MAX) ? 0 : 1;
+        }
+        return 0;
+    }
+}
@@ -0,0 +1,141 @@
+//
+//  NBodyBenchmark.h
+//  PartyCL
+//
+//  Headless benchmark for the CPU N-body backends. Sweeps body counts, initial
+//  distributions and thread counts, then writes one row per run as CSV or JSON
+//  so results can be diffed between builds.
+//
+//  Each run also reports the error of its first forces against a double
+//  precision direct sum, so force accumulation modes can be compared on both
+//  accuracy and throughput.
+//
+
+#pragma once
+
+#include "ofMain.h"
+
+#include "NBodySystem.h"
+
+namespace entropy
+{
+    class NBodySystemCPU;
+
+    struct BenchmarkSettings
+    {
+        BenchmarkSettings();
+
+        // Reads `--name value` pairs from the command line, lists are comma
+        // separated. Returns false and logs on an unknown option.
+        bool parse(int argc, char *argv[], int first);
+
+        vector<string> backends;         // cpu, fmm, pm, cl[:PxQ]
+        vector<int> bodyCounts;
+        vector<NBodyConfig> configs;
+        vector<int> threadCounts;
+
+        int numSteps;
+        int numWarmupSteps;
+        float timestep;
+        float clusterScale;
+        float velocityScale;
+        float softening;
+        uint32_t seed;
+
+        // The direct solvers are O(N^2) per step, larger runs are skipped.
+        int maxDirectBodies;
+
+        // Energy is summed over all pairs, so it is only measured up to this size.
+        int maxEnergyBodies;
+
+        // Weak scaling grows the problem with the thread count from this size.
+        int weakBaseBodies;
+
+        // Mesh and periodic box for the pm backend, a box size of 0 fits the
+        // box to the initial conditions. Energy is still measured with open
+        // boundaries, so it is only indicative there.
+        int gridSize;
+        float boxSize;
+
+        // Steps between space-filling curve reorders, 0 for none. Every value
+        // is run so the cache effect can be compared directly.
+        vector<int> reorderIntervals;
+        ofxSpaceFillingCurve reorderCurve;
+
+        // Summation of the direct solver, every mode is run. The other
+        // backends only run the first one.
+        vector<ofxForceAccumulation> accumulations;
+
+        string format;                   // csv, json
+        string outputPath;               // empty for stdout
+
+        // Per stage timings of the whole sweep, see ofxProfiler::writeStatsCSV().
+        string profilePath;              // empty for none
+    };
+
+    struct BenchmarkResult
+    {
+        string kind;                     // sweep, weak
+        string backend;
+        NBodyConfig config;
+        int numBodies;
+        int numThreads;
+        int numSteps;
+        int reorderInterval;
+        ofxForceAccumulation accumulation;
+
+        double seconds;
+        double msPerStep;
+        double interactionsPerSecond;
+        double nsPerBodyStep;
+
+        // Relative to the single thread run with the same parameters (the
+        // base size for weak scaling). Zero when there is nothing to compare to.
+        double speedup;
+        double efficiency;
+
+        // |E1 - E0| / |E0| over the timed steps, negative if not measured.
+        double energyError;
+
+        // Relative RMS and largest per-body relative error of the first step's
+        // forces, against computeReferenceForces(). Negative if not measured.
+        double forceRmsError;
+        double forceMaxError;
+    };
+
+    class NBodyBenchmark
+    {
+    public:
+        NBodyBenchmark(const BenchmarkSettings& settings);
+
+        void run();
+
+        bool write() const;
+
+        const vector<BenchmarkResult>& getResults() const
+        { return _results; }
+
+        // Total energy, kinetic plus softened potential, in double precision.
+        static double computeEnergy(const float* positions, const float* velocities, int numBodies, float softening);
+
+        // Direct sum forces m_i * sum(m_j * r / d^3) in double precision, like
+        // NBodySystemCPU.
+        static void computeReferenceForces(const float* positions, int numBodies, float softening, vector<double>& forces);
+
+    protected:
+        BenchmarkResult _runOne(const string& backend, NBodyConfig config, int numBodies, int numThreads, int reorderInterval, ofxForceAccumulation accumulation);
+        // extent is the largest initial coordinate, used to size periodic boxes.
+        NBodySystemCPU* _createSystem(const string& backend, int numBodies, float extent);
+
+        void _computeScaling();
+
+        void _writeCSV(ostream& out) const;
+        void _writeJSON(ostream& out) const;
+
+        BenchmarkSettings _settings;
+        vector<BenchmarkResult> _results;
+    };
+
+    // Entry point for `--benchmark [options]`, returns the process exit code.
+    int runHeadlessBenchmark(int argc, char *argv[], int first);
+}
@@ -0,0 +1,244 @@
+//
+//  NBodyCheckpoint.cpp
+//  PartyCL
+//
+
+#include "NBodyCheckpoint.h"
+
+namespace entropy
+{
+    //--------------------------------------------------------------
+    struct CheckpointHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        int32_t numBodies;
+        int32_t config;
+        uint64_t stepCount;
+        double simulationTime;
+        float timestep;
+        float softening;
+        float damping;
+        uint32_t seed;
+    };
+
+    //--------------------------------------------------------------
+    // Follows the header from version 2 on.
+    struct CheckpointForceSettings
+    {
+        uint32_t adaptiveSoftening;
+        float softeningEta;
+        float minSoftening;
+        int32_t accumulation;
+        int32_t collisionMode;
+        float collisionRadius;
+        float restitution;
+    };
+
+    //--------------------------------------------------------------
+    NBodyCheckpoint::NBodyCheckpoint()
+    : numBodies(0)
+    , stepCount(0)
+    , simulationTime(0)
+    , timestep(0)
+    , softening(0)
+    , damping(1)
+    , bAdaptiveSoftening(false)
+    , softeningEta(0.5f)
+    , minSoftening(0.01f)
+    , accumulation(OFX_ACCUMULATE_FLOAT)
+    , collisionMode(NBODY_COLLISIONS_NONE)
+    , collisionRadius(0.01f)
+    , restitution(0.5f)
+    , config(NBODY_CONFIG_RANDOM)
+    , seed(0)
+    {}
+
+    //--------------------------------------------------------------
+    void NBodyCheckpoint::capture(NBodySystem& system)
+    {
+        // Merges on the simulation thread change the count.
+        system.synchronizeThreads();
+        numBodies = system.getNumBodies();
+
+        // getArray() may hand back a temporary buffer, copy each one right away.
+        positions.assign(numBodies * 4, 0.0f);
+        const float* data = system.getArray(NBodySystem::ARRAY_POSITION);
+        if (data) {
+            memcpy(positions.data(), data, numBodies * 4 * sizeof(float));
+        }
+
+        velocities.assign(numBodies * 4, 0.0f);
+        data = system.getArray(NBodySystem::ARRAY_VELOCITY);
+        if (data) {
+            memcpy(velocities.data(), data, numBodies * 4 * sizeof(float));
+        }
+    }
+
+    //--------------------------------------------------------------
+    void NBodyCheckpoint::restore(NBodySystem& system) const
+    {
+        if (!system.setNumBodies(numBodies)) {
+            ofLogError("NBodyCheckpoint::restore", "Checkpoint has %d bodies but the system has %d", numBodies, system.getNumBodies());
+            return;
+        }
+
+        system.setSoftening(softening);
+        system.setDamping(damping);
+        system.setAdaptiveSoftening(bAdaptiveSoftening, softeningEta, minSoftening);
+        system.setForceAccumulation(accumulation);
+        system.setCollisions(collisionMode, collisionRadius, restitution);
+        system.setArray(NBodySystem::ARRAY_POSITION, positions.data());
+        system.setArray(NBodySystem::ARRAY_VELOCITY, velocities.data());
+    }
+
+    //--------------------------------------------------------------
+    bool NBodyCheckpoint::save(const string& path) const
+    {
+        std::ofstream file(ofToDataPath(path, true).c_str(), std::ios::binary);
+        if (!file) {
+            ofLogError("NBodyCheckpoint::save", "Could not open %s", path.c_str());
+            return false;
+        }
+
+        CheckpointHeader header;
+        header.magic = MAGIC;
+        header.version = VERSION;
+        header.numBodies = numBodies;
+        header.config = config;
+        header.stepCount = stepCount;
+        header.simulationTime = simulationTime;
+        header.timestep = timestep;
+        header.softening = softening;
+        header.damping = damping;
+        header.seed = seed;
+
+        CheckpointForceSettings forceSettings;
+        forceSettings.adaptiveSoftening = bAdaptiveSoftening ? 1 : 0;
+        forceSettings.softeningEta = softeningEta;
+        forceSettings.minSoftening = minSoftening;
+        forceSettings.accumulation = accumulation;
+        forceSettings.collisionMode = collisionMode;
+        forceSettings.collisionRadius = collisionRadius;
+        forceSettings.restitution = restitution;
+
+        file.write((const char *)&header, sizeof(header));
+        file.write((const char *)&forceSettings, sizeof(forceSettings));
+        file.write((const char *)positions.data(), numBodies * 4 * sizeof(float));
+        file.write((const char *)velocities.data(), numBodies * 4 * sizeof(float));
+
+        if (!file) {
+            ofLogError("NBodyCheckpoint::save", "Error writing %s", path.c_str());
+            return false;
+        }
+
+        ofLogNotice("NBodyCheckpoint::save", "Saved %d bodies at step %llu to %s", numBodies, (unsigned long long)stepCount, path.c_str());
+        return true;
+    }
+
+    //--------------------------------------------------------------
+    bool NBodyCheckpoint::load(const string& path)
+    {
+        std::ifstream file(ofToDataPath(path, true).c_str(), std::ios::binary);
+        if (!file) {
+            ofLogError("NBodyCheckpoint::load", "Could not open %s", path.c_str());
+            return false;
+        }
+
+        CheckpointHeader header;
+        file.read((char *)&header, sizeof(header));
+        if (!file || header.magic != MAGIC) {
+            ofLogError("NBodyCheckpoint::load", "%s is not a checkpoint file", path.c_str());
+            return false;
+        }
+        if (header.version < 1 || header.version > VERSION) {
+            ofLogError("NBodyCheckpoint::load", "Unsupported checkpoint version %u in %s", header.version, path.c_str());
+            return false;
+        }
+
+        CheckpointForceSettings forceSettings;
+        forceSettings.adaptiveSoftening = 0;
+        forceSettings.softeningEta = 0.5f;
+        forceSettings.minSoftening = 0.01f;
+        forceSettings.accumulation = OFX_ACCUMULATE_FLOAT;
+        forceSettings.collisionMode = NBODY_COLLISIONS_NONE;
+        forceSettings.collisionRadius = 0.01f;
+        forceSettings.restitution = 0.5f;
+        if (header.version >= 2) {
+            file.read((char *)&forceSettings, sizeof(forceSettings));
+            if (!file) {
+                ofLogError("NBodyCheckpoint::load", "%s is truncated", path.c_str());
+                return false;
+            }
+        }
+        if (header.config < 0 || header.config >= NBODY_NUM_CONFIGS ||
+            forceSettings.accumulation < 0 || forceSettings.accumulation >= OFX_NUM_FORCE_ACCUMULATIONS ||
+            forceSettings.collisionMode < 0 || forceSettings.collisionMode >= NBODY_NUM_COLLISION_MODES) {
+            ofLogError("NBodyCheckpoint::load", "%s has invalid settings", path.c_str());
+            return false;
+        }
+
+        // Check the count against the file size before allocating, a corrupt
+        // header could otherwise ask for any amount of memory.
+        std::streamoff dataBegin = file.tellg();
+        file.seekg(0, std::ios::end);
+        std::streamoff dataSize = file.tellg() - dataBegin;
+        file.seekg(dataBegin);
+        const std::streamoff bodySize = 2 * 4 * sizeof(float);
+        if (header.numBodies <= 0 || header.numBodies > dataSize / bodySize) {
+            ofLogError("NBodyCheckpoint::load", "%s has %d bodies but only holds data for %lld", path.c_str(), header.numBodies, (long long)(dataSize / bodySize));
+            return false;
+        }
+
+        std::vector<float> filePositions(header.numBodies * 4);
+        std::vector<float> fileVelocities(header.numBodies * 4);
+        file.read((char *)filePositions.data(), header.numBodies * 4 * sizeof(float));
+        file.read((char *)fileVelocities.data(), header.numBodies * 4 * sizeof(float));
+        if (!file) {
+            ofLogError("NBodyCheckpoint::load", "%s is truncated", path.c_str());
+            return false;
+        }
+
+        numBodies = header.numBodies;
+        config = (NBodyConfig)header.config;
+        stepCount = header.stepCount;
+        simulationTime = header.simulationTime;
+        timestep = header.timestep;
+        softening = header.softening;
+        damping = header.damping;
+        seed = header.seed;
+        bAdaptiveSoftening = (forceSettings.adaptiveSoftening != 0);
+        softeningEta = forceSettings.softeningEta;
+        minSoftening = forceSettings.minSoftening;
+        accumulation = (ofxForceAccumulation)forceSettings.accumulation;
+        collisionMode = (NBodyCollisionMode)forceSettings.collisionMode;
+        collisionRadius = forceSettings.collisionRadius;
+        restitution = forceSettings.restitution;
+        positions.swap(filePositions);
+        velocities.swap(fileVelocities);
+
+        return true;
+    }
+
+    //--------------------------------------------------------------
+    uint64_t NBodyCheckpoint::getStateHash() const
+    {
+        return hashState(positions.data(), velocities.data(), numBodies);
+    }
+
+    //--------------------------------------------------------------
+    uint64_t NBodyCheckpoint::hashState(const float* positions, const float* velocities, int numBodies)
+    {
+        uint64_t hash = 14695981039346656037ULL;
+        const float* arrays[2] = { positions, velocities };
+        for (int a = 0; a < 2; ++a) {
+            const uint8_t* bytes = (const uint8_t *)arrays[a];
+            size_t numBytes = numBodies * 4 * sizeof(float);
+            for (size_t i = 0; i < numBytes; ++i) {
+                hash ^= bytes[i];
+                hash *= 1099511628211ULL;
+            }
+        }
+        return hash;
+    }
+}
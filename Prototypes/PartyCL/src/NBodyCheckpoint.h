@@ -0,0 +1,67 @@
+//
+//  NBodyCheckpoint.h
+//  PartyCL
+//
+//  Binary snapshot of an N-body run: positions, velocities and everything the
+//  integrator needs to continue bit for bit from the same point.
+//
+
+#pragma once
+
+#include "ofMain.h"
+
+#include "NBodySystem.h"
+
+namespace entropy
+{
+    class NBodyCheckpoint
+    {
+    public:
+        NBodyCheckpoint();
+
+        // Copies the current state out of / back into a system. The integrator
+        // and force parameters are not readable from NBodySystem, so set them
+        // on the checkpoint before saving and read them back after loading.
+        // restore() applies them to the system. Restoring brings back bodies
+        // merged since, up to the system's capacity.
+        void capture(NBodySystem& system);
+        void restore(NBodySystem& system) const;
+
+        bool save(const string& path) const;
+        bool load(const string& path);
+
+        // FNV-1a over the positions and velocities.
+        uint64_t getStateHash() const;
+
+        static uint64_t hashState(const float* positions, const float* velocities, int numBodies);
+
+        // Integrator state.
+        int numBodies;
+        uint64_t stepCount;
+        double simulationTime;
+        float timestep;
+        float softening;
+        float damping;
+
+        // Force settings, which all change the trajectory. Version 1 files
+        // load with the defaults, which match a system that never set them.
+        bool bAdaptiveSoftening;
+        float softeningEta;
+        float minSoftening;
+        ofxForceAccumulation accumulation;
+        NBodyCollisionMode collisionMode;
+        float collisionRadius;
+        float restitution;
+
+        // How the run was initialized, for reference.
+        NBodyConfig config;
+        uint32_t seed;
+
+        std::vector<float> positions;
+        std::vector<float> velocities;
+
+    protected:
+        static const uint32_t MAGIC = 0x4B43424E; // "NBCK"
+        static const uint32_t VERSION = 2;
+    };
+}
@@ -0,0 +1,703 @@
+//
+//  NBodyDomain.cpp
+//  PartyCL
+//
+
+#include "NBodyDomain.h"
+#include "Parallel.h"
+#include "ofxSpaceFillingCurve.h"
+
+#include <cfloat>
+
+namespace entropy
+{
+    // Key samples each rank contributes when choosing the slice boundaries.
+    static const int SPLITTER_SAMPLES = 64;
+
+    // A body as it travels between ranks.
+    struct BodyRecord
+    {
+        float pos[4];
+        float vel[4];
+        uint32_t id;
+    };
+
+    //--------------------------------------------------------------
+    template<typename T>
+    static void appendData(DomainTransport::Buffer& buffer, const T* data, size_t count)
+    {
+        size_t offset = buffer.size();
+        buffer.resize(offset + count * sizeof(T));
+        if (count > 0) {
+            memcpy(buffer.data() + offset, data, count * sizeof(T));
+        }
+    }
+
+    //--------------------------------------------------------------
+    uint64_t NBodyDomain::_mortonKey(const float* pos, const float* boundsMin, float cellsPerUnit)
+    {
+        const uint32_t maxCoord = (1u << OFX_CURVE_BITS) - 1;
+
+        uint32_t coords[3];
+        for (int k = 0; k < 3; ++k) {
+            coords[k] = MIN((uint32_t)MAX((pos[k] - boundsMin[k]) * cellsPerUnit, 0.0f), maxCoord);
+        }
+        return ofxMortonKey(coords[0], coords[1], coords[2]);
+    }
+
+    //--------------------------------------------------------------
+    void NBodyDomain::Tree::build(const float* source, int numPoints)
+    {
+        nodes.clear();
+        points.resize(numPoints * 4);
+        keys.resize(numPoints);
+        order.resize(numPoints);
+        if (numPoints == 0) return;
+
+        float boundsMin[3] = { source[0], source[1], source[2] };
+        float boundsMax[3] = { source[0], source[1], source[2] };
+        for (int i = 1; i < numPoints; ++i) {
+            for (int k = 0; k < 3; ++k) {
+                boundsMin[k] = MIN(boundsMin[k], source[i*4+k]);
+                boundsMax[k] = MAX(boundsMax[k], source[i*4+k]);
+            }
+        }
+        float size = 1e-6f;
+        for (int k = 0; k < 3; ++k) {
+            size = MAX(size, boundsMax[k] - boundsMin[k]);
+        }
+        // Pad the cube so the largest coordinate still lands inside the grid.
+        size *= 1.0001f;
+        const float cellsPerUnit = (1 << OFX_CURVE_BITS) / size;
+
+        tempKeys.resize(numPoints);
+        tempOrder.resize(numPoints);
+        parallelFor(numPoints, [&](int i) {
+            keys[i] = _mortonKey(&source[i*4], boundsMin, cellsPerUnit);
+            order[i] = i;
+        });
+        ofxRadixSortPairs(keys.data(), order.data(), numPoints, tempKeys.data(), tempOrder.data());
+
+        parallelFor(numPoints, [&](int i) {
+            memcpy(&points[i*4], &source[order[i]*4], 4*sizeof(float));
+        });
+
+
+        nodes.reserve(2 * numPoints / LEAF_SIZE + 1);
+        nodes.resize(1);
+        buildNode(0, 0, 0, numPoints, size);
+    }
+
+    //--------------------------------------------------------------
+    void NBodyDomain::Tree::buildNode(int index, int level, int begin, int end, float size)
+    {
+        nodes[index].size = size;
+        nodes[index].begin = begin;
+        nodes[index].end = end;
+        nodes[index].firstChild = -1;
+        nodes[index].numChildren = 0;
+
+        if (end - begin > LEAF_SIZE && level < OFX_CURVE_BITS) {
+            // Points are sorted by key, so each octant is a contiguous run.
+            const int shift = 3 * (OFX_CURVE_BITS - 1 - level);
+            int splits[9];
+            splits[0] = begin;
+            for (int octant = 1; octant < 8; ++octant) {
+                splits[octant] = (int)(std::lower_bound(keys.begin() + splits[octant - 1], keys.begin() + end, (uint64_t)octant, [shift](uint64_t key, uint64_t value) {
+                    return ((key >> shift) & 7) < value;
+                }) - keys.begin());
+            }
+            splits[8] = end;
+
+            int numChildren = 0;
+            for (int octant = 0; octant < 8; ++octant) {
+                if (splits[octant + 1] > splits[octant]) ++numChildren;
+            }
+
+            // A run that does not split yet just gets a single child one level down.
+            const int firstChild = (int)nodes.size();
+            nodes.resize(firstChild + numChildren);
+            nodes[index].firstChild = firstChild;
+            nodes[index].numChildren = numChildren;
+
+            int child = firstChild;
+            for (int octant = 0; octant < 8; ++octant) {
+                if (splits[octant + 1] > splits[octant]) {
+                    buildNode(child++, level + 1, splits[octant], splits[octant + 1], size * 0.5f);
+                }
+            }
+        }
+
+        // Monopole of the cell, accumulated in double for large leaves.
+        double mass = 0.0;
+        double com[3] = { 0.0, 0.0, 0.0 };
+        if (nodes[index].numChildren == 0) {
+            for (int i = begin; i < end; ++i) {
+                const float* point = &points[i*4];
+                mass += point[3];
+                for (int k = 0; k < 3; ++k) {
+                    com[k] += (double)point[k] * point[3];
+                }
+            }
+        }
+        else {
+            for (int c = 0; c < nodes[index].numChildren; ++c) {
+                const Node& child = nodes[nodes[index].firstChild + c];
+                mass += child.mass;
+                for (int k = 0; k < 3; ++k) {
+                    com[k] += (double)child.com[k] * child.mass;
+                }
+            }
+        }
+
+        Node& node = nodes[index];
+        node.mass = (float)mass;
+        for (int k = 0; k < 3; ++k) {
+            node.com[k] = (mass > 0.0) ? (float)(com[k] / mass) : points[begin*4+k];
+        }
+    }
+
+    //--------------------------------------------------------------
+    void NBodyDomain::Tree::coverBounds(int maxCells, std::vector<Bounds>& bounds) const
+    {
+        bounds.clear();
+        if (nodes.empty()) return;
+
+        // Keep splitting the most populated cell while the children still fit.
+        std::vector<int> cells(1, 0);
+        while (true) {
+            int largest = -1;
+            for (int c = 0; c < (int)cells.size(); ++c) {
+                const Node& node = nodes[cells[c]];
+                if (node.numChildren > 0 && (int)cells.size() - 1 + node.numChildren <= maxCells &&
+                    (largest < 0 || node.end - node.begin > nodes[cells[largest]].end - nodes[cells[largest]].begin)) {
+                    largest = c;
+                }
+            }
+            if (largest < 0) break;
+
+            const Node& node = nodes[cells[largest]];
+            cells[largest] = node.firstChild;
+            for (int c = 1; c < node.numChildren; ++c) {
+                cells.push_back(node.firstChild + c);
+            }
+        }
+
+        bounds.resize(cells.size());
+        for (int c = 0; c < (int)cells.size(); ++c) {
+            const Node& node = nodes[cells[c]];
+            Bounds& box = bounds[c];
+            box.count = node.end - node.begin;
+            for (int k = 0; k < 3; ++k) {
+                box.min[k] = box.max[k] = points[node.begin*4+k];
+            }
+            for (int i = node.begin + 1; i < node.end; ++i) {
+                for (int k = 0; k < 3; ++k) {
+                    box.min[k] = MIN(box.min[k], points[i*4+k]);
+                    box.max[k] = MAX(box.max[k], points[i*4+k]);
+                }
+            }
+        }
+    }
+
+    //--------------------------------------------------------------
+    NBodyDomain::NBodyDomain(DomainTransport* transport)
+    : _transport(transport)
+    , _stepCount(0)
+    , _bLost(false)
+    {}
+
+    //--------------------------------------------------------------
+    NBodyDomain::~NBodyDomain()
+    {
+        delete _transport;
+    }
+
+    //--------------------------------------------------------------
+    void NBodyDomain::load(const float* positions, const float* velocities, int numBodies)
+    {
+        Command command;
+        memset(&command, 0, sizeof(command));
+        command.type = COMMAND_LOAD;
+        _broadcastCommand(command);
+        _execute(command, positions, velocities, numBodies, nullptr, nullptr);
+    }
+
+    //--------------------------------------------------------------
+    void NBodyDomain::step(const StepParams& params, float* positions)
+    {
+        Command command;
+        memset(&command, 0, sizeof(command));
+        command.type = COMMAND_STEP;
+        command.params = params;
+        _broadcastCommand(command);
+        _execute(command, nullptr, nullptr, 0, positions, nullptr);
+    }
+
+    //--------------------------------------------------------------
+    void NBodyDomain::gather(float* positions, float* velocities)
+    {
+        Command command;
+        memset(&command, 0, sizeof(command));
+        command.type = COMMAND_GATHER;
+        _broadcastCommand(command);
+        _execute(command, nullptr, nullptr, 0, positions, velocities);
+    }
+
+    //--------------------------------------------------------------
+    void NBodyDomain::shutdown()
+    {
+        Command command;
+        memset(&command, 0, sizeof(command));
+        command.type = COMMAND_SHUTDOWN;
+        _broadcastCommand(command);
+    }
+
+    //--------------------------------------------------------------
+    void NBodyDomain::serve()
+    {
+        while (true) {
+            Command command;
+            _broadcastCommand(command);
+            if (command.type == COMMAND_SHUTDOWN) break;
+
+            _execute(command, nullptr, nullptr, 0, nullptr, nullptr);
+        }
+    }
+
+    //--------------------------------------------------------------
+    void NBodyDomain::_broadcastCommand(Command& command)
+    {
+        const int numRanks = getNumRanks();
+        std::vector<DomainTransport::Buffer> send(numRanks), recv;
+        if (getRank() == 0) {
+            for (int q = 0; q < numRanks; ++q) {
+                appendData(send[q], &command, 1);
+            }
+        }
+        if (_exchange(send, recv) && recv[0].size() == sizeof(Command)) {
+            memcpy(&command, recv[0].data(), sizeof(Command));
+        }
+        else {
+            // A rank went away, treat it as the end of the run.
+            command.type = COMMAND_SHUTDOWN;
+        }
+    }
+
+    //--------------------------------------------------------------
+    void NBodyDomain::_execute(const Command& command, const float* inPositions, const float* inVelocities, int numBodies, float* outPositions, float* outVelocities)
+    {
+        switch (command.type)
+        {
+            case COMMAND_LOAD:
+                _load(inPositions, inVelocities, numBodies);
+                break;
+
+            case COMMAND_STEP:
+                _step(command.params);
+                if (!_bLost) {
+                    _gather(outPositions, nullptr, false);
+                }
+                break;
+
+            case COMMAND_GATHER:
+                _gather(outPositions, outVelocities, true);
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    //--------------------------------------------------------------
+    void NBodyDomain::_load(const float* positions, const float* velocities, int numBodies)
+    {
+        // Rank 0 starts out owning everything, the repartition spreads it out.
+        _positions.assign(positions, positions + numBodies * 4);
+        _velocities.assign(velocities, velocities + numBodies * 4);
+        _ids.resize(numBodies);
+        for (int i = 0; i < numBodies; ++i) {
+            _ids[i] = i;
+        }
+
+        _stepCount = 0;
+        _repartition();
+    }
+
+    //--------------------------------------------------------------
+    bool NBodyDomain::_exchange(const std::vector<DomainTransport::Buffer>& send, std::vector<DomainTransport::Buffer>& recv)
+    {
+        if (!_transport->allToAll(send, recv)) {
+            if (!_bLost) {
+                ofLogError("NBodyDomain", "Rank %d lost the other ranks", getRank());
+            }
+            _bLost = true;
+        }
+        return !_bLost;
+    }
+
+    //--------------------------------------------------------------
+    bool NBodyDomain::_allGatherBounds(std::vector<Bounds>& bounds)
+    {
+        Bounds local;
+        local.count = (uint32_t)_ids.size();
+        for (int k = 0; k < 3; ++k) {
+            local.min[k] = local.count ? _positions[k] : 0.0f;
+            local.max[k] = local.min[k];
+        }
+        for (uint32_t i = 1; i < local.count; ++i) {
+            for (int k = 0; k < 3; ++k) {
+                local.min[k] = MIN(local.min[k], _positions[i*4+k]);
+                local.max[k] = MAX(local.max[k], _positions[i*4+k]);
+            }
+        }
+
+        const int numRanks = getNumRanks();
+        std::vector<DomainTransport::Buffer> send(numRanks), recv;
+        for (int q = 0; q < numRanks; ++q) {
+            appendData(send[q], &local, 1);
+        }
+        if (!_exchange(send, recv)) return false;
+
+        bounds.resize(numRanks);
+        for (int p = 0; p < numRanks; ++p) {
+            memcpy(&bounds[p], recv[p].data(), sizeof(Bounds));
+        }
+        return true;
+    }
+
+    //--------------------------------------------------------------
+    void NBodyDomain::_repartition()
+    {
+        const int numRanks = getNumRanks();
+        const int numLocal = (int)_ids.size();
+
+        std::vector<Bounds> bounds;
+        if (!_allGatherBounds(bounds)) return;
+
+        float boundsMin[3], boundsMax[3];
+        bool bFirst = true;
+        uint32_t totalCount = 0;
+        for (const Bounds& b : bounds) {
+            if (b.count == 0) continue;
+            for (int k = 0; k < 3; ++k) {
+                boundsMin[k] = bFirst ? b.min[k] : MIN(boundsMin[k], b.min[k]);
+                boundsMax[k] = bFirst ? b.max[k] : MAX(boundsMax[k], b.max[k]);
+            }
+            bFirst = false;
+            totalCount += b.count;
+        }
+        if (totalCount == 0) return;
+
+        float size = 1e-6f;
+        for (int k = 0; k < 3; ++k) {
+            size = MAX(size, boundsMax[k] - boundsMin[k]);
+        }
+        const float cellsPerUnit = ((1 << OFX_CURVE_BITS) - 1) / size;
+
+        std::vector<uint64_t> keys(numLocal), tempKeys(numLocal);
+        std::vector<uint32_t> order(numLocal), tempOrder(numLocal);
+        parallelFor(numLocal, [&](int i) {
+            keys[i] = _mortonKey(&_positions[i*4], boundsMin, cellsPerUnit);
+            order[i] = i;
+        });
+        ofxRadixSortPairs(keys.data(), order.data(), numLocal, tempKeys.data(), tempOrder.data());
+
+        // Regular samples of the local keys, each standing for an equal share of
+        // the local bodies. Every rank sees the same samples, so they all pick
+        // the same splitters.
+        int numSamples = MIN(numLocal, SPLITTER_SAMPLES);
+        std::vector<uint64_t> samples(numSamples);
+        for (int s = 0; s < numSamples; ++s) {
+            samples[s] = keys[(int)(((int64_t)s * 2 + 1) * numLocal / (numSamples * 2))];
+        }
+
+        std::vector<DomainTransport::Buffer> send(numRanks), recv;
+        for (int q = 0; q < numRanks; ++q) {
+            uint32_t count = numLocal;
+            appendData(send[q], &count, 1);
+            appendData(send[q], samples.data(), samples.size());
+        }
+        if (!_exchange(send, recv)) return;
+
+        std::vector<std::pair<uint64_t, double>> weighted;
+        for (int p = 0; p < numRanks; ++p) {
+            uint32_t count;
+            memcpy(&count, recv[p].data(), sizeof(count));
+            int numRemote = (int)((recv[p].size() - sizeof(count)) / sizeof(uint64_t));
+            const uint64_t* remote = (const uint64_t *)(recv[p].data() + sizeof(count));
+            for (int s = 0; s < numRemote; ++s) {
+                weighted.push_back(std::make_pair(remote[s], (double)count / numRemote));
+            }
+        }
+        std::sort(weighted.begin(), weighted.end());
+
+        std::vector<uint64_t> splitters;
+        double cumulative = 0.0;
+        for (const auto& sample : weighted) {
+            cumulative += sample.second;
+            while ((int)splitters.size() < numRanks - 1 && cumulative >= (double)totalCount * (splitters.size() + 1) / numRanks) {
+                splitters.push_back(sample.first);
+            }
+        }
+        while ((int)splitters.size() < numRanks - 1) {
+            splitters.push_back(~0ull);
+        }
+
+        // Ship every body to the owner of its key range. Sorted order keeps
+        // each destination a contiguous run.
+        for (int q = 0; q < numRanks; ++q) {
+            send[q].clear();
+        }
+        int dest = 0;
+        for (int s = 0; s < numLocal; ++s) {
+            while (dest < numRanks - 1 && keys[s] >= splitters[dest]) ++dest;
+
+            uint32_t i = order[s];
+            BodyRecord record;
+            memcpy(record.pos, &_positions[i*4], sizeof(record.pos));
+            memcpy(record.vel, &_velocities[i*4], sizeof(record.vel));
+            record.id = _ids[i];
+            appendData(send[dest], &record, 1);
+        }
+        if (!_exchange(send, recv)) return;
+
+        size_t numOwned = 0;
+        for (int p = 0; p < numRanks; ++p) {
+            numOwned += recv[p].size() / sizeof(BodyRecord);
+        }
+        _positions.resize(numOwned * 4);
+        _velocities.resize(numOwned * 4);
+        _ids.resize(numOwned);
+
+        size_t i = 0;
+        for (int p = 0; p < numRanks; ++p) {
+            const BodyRecord* records = (const BodyRecord *)recv[p].data();
+            size_t count = recv[p].size() / sizeof(BodyRecord);
+            for (size_t r = 0; r < count; ++r, ++i) {
+                memcpy(&_positions[i*4], records[r].pos, sizeof(records[r].pos));
+                memcpy(&_velocities[i*4], records[r].vel, sizeof(records[r].vel));
+                _ids[i] = records[r].id;
+            }
+        }
+    }
+
+    //--------------------------------------------------------------
+    void NBodyDomain::_exchangeEssentialTrees(float theta, std::vector<float>& imported)
+    {
+        const int numRanks = getNumRanks();
+        const float thetaSquared = theta * theta;
+
+        _localTree.build(_positions.data(), (int)_ids.size());
+
+        // A single box per slice is as large as its outliers, so ranks describe
+        // their region with the tight bounds of a few dozen top level cells.
+        std::vector<Bounds> localCover;
+        _localTree.coverBounds(MAX_COVER_CELLS, localCover);
+
+        std::vector<DomainTransport::Buffer> send(numRanks), recv;
+        for (int q = 0; q < numRanks; ++q) {
+            appendData(send[q], localCover.data(), localCover.size());
+        }
+        if (!_exchange(send, recv)) return;
+
+        std::vector<std::vector<Bounds>> covers(numRanks);
+        for (int p = 0; p < numRanks; ++p) {
+            const Bounds* boxes = (const Bounds *)recv[p].data();
+            covers[p].assign(boxes, boxes + recv[p].size() / sizeof(Bounds));
+            send[p].clear();
+        }
+
+        // For each receiver, walk the local tree against its cover. A cell that
+        // passes the opening test for the nearest point of any box passes it
+        // for every body the receiver owns, so its monopole is all it needs.
+        parallelFor(numRanks, [&](int q) {
+            if (q == getRank() || covers[q].empty() || _localTree.nodes.empty()) return;
+
+            std::vector<int> stack(1, 0);
+            while (!stack.empty()) {
+                const Node& node = _localTree.nodes[stack.back()];
+                stack.pop_back();
+
+                float distSqr = FLT_MAX;
+                for (const Bounds& box : covers[q]) {
+                    float boxDistSqr = 0.0f;
+                    for (int k = 0; k < 3; ++k) {
+                        float d = MAX(MAX(box.min[k] - node.com[k], node.com[k] - box.max[k]), 0.0f);
+                        boxDistSqr += d * d;
+                    }
+                    distSqr = MIN(distSqr, boxDistSqr);
+                }
+
+                if (node.size * node.size < thetaSquared * distSqr) {
+                    float pseudo[4] = { node.com[0], node.com[1], node.com[2], node.mass };
+                    appendData(send[q], pseudo, 4);
+                }
+                else if (node.numChildren == 0) {
+                    appendData(send[q], &_localTree.points[node.begin*4], (node.end - node.begin) * 4);
+                }
+                else {
+                    for (int c = 0; c < node.numChildren; ++c) {
+                        stack.push_back(node.firstChild + c);
+                    }
+                }
+            }
+        });
+        if (!_exchange(send, recv)) return;
+
+        imported.clear();
+        for (int p = 0; p < numRanks; ++p) {
+            if (p == getRank()) continue;
+            const float* data = (const float *)recv[p].data();
+            imported.insert(imported.end(), data, data + recv[p].size() / sizeof(float));
+        }
+    }
+
+    //--------------------------------------------------------------
+    void NBodyDomain::_computeForces(const std::vector<float>& imported, float softeningSquared, float theta)
+    {
+        const int numLocal = (int)_ids.size();
+        const float thetaSquared = theta * theta;
+
+        std::vector<float> points(_positions);
+        points.insert(points.end(), imported.begin(), imported.end());
+        _forceTree.build(points.data(), (int)(points.size() / 4));
+
+        _accelerations.assign(numLocal * 4, 0.0f);
+        if (_forceTree.nodes.empty()) return;
+
+        parallelFor(numLocal, [&](int i) {
+            const float* pos = &_positions[i*4];
+            float acc[3] = { 0.0f, 0.0f, 0.0f };
+
+            int stack[64 * 8];
+            int stackSize = 0;
+            stack[stackSize++] = 0;
+            while (stackSize > 0) {
+                const Node& node = _forceTree.nodes[stack[--stackSize]];
+
+                float r[3] = { node.com[0] - pos[0], node.com[1] - pos[1], node.com[2] - pos[2] };
+                float distSqr = r[0] * r[0] + r[1] * r[1] + r[2] * r[2];
+
+                if (node.size * node.size < thetaSquared * distSqr) {
+                    float invDist = 1.0f / sqrtf(distSqr + softeningSquared);
+                    float s = node.mass * invDist * invDist * invDist;
+                    for (int k = 0; k < 3; ++k) {
+                        acc[k] += r[k] * s;
+                    }
+                }
+                else if (node.numChildren == 0) {
+                    for (int j = node.begin; j < node.end; ++j) {
+                        const float* other = &_forceTree.points[j*4];
+                        float d[3] = { other[0] - pos[0], other[1] - pos[1], other[2] - pos[2] };
+                        float dSqr = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+                        if (dSqr == 0.0f) continue;
+
+                        float invDist = 1.0f / sqrtf(dSqr + softeningSquared);
+                        float s = other[3] * invDist * invDist * invDist;
+                        for (int k = 0; k < 3; ++k) {
+                            acc[k] += d[k] * s;
+                        }
+                    }
+                }
+                else {
+                    for (int c = 0; c < node.numChildren; ++c) {
+                        stack[stackSize++] = node.firstChild + c;
+                    }
+                }
+            }
+
+            for (int k = 0; k < 3; ++k) {
+                _accelerations[i*4+k] = acc[k];
+            }
+        });
+    }
+
+    //--------------------------------------------------------------
+    void NBodyDomain::_step(const StepParams& params)
+    {
+        if (_stepCount > 0 && params.rebalanceInterval > 0 && (_stepCount % params.rebalanceInterval) == 0) {
+            _repartition();
+        }
+
+        std::vector<float> imported;
+        _exchangeEssentialTrees(params.theta, imported);
+        if (_bLost) return;
+        _computeForces(imported, params.softeningSquared, params.theta);
+
+        // Same integrator as NBodySystemCPU.
+        const float deltaTime = params.deltaTime;
+        const float damping = params.damping;
+        parallelFor((int)_ids.size(), [&](int i) {
+            float* pos = &_positions[i*4];
+            float* vel = &_velocities[i*4];
+            const float* acc = &_accelerations[i*4];
+            for (int k = 0; k < 3; ++k) {
+                vel[k] = (vel[k] + acc[k] * deltaTime) * damping;
+                pos[k] += vel[k] * deltaTime;
+            }
+        });
+
+        ++_stepCount;
+    }
+
+    //--------------------------------------------------------------
+    void NBodyDomain::_gather(float* positions, float* velocities, bool withVelocities)
+    {
+        const int numRanks = getNumRanks();
+        const uint32_t numLocal = (uint32_t)_ids.size();
+
+        std::vector<DomainTransport::Buffer> send(numRanks), recv;
+        appendData(send[0], &numLocal, 1);
+        appendData(send[0], _ids.data(), numLocal);
+        appendData(send[0], _positions.data(), numLocal * 4);
+        if (withVelocities) {
+            appendData(send[0], _velocities.data(), numLocal * 4);
+        }
+        if (!_exchange(send, recv)) return;
+
+        if (getRank() != 0) return;
+
+        // Slices arrive in curve order, put every body back at its own index.
+        for (int p = 0; p < numRanks; ++p) {
+            if (recv[p].empty()) continue;
+
+            uint32_t count;
+            memcpy(&count, recv[p].data(), sizeof(count));
+            const uint32_t* ids = (const uint32_t *)(recv[p].data() + sizeof(count));
+            const float* pos = (const float *)(ids + count);
+            const float* vel = pos + count * 4;
+
+            parallelFor(count, [&](int i) {
+                if (positions) {
+                    memcpy(&positions[ids[i]*4], &pos[i*4], 4*sizeof(float));
+                }
+                if (velocities && withVelocities) {
+                    memcpy(&velocities[ids[i]*4], &vel[i*4], 4*sizeof(float));
+                }
+            });
+        }
+    }
+
+    //--------------------------------------------------------------
+    int runDomainWorker(int argc, char *argv[], int first)
+    {
+        if (argc < first + 4) {
+            ofLogError("runDomainWorker", "Usage: --domain-worker <shm|tcp:port> <session> <rank> <ranks>");
+            return 1;
+        }
+
+        int rank = ofToInt(argv[first + 2]);
+        int numRanks = ofToInt(argv[first + 3]);
+        DomainTransport* transport = DomainTransport::create(argv[first], argv[first + 1], rank, numRanks);
+        if (transport == nullptr || !transport->open()) {
+            delete transport;
+            return 1;
+        }
+
+        NBodyDomain domain(transport);
+        domain.serve();
+
+        return 0;
+    }
+}
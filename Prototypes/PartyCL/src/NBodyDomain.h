@@ -0,0 +1,163 @@
+//
+//  NBodyDomain.h
+//  PartyCL
+//
+//  One rank of a domain decomposed N-body run. Bodies are split into slices of
+//  a Morton curve over the global bounds, so each process owns a compact region
+//  of space. Every step, each rank builds a Barnes-Hut tree over its slice and
+//  sends every other rank the part of it that rank needs: cells that are far
+//  enough from the receiver's bounds as single pseudo-bodies, and the bodies of
+//  the leaves that are not (a locally essential tree). Forces on owned bodies
+//  then come from a second tree over the owned and imported bodies.
+//
+//  Rank 0 drives the run. Each call below is a collective, rank 0 broadcasts
+//  the command and the workers, sitting in serve(), follow along.
+//
+
+#pragma once
+
+#include "ofMain.h"
+
+#include "DomainTransport.h"
+
+namespace entropy
+{
+    class NBodyDomain
+    {
+    public:
+        struct StepParams
+        {
+            float deltaTime;
+            float softeningSquared;
+            float damping;
+            // Barnes-Hut opening angle, cells are used whole when size < theta * distance.
+            float theta;
+            // Slices are recomputed every this many steps to follow the bodies.
+            int rebalanceInterval;
+        };
+
+        // Takes ownership of the transport, which must already be open.
+        NBodyDomain(DomainTransport* transport);
+        ~NBodyDomain();
+
+        // Rank 0 only. Hands over the full state, arrays hold four floats per body.
+        void load(const float* positions, const float* velocities, int numBodies);
+
+        // Rank 0 only. Advances all ranks one step, then assembles the positions
+        // of every body in its original order into positions (may be null).
+        void step(const StepParams& params, float* positions);
+
+        // Rank 0 only. Assembles positions and velocities in the original order.
+        void gather(float* positions, float* velocities);
+
+        // Rank 0 only. Releases the workers from serve().
+        void shutdown();
+
+        // Workers only. Follows rank 0's commands until shutdown().
+        void serve();
+
+        // A rank went away during a collective, nothing can be exchanged anymore.
+        bool isLost() const
+        { return _bLost; }
+
+        int getRank() const
+        { return _transport->getRank(); }
+        int getNumRanks() const
+        { return _transport->getNumRanks(); }
+        int getNumLocalBodies() const
+        { return (int)_ids.size(); }
+
+        static const int LEAF_SIZE = 16;
+
+        // Boxes each rank publishes to describe the region it needs forces in.
+        static const int MAX_COVER_CELLS = 64;
+
+    protected: // types
+        enum CommandType
+        {
+            COMMAND_LOAD,
+            COMMAND_STEP,
+            COMMAND_GATHER,
+            COMMAND_SHUTDOWN
+        };
+
+        struct Command
+        {
+            uint32_t type;
+            StepParams params;
+        };
+
+        struct Bounds
+        {
+            float min[3];
+            float max[3];
+            uint32_t count;
+        };
+
+        struct Node
+        {
+            float com[3];
+            float mass;
+            float size;
+            int begin;
+            int end;
+            int firstChild;
+            int numChildren;
+        };
+
+        // Barnes-Hut octree over xyzm points, stored sorted along a Morton curve.
+        struct Tree
+        {
+            void build(const float* points, int numPoints);
+            // Fills the already allocated node at index and appends its children.
+            void buildNode(int index, int level, int begin, int end, float size);
+            // Tight bounds of up to maxCells cells that together cover all points.
+            void coverBounds(int maxCells, std::vector<Bounds>& bounds) const;
+
+            std::vector<Node> nodes;
+            std::vector<float> points;
+            std::vector<uint64_t> keys;
+            // Index into the source array of each sorted point.
+            std::vector<uint32_t> order;
+            std::vector<uint64_t> tempKeys;
+            std::vector<uint32_t> tempOrder;
+        };
+
+    protected: // methods
+        void _broadcastCommand(Command& command);
+        void _execute(const Command& command, const float* inPositions, const float* inVelocities, int numBodies, float* outPositions, float* outVelocities);
+
+        void _load(const float* positions, const float* velocities, int numBodies);
+        void _step(const StepParams& params);
+        void _gather(float* positions, float* velocities, bool withVelocities);
+
+        // Marks the domain lost when the transport fails.
+        bool _exchange(const std::vector<DomainTransport::Buffer>& send, std::vector<DomainTransport::Buffer>& recv);
+
+        bool _allGatherBounds(std::vector<Bounds>& bounds);
+        void _repartition();
+        void _exchangeEssentialTrees(float theta, std::vector<float>& imported);
+        void _computeForces(const std::vector<float>& imported, float softeningSquared, float theta);
+
+        static uint64_t _mortonKey(const float* pos, const float* boundsMin, float cellsPerUnit);
+
+    protected: // data
+        DomainTransport* _transport;
+
+        // Owned bodies, four floats each, and their index in the original arrays.
+        std::vector<float> _positions;
+        std::vector<float> _velocities;
+        std::vector<uint32_t> _ids;
+        std::vector<float> _accelerations;
+
+        Tree _localTree;
+        Tree _forceTree;
+
+        uint64_t _stepCount;
+        bool _bLost;
+    };
+
+    // Entry point for `--domain-worker <transport> <session> <rank> <ranks>`,
+    // returns the process exit code.
+    int runDomainWorker(int argc, char *argv[], int first);
+}
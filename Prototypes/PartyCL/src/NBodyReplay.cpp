@@ -0,0 +1,68 @@
+//
+//  NBodyReplay.cpp
+//  PartyCL
+//
+
+#include "NBodyReplay.h"
+
+#include "NBodySystemCPU.h"
+#include "NBodySystemFMM.h"
+#include "UploadAllocator.h"
+
+namespace entropy
+{
+    //--------------------------------------------------------------
+    ReplayResult runReplay(NBodySystem& system, const NBodyCheckpoint& checkpoint, int numSteps)
+    {
+        checkpoint.restore(system);
+        system.synchronizeThreads();
+
+        ReplayResult result;
+        result.numSteps = numSteps;
+
+        uint64_t startTime = ofGetElapsedTimeMicros();
+        for (int i = 0; i < numSteps; ++i) {
+            system.update(checkpoint.timestep);
+            system.synchronizeThreads();
+        }
+        result.elapsedSeconds = (ofGetElapsedTimeMicros() - startTime) / 1000000.0;
+        result.msPerStep = (numSteps > 0) ? (result.elapsedSeconds * 1000.0 / numSteps) : 0.0;
+
+        NBodyCheckpoint finalState;
+        finalState.capture(system);
+        result.stateHash = finalState.getStateHash();
+
+        return result;
+    }
+
+    //--------------------------------------------------------------
+    int runHeadlessReplay(const string& path, int numSteps, const string& backend)
+    {
+        NBodyCheckpoint checkpoint;
+        if (!checkpoint.load(path)) {
+            return 1;
+        }
+
+        // No GL context here, so uploads go to the mock allocator.
+        NBodySystemCPU *system;
+        if (backend == "fmm") {
+            system = new NBodySystemFMM(checkpoint.numBodies, 4, 0.6f, 64, new UploadAllocatorMock());
+        }
+        else {
+            system = new NBodySystemCPU(checkpoint.numBodies, new UploadAllocatorMock());
+        }
+
+        ReplayResult result = runReplay(*system, checkpoint, numSteps);
+        delete system;
+
+        printf("checkpoint %s\n", path.c_str());
+        printf("backend    %s\n", backend.c_str());
+        printf("bodies     %d\n", checkpoint.numBodies);
+        printf("from step  %llu\n", (unsigned long long)checkpoint.stepCount);
+        printf("steps      %d\n", result.numSteps);
+        printf("elapsed    %.3f s (%.3f ms/step)\n", result.elapsedSeconds, result.msPerStep);
+        printf("hash       %016llx\n", (unsigned long long)result.stateHash);
+
+        return 0;
+    }
+}
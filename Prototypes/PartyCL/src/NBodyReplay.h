@@ -0,0 +1,34 @@
+//
+//  NBodyReplay.h
+//  PartyCL
+//
+//  Headless replay: restores a checkpoint, steps the system a fixed number of
+//  times and reports how long it took and the hash of the final state. Two runs
+//  from the same checkpoint on the same build must produce the same hash.
+//
+
+#pragma once
+
+#include "ofMain.h"
+
+#include "NBodyCheckpoint.h"
+#include "NBodySystem.h"
+
+namespace entropy
+{
+    struct ReplayResult
+    {
+        int numSteps;
+        double elapsedSeconds;
+        double msPerStep;
+        uint64_t stateHash;
+    };
+
+    // Steps are run back to back, waiting on any simulation thread after each
+    // one so that none are dropped.
+    ReplayResult runReplay(NBodySystem& system, const NBodyCheckpoint& checkpoint, int numSteps);
+
+    // Entry point for `--replay <checkpoint> [steps] [cpu|fmm]`. Runs without a
+    // window and returns the process exit code.
+    int runHeadlessReplay(const string& path, int numSteps, const string& backend);
+}
@@ -10,6 +10,9 @@
 
 #include "ofMain.h"
 
+#include "ofxForceAccumulator.h"
+#include "ofxSpaceFillingCurve.h"
+
 namespace entropy
 {
     enum NBodyConfig
@@ -17,10 +20,21 @@ namespace entropy
         NBODY_CONFIG_RANDOM,
         NBODY_CONFIG_SHELL,
         NBODY_CONFIG_EXPAND,
+        NBODY_CONFIG_PLUMMER,
+        NBODY_CONFIG_HERNQUIST,
 
         NBODY_NUM_CONFIGS
     };
 
+    enum NBodyCollisionMode
+    {
+        NBODY_COLLISIONS_NONE,
+        NBODY_COLLISIONS_MERGE,
+        NBODY_COLLISIONS_INELASTIC,
+
+        NBODY_NUM_COLLISION_MODES
+    };
+
     class NBodySystem
     {
     public:
@@ -43,6 +57,26 @@ namespace entropy
         virtual void setSoftening(float softening) = 0;
         virtual void setDamping(float damping) = 0;
 
+        // Per-body softening from the local density, between minSoftening and
+        // the value passed to setSoftening(). Backends without it ignore this.
+        virtual void setAdaptiveSoftening(bool /*enabled*/, float /*eta*/ = 0.5f, float /*minSoftening*/ = 0.01f)
+        {}
+
+        // Sorts the bodies in memory along a space-filling curve every interval
+        // steps, 0 disables it. Backends without it ignore this.
+        virtual void setReordering(int /*interval*/, ofxSpaceFillingCurve /*curve*/ = OFX_CURVE_HILBERT)
+        {}
+
+        // Precision of the per-body force sums. Backends without it ignore this.
+        virtual void setForceAccumulation(ofxForceAccumulation /*accumulation*/)
+        {}
+
+        // Bodies closer than their collision radii either merge into one body
+        // or bounce off each other, losing energy with the restitution. radius
+        // is for a body of the mean initial mass. Backends without it ignore this.
+        virtual void setCollisions(NBodyCollisionMode /*mode*/, float /*radius*/ = 0.01f, float /*restitution*/ = 0.5f)
+        {}
+
         virtual ofVbo& getVbo() = 0;
 
         virtual float* getArray(ArrayType type) = 0;
@@ -51,6 +85,17 @@ namespace entropy
         virtual int getNumBodies() const
         { return _numBodies; }
 
+        // Merged bodies are removed, this brings the count back up to at most
+        // the one the system was created with before loading new arrays.
+        // Backends without collisions only accept their current count.
+        virtual bool setNumBodies(int numBodies)
+        { return numBodies == _numBodies; }
+
+        // Bodies in getVbo(), which can trail getNumBodies() by a frame when
+        // the simulation runs on its own thread.
+        virtual int getNumVboBodies() const
+        { return getNumBodies(); }
+
         virtual void synchronizeThreads()
         {};
 
@@ -7,23 +7,65 @@
 //
 
 #include "NBodySystemCPU.h"
+#include "Parallel.h"
+#include "UploadAllocator.h"
+
+#include "ofxForceAccumulator.h"
+#include "ofxNuma.h"
+#include "ofxProfiler.h"
 
 namespace entropy
 {
     //--------------------------------------------------------------
-    NBodySystemCPU::NBodySystemCPU(int numBodies)
+    NBodySystemCPU::NBodySystemCPU(int numBodies, UploadAllocator* uploadAllocator)
     : NBodySystem(numBodies),
     _force(0),
+    _uploadAllocator(uploadAllocator),
     _softeningSquared(.00125f),
     _damping(0.995f),
     _currentRead(0),
-    _currentWrite(1)
+    _currentWrite(1),
+    _pendingSteps(0),
+    _bStepping(false),
+    _bStopThread(false)
     {
         for (int i = 0; i < 2; ++i) {
             _pos[i] = nullptr;
             _vel[i] = nullptr;
         }
 
+        _bAdaptiveSoftening = false;
+        _softeningEta = 0.5f;
+        _minSoftening = 0.01f;
+
+        _reorderInterval = 0;
+        _reorderCurve = OFX_CURVE_HILBERT;
+        _stepCount = 0;
+        _bReordered = false;
+
+        _forceAccumulation = OFX_ACCUMULATE_FLOAT;
+
+        _collisionMode = NBODY_COLLISIONS_NONE;
+        _collisionRadius = 0.01f;
+        _restitution = 0.5f;
+        _referenceMass = 1.0f;
+
+        _capacity = 0;
+        _numVboBodies = 0;
+
+        _params.deltaTime = 0.0f;
+        _params.softeningSquared = _softeningSquared;
+        _params.damping = _damping;
+        _params.adaptiveSoftening = _bAdaptiveSoftening;
+        _params.softeningEta = _softeningEta;
+        _params.minSoftening = _minSoftening;
+        _params.reorderInterval = _reorderInterval;
+        _params.reorderCurve = _reorderCurve;
+        _params.forceAccumulation = _forceAccumulation;
+        _params.collisionMode = _collisionMode;
+        _params.collisionRadius = _collisionRadius;
+        _params.restitution = _restitution;
+
         _initialize(numBodies);
     }
 
@@ -40,19 +82,32 @@ namespace entropy
         if (_bInitialized) return;
 
         _numBodies = numBodies;
+        _capacity = numBodies;
+        _numVboBodies = numBodies;
 
+        // Placed and zeroed by the threads that integrate them, so on NUMA
+        // machines each body's pages sit on the node that updates it.
         for (int i = 0; i < 2; ++i) {
-            _pos[i] = new float[_numBodies*4];
-            _vel[i] = new float[_numBodies*4];
-
-            memset(_pos[i], 0, _numBodies*4*sizeof(float));
-            memset(_vel[i], 0, _numBodies*4*sizeof(float));
+            _pos[i] = ofxNumaAllocArray<float>(_numBodies*4);
+            _vel[i] = ofxNumaAllocArray<float>(_numBodies*4);
         }
 
-        _force  = new float[_numBodies*4];
-        memset(_force, 0, _numBodies*4*sizeof(float));
+        _force = ofxNumaAllocArray<float>(_numBodies*4);
+
+        _bodySofteningSquared.assign(_numBodies, _softeningSquared);
+
+        _bodyIds.resize(_numBodies);
+        for (int i = 0; i < _numBodies; ++i) {
+            _bodyIds[i] = i;
+        }
+        _bodySlots = _bodyIds;
+        _bReordered = false;
 
-        _vbo.setVertexData(_pos[_currentWrite], 4, _numBodies, GL_DYNAMIC_DRAW);
+        if (_uploadAllocator == nullptr) {
+            _uploadAllocator = new UploadAllocatorGL();
+        }
+        _uploadRing.setup(_uploadAllocator, _numBodies*4*sizeof(float));
+        _publishPositions();
 
         _bInitialized = true;
     }
@@ -62,15 +117,18 @@ namespace entropy
     {
         if (!_bInitialized) return;
 
-        for (int i = 0; i < 2; ++i) {
-            delete [] _pos[i];
-            delete [] _vel[i];
+        setThreaded(false);
 
+        for (int i = 0; i < 2; ++i) {
+            ofxNumaFreeArray(_pos[i], _capacity*4);
+            ofxNumaFreeArray(_vel[i], _capacity*4);
         }
 
-        delete [] _force;
+        ofxNumaFreeArray(_force, _capacity*4);
 
         _vbo.clear();
+        _uploadRing.clear();
+        _uploadAllocator = nullptr;
 
         _bInitialized = false;
     }
@@ -80,12 +138,497 @@ namespace entropy
     {
         if (!_bInitialized) return;
 
-        _integrateNBodySystem(deltaTime);
+        OFX_PROFILE_SCOPE("update");
+
+        _params.deltaTime = deltaTime;
+
+        if (isThreaded()) {
+            // Hand the latest parameters over and queue a step. Steps are capped
+            // so that a slow simulation drops steps instead of building a backlog.
+            _paramsBuffer.getWriteBuffer() = _params;
+            _paramsBuffer.publish();
+            {
+                std::lock_guard<std::mutex> lock(_stepMutex);
+                _pendingSteps = MIN(_pendingSteps + 1, 2);
+            }
+            _stepCondition.notify_one();
+
+            // Draw from the newest completed frame, if there is one.
+            OFX_PROFILE_SCOPE("upload");
+            if (_uploadRing.acquire()) {
+                _bindUploadRegion();
+            }
+        }
+        else {
+            _softeningSquared = _params.softeningSquared;
+            _damping = _params.damping;
+            _bAdaptiveSoftening = _params.adaptiveSoftening;
+            _softeningEta = _params.softeningEta;
+            _minSoftening = _params.minSoftening;
+            _reorderInterval = _params.reorderInterval;
+            _reorderCurve = _params.reorderCurve;
+            _forceAccumulation = _params.forceAccumulation;
+            _collisionMode = _params.collisionMode;
+            _collisionRadius = _params.collisionRadius;
+            _restitution = _params.restitution;
+
+            ofxNuma::applyThreadPinning();
+            {
+                OFX_PROFILE_SCOPE("step");
+                _step(deltaTime, _uploadRing.getWriteRegion());
+            }
+
+            OFX_PROFILE_SCOPE("upload");
+            _uploadRing.publish(_numBodies*4*sizeof(float));
+            if (_uploadRing.acquire()) {
+                _bindUploadRegion();
+            }
+        }
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemCPU::_step(float deltaTime, float* upload)
+    {
+        if (_reorderInterval > 0 && (_stepCount % _reorderInterval) == 0) {
+            OFX_PROFILE_SCOPE("reorder");
+            _reorderBodies();
+        }
+        ++_stepCount;
+
+        _integrateNBodySystem(deltaTime, upload);
+
+        std::swap(_currentRead, _currentWrite);
+
+        if (_collisionMode != NBODY_COLLISIONS_NONE) {
+            OFX_PROFILE_SCOPE("collisions");
+            _resolveCollisions(upload);
+        }
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemCPU::setReordering(int interval, ofxSpaceFillingCurve curve)
+    {
+        _params.reorderInterval = MAX(interval, 0);
+        _params.reorderCurve = curve;
+    }
 
-        // Upload data to VBO.
-        _vbo.setVertexData(_pos[_currentWrite], 4, _numBodies, GL_DYNAMIC_DRAW);
+    //--------------------------------------------------------------
+    void NBodySystemCPU::setForceAccumulation(ofxForceAccumulation accumulation)
+    {
+        _params.forceAccumulation = accumulation;
+    }
 
+    //--------------------------------------------------------------
+    void NBodySystemCPU::_reorderBodies()
+    {
+        if (_numBodies < 2) return;
+
+        _sortKeys.resize(_numBodies);
+        _sortTempKeys.resize(_numBodies);
+        _sortOrder.resize(_numBodies);
+        _sortTempOrder.resize(_numBodies);
+
+        ofxComputeCurveKeys(_pos[_currentRead], 4, _numBodies, _reorderCurve, _sortKeys.data(), _sortOrder.data());
+        ofxRadixSortPairs(_sortKeys.data(), _sortOrder.data(), _numBodies, _sortTempKeys.data(), _sortTempOrder.data());
+
+        // Gather into the write arrays, which the integrator overwrites anyway,
+        // and make them current. The old ids are kept in the temp order.
+        _sortTempOrder.swap(_bodyIds);
+        parallelForStatic(_numBodies, [&](int i) {
+            uint32_t src = _sortOrder[i];
+            memcpy(&_pos[_currentWrite][i*4], &_pos[_currentRead][src*4], 4*sizeof(float));
+            memcpy(&_vel[_currentWrite][i*4], &_vel[_currentRead][src*4], 4*sizeof(float));
+
+            uint32_t id = _sortTempOrder[src];
+            _bodyIds[i] = id;
+            _bodySlots[id] = i;
+        });
         std::swap(_currentRead, _currentWrite);
+
+        _bReordered = true;
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemCPU::setCollisions(NBodyCollisionMode mode, float radius, float restitution)
+    {
+        _params.collisionMode = mode;
+        _params.collisionRadius = MAX(radius, 0.0f);
+        _params.restitution = ofClamp(restitution, 0.0f, 1.0f);
+    }
+
+    //--------------------------------------------------------------
+    bool NBodySystemCPU::setNumBodies(int numBodies)
+    {
+        if (!_bInitialized || numBodies < 1 || numBodies > _capacity) return false;
+
+        synchronizeThreads();
+
+        _numBodies = numBodies;
+        _bodySofteningSquared.assign(_numBodies, _softeningSquared);
+
+        _bodyIds.resize(_numBodies);
+        for (int i = 0; i < _numBodies; ++i) {
+            _bodyIds[i] = i;
+        }
+        _bodySlots = _bodyIds;
+        _bReordered = false;
+
+        _publishPositions();
+        return true;
+    }
+
+    //--------------------------------------------------------------
+    // Hash of an integer cell, from "Optimized Spatial Hashing for Collision
+    // Detection of Deformable Objects" (Teschner et al. 2003).
+    static inline uint32_t hashCell(int x, int y, int z)
+    {
+        return ((uint32_t)x * 73856093u) ^ ((uint32_t)y * 19349663u) ^ ((uint32_t)z * 83492791u);
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemCPU::_resolveCollisions(float* upload)
+    {
+        if (_collisionRadius <= 0.0f || _numBodies < 2) return;
+
+        float* pos = _pos[_currentRead];
+        float* vel = _vel[_currentRead];
+
+        // Radii grow with the cube root of the mass, merged bodies keep the
+        // density of the ones they came from.
+        _collisionRadii.resize(_numBodies);
+        parallelForStatic(_numBodies, [&](int i) {
+            _collisionRadii[i] = _collisionRadius * cbrtf(MAX(pos[i*4+3], 0.0f) / _referenceMass);
+        });
+        float maxRadius = *std::max_element(_collisionRadii.begin(), _collisionRadii.end());
+        if (maxRadius <= 0.0f) return;
+
+        // Cells as wide as the largest contact distance, so every contact is
+        // between a cell and its 26 neighbors. Twice as many hash slots as
+        // bodies keeps unrelated cells from sharing slots.
+        const float invCellSize = 1.0f / (2.0f * maxRadius);
+        int tableBits = 1;
+        while ((1 << tableBits) < 2 * _numBodies) ++tableBits;
+        const uint32_t tableMask = (1u << tableBits) - 1;
+
+        _sortKeys.resize(_numBodies);
+        _sortTempKeys.resize(_numBodies);
+        _sortOrder.resize(_numBodies);
+        _sortTempOrder.resize(_numBodies);
+
+        auto getCell = [&](int i, int cell[3]) {
+            for (int k = 0; k < 3; ++k) {
+                cell[k] = (int)floorf(pos[i*4+k] * invCellSize);
+            }
+        };
+
+        parallelForStatic(_numBodies, [&](int i) {
+            int cell[3];
+            getCell(i, cell);
+            _sortKeys[i] = hashCell(cell[0], cell[1], cell[2]) & tableMask;
+            _sortOrder[i] = i;
+        });
+        ofxRadixSortPairs(_sortKeys.data(), _sortOrder.data(), _numBodies, _sortTempKeys.data(), _sortTempOrder.data(), tableBits);
+
+        _cellStart.assign(tableMask + 1, -1);
+        parallelForStatic(_numBodies, [&](int k) {
+            if (k == 0 || _sortKeys[k] != _sortKeys[k - 1]) {
+                _cellStart[_sortKeys[k]] = k;
+            }
+        });
+
+        // Each block of bodies lists its contacts (i, j), i < j, in order, so
+        // the result does not depend on the thread count.
+        const int BLOCK_SIZE = 1024;
+        const int numBlocks = (_numBodies + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        _blockContacts.resize(numBlocks);
+        parallelFor(numBlocks, [&](int block) {
+            std::vector<std::pair<uint32_t, uint32_t>>& contacts = _blockContacts[block];
+            contacts.clear();
+
+            std::vector<uint32_t> neighbors;
+            const int end = MIN((block + 1) * BLOCK_SIZE, _numBodies);
+            for (int i = block * BLOCK_SIZE; i < end; ++i) {
+                int cell[3];
+                getCell(i, cell);
+
+                neighbors.clear();
+                for (int dz = -1; dz <= 1; ++dz) {
+                    for (int dy = -1; dy <= 1; ++dy) {
+                        for (int dx = -1; dx <= 1; ++dx) {
+                            uint32_t hash = hashCell(cell[0] + dx, cell[1] + dy, cell[2] + dz) & tableMask;
+                            for (int k = _cellStart[hash]; k >= 0 && k < _numBodies && _sortKeys[k] == hash; ++k) {
+                                uint32_t j = _sortOrder[k];
+                                if (j <= (uint32_t)i) continue;
+
+                                float r[3];
+                                for (int c = 0; c < 3; ++c) {
+                                    r[c] = pos[j*4+c] - pos[i*4+c];
+                                }
+                                float contact = _collisionRadii[i] + _collisionRadii[j];
+                                if (r[0] * r[0] + r[1] * r[1] + r[2] * r[2] < contact * contact) {
+                                    neighbors.push_back(j);
+                                }
+                            }
+                        }
+                    }
+                }
+
+                // Cells that share a hash slot are visited more than once.
+                std::sort(neighbors.begin(), neighbors.end());
+                neighbors.erase(std::unique(neighbors.begin(), neighbors.end()), neighbors.end());
+                for (auto j : neighbors) {
+                    contacts.push_back(std::make_pair((uint32_t)i, j));
+                }
+            }
+        });
+
+        _contacts.clear();
+        for (auto& contacts : _blockContacts) {
+            _contacts.insert(_contacts.end(), contacts.begin(), contacts.end());
+        }
+        if (_contacts.empty()) return;
+
+        if (_collisionMode == NBODY_COLLISIONS_INELASTIC) {
+            // Contacts are few, resolve them one after the other so bodies
+            // touching several others see the earlier impulses.
+            for (auto& contact : _contacts) {
+                float* pi = &pos[contact.first*4];
+                float* pj = &pos[contact.second*4];
+                float* vi = &vel[contact.first*4];
+                float* vj = &vel[contact.second*4];
+
+                float n[3];
+                for (int k = 0; k < 3; ++k) {
+                    n[k] = pj[k] - pi[k];
+                }
+                float dist = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+                if (dist <= 0.0f) continue;
+                for (int k = 0; k < 3; ++k) {
+                    n[k] /= dist;
+                }
+
+                // Only approaching bodies bounce. vel.w holds the inverse mass.
+                float approach = (vj[0] - vi[0]) * n[0] + (vj[1] - vi[1]) * n[1] + (vj[2] - vi[2]) * n[2];
+                float invMassSum = vi[3] + vj[3];
+                if (approach >= 0.0f || invMassSum <= 0.0f) continue;
+
+                float impulse = -(1.0f + _restitution) * approach / invMassSum;
+                for (int k = 0; k < 3; ++k) {
+                    vi[k] -= impulse * vi[3] * n[k];
+                    vj[k] += impulse * vj[3] * n[k];
+                }
+            }
+
+            // Only velocities changed, the upload is still current.
+            return;
+        }
+
+        // Sticky merge: contacts link bodies into groups, each group becomes
+        // its lowest slot with the total mass at the center of mass, moving
+        // with the total momentum.
+        _mergeParent.resize(_numBodies);
+        for (int i = 0; i < _numBodies; ++i) {
+            _mergeParent[i] = i;
+        }
+        auto findRoot = [&](uint32_t i) {
+            while (_mergeParent[i] != i) {
+                _mergeParent[i] = _mergeParent[_mergeParent[i]];
+                i = _mergeParent[i];
+            }
+            return i;
+        };
+        for (auto& contact : _contacts) {
+            uint32_t a = findRoot(contact.first);
+            uint32_t b = findRoot(contact.second);
+            if (a != b) {
+                _mergeParent[MAX(a, b)] = MIN(a, b);
+            }
+        }
+
+        std::vector<uint32_t> survivors;
+        survivors.reserve(_numBodies);
+        for (int i = 0; i < _numBodies; ++i) {
+            uint32_t root = findRoot(i);
+            if (root == (uint32_t)i) {
+                survivors.push_back(i);
+                continue;
+            }
+
+            float* pr = &pos[root*4];
+            float* vr = &vel[root*4];
+            const float* pi = &pos[i*4];
+            const float* vi = &vel[i*4];
+            float mass = pr[3] + pi[3];
+            if (mass <= 0.0f) continue;
+
+            for (int k = 0; k < 3; ++k) {
+                pr[k] = (pr[k] * pr[3] + pi[k] * pi[3]) / mass;
+                vr[k] = (vr[k] * pr[3] + vi[k] * pi[3]) / mass;
+            }
+            pr[3] = mass;
+            vr[3] = 1.0f / mass;
+        }
+
+        _compactBodies(survivors, upload);
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemCPU::_compactBodies(const std::vector<uint32_t>& survivors, float* upload)
+    {
+        const int numSurvivors = (int)survivors.size();
+
+        // Gathered into the write arrays, like a reorder.
+        parallelForStatic(numSurvivors, [&](int k) {
+            uint32_t src = survivors[k];
+            memcpy(&_pos[_currentWrite][k*4], &_pos[_currentRead][src*4], 4*sizeof(float));
+            memcpy(&_vel[_currentWrite][k*4], &_vel[_currentRead][src*4], 4*sizeof(float));
+        });
+        std::swap(_currentRead, _currentWrite);
+
+        // Sources never come before their destination, so this works in place.
+        for (int k = 0; k < numSurvivors; ++k) {
+            if (survivors[k] != (uint32_t)k) {
+                memcpy(&_force[k*4], &_force[survivors[k]*4], 4*sizeof(float));
+            }
+        }
+
+        // Survivors are renumbered in the order of their old ids, so
+        // getArray() keeps listing them in the original order.
+        std::vector<uint32_t> newIds(_numBodies, 0);
+        for (auto slot : survivors) {
+            newIds[_bodyIds[slot]] = 1;
+        }
+        uint32_t count = 0;
+        for (auto& id : newIds) {
+            uint32_t alive = id;
+            id = count;
+            count += alive;
+        }
+        for (int k = 0; k < numSurvivors; ++k) {
+            _bodyIds[k] = newIds[_bodyIds[survivors[k]]];
+        }
+        _bodyIds.resize(numSurvivors);
+        _bodySlots.resize(numSurvivors);
+        for (int k = 0; k < numSurvivors; ++k) {
+            _bodySlots[_bodyIds[k]] = k;
+        }
+
+        _numBodies = numSurvivors;
+        _bodySofteningSquared.resize(_numBodies);
+
+        if (upload) {
+            memcpy(upload, _pos[_currentRead], _numBodies*4*sizeof(float));
+        }
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemCPU::_bindUploadRegion()
+    {
+        // Point the VBO at the region instead of re-specifying its storage.
+        _numVboBodies = (int)(_uploadRing.getReadSize() / (4*sizeof(float)));
+
+        ofBufferObject* buffer = _uploadRing.getAllocator()->getBuffer();
+        if (buffer) {
+            _vbo.setVertexBuffer(*buffer, 4, 4*sizeof(float), _uploadRing.getReadOffset());
+        }
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemCPU::setThreaded(bool threaded)
+    {
+        if (threaded == isThreaded()) return;
+
+        if (threaded) {
+            _paramsBuffer.reset(_params);
+
+            _pendingSteps = 0;
+            _bStepping = false;
+            _bStopThread = false;
+            _simThread = std::thread(&NBodySystemCPU::_threadedFunction, this);
+        }
+        else {
+            {
+                std::lock_guard<std::mutex> lock(_stepMutex);
+                _bStopThread = true;
+            }
+            _stepCondition.notify_one();
+            _simThread.join();
+        }
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemCPU::synchronizeThreads()
+    {
+        if (!isThreaded()) return;
+
+        std::unique_lock<std::mutex> lock(_stepMutex);
+        _idleCondition.wait(lock, [this] {
+            return _pendingSteps == 0 && !_bStepping;
+        });
+
+        if (_uploadRing.acquire()) {
+            _bindUploadRegion();
+        }
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemCPU::_publishPositions()
+    {
+        OFX_PROFILE_SCOPE("upload");
+
+        memcpy(_uploadRing.getWriteRegion(), _pos[_currentRead], _numBodies*4*sizeof(float));
+        _uploadRing.publish(_numBodies*4*sizeof(float));
+
+        // Only called while the simulation thread is idle, so the frame can be
+        // taken right away.
+        if (_uploadRing.acquire()) {
+            _bindUploadRegion();
+        }
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemCPU::_threadedFunction()
+    {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(_stepMutex);
+                _stepCondition.wait(lock, [this] {
+                    return _pendingSteps > 0 || _bStopThread;
+                });
+                if (_bStopThread) break;
+
+                --_pendingSteps;
+                _bStepping = true;
+            }
+
+            _paramsBuffer.acquire();
+            const StepParams& params = _paramsBuffer.getReadBuffer();
+            _softeningSquared = params.softeningSquared;
+            _damping = params.damping;
+            _bAdaptiveSoftening = params.adaptiveSoftening;
+            _softeningEta = params.softeningEta;
+            _minSoftening = params.minSoftening;
+            _reorderInterval = params.reorderInterval;
+            _reorderCurve = params.reorderCurve;
+            _forceAccumulation = params.forceAccumulation;
+            _collisionMode = params.collisionMode;
+            _collisionRadius = params.collisionRadius;
+            _restitution = params.restitution;
+
+            // This thread owns its own worker pool, pin it too.
+            ofxNuma::applyThreadPinning();
+            {
+                OFX_PROFILE_SCOPE("step");
+                _step(params.deltaTime, _uploadRing.getWriteRegion());
+            }
+            _uploadRing.publish(_numBodies*4*sizeof(float));
+
+            {
+                std::lock_guard<std::mutex> lock(_stepMutex);
+                _bStepping = false;
+            }
+            _idleCondition.notify_all();
+        }
     }
 
     //--------------------------------------------------------------
@@ -97,7 +640,9 @@ namespace entropy
     //--------------------------------------------------------------
     float* NBodySystemCPU::getArray(ArrayType type)
     {
-        if (!_bInitialized) return;
+        if (!_bInitialized) return nullptr;
+
+        synchronizeThreads();
 
         float* data = 0;
         switch (type)
@@ -112,6 +657,16 @@ namespace entropy
                 break;
         }
 
+        if (_bReordered) {
+            // Back to the original order.
+            std::vector<float>& staging = _arrayStaging[type == ARRAY_VELOCITY ? 1 : 0];
+            staging.resize(_numBodies*4);
+            parallelForStatic(_numBodies, [&](int i) {
+                memcpy(&staging[_bodyIds[i]*4], &data[i*4], 4*sizeof(float));
+            });
+            data = staging.data();
+        }
+
         return data;
     }
 
@@ -120,6 +675,10 @@ namespace entropy
     {
         if (!_bInitialized) return;
 
+        // The simulation thread only runs queued steps, so once it is idle the
+        // arrays belong to this thread until the next update().
+        synchronizeThreads();
+
         float* target = 0;
         switch (type)
         {
@@ -133,59 +692,208 @@ namespace entropy
                 break;
         }
 
-        memcpy(target, data, _numBodies*4*sizeof(float));
+        if (_bReordered) {
+            parallelForStatic(_numBodies, [&](int i) {
+                memcpy(&target[i*4], &data[_bodyIds[i]*4], 4*sizeof(float));
+            });
+        }
+        else {
+            memcpy(target, data, _numBodies*4*sizeof(float));
+        }
+
+        if (type == ARRAY_POSITION) {
+            double totalMass = 0.0;
+            for (int i = 0; i < _numBodies; ++i) {
+                totalMass += data[i*4+3];
+            }
+            _referenceMass = (totalMass > 0.0) ? (float)(totalMass / _numBodies) : 1.0f;
+
+            _publishPositions();
+        }
     }
 
     //--------------------------------------------------------------
-    void NBodySystemCPU::_bodyBodyInteraction(float accel[3], float posMass0[4], float posMass1[4], float softeningSquared)
+    void NBodySystemCPU::setAdaptiveSoftening(bool enabled, float eta, float minSoftening)
     {
-        float r[3];
+        _params.adaptiveSoftening = enabled;
+        _params.softeningEta = MAX(eta, 0.0f);
+        _params.minSoftening = MAX(minSoftening, 0.0f);
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemCPU::_updateSoftening()
+    {
+        if (!_bAdaptiveSoftening || _numBodies < 2) {
+            std::fill(_bodySofteningSquared.begin(), _bodySofteningSquared.end(), _softeningSquared);
+            return;
+        }
 
-        // r_01  [3 FLOPS]
-        r[0] = posMass0[0] - posMass1[0];
-        r[1] = posMass0[1] - posMass1[1];
-        r[2] = posMass0[2] - posMass1[2];
+        const float* pos = _pos[_currentRead];
 
-        // d^2 + e^2 [6 FLOPS]
-        float distSqr = r[0] * r[0] + r[1] * r[1] + r[2] * r[2];
-        distSqr += softeningSquared;
+        float boundsMin[3] = { pos[0], pos[1], pos[2] };
+        float boundsMax[3] = { pos[0], pos[1], pos[2] };
+        for (int i = 1; i < _numBodies; ++i) {
+            for (int k = 0; k < 3; ++k) {
+                boundsMin[k] = MIN(boundsMin[k], pos[i*4+k]);
+                boundsMax[k] = MAX(boundsMax[k], pos[i*4+k]);
+            }
+        }
 
-        // invDistCube =1/distSqr^(3/2)  [4 FLOPS (2 mul, 1 sqrt, 1 inv)]
-        float invDist = 1.0f / sqrtf(distSqr);
-        float invDistCube =  invDist * invDist * invDist;
+        // Count bodies per cell on a hierarchy of grids, the coarsest sized for
+        // about 8 bodies per cell on average and each level halving the cell
+        // size. Bodies are sorted once along a Morton curve on the finest grid,
+        // which makes every coarser cell a contiguous run of the same order.
+        // Each body uses the finest cell that still holds enough bodies for a
+        // stable estimate.
+        static const int NUM_LEVELS = 6;
+        static const int MIN_NEIGHBORS = 16;
+
+        double volume = 1.0;
+        for (int k = 0; k < 3; ++k) {
+            volume *= MAX(boundsMax[k] - boundsMin[k], 1e-6f);
+        }
+        const float coarseCellSize = (float)cbrt(volume * 8.0 / _numBodies);
+        const float fineCellsPerUnit = (1 << (NUM_LEVELS - 1)) / coarseCellSize;
+        const uint32_t maxCoord = (1u << OFX_CURVE_BITS) - 1;
+
+        _sortKeys.resize(_numBodies);
+        _sortTempKeys.resize(_numBodies);
+        _sortOrder.resize(_numBodies);
+        _sortTempOrder.resize(_numBodies);
+
+        parallelFor(_numBodies, [&](int i) {
+            uint32_t coords[3];
+            for (int k = 0; k < 3; ++k) {
+                coords[k] = MIN((uint32_t)MAX((pos[i*4+k] - boundsMin[k]) * fineCellsPerUnit, 0.0f), maxCoord);
+            }
+            _sortKeys[i] = ofxMortonKey(coords[0], coords[1], coords[2]);
+            _sortOrder[i] = i;
+        });
+        ofxRadixSortPairs(_sortKeys.data(), _sortOrder.data(), _numBodies, _sortTempKeys.data(), _sortTempOrder.data());
+
+        std::vector<float> spacing(_numBodies);
+        for (int level = 0; level < NUM_LEVELS; ++level) {
+            const int shift = 3 * (NUM_LEVELS - 1 - level);
+            const float cellSize = coarseCellSize / (1 << level);
+            const float cellVolume = cellSize * cellSize * cellSize;
+
+            for (int begin = 0; begin < _numBodies; ) {
+                uint64_t cell = _sortKeys[begin] >> shift;
+                int end = begin + 1;
+                while (end < _numBodies && (_sortKeys[end] >> shift) == cell) ++end;
+
+                // Finer cells hold fewer bodies, so once a body drops below the
+                // threshold it stays on the last level that met it.
+                int count = end - begin;
+                if (level == 0 || count >= MIN_NEIGHBORS) {
+                    float cellSpacing = cbrtf(cellVolume / count);
+                    for (int b = begin; b < end; ++b) {
+                        spacing[_sortOrder[b]] = cellSpacing;
+                    }
+                }
+                begin = end;
+            }
+        }
 
-        // s = m_j * invDistCube [1 FLOP]
-        float s = posMass1[3] * invDistCube;
+        const float maxSofteningSquared = _softeningSquared;
+        const float minSofteningSquared = MIN(_minSoftening * _minSoftening, maxSofteningSquared);
 
-        // (m_1 * r_01) / (d^2 + e^2)^(3/2)  [6 FLOPS]
-        accel[0] += r[0] * s;
-        accel[1] += r[1] * s;
-        accel[2] += r[2] * s;
+        parallelFor(_numBodies, [&](int i) {
+            float softening = _softeningEta * spacing[i];
+            _bodySofteningSquared[i] = MIN(MAX(softening * softening, minSofteningSquared), maxSofteningSquared);
+        });
     }
 
     //--------------------------------------------------------------
-    void NBodySystemCPU::_computeNBodyGravitation()
+    template<typename Accumulator>
+    static void computeDirectForces(const float* pos, const float* softeningSquared, int numBodies, float* force)
     {
-        for (int i = 0; i < _numBodies; ++i) {
-            _force[i*4] = _force[i*4+1] = _force[i*4+2] = 0;
+        // Pair terms are computed a tile at a time into plain arrays, which
+        // vectorizes, and then summed in order by the accumulator.
+        static const int TILE_SIZE = 16;
 
-            for (int j = 0; j < _numBodies; ++j) {
-                float acc[3] = {0, 0, 0};
-                _bodyBodyInteraction(acc, &_pos[_currentRead][j*4], &_pos[_currentRead][i*4], _softeningSquared);
+        parallelFor(numBodies, [&](int i) {
+            const float* pi = &pos[i*4];
+            const float si = softeningSquared[i];
 
-                for (int k = 0; k < 3; ++k) {
-                    _force[i*4+k] += acc[k];
+            float terms[3][TILE_SIZE];
+            Accumulator sum;
+
+            for (int begin = 0; begin < numBodies; begin += TILE_SIZE) {
+                const int count = MIN(TILE_SIZE, numBodies - begin);
+
+                for (int t = 0; t < count; ++t) {
+                    const float* pj = &pos[(begin + t)*4];
+
+                    // r_01  [3 FLOPS]
+                    float rx = pj[0] - pi[0];
+                    float ry = pj[1] - pi[1];
+                    float rz = pj[2] - pi[2];
+
+                    // d^2 + e^2 [6 FLOPS], softening is the pair mean
+                    float distSqr = rx * rx + ry * ry + rz * rz;
+                    distSqr += 0.5f * (si + softeningSquared[begin + t]);
+
+                    // invDistCube =1/distSqr^(3/2)  [4 FLOPS (2 mul, 1 sqrt, 1 inv)]
+                    float invDist = 1.0f / sqrtf(distSqr);
+                    float invDistCube = invDist * invDist * invDist;
+
+                    // s = m_j * invDistCube [1 FLOP]
+                    float s = pj[3] * invDistCube;
+
+                    terms[0][t] = rx * s;
+                    terms[1][t] = ry * s;
+                    terms[2][t] = rz * s;
+                }
+
+                for (int t = 0; t < count; ++t) {
+                    sum.add(terms[0][t], terms[1][t], terms[2][t]);
                 }
             }
+
+            // Force on i, integration scales it back by the inverse mass.
+            float* fi = &force[i*4];
+            sum.get(fi);
+            fi[0] *= pi[3];
+            fi[1] *= pi[3];
+            fi[2] *= pi[3];
+        });
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemCPU::_computeNBodyGravitation()
+    {
+        switch (_forceAccumulation)
+        {
+            default:
+            case OFX_ACCUMULATE_FLOAT:
+                computeDirectForces<ofxFloatAccumulator>(_pos[_currentRead], _bodySofteningSquared.data(), _numBodies, _force);
+                break;
+
+            case OFX_ACCUMULATE_KAHAN:
+                computeDirectForces<ofxKahanAccumulator>(_pos[_currentRead], _bodySofteningSquared.data(), _numBodies, _force);
+                break;
+
+            case OFX_ACCUMULATE_DOUBLE:
+                computeDirectForces<ofxDoubleAccumulator>(_pos[_currentRead], _bodySofteningSquared.data(), _numBodies, _force);
+                break;
         }
     }
 
     //--------------------------------------------------------------
-    void NBodySystemCPU::_integrateNBodySystem(float deltaTime)
+    void NBodySystemCPU::_integrateNBodySystem(float deltaTime, float* upload)
     {
-        _computeNBodyGravitation();
+        {
+            OFX_PROFILE_SCOPE("softening");
+            _updateSoftening();
+        }
+        {
+            OFX_PROFILE_SCOPE("force");
+            _computeNBodyGravitation();
+        }
 
-        for (int i = 0; i < _numBodies; ++i) {
+        OFX_PROFILE_SCOPE("integrate");
+        parallelForStatic(_numBodies, [&](int i) {
             int index = 4*i;
             float pos[3], vel[3], force[3];
             pos[0] = _pos[_currentRead][index+0];
@@ -222,10 +930,67 @@ namespace entropy
             _pos[_currentWrite][index+2] = pos[2];
             _pos[_currentWrite][index+3] = mass;
 
+            if (upload) {
+                upload[index+0] = pos[0];
+                upload[index+1] = pos[1];
+                upload[index+2] = pos[2];
+                upload[index+3] = mass;
+            }
+
             _vel[_currentWrite][index+0] = vel[0];
             _vel[_currentWrite][index+1] = vel[1];
             _vel[_currentWrite][index+2] = vel[2];
             _vel[_currentWrite][index+3] = invMass;
+        });
+    }
+
+    //--------------------------------------------------------------
+    float NBodySystemCPU::validateMerge()
+    {
+        // Two touching bodies that merge on the first step and a probe far
+        // enough away to stay out of the collision.
+        const float softening = 0.1f;
+        const ofVec4f positions[3] = { ofVec4f(0.0f, 0.0f, 0.0f, 1.0f), ofVec4f(0.001f, 0.0f, 0.0f, 3.0f), ofVec4f(10.0f, 0.0f, 0.0f, 1.0f) };
+        const ofVec4f velocities[3] = { ofVec4f(1.0f, 0.0f, 0.0f, 1.0f), ofVec4f(-1.0f, 0.5f, 0.0f, 1.0f / 3.0f), ofVec4f(0.0f, 0.0f, 0.0f, 1.0f) };
+
+        NBodySystemCPU system(3, new UploadAllocatorMock());
+        system.setSoftening(softening);
+        system.setDamping(1.0f);
+        system.setCollisions(NBODY_COLLISIONS_MERGE, 0.05f);
+        system.setArray(ARRAY_POSITION, &positions[0].x);
+        system.setArray(ARRAY_VELOCITY, &velocities[0].x);
+
+        // Zero length steps, the first merges and the second computes the
+        // forces of the merged system.
+        system.update(0.0f);
+        system.update(0.0f);
+        system.synchronizeThreads();
+        if (system.getNumBodies() != 2) {
+            ofLogError("NBodySystemCPU::validateMerge", "%d bodies left, expected 2", system.getNumBodies());
+            return 1.0f;
         }
+
+        // Survivors are renumbered, the merged pair becomes id 0 and the probe
+        // id 1. Forces are per slot, the arrays in id order.
+        int probe = (system.getBodyIds()[0] == 1) ? 0 : 1;
+        double mass = positions[0].w + positions[1].w;
+        double center = (positions[0].x * positions[0].w + positions[1].x * positions[1].w) / mass;
+        double dist = positions[2].x - center;
+        double expected = -positions[2].w * mass * dist / pow(dist * dist + softening * softening, 1.5);
+
+        float error = (float)(fabs(system.getForces()[probe * 4] - expected) / fabs(expected));
+
+        // The merged body carries the total mass and momentum of the pair.
+        const float* merged = system.getArray(ARRAY_POSITION);
+        error = MAX(error, (float)(fabs(merged[3] - mass) / mass));
+        error = MAX(error, (float)fabs(merged[0] - center));
+        const float* mergedVel = system.getArray(ARRAY_VELOCITY);
+        for (int k = 0; k < 3; ++k) {
+            double momentum = velocities[0][k] * positions[0].w + velocities[1][k] * positions[1].w;
+            error = MAX(error, (float)fabs(mergedVel[k] - momentum / mass));
+        }
+
+        ofLogNotice("NBodySystemCPU::validateMerge", "Merged mass %g: largest error %g", merged[3], error);
+        return error;
     }
-}
\ No newline at end of file
+}
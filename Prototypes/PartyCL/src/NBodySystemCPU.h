@@ -8,7 +8,13 @@
 
 #pragma once
 
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
 #include "NBodySystem.h"
+#include "TripleBuffer.h"
+#include "UploadRing.h"
 
 namespace entropy
 {
@@ -16,43 +22,201 @@ namespace entropy
     : public NBodySystem
     {
     public:
-        NBodySystemCPU(int numBodies);
+        // Positions are streamed to the GPU through the allocator, which the
+        // system takes ownership of. Defaults to UploadAllocatorGL.
+        NBodySystemCPU(int numBodies, UploadAllocator* uploadAllocator = nullptr);
         virtual ~NBodySystemCPU();
 
         virtual void update(float deltaTime);
 
         virtual void setSoftening(float softening)
-        { _softeningSquared = softening * softening; }
+        { _params.softeningSquared = softening * softening; }
         virtual void setDamping(float damping)
-        { _damping = damping; }
+        { _params.damping = damping; }
+
+        // Each body gets eta times its local interparticle spacing, clamped to
+        // [minSoftening, softening]. Pairs use the mean of their squared
+        // softenings so forces stay symmetric.
+        virtual void setAdaptiveSoftening(bool enabled, float eta = 0.5f, float minSoftening = 0.01f);
+
+        // Bodies close in space end up close in memory for the force loops.
+        // getArray() and setArray() keep using the original body order, only
+        // the VBO is in simulation order.
+        virtual void setReordering(int interval, ofxSpaceFillingCurve curve = OFX_CURVE_HILBERT);
+
+        // Original index of the body in each slot of the simulation arrays and
+        // the VBO.
+        const std::vector<uint32_t>& getBodyIds() const
+        { return _bodyIds; }
+
+        // Applies to the direct sum. Pair math stays in float, only the sums
+        // are compensated or kept in double.
+        virtual void setForceAccumulation(ofxForceAccumulation accumulation);
+
+        // Forces of the last step, in simulation order.
+        const float* getForces() const
+        { return _force; }
+
+        // Contacts are found with a uniform spatial hash after each step.
+        // Merged bodies are compacted out of the arrays, so later steps get
+        // cheaper; getArray() then lists the survivors in their original order.
+        virtual void setCollisions(NBodyCollisionMode mode, float radius = 0.01f, float restitution = 0.5f);
+
+        // Merges two touching bodies next to a distant probe and returns the
+        // relative error of the probe's force against the pull of their summed
+        // mass.
+        static float validateMerge();
+
+        // Up to the count the system was created with. Ids are reset and the
+        // added slots hold stale bodies until setArray() is called.
+        virtual bool setNumBodies(int numBodies);
+
+        // Bodies in the newest frame taken from the upload ring. When threaded
+        // _numBodies belongs to the simulation thread, so merges only show up
+        // here with the frame they happened in, or after synchronizeThreads().
+        virtual int getNumBodies() const
+        { return _numVboBodies; }
+
+        virtual int getNumVboBodies() const
+        { return _numVboBodies; }
 
         virtual ofVbo& getVbo();
 
         virtual float* getArray(ArrayType type);
         virtual void setArray(ArrayType type, const float *data);
 
+        // Waits for any queued simulation steps to complete and takes their
+        // last frame.
+        virtual void synchronizeThreads();
+
+        // When threaded, update() only queues a step for the simulation thread
+        // and uploads the newest completed frame, so rendering never waits on
+        // the integrator.
+        void setThreaded(bool threaded);
+        bool isThreaded() const
+        { return _simThread.joinable(); }
+
     protected: // methods
         NBodySystemCPU() {} // default constructor
 
         virtual void _initialize(int numBodies);
         virtual void _finalize();
 
-        void _bodyBodyInteraction(float accel[3], float posMass0[4], float posMass1[4], float softeningSquared);
-        void _computeNBodyGravitation();
-        void _integrateNBodySystem(float deltaTime);
+        void _updateSoftening();
+
+        inline float _pairSofteningSquared(int i, int j) const
+        { return 0.5f * (_bodySofteningSquared[i] + _bodySofteningSquared[j]); }
+        virtual void _computeNBodyGravitation();
+        void _integrateNBodySystem(float deltaTime, float* upload = nullptr);
+
+        virtual void _step(float deltaTime, float* upload);
+        void _reorderBodies();
+        void _resolveCollisions(float* upload);
+        void _compactBodies(const std::vector<uint32_t>& survivors, float* upload);
+        void _publishPositions();
+        void _bindUploadRegion();
+        void _threadedFunction();
 
     protected: // data
+        struct StepParams
+        {
+            float deltaTime;
+            float softeningSquared;
+            float damping;
+
+            bool adaptiveSoftening;
+            float softeningEta;
+            float minSoftening;
+
+            int reorderInterval;
+            ofxSpaceFillingCurve reorderCurve;
+
+            ofxForceAccumulation forceAccumulation;
+
+            NBodyCollisionMode collisionMode;
+            float collisionRadius;
+            float restitution;
+        };
+
         float* _pos[2];
         float* _vel[2];
         float* _force;
 
         ofVbo _vbo;
 
+        // Integrated positions are written straight into mapped upload
+        // memory, and the VBO sources them from the newest region.
+        UploadAllocator* _uploadAllocator;
+        UploadRing _uploadRing;
+
+        // Parameters set from the main thread. They are copied to the
+        // simulation values below at the start of each step.
+        StepParams _params;
+
         float _softeningSquared;
         float _damping;
 
+        bool _bAdaptiveSoftening;
+        float _softeningEta;
+        float _minSoftening;
+
+        // Squared softening of each body, constant unless adaptive.
+        std::vector<float> _bodySofteningSquared;
+
+        int _reorderInterval;
+        ofxSpaceFillingCurve _reorderCurve;
+        uint64_t _stepCount;
+
+        ofxForceAccumulation _forceAccumulation;
+
+        NBodyCollisionMode _collisionMode;
+        float _collisionRadius;
+        float _restitution;
+
+        // Mean mass of the last setArray(), the collision radius is scaled
+        // from it by the cube root of the mass.
+        float _referenceMass;
+
+        // Spatial hash, bodies sorted by cell hash in the sort buffers and the
+        // first sorted index of each hash, or -1.
+        std::vector<float> _collisionRadii;
+        std::vector<int> _cellStart;
+        std::vector<std::vector<std::pair<uint32_t, uint32_t>>> _blockContacts;
+        std::vector<std::pair<uint32_t, uint32_t>> _contacts;
+        std::vector<uint32_t> _mergeParent;
+
+        // Bodies the arrays were allocated for, merges only lower _numBodies.
+        int _capacity;
+        int _numVboBodies;
+
+        // Slot to original index and back. Arrays in the original order are
+        // assembled in the staging buffers when getArray() is called.
+        std::vector<uint32_t> _bodyIds;
+        std::vector<uint32_t> _bodySlots;
+        bool _bReordered;
+        std::vector<float> _arrayStaging[2];
+
+        // Scratch for the reorder, collision and adaptive softening sorts.
+        std::vector<uint64_t> _sortKeys;
+        std::vector<uint64_t> _sortTempKeys;
+        std::vector<uint32_t> _sortOrder;
+        std::vector<uint32_t> _sortTempOrder;
+
         unsigned int _currentRead;
         unsigned int _currentWrite;
+
+        // Threaded mode. Parameters flow to the simulation thread through a
+        // triple buffer and finished positions flow back through the upload
+        // ring; the mutex and conditions only gate when the thread wakes up.
+        std::thread _simThread;
+        std::mutex _stepMutex;
+        std::condition_variable _stepCondition;
+        std::condition_variable _idleCondition;
+        int _pendingSteps;
+        bool _bStepping;
+        bool _bStopThread;
+
+        TripleBuffer<StepParams> _paramsBuffer;
     };
 }
 
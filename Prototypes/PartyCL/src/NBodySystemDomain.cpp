@@ -0,0 +1,280 @@
+//
+//  NBodySystemDomain.cpp
+//  PartyCL
+//
+
+#include "NBodySystemDomain.h"
+
+#include "InitialConditions.h"
+#include "NBodyBenchmark.h"
+#include "UploadAllocator.h"
+
+#include "ofxProfiler.h"
+
+#if defined(TARGET_WIN32)
+#include <process.h>
+#else
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#if defined(TARGET_LINUX)
+#include <spawn.h>
+
+extern char **environ;
+#endif
+
+namespace entropy
+{
+    //--------------------------------------------------------------
+    static int currentProcessId()
+    {
+#if defined(TARGET_WIN32)
+        return _getpid();
+#else
+        return getpid();
+#endif
+    }
+
+    //--------------------------------------------------------------
+    NBodySystemDomain::NBodySystemDomain(int numBodies, int numRanks, const string& transport, bool spawnWorkers, UploadAllocator* uploadAllocator)
+    : NBodySystemCPU(numBodies, uploadAllocator)
+    , _domain(nullptr)
+    , _theta(0.5f)
+    , _rebalanceInterval(10)
+    , _bLoadPending(true)
+    , _bVelocitiesStale(false)
+    {
+        numRanks = MAX(1, numRanks);
+        string session = "partycl-" + ofToString(currentProcessId());
+
+        if (spawnWorkers && !_spawnWorkers(numRanks, transport, session)) {
+            return;
+        }
+        else if (!spawnWorkers) {
+            ofLogNotice("NBodySystemDomain", "Waiting for workers: PartyCL --domain-worker %s %s <rank> %d", transport.c_str(), session.c_str(), numRanks);
+        }
+
+        DomainTransport* domainTransport = DomainTransport::create(transport, session, 0, numRanks);
+        if (domainTransport && domainTransport->open()) {
+            _domain = new NBodyDomain(domainTransport);
+        }
+        else {
+            ofLogError("NBodySystemDomain", "Could not reach the workers, falling back to a single process");
+            delete domainTransport;
+
+            // Whichever workers did start have nobody to talk to.
+            _stopWorkers(true);
+        }
+    }
+
+    //--------------------------------------------------------------
+    NBodySystemDomain::~NBodySystemDomain()
+    {
+        // The simulation thread may be inside a collective, stop it first.
+        setThreaded(false);
+
+        if (_domain) {
+            _domain->shutdown();
+            delete _domain;
+            _domain = nullptr;
+        }
+
+        _stopWorkers(false);
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemDomain::_stopWorkers(bool terminate)
+    {
+#if !defined(TARGET_WIN32)
+        for (int pid : _workerPids) {
+            if (terminate) {
+                kill(pid, SIGTERM);
+            }
+            waitpid(pid, nullptr, 0);
+        }
+#endif
+        _workerPids.clear();
+    }
+
+    //--------------------------------------------------------------
+    bool NBodySystemDomain::_spawnWorkers(int numRanks, const string& transport, const string& session)
+    {
+#ifdef TARGET_LINUX
+        for (int rank = 1; rank < numRanks; ++rank) {
+            string rankArg = ofToString(rank);
+            string numRanksArg = ofToString(numRanks);
+            char* args[] = {
+                (char *)"PartyCL",
+                (char *)"--domain-worker",
+                (char *)transport.c_str(),
+                (char *)session.c_str(),
+                (char *)rankArg.c_str(),
+                (char *)numRanksArg.c_str(),
+                nullptr
+            };
+
+            pid_t pid;
+            if (posix_spawn(&pid, "/proc/self/exe", nullptr, nullptr, args, environ) != 0) {
+                ofLogError("NBodySystemDomain::_spawnWorkers", "Could not start rank %d", rank);
+                _stopWorkers(true);
+                return false;
+            }
+            _workerPids.push_back(pid);
+        }
+        return true;
+#else
+        ofLogNotice("NBodySystemDomain::_spawnWorkers", "Start the workers with: PartyCL --domain-worker %s %s <rank> %d", transport.c_str(), session.c_str(), numRanks);
+        return true;
+#endif
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemDomain::_step(float deltaTime, float* upload)
+    {
+        if (_domain == nullptr) {
+            NBodySystemCPU::_step(deltaTime, upload);
+            return;
+        }
+
+        if (_bLoadPending) {
+            _domain->load(_pos[_currentRead], _vel[_currentRead], _numBodies);
+            _bLoadPending = false;
+        }
+
+        NBodyDomain::StepParams params;
+        params.deltaTime = deltaTime;
+        params.softeningSquared = _softeningSquared;
+        params.damping = _damping;
+        params.theta = _theta;
+        params.rebalanceInterval = _rebalanceInterval;
+
+        // The assembled frame lands straight in the upload region when there
+        // is one, it is only copied back for getArray().
+        float* target = upload ? upload : _pos[_currentWrite];
+        {
+            // Force and integration are fused in the ranks.
+            OFX_PROFILE_SCOPE("domain");
+            _domain->step(params, target);
+        }
+        if (_domain->isLost()) {
+            // The ranks took the velocities with them, carry on from the ones
+            // last loaded or gathered here.
+            ofLogError("NBodySystemDomain", "Lost a rank, falling back to a single process");
+            delete _domain;
+            _domain = nullptr;
+            NBodySystemCPU::_step(deltaTime, upload);
+            return;
+        }
+        if (upload) {
+            memcpy(_pos[_currentWrite], upload, _numBodies*4*sizeof(float));
+        }
+        _bVelocitiesStale = true;
+
+        std::swap(_currentRead, _currentWrite);
+    }
+
+    //--------------------------------------------------------------
+    float* NBodySystemDomain::getArray(ArrayType type)
+    {
+        if (!_bInitialized) return nullptr;
+
+        synchronizeThreads();
+
+        if (type == ARRAY_VELOCITY && _bVelocitiesStale && _domain) {
+            _domain->gather(_pos[_currentRead], _vel[_currentRead]);
+            _bVelocitiesStale = false;
+        }
+
+        return NBodySystemCPU::getArray(type);
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemDomain::setArray(ArrayType type, const float *data)
+    {
+        if (!_bInitialized) return;
+
+        synchronizeThreads();
+
+        // Bring the other array up to date, everything is reloaded next step.
+        if (_bVelocitiesStale && _domain) {
+            _domain->gather(_pos[_currentRead], _vel[_currentRead]);
+            _bVelocitiesStale = false;
+        }
+
+        NBodySystemCPU::setArray(type, data);
+        _bLoadPending = true;
+    }
+
+    //--------------------------------------------------------------
+    int runHeadlessDomain(int argc, char *argv[], int first)
+    {
+        int numRanks = (argc > first) ? ofToInt(argv[first]) : 2;
+        int numBodies = (argc > first + 1) ? ofToInt(argv[first + 1]) : 16384;
+        int numSteps = (argc > first + 2) ? ofToInt(argv[first + 2]) : 20;
+        string transport = (argc > first + 3) ? argv[first + 3] : "shm";
+
+        // Small enough for the reference direct sum and the energy pair sum.
+        static const int MAX_REFERENCE_BODIES = 16384;
+        const float timestep = 0.016f;
+        const float softening = 0.1f;
+
+        vector<ofVec4f> positions(numBodies), velocities(numBodies);
+        generateInitialConditions(NBODY_CONFIG_PLUMMER, numBodies, 1.54f, 8.0f, 1, positions.data(), velocities.data());
+
+        NBodySystemDomain system(numBodies, numRanks, transport, true, new UploadAllocatorMock());
+        if (system.getNumRanks() != numRanks) {
+            return 1;
+        }
+        system.setSoftening(softening);
+        system.setDamping(1.0f);
+        system.setArray(NBodySystem::ARRAY_POSITION, (float *)positions.data());
+        system.setArray(NBodySystem::ARRAY_VELOCITY, (float *)velocities.data());
+
+        bool bReference = (numBodies <= MAX_REFERENCE_BODIES);
+        double energy0 = bReference ? NBodyBenchmark::computeEnergy((float *)positions.data(), (float *)velocities.data(), numBodies, softening) : 0.0;
+
+        uint64_t startTime = ofGetElapsedTimeMicros();
+        for (int i = 0; i < numSteps; ++i) {
+            system.update(timestep);
+        }
+        double seconds = (ofGetElapsedTimeMicros() - startTime) / 1000000.0;
+
+        printf("ranks      %d (%s)\n", numRanks, transport.c_str());
+        printf("bodies     %d\n", numBodies);
+        printf("steps      %d\n", numSteps);
+        printf("elapsed    %.3f s (%.3f ms/step)\n", seconds, seconds * 1000.0 / MAX(numSteps, 1));
+
+        if (bReference) {
+            const float* finalPositions = system.getArray(NBodySystem::ARRAY_POSITION);
+            const float* finalVelocities = system.getArray(NBodySystem::ARRAY_VELOCITY);
+            double energy1 = NBodyBenchmark::computeEnergy(finalPositions, finalVelocities, numBodies, softening);
+
+            // Same run on a single process with the direct sum.
+            NBodySystemCPU reference(numBodies, new UploadAllocatorMock());
+            reference.setSoftening(softening);
+            reference.setDamping(1.0f);
+            reference.setArray(NBodySystem::ARRAY_POSITION, (float *)positions.data());
+            reference.setArray(NBodySystem::ARRAY_VELOCITY, (float *)velocities.data());
+            for (int i = 0; i < numSteps; ++i) {
+                reference.update(timestep);
+            }
+            const float* referencePositions = reference.getArray(NBodySystem::ARRAY_POSITION);
+
+            double errorSum = 0.0, extentSum = 0.0;
+            for (int i = 0; i < numBodies; ++i) {
+                for (int k = 0; k < 3; ++k) {
+                    double d = finalPositions[i*4+k] - referencePositions[i*4+k];
+                    errorSum += d * d;
+                    extentSum += (double)referencePositions[i*4+k] * referencePositions[i*4+k];
+                }
+            }
+
+            printf("energy     %.3e relative drift\n", fabs((energy1 - energy0) / energy0));
+            printf("vs direct  %.3e relative rms position error\n", sqrt(errorSum / MAX(extentSum, 1e-30)));
+        }
+
+        return 0;
+    }
+}
@@ -0,0 +1,72 @@
+//
+//  NBodySystemDomain.h
+//  PartyCL
+//
+//  Runs the simulation across several local processes with NBodyDomain. This
+//  process is rank 0: it takes part in the force computation like any other
+//  rank and collects every step back into one position array, which is then
+//  drawn like any other CPU backend. The worker ranks are separate processes
+//  running `PartyCL --domain-worker`, spawned automatically on Linux.
+//
+//  The ranks own their bodies, so collisions are only handled when falling
+//  back to a single process.
+//
+
+#pragma once
+
+#include "NBodySystemCPU.h"
+#include "NBodyDomain.h"
+
+namespace entropy
+{
+    class NBodySystemDomain
+    : public NBodySystemCPU
+    {
+    public:
+        // transport is "shm" or "tcp:<port>". Falls back to a single process
+        // direct sum if the workers can't be reached.
+        NBodySystemDomain(int numBodies, int numRanks, const string& transport = "shm", bool spawnWorkers = true, UploadAllocator* uploadAllocator = nullptr);
+        virtual ~NBodySystemDomain();
+
+        virtual float* getArray(ArrayType type);
+        virtual void setArray(ArrayType type, const float *data);
+
+        // Barnes-Hut opening angle for the per-rank trees.
+        void setOpeningAngle(float theta)
+        { _theta = theta; }
+        float getOpeningAngle() const
+        { return _theta; }
+
+        // Steps between re-slicing the bodies along the curve.
+        void setRebalanceInterval(int interval)
+        { _rebalanceInterval = MAX(1, interval); }
+        int getRebalanceInterval() const
+        { return _rebalanceInterval; }
+
+        int getNumRanks() const
+        { return _domain ? _domain->getNumRanks() : 1; }
+
+    protected: // methods
+        virtual void _step(float deltaTime, float* upload);
+
+        bool _spawnWorkers(int numRanks, const string& transport, const string& session);
+        // Waits for the spawned workers to exit, after asking them to if terminate.
+        void _stopWorkers(bool terminate);
+
+    protected: // data
+        NBodyDomain* _domain;
+        vector<int> _workerPids;
+
+        float _theta;
+        int _rebalanceInterval;
+
+        // The workers own the state between steps. Positions come back every
+        // step, velocities only when asked for.
+        bool _bLoadPending;
+        bool _bVelocitiesStale;
+    };
+
+    // Entry point for `--domain <ranks> [bodies] [steps] [shm|tcp:port]`,
+    // returns the process exit code.
+    int runHeadlessDomain(int argc, char *argv[], int first);
+}
@@ -0,0 +1,635 @@
+//
+//  NBodySystemFMM.cpp
+//  PartyCL
+//
+
+#include "NBodySystemFMM.h"
+#include "Parallel.h"
+
+namespace entropy
+{
+    // Bits per axis in the Morton keys, which is also the deepest tree level.
+    static const int MORTON_LEVELS = 10;
+
+    //--------------------------------------------------------------
+    static inline int octantAtLevel(uint64_t key, int level)
+    {
+        return (key >> (3 * (MORTON_LEVELS - 1 - level))) & 7;
+    }
+
+    //--------------------------------------------------------------
+    NBodySystemFMM::NBodySystemFMM(int numBodies, int order, float theta, int leafSize, UploadAllocator* uploadAllocator)
+    : NBodySystemCPU(numBodies, uploadAllocator)
+    , _order(0)
+    , _theta(theta)
+    , _leafSize(MAX(1, leafSize))
+    , _rootHalfSize(0)
+    {
+        _rootCenter[0] = _rootCenter[1] = _rootCenter[2] = 0;
+
+        setExpansionOrder(order);
+    }
+
+    //--------------------------------------------------------------
+    NBodySystemFMM::~NBodySystemFMM()
+    {
+        // Stop the simulation thread before the tree goes away.
+        setThreaded(false);
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemFMM::setExpansionOrder(int order)
+    {
+        order = MIN(MAX(order, 1), MAX_ORDER);
+        if (order == _order) return;
+
+        _order = order;
+        _buildExpansionTables();
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemFMM::_buildExpansionTables()
+    {
+        const int dim = _order + 1;
+
+        // Enumerate all multi-indices n with |n| <= order, sorted by |n|.
+        _terms.clear();
+        _termIndex.assign(dim * dim * dim, -1);
+        for (int order = 0; order <= _order; ++order) {
+            for (int nx = order; nx >= 0; --nx) {
+                for (int ny = order - nx; ny >= 0; --ny) {
+                    int nz = order - nx - ny;
+
+                    Term term;
+                    term.n[0] = nx;
+                    term.n[1] = ny;
+                    term.n[2] = nz;
+                    term.order = order;
+
+                    _termIndex[(nx * dim + ny) * dim + nz] = (int)_terms.size();
+                    _terms.push_back(term);
+                }
+            }
+        }
+
+        const int numTerms = (int)_terms.size();
+        auto indexOf = [&](int nx, int ny, int nz) {
+            if (nx < 0 || ny < 0 || nz < 0 || nx + ny + nz > _order) return -1;
+            return _termIndex[(nx * dim + ny) * dim + nz];
+        };
+
+        // Each monomial is built from a lower one by multiplying along one axis.
+        _termParent.assign(numTerms, -1);
+        _termParentAxis.assign(numTerms, -1);
+        for (int t = 1; t < numTerms; ++t) {
+            const Term& term = _terms[t];
+            int axis = (term.n[0] > 0) ? 0 : ((term.n[1] > 0) ? 1 : 2);
+            int n[3] = { term.n[0], term.n[1], term.n[2] };
+            --n[axis];
+
+            _termParent[t] = indexOf(n[0], n[1], n[2]);
+            _termParentAxis[t] = axis;
+        }
+
+        _m2mTable.clear();
+        _l2lTable.clear();
+        _m2lTable.clear();
+        for (int a = 0; a < numTerms; ++a) {
+            const Term& ta = _terms[a];
+            for (int b = 0; b < numTerms; ++b) {
+                const Term& tb = _terms[b];
+
+                // M2M: M_a += M'_b * (-t)^(a-b) / (a-b)!, for b <= a.
+                // L2L: L'_b += L_a * s^(a-b) / (a-b)!, for b <= a.
+                int diff = indexOf(ta.n[0] - tb.n[0], ta.n[1] - tb.n[1], ta.n[2] - tb.n[2]);
+                if (diff >= 0) {
+                    Contraction m2m = { a, b, diff };
+                    _m2mTable.push_back(m2m);
+
+                    Contraction l2l = { b, a, diff };
+                    _l2lTable.push_back(l2l);
+                }
+
+                // M2L: L_a += M_b * D_(a+b), truncated at |a| + |b| <= order.
+                int sum = indexOf(ta.n[0] + tb.n[0], ta.n[1] + tb.n[1], ta.n[2] + tb.n[2]);
+                if (sum >= 0) {
+                    Contraction m2l = { a, b, sum };
+                    _m2lTable.push_back(m2l);
+                }
+            }
+        }
+
+        // L2P: the gradient picks the L_(n+e_axis) coefficients.
+        _l2pTable.assign(numTerms * 3, -1);
+        for (int t = 0; t < numTerms; ++t) {
+            const Term& term = _terms[t];
+            _l2pTable[t * 3 + 0] = indexOf(term.n[0] + 1, term.n[1], term.n[2]);
+            _l2pTable[t * 3 + 1] = indexOf(term.n[0], term.n[1] + 1, term.n[2]);
+            _l2pTable[t * 3 + 2] = indexOf(term.n[0], term.n[1], term.n[2] + 1);
+        }
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemFMM::_monomials(const double v[3], double* out) const
+    {
+        out[0] = 1.0;
+        for (int t = 1; t < (int)_terms.size(); ++t) {
+            int axis = _termParentAxis[t];
+            out[t] = out[_termParent[t]] * v[axis] / _terms[t].n[axis];
+        }
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemFMM::_derivatives(const double r[3], double* out) const
+    {
+        // Recurrence for the derivatives of 1/|r|:
+        // |n| r^2 D_n = -(2|n| - 1) sum_i n_i r_i D_(n-e_i) - (|n| - 1) sum_i n_i (n_i - 1) D_(n-2e_i)
+        const int dim = _order + 1;
+        double r2 = r[0] * r[0] + r[1] * r[1] + r[2] * r[2];
+        double invR2 = 1.0 / r2;
+
+        out[0] = sqrt(invR2);
+        for (int t = 1; t < (int)_terms.size(); ++t) {
+            const Term& term = _terms[t];
+            double sum1 = 0;
+            double sum2 = 0;
+            for (int i = 0; i < 3; ++i) {
+                int ni = term.n[i];
+                if (ni == 0) continue;
+
+                int n[3] = { term.n[0], term.n[1], term.n[2] };
+                --n[i];
+                sum1 += ni * r[i] * out[_termIndex[(n[0] * dim + n[1]) * dim + n[2]]];
+
+                if (ni > 1) {
+                    --n[i];
+                    sum2 += ni * (ni - 1) * out[_termIndex[(n[0] * dim + n[1]) * dim + n[2]]];
+                }
+            }
+
+            out[t] = -((2 * term.order - 1) * sum1 + (term.order - 1) * sum2) * invR2 / term.order;
+        }
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemFMM::_computeNBodyGravitation()
+    {
+        if (_numBodies == 0) return;
+
+        _sortBodies();
+        _buildTree();
+
+        const int numTerms = (int)_terms.size();
+        _multipoles.assign(_cells.size() * numTerms, 0.0);
+        _locals.assign(_cells.size() * numTerms, 0.0);
+        _sortedAcc.assign(_numBodies * 3, 0.0);
+
+        _upwardPass(0);
+        _traverse(0, 0);
+        _downwardPass(0);
+
+        // Scatter back to the original body order. NBodySystemCPU stores
+        // forces, which _integrateNBodySystem() scales back by the inverse mass.
+        parallelFor(_numBodies, [&](int i) {
+            int body = _sortedToBody[i];
+            float mass = _pos[_currentRead][body * 4 + 3];
+            _force[body * 4 + 0] = (float)(_sortedAcc[i * 3 + 0] * mass);
+            _force[body * 4 + 1] = (float)(_sortedAcc[i * 3 + 1] * mass);
+            _force[body * 4 + 2] = (float)(_sortedAcc[i * 3 + 2] * mass);
+        });
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemFMM::_sortBodies()
+    {
+        const float* pos = _pos[_currentRead];
+
+        float minBounds[3] = { pos[0], pos[1], pos[2] };
+        float maxBounds[3] = { pos[0], pos[1], pos[2] };
+        for (int i = 1; i < _numBodies; ++i) {
+            for (int k = 0; k < 3; ++k) {
+                minBounds[k] = MIN(minBounds[k], pos[i * 4 + k]);
+                maxBounds[k] = MAX(maxBounds[k], pos[i * 4 + k]);
+            }
+        }
+
+        double extent = 0;
+        for (int k = 0; k < 3; ++k) {
+            _rootCenter[k] = 0.5 * ((double)minBounds[k] + maxBounds[k]);
+            extent = MAX(extent, (double)maxBounds[k] - minBounds[k]);
+        }
+        // Pad a little so that bodies on the max faces still quantize inside.
+        _rootHalfSize = MAX(0.5 * extent * 1.001, 1e-6);
+
+        _keys.resize(_numBodies);
+        _tempKeys.resize(_numBodies);
+        _sortedToBody.resize(_numBodies);
+        _tempSortedToBody.resize(_numBodies);
+
+        const double scale = (1 << MORTON_LEVELS) / (2.0 * _rootHalfSize);
+        const int maxCoord = (1 << MORTON_LEVELS) - 1;
+        parallelFor(_numBodies, [&](int i) {
+            uint32_t coords[3];
+            for (int k = 0; k < 3; ++k) {
+                int c = (int)((pos[i * 4 + k] - (_rootCenter[k] - _rootHalfSize)) * scale);
+                coords[k] = (uint32_t)MIN(MAX(c, 0), maxCoord);
+            }
+            _keys[i] = ofxMortonKey(coords[0], coords[1], coords[2]);
+            _sortedToBody[i] = i;
+        });
+
+        ofxRadixSortPairs(_keys.data(), _sortedToBody.data(), _numBodies, _tempKeys.data(), _tempSortedToBody.data(), 3 * MORTON_LEVELS);
+
+        _sortedPos.resize(_numBodies * 4);
+        _sortedSofteningSquared.resize(_numBodies);
+        parallelFor(_numBodies, [&](int i) {
+            memcpy(&_sortedPos[i * 4], &pos[_sortedToBody[i] * 4], 4 * sizeof(float));
+            _sortedSofteningSquared[i] = _bodySofteningSquared[_sortedToBody[i]];
+        });
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemFMM::_buildTree()
+    {
+        _cells.clear();
+
+        Cell root;
+        root.center[0] = _rootCenter[0];
+        root.center[1] = _rootCenter[1];
+        root.center[2] = _rootCenter[2];
+        root.halfSize = _rootHalfSize;
+        root.radius = 0;
+        root.bodyBegin = 0;
+        root.bodyEnd = _numBodies;
+        root.childBegin = 0;
+        root.numChildren = 0;
+        root.level = 0;
+        _cells.push_back(root);
+
+        // Build breadth first, one level at a time. Each level is split in
+        // parallel, then children are allocated contiguously after a prefix sum,
+        // which keeps the cell order deterministic.
+        std::vector<int> splits;
+        std::vector<int> childCounts;
+
+        int levelBegin = 0;
+        int levelEnd = 1;
+        while (levelBegin < levelEnd) {
+            const int levelSize = levelEnd - levelBegin;
+            splits.resize(levelSize * 9);
+            childCounts.resize(levelSize);
+
+            parallelFor(levelSize, [&](int i) {
+                const Cell& cell = _cells[levelBegin + i];
+                int* cellSplits = &splits[i * 9];
+
+                childCounts[i] = 0;
+                if (cell.bodyEnd - cell.bodyBegin <= _leafSize || cell.level >= MORTON_LEVELS) return;
+
+                // Keys share their prefix down to this level, so the octant digit
+                // is monotonic over the cell's range.
+                const uint64_t* keys = _keys.data();
+                cellSplits[0] = cell.bodyBegin;
+                for (int octant = 1; octant < 8; ++octant) {
+                    cellSplits[octant] = (int)(std::partition_point(keys + cellSplits[octant - 1], keys + cell.bodyEnd, [&](uint64_t key) {
+                        return octantAtLevel(key, cell.level) < octant;
+                    }) - keys);
+                }
+                cellSplits[8] = cell.bodyEnd;
+
+                for (int octant = 0; octant < 8; ++octant) {
+                    if (cellSplits[octant + 1] > cellSplits[octant]) {
+                        ++childCounts[i];
+                    }
+                }
+            });
+
+            int childBegin = (int)_cells.size();
+            for (int i = 0; i < levelSize; ++i) {
+                Cell& cell = _cells[levelBegin + i];
+                cell.childBegin = childBegin;
+                cell.numChildren = childCounts[i];
+                childBegin += childCounts[i];
+            }
+            _cells.resize(childBegin);
+
+            parallelFor(levelSize, [&](int i) {
+                const Cell& cell = _cells[levelBegin + i];
+                const int* cellSplits = &splits[i * 9];
+
+                int childIdx = cell.childBegin;
+                for (int octant = 0; cell.numChildren && octant < 8; ++octant) {
+                    if (cellSplits[octant + 1] == cellSplits[octant]) continue;
+
+                    Cell& child = _cells[childIdx++];
+                    child.halfSize = 0.5 * cell.halfSize;
+                    // ofxMortonKey() puts x in the high bit of each octant digit.
+                    child.center[0] = cell.center[0] + ((octant & 4) ? child.halfSize : -child.halfSize);
+                    child.center[1] = cell.center[1] + ((octant & 2) ? child.halfSize : -child.halfSize);
+                    child.center[2] = cell.center[2] + ((octant & 1) ? child.halfSize : -child.halfSize);
+                    child.radius = 0;
+                    child.bodyBegin = cellSplits[octant];
+                    child.bodyEnd = cellSplits[octant + 1];
+                    child.childBegin = 0;
+                    child.numChildren = 0;
+                    child.level = cell.level + 1;
+                }
+            });
+
+            levelBegin = levelEnd;
+            levelEnd = (int)_cells.size();
+        }
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemFMM::_upwardPass(int cellIdx)
+    {
+        Cell& cell = _cells[cellIdx];
+
+        if (cell.numChildren == 0) {
+            double radius2 = 0;
+            for (int i = cell.bodyBegin; i < cell.bodyEnd; ++i) {
+                double dx = _sortedPos[i * 4 + 0] - cell.center[0];
+                double dy = _sortedPos[i * 4 + 1] - cell.center[1];
+                double dz = _sortedPos[i * 4 + 2] - cell.center[2];
+                radius2 = MAX(radius2, dx * dx + dy * dy + dz * dz);
+            }
+            cell.radius = sqrt(radius2);
+
+            _p2m(cellIdx);
+            return;
+        }
+
+        if (cell.bodyEnd - cell.bodyBegin > _leafSize * 8) {
+            parallelTasks(cell.numChildren, [&](int c) {
+                _upwardPass(cell.childBegin + c);
+            });
+        }
+        else {
+            for (int c = 0; c < cell.numChildren; ++c) {
+                _upwardPass(cell.childBegin + c);
+            }
+        }
+
+        cell.radius = 0;
+        for (int c = 0; c < cell.numChildren; ++c) {
+            const Cell& child = _cells[cell.childBegin + c];
+            double dx = child.center[0] - cell.center[0];
+            double dy = child.center[1] - cell.center[1];
+            double dz = child.center[2] - cell.center[2];
+            cell.radius = MAX(cell.radius, sqrt(dx * dx + dy * dy + dz * dz) + child.radius);
+
+            _m2m(cellIdx, cell.childBegin + c);
+        }
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemFMM::_traverse(int targetIdx, int sourceIdx)
+    {
+        const Cell& target = _cells[targetIdx];
+        const Cell& source = _cells[sourceIdx];
+
+        double dx = target.center[0] - source.center[0];
+        double dy = target.center[1] - source.center[1];
+        double dz = target.center[2] - source.center[2];
+        double dist2 = dx * dx + dy * dy + dz * dz;
+        double radii = target.radius + source.radius;
+
+        if (radii * radii < _theta * _theta * dist2) {
+            _m2l(targetIdx, sourceIdx);
+        }
+        else if (target.numChildren == 0 && source.numChildren == 0) {
+            _p2p(targetIdx, sourceIdx);
+        }
+        else if (source.numChildren == 0 || (target.numChildren > 0 && target.radius >= source.radius)) {
+            // Splitting the target only ever writes to disjoint subtrees, so the
+            // children can run concurrently. parallelTasks() waits for all of
+            // them, which keeps later calls on the same target serialized.
+            if (target.bodyEnd - target.bodyBegin > _leafSize * 8) {
+                parallelTasks(target.numChildren, [&](int c) {
+                    _traverse(target.childBegin + c, sourceIdx);
+                });
+            }
+            else {
+                for (int c = 0; c < target.numChildren; ++c) {
+                    _traverse(target.childBegin + c, sourceIdx);
+                }
+            }
+        }
+        else {
+            for (int c = 0; c < source.numChildren; ++c) {
+                _traverse(targetIdx, source.childBegin + c);
+            }
+        }
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemFMM::_downwardPass(int cellIdx)
+    {
+        const Cell& cell = _cells[cellIdx];
+
+        if (cell.numChildren == 0) {
+            _l2p(cellIdx);
+            return;
+        }
+
+        auto visitChild = [&](int c) {
+            _l2l(cellIdx, cell.childBegin + c);
+            _downwardPass(cell.childBegin + c);
+        };
+
+        if (cell.bodyEnd - cell.bodyBegin > _leafSize * 8) {
+            parallelTasks(cell.numChildren, visitChild);
+        }
+        else {
+            for (int c = 0; c < cell.numChildren; ++c) {
+                visitChild(c);
+            }
+        }
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemFMM::_p2m(int cellIdx)
+    {
+        const Cell& cell = _cells[cellIdx];
+        const int numTerms = (int)_terms.size();
+        double* multipole = &_multipoles[cellIdx * numTerms];
+
+        double mono[256];
+        for (int i = cell.bodyBegin; i < cell.bodyEnd; ++i) {
+            const float* body = &_sortedPos[i * 4];
+            double d[3] = {
+                cell.center[0] - body[0],
+                cell.center[1] - body[1],
+                cell.center[2] - body[2]
+            };
+            _monomials(d, mono);
+
+            for (int t = 0; t < numTerms; ++t) {
+                multipole[t] += body[3] * mono[t];
+            }
+        }
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemFMM::_m2m(int parentIdx, int childIdx)
+    {
+        const Cell& parent = _cells[parentIdx];
+        const Cell& child = _cells[childIdx];
+        const int numTerms = (int)_terms.size();
+
+        double d[3] = {
+            parent.center[0] - child.center[0],
+            parent.center[1] - child.center[1],
+            parent.center[2] - child.center[2]
+        };
+        double mono[256];
+        _monomials(d, mono);
+
+        double* out = &_multipoles[parentIdx * numTerms];
+        const double* in = &_multipoles[childIdx * numTerms];
+        for (const Contraction& c : _m2mTable) {
+            out[c.a] += in[c.b] * mono[c.c];
+        }
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemFMM::_m2l(int targetIdx, int sourceIdx)
+    {
+        const Cell& target = _cells[targetIdx];
+        const Cell& source = _cells[sourceIdx];
+        const int numTerms = (int)_terms.size();
+
+        double r[3] = {
+            target.center[0] - source.center[0],
+            target.center[1] - source.center[1],
+            target.center[2] - source.center[2]
+        };
+        double deriv[256];
+        _derivatives(r, deriv);
+
+        double* out = &_locals[targetIdx * numTerms];
+        const double* in = &_multipoles[sourceIdx * numTerms];
+        for (const Contraction& c : _m2lTable) {
+            out[c.a] += in[c.b] * deriv[c.c];
+        }
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemFMM::_l2l(int parentIdx, int childIdx)
+    {
+        const Cell& parent = _cells[parentIdx];
+        const Cell& child = _cells[childIdx];
+        const int numTerms = (int)_terms.size();
+
+        double s[3] = {
+            child.center[0] - parent.center[0],
+            child.center[1] - parent.center[1],
+            child.center[2] - parent.center[2]
+        };
+        double mono[256];
+        _monomials(s, mono);
+
+        double* out = &_locals[childIdx * numTerms];
+        const double* in = &_locals[parentIdx * numTerms];
+        for (const Contraction& c : _l2lTable) {
+            out[c.a] += in[c.b] * mono[c.c];
+        }
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemFMM::_l2p(int cellIdx)
+    {
+        const Cell& cell = _cells[cellIdx];
+        const int numTerms = (int)_terms.size();
+        const double* local = &_locals[cellIdx * numTerms];
+
+        double mono[256];
+        for (int i = cell.bodyBegin; i < cell.bodyEnd; ++i) {
+            const float* body = &_sortedPos[i * 4];
+            double d[3] = {
+                body[0] - cell.center[0],
+                body[1] - cell.center[1],
+                body[2] - cell.center[2]
+            };
+            _monomials(d, mono);
+
+            double acc[3] = { 0, 0, 0 };
+            for (int t = 0; t < numTerms; ++t) {
+                for (int k = 0; k < 3; ++k) {
+                    int grad = _l2pTable[t * 3 + k];
+                    if (grad >= 0) {
+                        acc[k] += local[grad] * mono[t];
+                    }
+                }
+            }
+
+            _sortedAcc[i * 3 + 0] += acc[0];
+            _sortedAcc[i * 3 + 1] += acc[1];
+            _sortedAcc[i * 3 + 2] += acc[2];
+        }
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemFMM::_p2p(int targetIdx, int sourceIdx)
+    {
+        const Cell& target = _cells[targetIdx];
+        const Cell& source = _cells[sourceIdx];
+        const float* pos = _sortedPos.data();
+
+        for (int i = target.bodyBegin; i < target.bodyEnd; ++i) {
+            const float* bodyI = &pos[i * 4];
+            float acc[3] = { 0, 0, 0 };
+
+            for (int j = source.bodyBegin; j < source.bodyEnd; ++j) {
+                const float* bodyJ = &pos[j * 4];
+
+                float r[3];
+                r[0] = bodyJ[0] - bodyI[0];
+                r[1] = bodyJ[1] - bodyI[1];
+                r[2] = bodyJ[2] - bodyI[2];
+
+                float softeningSquared = 0.5f * (_sortedSofteningSquared[i] + _sortedSofteningSquared[j]);
+                float distSqr = r[0] * r[0] + r[1] * r[1] + r[2] * r[2] + softeningSquared;
+                float invDist = 1.0f / sqrtf(distSqr);
+                float s = bodyJ[3] * invDist * invDist * invDist;
+
+                acc[0] += r[0] * s;
+                acc[1] += r[1] * s;
+                acc[2] += r[2] * s;
+            }
+
+            _sortedAcc[i * 3 + 0] += acc[0];
+            _sortedAcc[i * 3 + 1] += acc[1];
+            _sortedAcc[i * 3 + 2] += acc[2];
+        }
+    }
+
+    //--------------------------------------------------------------
+    float NBodySystemFMM::validate()
+    {
+        if (!_bInitialized || _numBodies == 0) return 0.0f;
+
+        synchronizeThreads();
+
+        // Both store m_i * sum(m_j * r / d^3), so the direct sum is the reference.
+        NBodySystemCPU::_computeNBodyGravitation();
+        std::vector<float> reference(_force, _force + _numBodies * 4);
+
+        _computeNBodyGravitation();
+
+        double errorSq = 0;
+        double normSq = 0;
+        for (int i = 0; i < _numBodies; ++i) {
+            for (int k = 0; k < 3; ++k) {
+                double diff = (double)_force[i * 4 + k] - reference[i * 4 + k];
+                errorSq += diff * diff;
+                normSq += (double)reference[i * 4 + k] * reference[i * 4 + k];
+            }
+        }
+
+        float error = (normSq > 0) ? (float)sqrt(errorSq / normSq) : 0.0f;
+        ofLogNotice("NBodySystemFMM::validate", "Order %d, theta %.2f, %d cells: RMS relative error %g", _order, _theta, (int)_cells.size(), error);
+        return error;
+    }
+}
@@ -0,0 +1,135 @@
+//
+//  NBodySystemFMM.h
+//  PartyCL
+//
+//  Fast Multipole Method solver. Bodies are sorted along a Morton curve, an
+//  adaptive octree is built on top of the sorted order, and forces are
+//  evaluated with Cartesian Taylor expansions (P2M, M2M, M2L, L2L, L2P)
+//  through a dual tree traversal. Near field interactions fall back to the
+//  same softened P2P kernel as NBodySystemCPU.
+//
+
+#pragma once
+
+#include "NBodySystemCPU.h"
+
+namespace entropy
+{
+    class NBodySystemFMM
+    : public NBodySystemCPU
+    {
+    public:
+        NBodySystemFMM(int numBodies, int order = 4, float theta = 0.6f, int leafSize = 64, UploadAllocator* uploadAllocator = nullptr);
+        virtual ~NBodySystemFMM();
+
+        // Highest multipole / local expansion order (1 to MAX_ORDER).
+        void setExpansionOrder(int order);
+        int getExpansionOrder() const
+        { return _order; }
+
+        // Multipole acceptance criterion, (rA + rB) < theta * distance.
+        void setOpeningAngle(float theta)
+        { _theta = theta; }
+        float getOpeningAngle() const
+        { return _theta; }
+
+        // Maximum number of bodies in a leaf cell.
+        void setLeafSize(int leafSize)
+        { _leafSize = MAX(1, leafSize); }
+        int getLeafSize() const
+        { return _leafSize; }
+
+        int getNumCells() const
+        { return (int)_cells.size(); }
+
+        // Computes forces for the current state with both the FMM and the
+        // direct sum from NBodySystemCPU and returns the RMS relative error.
+        // O(N^2), only meant for small N.
+        float validate();
+
+        static const int MAX_ORDER = 8;
+
+    protected: // methods
+        virtual void _computeNBodyGravitation();
+
+        void _buildExpansionTables();
+
+        void _sortBodies();
+        void _buildTree();
+        void _upwardPass(int cellIdx);
+        void _traverse(int targetIdx, int sourceIdx);
+        void _downwardPass(int cellIdx);
+
+        void _p2m(int cellIdx);
+        void _m2m(int parentIdx, int childIdx);
+        void _m2l(int targetIdx, int sourceIdx);
+        void _l2l(int parentIdx, int childIdx);
+        void _l2p(int cellIdx);
+        void _p2p(int targetIdx, int sourceIdx);
+
+        // Fills out[t] = v^t / t! for every expansion term t.
+        void _monomials(const double v[3], double* out) const;
+        // Fills out[t] = d^t (1/|r|) for every expansion term t.
+        void _derivatives(const double r[3], double* out) const;
+
+    protected: // data
+        struct Cell
+        {
+            double center[3];
+            double halfSize;
+            double radius;
+
+            int bodyBegin;
+            int bodyEnd;
+
+            int childBegin;
+            int numChildren;
+
+            int level;
+        };
+
+        struct Term
+        {
+            int n[3];
+            int order;
+        };
+
+        // Triplets used to apply the translation operators:
+        // out[a] += in[b] * factor[c].
+        struct Contraction
+        {
+            int a;
+            int b;
+            int c;
+        };
+
+        int _order;
+        float _theta;
+        int _leafSize;
+
+        std::vector<Term> _terms;
+        std::vector<int> _termIndex;
+        std::vector<int> _termParent;
+        std::vector<int> _termParentAxis;
+        std::vector<Contraction> _m2mTable;
+        std::vector<Contraction> _m2lTable;
+        std::vector<Contraction> _l2lTable;
+        std::vector<int> _l2pTable;
+
+        std::vector<uint64_t> _keys;
+        std::vector<uint64_t> _tempKeys;
+        std::vector<uint32_t> _sortedToBody;
+        std::vector<uint32_t> _tempSortedToBody;
+
+        std::vector<float> _sortedPos;
+        std::vector<float> _sortedSofteningSquared;
+        std::vector<double> _sortedAcc;
+
+        std::vector<Cell> _cells;
+        std::vector<double> _multipoles;
+        std::vector<double> _locals;
+
+        double _rootCenter[3];
+        double _rootHalfSize;
+    };
+}
@@ -8,6 +8,8 @@
 
 #include "NBodySystemOpenCL.h"
 
+#include "ofxProfiler.h"
+
 namespace entropy
 {
     //--------------------------------------------------------------
@@ -107,6 +109,9 @@ namespace entropy
     {
         if (!_bInitialized) return;
 
+        // Only measures the enqueue, the kernel runs asynchronously.
+        OFX_PROFILE_SCOPE("update");
+
         _integrateNBodySystem(deltaTime);
 //        _bufferCL[_currentWrite].readFromDevice();
 //        _opencl.finish();
@@ -188,7 +193,7 @@ namespace entropy
         // threads per body and 256 threads per block. There will be n/p = 16
         // blocks, so a G80 GPU will be 100% utilized.
         msa::OpenCLKernelPtr kernel;
-        if (_q == 1) {
+        if (_q > 1) {
             kernel = _kernelMT;
         }
         else {
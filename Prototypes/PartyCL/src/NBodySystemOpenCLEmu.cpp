@@ -0,0 +1,208 @@
+//
+//  NBodySystemOpenCLEmu.cpp
+//  PartyCL
+//
+
+#include "NBodySystemOpenCLEmu.h"
+
+#include "OpenCLEmu.h"
+
+#include "ofxProfiler.h"
+
+namespace entropy
+{
+    // Ports of the helpers in cl/oclNbodyKernel.cl, keep them in sync.
+
+    //--------------------------------------------------------------
+    static inline CLFloat3 bodyBodyInteraction(CLFloat3 ai, CLFloat4 bi, CLFloat4 bj, float softeningSquared)
+    {
+        CLFloat3 r;
+
+        // r_ij  [3 FLOPS]
+        r.x = bi.x - bj.x;
+        r.y = bi.y - bj.y;
+        r.z = bi.z - bj.z;
+
+        // distSqr = dot(r_ij, r_ij) + EPS^2  [6 FLOPS]
+        float distSqr = r.x * r.x + r.y * r.y + r.z * r.z;
+        distSqr += softeningSquared;
+
+        // invDistCube =1/distSqr^(3/2)  [4 FLOPS (2 mul, 1 sqrt, 1 inv)]
+        float invDist = 1.0f / sqrtf(distSqr);
+        float invDistCube = invDist * invDist * invDist;
+
+        // s = m_j * invDistCube [1 FLOP]
+        float s = bj.w * invDistCube;
+
+        // a_i =  a_i + s * r_ij [6 FLOPS]
+        ai.x += r.x * s;
+        ai.y += r.y * s;
+        ai.z += r.z * s;
+
+        return ai;
+    }
+
+    //--------------------------------------------------------------
+    // The "tile_calculation" function from the GPUG3 article, over the row of
+    // local memory that belongs to the work-item.
+    static inline CLFloat3 gravitation(CLFloat4 myPos, CLFloat3 accel, float softeningSquared, const CLFloat4* sharedPos, const CLWorkGroup& group, const CLWorkItem& item)
+    {
+        const unsigned int blockDimx = group.getLocalSize(0);
+        const CLFloat4* row = &sharedPos[blockDimx * item.localId[1]];
+        for (unsigned int i = 0; i < blockDimx; ++i) {
+            accel = bodyBodyInteraction(accel, row[i], myPos, softeningSquared);
+        }
+        return accel;
+    }
+
+    //--------------------------------------------------------------
+    // Mod without divide, works on values from 0 up to 2m.
+    static inline unsigned int wrap(unsigned int x, unsigned int m)
+    {
+        return (x < m) ? x : x - m;
+    }
+
+    //--------------------------------------------------------------
+    // integrateBodies_MT when multithreadBodies is set, integrateBodies_noMT
+    // otherwise. Also stores force = accel * mass, for getForces().
+    static void integrateBodies(const CLWorkGroup& group, bool multithreadBodies,
+                                CLFloat4* newPos, CLFloat4* newVel, const CLFloat4* oldPos, const CLFloat4* oldVel,
+                                float deltaTime, float damping, float softeningSquared, int numBodies,
+                                float* force, float* upload)
+    {
+        const unsigned int blockIdxx = group.getGroupId(0);
+        const unsigned int blockIdxy = group.getGroupId(1);
+        const unsigned int gridDimx = group.getNumGroups(0);
+        const unsigned int blockDimx = group.getLocalSize(0);
+        const unsigned int blockDimy = group.getLocalSize(1);
+        const unsigned int numTiles = numBodies / (blockDimx * blockDimy);
+
+        CLFloat4* sharedPos = group.getLocal<CLFloat4>();
+
+        // Private registers of each work-item.
+        std::vector<CLFloat4> pos(group.getNumItems());
+        std::vector<CLFloat3> acc(group.getNumItems());
+
+        group.forEachItem([&](const CLWorkItem& item) {
+            unsigned int index = blockIdxx * blockDimx + item.localId[0];
+            pos[item.linearId] = oldPos[index];
+            acc[item.linearId] = { 0.0f, 0.0f, 0.0f };
+        });
+
+        for (unsigned int tile = blockIdxy; tile < numTiles + blockIdxy; ++tile) {
+            group.forEachItem([&](const CLWorkItem& item) {
+                unsigned int tx = item.localId[0];
+                unsigned int ty = item.localId[1];
+                unsigned int block = multithreadBodies ? (blockIdxx + blockDimy * tile + ty) : (blockIdxx + tile);
+                sharedPos[tx + blockDimx * ty] = oldPos[wrap(block, gridDimx) * blockDimx + tx];
+            });
+
+            // barrier(CLK_LOCAL_MEM_FENCE);
+
+            group.forEachItem([&](const CLWorkItem& item) {
+                acc[item.linearId] = gravitation(pos[item.linearId], acc[item.linearId], softeningSquared, sharedPos, group, item);
+            });
+
+            // barrier(CLK_LOCAL_MEM_FENCE);
+        }
+
+        if (multithreadBodies) {
+            // Each row summed 1/q of the tiles, row 0 adds up the partial sums.
+            group.forEachItem([&](const CLWorkItem& item) {
+                const CLFloat3& a = acc[item.linearId];
+                sharedPos[item.localId[0] + blockDimx * item.localId[1]] = { a.x, a.y, a.z, 0.0f };
+            });
+
+            // barrier(CLK_LOCAL_MEM_FENCE);
+
+            group.forEachItem([&](const CLWorkItem& item) {
+                if (item.localId[1] != 0) return;
+
+                CLFloat3& a = acc[item.linearId];
+                for (unsigned int i = 1; i < blockDimy; ++i) {
+                    const CLFloat4& partial = sharedPos[item.localId[0] + blockDimx * i];
+                    a.x += partial.x;
+                    a.y += partial.y;
+                    a.z += partial.z;
+                }
+            });
+        }
+
+        group.forEachItem([&](const CLWorkItem& item) {
+            if (item.localId[1] != 0) return;
+
+            unsigned int index = blockIdxx * blockDimx + item.localId[0];
+            CLFloat4 p = pos[item.linearId];
+            const CLFloat3& accel = acc[item.linearId];
+
+            // acceleration = force \ mass;
+            // new velocity = old velocity + acceleration * deltaTime
+            // note we factor out the body's mass from the equation, here and in bodyBodyInteraction
+            // (because they cancel out).  Thus here force == acceleration
+            CLFloat4 vel = oldVel[index];
+
+            vel.x += accel.x * deltaTime;
+            vel.y += accel.y * deltaTime;
+            vel.z += accel.z * deltaTime;
+
+            vel.x *= damping;
+            vel.y *= damping;
+            vel.z *= damping;
+
+            // new position = old position + velocity * deltaTime
+            p.x += vel.x * deltaTime;
+            p.y += vel.y * deltaTime;
+            p.z += vel.z * deltaTime;
+
+            // store new position and velocity
+            newPos[index] = p;
+            newVel[index] = vel;
+
+            force[index*4+0] = accel.x * p.w;
+            force[index*4+1] = accel.y * p.w;
+            force[index*4+2] = accel.z * p.w;
+
+            if (upload) {
+                memcpy(&upload[index*4], &p, 4*sizeof(float));
+            }
+        });
+    }
+
+    //--------------------------------------------------------------
+    NBodySystemOpenCLEmu::NBodySystemOpenCLEmu(int numBodies, unsigned int p, unsigned int q, UploadAllocator* uploadAllocator)
+    : NBodySystemCPU(numBodies, uploadAllocator)
+    , _p(MAX(p, 1u))
+    , _q(MAX(q, 1u))
+    {
+        _bValidWorkGroup = (numBodies % (_p * _q)) == 0;
+        if (!_bValidWorkGroup) {
+            ofLogError("NBodySystemOpenCLEmu", "%d bodies is not a multiple of p * q = %d, using the direct sum", numBodies, _p * _q);
+        }
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemOpenCLEmu::_step(float deltaTime, float* upload)
+    {
+        if (!_bValidWorkGroup) {
+            NBodySystemCPU::_step(deltaTime, upload);
+            return;
+        }
+
+        // Same launch as NBodySystemOpenCL: run2D(numBodies, q, p, q), with
+        // p * q float4 of local memory. q > 1 needs the multithreaded kernel.
+        bool multithreadBodies = (_q > 1);
+
+        CLFloat4* newPos = (CLFloat4 *)_pos[_currentWrite];
+        CLFloat4* newVel = (CLFloat4 *)_vel[_currentWrite];
+        const CLFloat4* oldPos = (const CLFloat4 *)_pos[_currentRead];
+        const CLFloat4* oldVel = (const CLFloat4 *)_vel[_currentRead];
+
+        // The kernel fuses force and integration.
+        OFX_PROFILE_SCOPE("kernel");
+        clEmuRun2D(_numBodies, _q, _p, _q, _p * _q * sizeof(CLFloat4), [&](const CLWorkGroup& group) {
+            integrateBodies(group, multithreadBodies, newPos, newVel, oldPos, oldVel, deltaTime, _damping, _softeningSquared, _numBodies, _force, upload);
+        });
+
+        std::swap(_currentRead, _currentWrite);
+    }
+}
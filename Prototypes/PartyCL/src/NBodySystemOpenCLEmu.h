@@ -0,0 +1,42 @@
+//
+//  NBodySystemOpenCLEmu.h
+//  PartyCL
+//
+//  The integrateBodies kernels of cl/oclNbodyKernel.cl, run on the CPU through
+//  OpenCLEmu. Work-groups are q rows of p work-items with the same tiling,
+//  local memory use and partial sum reduction as the OpenCL path, so p and q
+//  can be validated and benchmarked without a GPU. Positions are uploaded the
+//  same way as the other CPU systems.
+//
+//  Forces are direct and use a uniform softening, reordering, force
+//  accumulation and collision settings are ignored.
+//
+
+#pragma once
+
+#include "NBodySystemCPU.h"
+
+namespace entropy
+{
+    class NBodySystemOpenCLEmu
+    : public NBodySystemCPU
+    {
+    public:
+        // The body count must be a multiple of p * q, like the OpenCL kernel
+        // expects. Otherwise the direct CPU sum is used instead.
+        NBodySystemOpenCLEmu(int numBodies, unsigned int p, unsigned int q, UploadAllocator* uploadAllocator = nullptr);
+
+        unsigned int getP() const
+        { return _p; }
+        unsigned int getQ() const
+        { return _q; }
+
+    protected: // methods
+        virtual void _step(float deltaTime, float* upload);
+
+    protected: // data
+        unsigned int _p;
+        unsigned int _q;
+        bool _bValidWorkGroup;
+    };
+}
@@ -0,0 +1,380 @@
+//
+//  NBodySystemPM.cpp
+//  PartyCL
+//
+
+#include "NBodySystemPM.h"
+#include "Parallel.h"
+
+namespace entropy
+{
+    const float NBodySystemPM::CUTOFF_SCALE = 4.5f;
+
+    //--------------------------------------------------------------
+    static inline int wrapIndex(int i, int n)
+    {
+        i %= n;
+        return (i < 0) ? i + n : i;
+    }
+
+    //--------------------------------------------------------------
+    // Buckets body indices by key with a counting sort. start gets numKeys + 1
+    // offsets into bodies.
+    static void bucketBodies(const std::vector<int>& keys, int numKeys, std::vector<int>& start, std::vector<int>& bodies)
+    {
+        start.assign(numKeys + 1, 0);
+        for (int key : keys) {
+            ++start[key + 1];
+        }
+        for (int k = 0; k < numKeys; ++k) {
+            start[k + 1] += start[k];
+        }
+
+        bodies.resize(keys.size());
+        std::vector<int> offset(start.begin(), start.end() - 1);
+        for (int i = 0; i < (int)keys.size(); ++i) {
+            bodies[offset[keys[i]]++] = i;
+        }
+    }
+
+    //--------------------------------------------------------------
+    NBodySystemPM::NBodySystemPM(int numBodies, int gridSize, float boxSize, bool shortRange, UploadAllocator* uploadAllocator)
+    : NBodySystemCPU(numBodies, uploadAllocator)
+    , _gridSize(0)
+    , _boxSize(MAX(boxSize, 1e-3f))
+    , _bShortRange(shortRange)
+    , _splitScale(1.25f)
+    , _chainSize(0)
+    {
+        setGridSize(gridSize);
+    }
+
+    //--------------------------------------------------------------
+    NBodySystemPM::~NBodySystemPM()
+    {
+        // Stop the simulation thread before the mesh goes away.
+        setThreaded(false);
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemPM::setGridSize(int gridSize)
+    {
+        int size = 2;
+        while (size < gridSize) size *= 2;
+        if (size == _gridSize) return;
+
+        synchronizeThreads();
+
+        _gridSize = size;
+        _fft.setup(_gridSize);
+
+        const int numCells = _gridSize * _gridSize * _gridSize;
+        _potential.resize(numCells);
+        _density.resize(numCells);
+        for (int k = 0; k < 3; ++k) {
+            _meshForce[k].resize(numCells);
+        }
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemPM::_computeNBodyGravitation()
+    {
+        _wrapPositions();
+
+        _depositMass();
+        _solvePotential();
+        _computeMeshForces();
+        _interpolateForces();
+
+        if (_bShortRange) {
+            _addShortRangeForces();
+        }
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemPM::_wrapPositions()
+    {
+        float* pos = _pos[_currentRead];
+        const float halfBox = _boxSize * 0.5f;
+
+        parallelFor(_numBodies, [&](int i) {
+            for (int k = 0; k < 3; ++k) {
+                float& x = pos[i * 4 + k];
+                if (x < -halfBox || x >= halfBox) {
+                    x -= _boxSize * floorf((x + halfBox) / _boxSize);
+                    // Rounding can land exactly on the upper edge.
+                    if (x >= halfBox) x -= _boxSize;
+                }
+            }
+        });
+    }
+
+    //--------------------------------------------------------------
+    inline void NBodySystemPM::_cloudInCell(const float* pos, int cell[3], float frac[3]) const
+    {
+        const float cellsPerUnit = _gridSize / _boxSize;
+        for (int k = 0; k < 3; ++k) {
+            // Cell centers sit at (i + 0.5) * cellSize from the box corner.
+            float u = (pos[k] + _boxSize * 0.5f) * cellsPerUnit - 0.5f;
+            float lower = floorf(u);
+            frac[k] = u - lower;
+            cell[k] = wrapIndex((int)lower, _gridSize);
+        }
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemPM::_depositMass()
+    {
+        const int n = _gridSize;
+        const float* pos = _pos[_currentRead];
+
+        std::vector<int> slabs(_numBodies);
+        parallelFor(_numBodies, [&](int i) {
+            int cell[3];
+            float frac[3];
+            _cloudInCell(&pos[i * 4], cell, frac);
+            slabs[i] = cell[0];
+        });
+        bucketBodies(slabs, n, _slabStart, _slabBodies);
+
+        std::fill(_density.begin(), _density.end(), 0.0f);
+
+        // A body in slab s writes to slabs s and s + 1, so even and odd slabs
+        // each form a conflict free batch. The grid size is a power of two, so
+        // the wrap from the last slab to the first keeps the parity.
+        const float cellVolume = powf(_boxSize / n, 3.0f);
+        for (int parity = 0; parity < 2; ++parity) {
+            parallelFor(n / 2, [&](int idx) {
+                int slab = idx * 2 + parity;
+                for (int b = _slabStart[slab]; b < _slabStart[slab + 1]; ++b) {
+                    int body = _slabBodies[b];
+                    int cell[3];
+                    float frac[3];
+                    _cloudInCell(&pos[body * 4], cell, frac);
+
+                    float density = pos[body * 4 + 3] / cellVolume;
+                    for (int dz = 0; dz < 2; ++dz) {
+                        int z = (cell[2] + dz) & (n - 1);
+                        float wz = dz ? frac[2] : 1.0f - frac[2];
+                        for (int dy = 0; dy < 2; ++dy) {
+                            int y = (cell[1] + dy) & (n - 1);
+                            float wy = dy ? frac[1] : 1.0f - frac[1];
+                            for (int dx = 0; dx < 2; ++dx) {
+                                int x = (cell[0] + dx) & (n - 1);
+                                float wx = dx ? frac[0] : 1.0f - frac[0];
+                                _density[(z * n + y) * n + x] += density * wx * wy * wz;
+                            }
+                        }
+                    }
+                }
+            });
+        }
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemPM::_solvePotential()
+    {
+        const int n = _gridSize;
+
+        parallelFor(n * n, [&](int line) {
+            for (int x = 0; x < n; ++x) {
+                int idx = line * n + x;
+                _potential[idx] = FFT3D::Complex(_density[idx], 0.0f);
+            }
+        });
+
+        _fft.forward(_potential.data());
+
+        // phi_k = -4 pi G rho_k / k^2 with G = 1, divided by the CIC window
+        // twice (deposit and interpolation). The mean density (k = 0) is
+        // dropped, as usual for a periodic box. For P3M the long range part is
+        // smoothed by exp(-k^2 rs^2) and the rest is summed directly.
+        const float cellSize = _boxSize / n;
+        const float rs = _splitScale * cellSize;
+        const float fundamental = 2.0f * PI / _boxSize;
+
+        parallelFor(n * n, [&](int line) {
+            int iz = line / n;
+            int iy = line % n;
+            float kz = fundamental * ((iz <= n / 2) ? iz : iz - n);
+            float ky = fundamental * ((iy <= n / 2) ? iy : iy - n);
+
+            auto window = [&](float k) {
+                float arg = 0.5f * k * cellSize;
+                float sinc = (arg == 0.0f) ? 1.0f : sinf(arg) / arg;
+                return sinc * sinc;
+            };
+            float wyz = window(ky) * window(kz);
+
+            for (int ix = 0; ix < n; ++ix) {
+                int idx = line * n + ix;
+                float kx = fundamental * ((ix <= n / 2) ? ix : ix - n);
+                float k2 = kx * kx + ky * ky + kz * kz;
+                if (k2 == 0.0f) {
+                    _potential[idx] = 0.0f;
+                    continue;
+                }
+
+                float w = window(kx) * wyz;
+                float green = -4.0f * PI / (k2 * w * w);
+                if (_bShortRange) {
+                    green *= expf(-k2 * rs * rs);
+                }
+                _potential[idx] *= green;
+            }
+        });
+
+        _fft.inverse(_potential.data());
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemPM::_computeMeshForces()
+    {
+        const int n = _gridSize;
+        const int mask = n - 1;
+        const float scale = -1.0f / (2.0f * _boxSize / n);
+
+        // a = -grad(phi), two point central differences.
+        parallelFor(n * n, [&](int line) {
+            int z = line / n;
+            int y = line % n;
+            for (int x = 0; x < n; ++x) {
+                int idx = (z * n + y) * n + x;
+                _meshForce[0][idx] = scale * (_potential[(z * n + y) * n + ((x + 1) & mask)].real() - _potential[(z * n + y) * n + ((x - 1) & mask)].real());
+                _meshForce[1][idx] = scale * (_potential[(z * n + ((y + 1) & mask)) * n + x].real() - _potential[(z * n + ((y - 1) & mask)) * n + x].real());
+                _meshForce[2][idx] = scale * (_potential[(((z + 1) & mask) * n + y) * n + x].real() - _potential[(((z - 1) & mask) * n + y) * n + x].real());
+            }
+        });
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemPM::_interpolateForces()
+    {
+        const int n = _gridSize;
+        const float* pos = _pos[_currentRead];
+
+        parallelFor(_numBodies, [&](int i) {
+            int cell[3];
+            float frac[3];
+            _cloudInCell(&pos[i * 4], cell, frac);
+
+            float acc[3] = { 0.0f, 0.0f, 0.0f };
+            for (int dz = 0; dz < 2; ++dz) {
+                int z = (cell[2] + dz) & (n - 1);
+                float wz = dz ? frac[2] : 1.0f - frac[2];
+                for (int dy = 0; dy < 2; ++dy) {
+                    int y = (cell[1] + dy) & (n - 1);
+                    float wy = dy ? frac[1] : 1.0f - frac[1];
+                    for (int dx = 0; dx < 2; ++dx) {
+                        int x = (cell[0] + dx) & (n - 1);
+                        float w = (dx ? frac[0] : 1.0f - frac[0]) * wy * wz;
+                        int idx = (z * n + y) * n + x;
+                        acc[0] += _meshForce[0][idx] * w;
+                        acc[1] += _meshForce[1][idx] * w;
+                        acc[2] += _meshForce[2][idx] * w;
+                    }
+                }
+            }
+
+            // The integrator expects force, it multiplies by the inverse mass.
+            float mass = pos[i * 4 + 3];
+            _force[i * 4 + 0] = acc[0] * mass;
+            _force[i * 4 + 1] = acc[1] * mass;
+            _force[i * 4 + 2] = acc[2] * mass;
+        });
+    }
+
+    //--------------------------------------------------------------
+    void NBodySystemPM::_addShortRangeForces()
+    {
+        const float* pos = _pos[_currentRead];
+        const float rs = _splitScale * _boxSize / _gridSize;
+        const float cutoff = CUTOFF_SCALE * rs;
+        const float cutoffSquared = cutoff * cutoff;
+
+        // Chaining cells at least one cutoff wide, and at least 3 per axis so
+        // the 27 neighbors are distinct. This assumes the cutoff is under a
+        // third of the box, i.e. a grid of 16 cells or more.
+        _chainSize = MAX(3, (int)floorf(_boxSize / cutoff));
+        const int m = _chainSize;
+        const float cellsPerUnit = m / _boxSize;
+
+        std::vector<int> cells(_numBodies);
+        parallelFor(_numBodies, [&](int i) {
+            int c[3];
+            for (int k = 0; k < 3; ++k) {
+                c[k] = MIN((int)((pos[i * 4 + k] + _boxSize * 0.5f) * cellsPerUnit), m - 1);
+            }
+            cells[i] = (c[2] * m + c[1]) * m + c[0];
+        });
+        bucketBodies(cells, m * m * m, _chainStart, _chainBodies);
+
+        // Short range factor erfc(d / 2rs) + d / (rs sqrt(pi)) exp(-d^2 / 4rs^2),
+        // the complement of the mesh smoothing, tabulated over [0, cutoff].
+        // In units of the cutoff it does not depend on rs.
+        if (_splitTable.empty()) {
+            _splitTable.resize(SPLIT_TABLE_SIZE + 1);
+            for (int t = 0; t <= SPLIT_TABLE_SIZE; ++t) {
+                double u = CUTOFF_SCALE * 0.5 * t / SPLIT_TABLE_SIZE;
+                _splitTable[t] = (float)(erfc(u) + 2.0 * u / sqrt(PI) * exp(-u * u));
+            }
+        }
+
+        const float halfBox = _boxSize * 0.5f;
+        const float tableScale = SPLIT_TABLE_SIZE / cutoff;
+
+        parallelFor(_numBodies, [&](int i) {
+            const float* pi = &pos[i * 4];
+            int cell = cells[i];
+            int cx = cell % m;
+            int cy = (cell / m) % m;
+            int cz = cell / (m * m);
+
+            float acc[3] = { 0.0f, 0.0f, 0.0f };
+            for (int dz = -1; dz <= 1; ++dz) {
+                int z = wrapIndex(cz + dz, m);
+                for (int dy = -1; dy <= 1; ++dy) {
+                    int y = wrapIndex(cy + dy, m);
+                    for (int dx = -1; dx <= 1; ++dx) {
+                        int x = wrapIndex(cx + dx, m);
+                        int neighbor = (z * m + y) * m + x;
+
+                        for (int b = _chainStart[neighbor]; b < _chainStart[neighbor + 1]; ++b) {
+                            int j = _chainBodies[b];
+                            if (j == i) continue;
+
+                            // Nearest periodic image.
+                            float r[3];
+                            for (int k = 0; k < 3; ++k) {
+                                r[k] = pos[j * 4 + k] - pi[k];
+                                if (r[k] >= halfBox) r[k] -= _boxSize;
+                                else if (r[k] < -halfBox) r[k] += _boxSize;
+                            }
+
+                            float distSqr = r[0] * r[0] + r[1] * r[1] + r[2] * r[2];
+                            if (distSqr >= cutoffSquared) continue;
+
+                            // Newtonian softened force times the split factor.
+                            float t = sqrtf(distSqr) * tableScale;
+                            int ti = MIN((int)t, SPLIT_TABLE_SIZE - 1);
+                            float split = _splitTable[ti] + (_splitTable[ti + 1] - _splitTable[ti]) * (t - ti);
+
+                            float softDistSqr = distSqr + _pairSofteningSquared(i, j);
+                            float invDist = 1.0f / sqrtf(softDistSqr);
+                            float s = pos[j * 4 + 3] * invDist * invDist * invDist * split;
+
+                            acc[0] += r[0] * s;
+                            acc[1] += r[1] * s;
+                            acc[2] += r[2] * s;
+                        }
+                    }
+                }
+            }
+
+            float mass = pi[3];
+            _force[i * 4 + 0] += acc[0] * mass;
+            _force[i * 4 + 1] += acc[1] * mass;
+            _force[i * 4 + 2] += acc[2] * mass;
+        });
+    }
+}
@@ -0,0 +1,92 @@
+//
+//  NBodySystemPM.h
+//  PartyCL
+//
+//  Particle-Mesh gravity in a periodic box centered on the origin. Masses are
+//  deposited on a grid with cloud-in-cell weights, the Poisson equation is
+//  solved with a 3D FFT, and the mesh accelerations are interpolated back with
+//  the same weights. With the short range correction enabled (P3M), the mesh
+//  only carries a Gaussian-smoothed long range force and close pairs are summed
+//  directly on a chaining mesh, which recovers the full resolution force.
+//
+//  Bodies leaving the box re-enter on the opposite side.
+//
+
+#pragma once
+
+#include "NBodySystemCPU.h"
+#include "FFT3D.h"
+
+namespace entropy
+{
+    class NBodySystemPM
+    : public NBodySystemCPU
+    {
+    public:
+        NBodySystemPM(int numBodies, int gridSize = 64, float boxSize = 64.0f, bool shortRange = true, UploadAllocator* uploadAllocator = nullptr);
+        virtual ~NBodySystemPM();
+
+        // Cells per axis, rounded up to a power of two.
+        void setGridSize(int gridSize);
+        int getGridSize() const
+        { return _gridSize; }
+
+        // Side of the periodic box, which spans [-boxSize/2, boxSize/2).
+        void setBoxSize(float boxSize)
+        { _boxSize = MAX(boxSize, 1e-3f); }
+        float getBoxSize() const
+        { return _boxSize; }
+
+        // Adds the direct short range sum (P3M). Without it the force is
+        // smoothed over a couple of mesh cells.
+        void setShortRange(bool shortRange)
+        { _bShortRange = shortRange; }
+        bool getShortRange() const
+        { return _bShortRange; }
+
+        // Force split scale in mesh cells. Pairs are summed directly out to
+        // CUTOFF_SCALE times this distance.
+        void setSplitScale(float cells)
+        { _splitScale = MAX(cells, 0.5f); }
+        float getSplitScale() const
+        { return _splitScale; }
+
+        static const float CUTOFF_SCALE;
+        static const int SPLIT_TABLE_SIZE = 1024;
+
+    protected: // methods
+        virtual void _computeNBodyGravitation();
+
+        void _wrapPositions();
+        void _depositMass();
+        void _solvePotential();
+        void _computeMeshForces();
+        void _interpolateForces();
+        void _addShortRangeForces();
+
+        // Lower CIC cell and weight of the upper cell along each axis.
+        inline void _cloudInCell(const float* pos, int cell[3], float frac[3]) const;
+
+    protected: // data
+        int _gridSize;
+        float _boxSize;
+        bool _bShortRange;
+        float _splitScale;
+
+        FFT3D _fft;
+        std::vector<FFT3D::Complex> _potential;
+        std::vector<float> _density;
+        std::vector<float> _meshForce[3];
+
+        // Bodies bucketed by their lower CIC slab along x, so that every other
+        // slab can be deposited in parallel without write conflicts.
+        std::vector<int> _slabStart;
+        std::vector<int> _slabBodies;
+
+        // Chaining mesh for the short range sum.
+        int _chainSize;
+        std::vector<int> _chainStart;
+        std::vector<int> _chainBodies;
+        std::vector<float> _splitTable;
+    };
+}
@@ -0,0 +1,111 @@
+//
+//  OpenCLEmu.h
+//  PartyCL
+//
+//  Runs OpenCL style NDRange kernels on the CPU, for machines without an
+//  OpenCL device. Work-groups are spread over the thread pool as tasks, and
+//  each gets its own block of local memory. Inside a group the work-items run
+//  in phases: every forEachItem() call runs one phase for all items, so
+//  consecutive calls behave as if separated by barrier(CLK_LOCAL_MEM_FENCE).
+//  Private values that live across a barrier are kept in per-item arrays.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "Parallel.h"
+
+namespace entropy
+{
+    struct CLFloat3
+    {
+        float x, y, z;
+    };
+
+    struct CLFloat4
+    {
+        float x, y, z, w;
+    };
+
+    struct CLWorkItem
+    {
+        unsigned int localId[2];
+        unsigned int globalId[2];
+
+        // Index into per-item arrays, localId[1] * localSize[0] + localId[0].
+        unsigned int linearId;
+    };
+
+    class CLWorkGroup
+    {
+    public:
+        CLWorkGroup(const unsigned int groupId[2], const unsigned int numGroups[2], const unsigned int localSize[2], void* localMemory)
+        : _localMemory(localMemory)
+        {
+            for (int d = 0; d < 2; ++d) {
+                _groupId[d] = groupId[d];
+                _numGroups[d] = numGroups[d];
+                _localSize[d] = localSize[d];
+            }
+        }
+
+        unsigned int getGroupId(int dim) const
+        { return _groupId[dim]; }
+        unsigned int getNumGroups(int dim) const
+        { return _numGroups[dim]; }
+        unsigned int getLocalSize(int dim) const
+        { return _localSize[dim]; }
+        unsigned int getNumItems() const
+        { return _localSize[0] * _localSize[1]; }
+
+        // The __local argument of the kernel.
+        template<typename T>
+        T* getLocal() const
+        { return (T *)_localMemory; }
+
+        // Runs func(item) for every work-item of the group, in linear order.
+        template<typename Func>
+        void forEachItem(const Func& func) const
+        {
+            CLWorkItem item;
+            for (unsigned int y = 0; y < _localSize[1]; ++y) {
+                for (unsigned int x = 0; x < _localSize[0]; ++x) {
+                    item.localId[0] = x;
+                    item.localId[1] = y;
+                    item.globalId[0] = _groupId[0] * _localSize[0] + x;
+                    item.globalId[1] = _groupId[1] * _localSize[1] + y;
+                    item.linearId = y * _localSize[0] + x;
+                    func(item);
+                }
+            }
+        }
+
+    protected:
+        unsigned int _groupId[2];
+        unsigned int _numGroups[2];
+        unsigned int _localSize[2];
+        void* _localMemory;
+    };
+
+    //--------------------------------------------------------------
+    // Like clEnqueueNDRangeKernel() with two dimensions: runs kernel(group) for
+    // every work-group. The global size must be a multiple of the local size.
+    template<typename Kernel>
+    inline void clEmuRun2D(unsigned int globalX, unsigned int globalY, unsigned int localX, unsigned int localY, size_t localMemorySize, const Kernel& kernel)
+    {
+        const unsigned int localSize[2] = { localX, localY };
+        const unsigned int numGroups[2] = { globalX / localX, globalY / localY };
+
+        parallelTasks((int)(numGroups[0] * numGroups[1]), [&](int index) {
+            const unsigned int groupId[2] = { index % numGroups[0], index / numGroups[0] };
+
+            // 16 byte aligned, like float4 local arrays.
+            std::vector<CLFloat4> localMemory((localMemorySize + sizeof(CLFloat4) - 1) / sizeof(CLFloat4));
+
+            CLWorkGroup group(groupId, numGroups, localSize, localMemory.data());
+            kernel(group);
+        });
+    }
+}
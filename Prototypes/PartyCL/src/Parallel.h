@@ -0,0 +1,99 @@
+//
+//  Parallel.h
+//  PartyCL
+//
+//  Thin wrappers over the platform schedulers used by the CPU simulations:
+//  Grand Central Dispatch on OS X, OpenMP everywhere else.
+//
+
+#pragma once
+
+#ifdef TARGET_OSX
+#include <dispatch/dispatch.h>
+#include <thread>
+#elif defined(_OPENMP)
+#include <omp.h>
+#endif
+
+namespace entropy
+{
+    //--------------------------------------------------------------
+    // Runs func(idx) for idx in [0, count) across all cores.
+    // Iterations must be independent.
+    template<typename Func>
+    inline void parallelFor(int count, const Func& func)
+    {
+#ifdef TARGET_OSX
+        dispatch_apply(count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^(size_t idx) {
+            func((int)idx);
+        });
+#else
+#pragma omp parallel for schedule(dynamic, 64)
+        for (int idx = 0; idx < count; ++idx) {
+            func(idx);
+        }
+#endif
+    }
+
+    //--------------------------------------------------------------
+    // Like parallelFor, but every thread always runs the same contiguous block
+    // of iterations. Loops over arrays placed with ofxNuma::place() then only
+    // stream memory local to the thread's node.
+    template<typename Func>
+    inline void parallelForStatic(int count, const Func& func)
+    {
+#ifdef TARGET_OSX
+        // GCD has no static schedule, hand out one block per core instead.
+        const int numBlocks = MAX(1, (int)std::thread::hardware_concurrency());
+        dispatch_apply(numBlocks, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^(size_t block) {
+            const int begin = (int)((int64_t)count * block / numBlocks);
+            const int end = (int)((int64_t)count * (block + 1) / numBlocks);
+            for (int idx = begin; idx < end; ++idx) {
+                func(idx);
+            }
+        });
+#else
+#pragma omp parallel for schedule(static)
+        for (int idx = 0; idx < count; ++idx) {
+            func(idx);
+        }
+#endif
+    }
+
+    //--------------------------------------------------------------
+    // Spawns func(idx) for idx in [0, count) as tasks and waits for all of them.
+    // Unlike parallelFor, this can be nested (e.g. for recursive tree walks)
+    // and the nested calls will still be spread across the whole pool.
+    template<typename Func>
+    inline void parallelTasks(int count, const Func& func)
+    {
+#ifdef TARGET_OSX
+        dispatch_apply(count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^(size_t idx) {
+            func((int)idx);
+        });
+#elif defined(_OPENMP)
+        if (omp_in_parallel()) {
+            for (int idx = 0; idx < count; ++idx) {
+#pragma omp task firstprivate(idx) shared(func)
+                func(idx);
+            }
+#pragma omp taskwait
+        }
+        else {
+#pragma omp parallel
+#pragma omp single
+            {
+                for (int idx = 0; idx < count; ++idx) {
+#pragma omp task firstprivate(idx) shared(func)
+                    func(idx);
+                }
+#pragma omp taskwait
+            }
+        }
+#else
+        for (int idx = 0; idx < count; ++idx) {
+            func(idx);
+        }
+#endif
+    }
+}
@@ -1,8 +1,14 @@
+#include "ofxNuma.h"
+#include "ofxProfiler.h"
 #include "ofxTipsyLoader.h"
 
 #include "PartyCLApp.h"
 
 #define USE_OPENCL 1
+//#define USE_FMM 1
+//#define USE_PM 1
+//#define USE_DOMAIN 4
+//#define USE_OPENCL_EMU 1
 //#define LOAD_TIPSY 1
 
 namespace entropy
@@ -33,6 +39,16 @@ namespace entropy
         params.add(velocityScale.set("velocity scale", 8.0, 4.0, 1000.0));
         params.add(softening.set("softening factor", 0.1, 0.001, 1.0));
         params.add(damping.set("velocity damping", 1.0, 0.5, 1.0));
+        params.add(bAdaptiveSoftening.set("adaptive softening", false));
+        params.add(softeningEta.set("softening eta", 0.5, 0.05, 2.0));
+        params.add(minSoftening.set("min softening", 0.01, 0.0001, 1.0));
+        params.add(seed.set("seed", 1, 0, 9999));
+        params.add(threadPinning.set("thread pinning", OFX_THREAD_PINNING_NONE, OFX_THREAD_PINNING_NONE, OFX_NUM_THREAD_PINNINGS - 1));
+        params.add(reorderInterval.set("reorder interval", 0, 0, 100));
+        params.add(forceAccumulation.set("force accumulation", OFX_ACCUMULATE_FLOAT, OFX_ACCUMULATE_FLOAT, OFX_NUM_FORCE_ACCUMULATIONS - 1));
+        params.add(collisionMode.set("collisions", NBODY_COLLISIONS_NONE, NBODY_COLLISIONS_NONE, NBODY_NUM_COLLISION_MODES - 1));
+        params.add(collisionRadius.set("collision radius", 0.01f, 0.0f, 0.5f));
+        params.add(restitution.set("restitution", 0.5f, 0.0f, 1.0f));
         params.add(pointSize.set("point size", 16.0f, 1.0f, 64.0f));
         params.add(bExportFrames.set("export frames", false));
         ofAddListener(params.parameterChangedE(), this, &PartyCLApp::paramsChanged);
@@ -43,12 +59,20 @@ namespace entropy
         guiPanel.setup(params, "partycl.xml");
         guiPanel.loadFromFile("partycl.xml");
 
+        // Before the system is created, so its arrays are placed for this policy.
+        ofxNuma::setThreadPinning((ofxThreadPinning)threadPinning.get());
+
         bGuiVisible = true;
 
         // Load the first preset.
         presetIndex = 0;
         loadPreset();
 
+        activeConfig = NBODY_CONFIG_RANDOM;
+        checkpointPath = "nbody.checkpoint";
+        stepCount = 0;
+        simulationTime = 0.0;
+
 #ifdef LOAD_TIPSY
         filename = "galaxy_20K.bin";
 #else
@@ -131,7 +155,23 @@ namespace entropy
 #ifdef USE_OPENCL
         system = new NBodySystemOpenCL(numBodies, p, q);
 #else
-        system = new NBodySystemCPU(numBodies);
+#if defined(USE_FMM)
+        NBodySystemCPU *cpuSystem = new NBodySystemFMM(numBodies);
+#elif defined(USE_PM)
+        // Periodic box, large enough to hold the default configurations.
+        NBodySystemCPU *cpuSystem = new NBodySystemPM(numBodies, 64, 256.0f);
+#elif defined(USE_OPENCL_EMU)
+        // The OpenCL kernel on the CPU, with the same work-group shape.
+        NBodySystemCPU *cpuSystem = new NBodySystemOpenCLEmu(numBodies, p, q);
+#elif defined(USE_DOMAIN)
+        // Split across USE_DOMAIN local processes sharing memory.
+        NBodySystemCPU *cpuSystem = new NBodySystemDomain(numBodies, USE_DOMAIN);
+#else
+        NBodySystemCPU *cpuSystem = new NBodySystemCPU(numBodies);
+#endif
+        // Run the integrator on its own thread so slow steps don't stall rendering.
+        cpuSystem->setThreaded(true);
+        system = cpuSystem;
 #endif
 
         // Init renderer.
@@ -146,107 +186,7 @@ namespace entropy
     //--------------------------------------------------------------
     void PartyCLApp::randomizeBodies()
     {
-        switch (activeConfig)
-        {
-            default:
-            case NBODY_CONFIG_RANDOM:
-            {
-                float scalePos = clusterScale * MAX(1.0f, numBodies / (1024.f));
-                float scaleVel = velocityScale * scalePos;
-
-                ofVec3f pos;
-                ofVec3f vel;
-                for (int i = 0; i < numBodies; ++i) {
-                    pos.x = ofRandomf();
-                    pos.y = ofRandomf();
-                    pos.z = ofRandomf();
-                    if (pos.lengthSquared() > 1)
-                        continue;
-
-                    vel.x = ofRandomf();
-                    vel.y = ofRandomf();
-                    vel.z = ofRandomf();
-                    if (vel.lengthSquared() > 1)
-                        continue;
-
-                    hPos[i].x = pos.x * scalePos;
-                    hPos[i].y = pos.y * scalePos;
-                    hPos[i].z = pos.z * scalePos;
-                    hPos[i].w = 1.0f;  // mass
-
-                    hVel[i].x = vel.x * scaleVel; // pos.x
-                    hVel[i].y = vel.y * scaleVel; // pos.x
-                    hVel[i].z = vel.z * scaleVel; // pos.x
-                    hVel[i].w = 1.0f;  // inverse mass
-                }
-            }
-                break;
-
-            case NBODY_CONFIG_SHELL:
-            {
-                float scalePos = clusterScale;
-                float scaleVel = scalePos * velocityScale;
-                float inner = 2.5f * scalePos;
-                float outer = 4.0f * scalePos;
-
-                ofVec3f pos;
-                ofVec3f vel;
-                ofVec3f axis;
-                for (int i = 0; i < numBodies; ++i) {
-                    pos.x = ofRandomf();
-                    pos.y = ofRandomf();
-                    pos.z = ofRandomf();
-                    if (pos.lengthSquared() > 1)
-                        continue;
-
-                    hPos[i].x = pos.x * ofRandom(inner, outer);
-                    hPos[i].y = pos.y * ofRandom(inner, outer);
-                    hPos[i].z = pos.z * ofRandom(inner, outer);
-                    hPos[i].w = 1.0f;  // mass
-
-                    axis.set(0.0f, 0.0f, 1.0f);
-                    if (1.0f - pos.dot(axis) < 1e-6) {
-                        axis.x = pos.y;
-                        axis.y = pos.x;
-                        axis.normalize();
-                    }
-                    vel.set(hPos[i].x, hPos[i].y, hPos[i].z);
-                    vel.cross(axis);
-
-                    hVel[i].x = vel.x * scaleVel;
-                    hVel[i].y = vel.y * scaleVel;
-                    hVel[i].z = vel.z * scaleVel;
-                    hVel[i].x = 1.0f;  // inverse mass
-                }
-            }
-                break;
-
-            case NBODY_CONFIG_EXPAND:
-            {
-                float scalePos = clusterScale * MAX(1.0f, numBodies / (1024.0f));
-                float scaleVel = scalePos * velocityScale;
-
-                ofVec3f point;
-                for (int i = 0; i < numBodies; ++i) {
-                    point.x = ofRandomf();
-                    point.y = ofRandomf();
-                    point.z = ofRandomf();
-                    if (point.lengthSquared() > 1)
-                        continue;
-
-                    hPos[i].x = point.x * scalePos;
-                    hPos[i].y = point.y * scalePos;
-                    hPos[i].z = point.z * scalePos;
-                    hPos[i].w = 1.0f;  // mass
-
-                    hVel[i].x = point.x * scaleVel;
-                    hVel[i].y = point.y * scaleVel;
-                    hVel[i].z = point.z * scaleVel;
-                    hVel[i].w = 1.0f;  // inverse mass
-                }
-            }
-                break;
-        }
+        generateInitialConditions(activeConfig, numBodies, clusterScale, velocityScale, seed, hPos.data(), hVel.data());
 
 //        if (color) {
 //            int v = 0;
@@ -276,12 +216,75 @@ namespace entropy
             velocityScale = 2.64;
         }
 
+        // Bring back any merged bodies.
+        system->setNumBodies(numBodies);
         system->setArray(NBodySystem::ARRAY_POSITION, (float *)hPos.data());
         system->setArray(NBodySystem::ARRAY_VELOCITY, (float *)hVel.data());
 
+        stepCount = 0;
+        simulationTime = 0.0;
+
 //        renderer->setColors(hColor, numBodies);
     }
 
+    //--------------------------------------------------------------
+    void PartyCLApp::saveCheckpoint()
+    {
+        NBodyCheckpoint checkpoint;
+        checkpoint.capture(*system);
+        checkpoint.stepCount = stepCount;
+        checkpoint.simulationTime = simulationTime;
+        checkpoint.timestep = timestep;
+        checkpoint.softening = softening;
+        checkpoint.damping = damping;
+        checkpoint.bAdaptiveSoftening = bAdaptiveSoftening;
+        checkpoint.softeningEta = softeningEta;
+        checkpoint.minSoftening = minSoftening;
+        checkpoint.accumulation = (ofxForceAccumulation)forceAccumulation.get();
+        checkpoint.collisionMode = (NBodyCollisionMode)collisionMode.get();
+        checkpoint.collisionRadius = collisionRadius;
+        checkpoint.restitution = restitution;
+        checkpoint.config = activeConfig;
+        checkpoint.seed = seed;
+
+        if (checkpoint.save(checkpointPath)) {
+            ofLogNotice("PartyCLApp::saveCheckpoint", "State hash %016llx", (unsigned long long)checkpoint.getStateHash());
+        }
+    }
+
+    //--------------------------------------------------------------
+    void PartyCLApp::loadCheckpoint()
+    {
+        NBodyCheckpoint checkpoint;
+        if (!checkpoint.load(checkpointPath)) return;
+
+        if (checkpoint.numBodies > numBodies) {
+            ofLogError("PartyCLApp::loadCheckpoint", "%s has %d bodies, expected at most %d", checkpointPath.c_str(), checkpoint.numBodies, numBodies);
+            return;
+        }
+
+        // Set the parameters first, changing them may otherwise trigger a reset.
+        activeConfig = checkpoint.config;
+        seed = checkpoint.seed;
+        timestep = checkpoint.timestep;
+        softening = checkpoint.softening;
+        damping = checkpoint.damping;
+        bAdaptiveSoftening = checkpoint.bAdaptiveSoftening;
+        softeningEta = checkpoint.softeningEta;
+        minSoftening = checkpoint.minSoftening;
+        forceAccumulation = checkpoint.accumulation;
+        collisionMode = checkpoint.collisionMode;
+        collisionRadius = checkpoint.collisionRadius;
+        restitution = checkpoint.restitution;
+        bReset = false;
+
+        checkpoint.restore(*system);
+        stepCount = checkpoint.stepCount;
+        simulationTime = checkpoint.simulationTime;
+
+        ofLogNotice("PartyCLApp::loadCheckpoint", "Restored step %llu, state hash %016llx", (unsigned long long)stepCount, (unsigned long long)checkpoint.getStateHash());
+    }
+
     //--------------------------------------------------------------
     void PartyCLApp::loadPreset()
     {
@@ -306,9 +309,15 @@ namespace entropy
             // Set simulation parameters.
             system->setSoftening(softening);
             system->setDamping(damping);
+            system->setAdaptiveSoftening(bAdaptiveSoftening, softeningEta, minSoftening);
+            system->setReordering(reorderInterval);
+            system->setForceAccumulation((ofxForceAccumulation)forceAccumulation.get());
+            system->setCollisions((NBodyCollisionMode)collisionMode.get(), collisionRadius, restitution);
 
             // Run the simulation computations.
             system->update(timestep);
+            ++stepCount;
+            simulationTime += timestep;
 
             // Set renderer parameters.
             renderer->setPointSize(pointSize);
@@ -320,7 +329,7 @@ namespace entropy
     void PartyCLApp::draw()
     {
         camera.begin();
-        renderer->display(system->getVbo(), system->getNumBodies(), displayMode);
+        renderer->display(system->getVbo(), system->getNumVboBodies(), displayMode);
 
 //        ofDrawAxis(10);
 
@@ -328,6 +337,8 @@ namespace entropy
 
         if (bGuiVisible) {
             guiPanel.draw();
+
+            ofxProfiler::draw(guiPanel.getShape().getRight() + 20, 20);
         }
     }
 
@@ -371,6 +382,23 @@ namespace entropy
                 ofToggleFullscreen();
                 break;
 
+            case 's':
+            case 'S':
+                saveCheckpoint();
+                break;
+
+            case 'l':
+            case 'L':
+                loadCheckpoint();
+                break;
+
+            case 't':
+            case 'T':
+                if (ofxProfiler::writeCSV("profile.csv")) {
+                    ofLogNotice("PartyCLApp::keyPressed", "Wrote stage timings to profile.csv");
+                }
+                break;
+
             case '1':
                 activeConfig = NBODY_CONFIG_SHELL;
                 resetSimulation();
@@ -385,6 +413,16 @@ namespace entropy
                 activeConfig = NBODY_CONFIG_EXPAND;
                 resetSimulation();
                 break;
+
+            case '4':
+                activeConfig = NBODY_CONFIG_PLUMMER;
+                resetSimulation();
+                break;
+
+            case '5':
+                activeConfig = NBODY_CONFIG_HERNQUIST;
+                resetSimulation();
+                break;
         }
     }
 
@@ -394,8 +432,13 @@ namespace entropy
         string paramName = param.getName();
 
         if (paramName == clusterScale.getName() ||
-            paramName == velocityScale.getName()) {
+            paramName == velocityScale.getName() ||
+            paramName == seed.getName()) {
             bReset = true;
         }
+        else if (paramName == threadPinning.getName()) {
+            // Arrays keep their pages, only the threads move.
+            ofxNuma::setThreadPinning((ofxThreadPinning)threadPinning.get());
+        }
     }
 }
@@ -3,7 +3,13 @@
 #include "ofMain.h"
 #include "ofxGui.h"
 
+#include "InitialConditions.h"
+#include "NBodyCheckpoint.h"
 #include "NBodySystemCPU.h"
+#include "NBodySystemFMM.h"
+#include "NBodySystemPM.h"
+#include "NBodySystemDomain.h"
+#include "NBodySystemOpenCLEmu.h"
 #include "NBodySystemOpenCL.h"
 #include "ParticleRenderer.h"
 #include "Preset.h"
@@ -47,17 +53,34 @@ namespace entropy
         void resetSimulation();
         void loadPreset();
 
+        void saveCheckpoint();
+        void loadCheckpoint();
+
         ofParameter<float> timestep;
         ofParameter<float> clusterScale;
         ofParameter<float> velocityScale;
         ofParameter<float> softening;
         ofParameter<float> damping;
+        ofParameter<bool> bAdaptiveSoftening;
+        ofParameter<float> softeningEta;
+        ofParameter<float> minSoftening;
+        ofParameter<int> seed;
+        ofParameter<int> threadPinning;
+        ofParameter<int> reorderInterval;
+        ofParameter<int> forceAccumulation;
+        ofParameter<int> collisionMode;
+        ofParameter<float> collisionRadius;
+        ofParameter<float> restitution;
 
         vector<Preset> presets;
         int presetIndex;
         NBodyConfig activeConfig;
 
         string filename;
+        string checkpointPath;
+
+        uint64_t stepCount;
+        double simulationTime;
 
         NBodySystem *system;
         int numBodies;
@@ -0,0 +1,73 @@
+//
+//  TripleBuffer.h
+//  PartyCL
+//
+//  Single producer / single consumer triple buffer. The producer always has a
+//  back slot to write into and the consumer always has a front slot to read
+//  from; publish() and acquire() swap them with the middle slot through one
+//  atomic exchange, so neither side ever waits on the other.
+//
+
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+namespace entropy
+{
+    template<typename T>
+    class TripleBuffer
+    {
+    public:
+        TripleBuffer()
+        : _middle(1)
+        , _back(0)
+        , _front(2)
+        {}
+
+        // Not thread safe, call before handing the buffer to the two threads.
+        void reset(const T& value)
+        {
+            for (int i = 0; i < 3; ++i) {
+                _buffers[i] = value;
+            }
+            _back = 0;
+            _middle.store(1);
+            _front = 2;
+        }
+
+        // Producer side.
+        T& getWriteBuffer()
+        { return _buffers[_back]; }
+
+        void publish()
+        {
+            uint8_t prev = _middle.exchange(_back | FRESH_BIT, std::memory_order_acq_rel);
+            _back = prev & INDEX_MASK;
+        }
+
+        // Consumer side. Returns true if a newer buffer was published since
+        // the last call, in which case getReadBuffer() now points at it.
+        bool acquire()
+        {
+            if ((_middle.load(std::memory_order_relaxed) & FRESH_BIT) == 0) return false;
+
+            uint8_t prev = _middle.exchange(_front, std::memory_order_acq_rel);
+            _front = prev & INDEX_MASK;
+            return true;
+        }
+
+        const T& getReadBuffer() const
+        { return _buffers[_front]; }
+
+    protected:
+        static const uint8_t INDEX_MASK = 0x3;
+        static const uint8_t FRESH_BIT = 0x4;
+
+        T _buffers[3];
+
+        std::atomic<uint8_t> _middle;
+        uint8_t _back;
+        uint8_t _front;
+    };
+}
@@ -0,0 +1,101 @@
+//
+//  UploadAllocator.cpp
+//  PartyCL
+//
+
+#include "UploadAllocator.h"
+
+namespace entropy
+{
+    //--------------------------------------------------------------
+    UploadAllocatorGL::UploadAllocatorGL()
+    : _mapped(nullptr)
+    {}
+
+    //--------------------------------------------------------------
+    UploadAllocatorGL::~UploadAllocatorGL()
+    {
+        release();
+    }
+
+    //--------------------------------------------------------------
+    uint8_t* UploadAllocatorGL::allocate(size_t size, int numRegions)
+    {
+        release();
+
+        _fences.assign(numRegions, nullptr);
+
+        _buffer.allocate();
+        glBindBuffer(GL_ARRAY_BUFFER, _buffer.getId());
+
+#ifdef GL_ARB_buffer_storage
+        if (GLEW_ARB_buffer_storage) {
+            // Immutable storage that stays mapped for the lifetime of the buffer.
+            const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_ARRAY_BUFFER, size, nullptr, flags);
+            _mapped = (uint8_t *)glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+        }
+#endif
+        if (_mapped == nullptr) {
+            ofLogNotice("UploadAllocatorGL::allocate", "Persistent mapping unavailable, using glBufferSubData");
+            glBufferData(GL_ARRAY_BUFFER, size, nullptr, GL_STREAM_DRAW);
+        }
+
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        return _mapped;
+    }
+
+    //--------------------------------------------------------------
+    void UploadAllocatorGL::release()
+    {
+        for (GLsync& sync : _fences) {
+            if (sync) {
+                glDeleteSync(sync);
+                sync = nullptr;
+            }
+        }
+
+        if (_mapped) {
+            glBindBuffer(GL_ARRAY_BUFFER, _buffer.getId());
+            glUnmapBuffer(GL_ARRAY_BUFFER);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+            _mapped = nullptr;
+        }
+
+        // Drop the old buffer object, storage created with glBufferStorage is immutable.
+        _buffer = ofBufferObject();
+    }
+
+    //--------------------------------------------------------------
+    void UploadAllocatorGL::copy(size_t offset, const void* data, size_t size)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, _buffer.getId());
+        glBufferSubData(GL_ARRAY_BUFFER, offset, size, data);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    //--------------------------------------------------------------
+    void UploadAllocatorGL::fence(int region)
+    {
+        if (_fences[region]) {
+            glDeleteSync(_fences[region]);
+        }
+        _fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+
+    //--------------------------------------------------------------
+    void UploadAllocatorGL::wait(int region)
+    {
+        GLsync sync = _fences[region];
+        if (sync == nullptr) return;
+
+        GLenum result = glClientWaitSync(sync, 0, 0);
+        while (result != GL_ALREADY_SIGNALED && result != GL_CONDITION_SATISFIED && result != GL_WAIT_FAILED) {
+            result = glClientWaitSync(sync, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+        }
+
+        glDeleteSync(sync);
+        _fences[region] = nullptr;
+    }
+}
@@ -0,0 +1,119 @@
+//
+//  UploadAllocator.h
+//  PartyCL
+//
+//  Storage backends for UploadRing. The GL version maps a buffer persistently
+//  when ARB_buffer_storage is available and falls back to glBufferSubData
+//  otherwise. The mock version only touches host memory and counts what the
+//  ring asks of it, so the upload path can be exercised without a context.
+//
+
+#pragma once
+
+#include "ofMain.h"
+
+namespace entropy
+{
+    class UploadAllocator
+    {
+    public:
+        virtual ~UploadAllocator()
+        {}
+
+        // Creates size bytes of upload storage split into numRegions regions.
+        // Returns the persistently mapped base pointer, or nullptr if the
+        // storage can't be mapped, in which case regions are filled with copy().
+        virtual uint8_t* allocate(size_t size, int numRegions) = 0;
+        virtual void release() = 0;
+
+        virtual void copy(size_t offset, const void* data, size_t size) = 0;
+
+        // Marks the point after which the GPU no longer reads the region.
+        virtual void fence(int region) = 0;
+        // Blocks until the last fence on the region has passed.
+        virtual void wait(int region) = 0;
+
+        // The buffer to source vertices from, if any.
+        virtual ofBufferObject* getBuffer()
+        { return nullptr; }
+    };
+
+    //--------------------------------------------------------------
+    class UploadAllocatorGL
+    : public UploadAllocator
+    {
+    public:
+        UploadAllocatorGL();
+        virtual ~UploadAllocatorGL();
+
+        virtual uint8_t* allocate(size_t size, int numRegions);
+        virtual void release();
+
+        virtual void copy(size_t offset, const void* data, size_t size);
+
+        virtual void fence(int region);
+        virtual void wait(int region);
+
+        virtual ofBufferObject* getBuffer()
+        { return &_buffer; }
+
+        bool isPersistent() const
+        { return _mapped != nullptr; }
+
+    protected:
+        ofBufferObject _buffer;
+        uint8_t* _mapped;
+        std::vector<GLsync> _fences;
+    };
+
+    //--------------------------------------------------------------
+    class UploadAllocatorMock
+    : public UploadAllocator
+    {
+    public:
+        UploadAllocatorMock(bool persistent = true)
+        : numAllocations(0)
+        , numCopies(0)
+        , numBytesCopied(0)
+        , numFences(0)
+        , numWaits(0)
+        , _bPersistent(persistent)
+        {}
+
+        virtual uint8_t* allocate(size_t size, int /*numRegions*/)
+        {
+            ++numAllocations;
+            _storage.assign(size, 0);
+            return _bPersistent ? _storage.data() : nullptr;
+        }
+
+        virtual void release()
+        { _storage.clear(); }
+
+        virtual void copy(size_t offset, const void* data, size_t size)
+        {
+            ++numCopies;
+            numBytesCopied += size;
+            memcpy(_storage.data() + offset, data, size);
+        }
+
+        virtual void fence(int /*region*/)
+        { ++numFences; }
+
+        virtual void wait(int /*region*/)
+        { ++numWaits; }
+
+        const uint8_t* getStorage() const
+        { return _storage.data(); }
+
+        int numAllocations;
+        int numCopies;
+        size_t numBytesCopied;
+        int numFences;
+        int numWaits;
+
+    protected:
+        bool _bPersistent;
+        std::vector<uint8_t> _storage;
+    };
+}
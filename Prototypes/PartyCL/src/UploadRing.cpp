@@ -0,0 +1,124 @@
+//
+//  UploadRing.cpp
+//  PartyCL
+//
+
+#include "UploadRing.h"
+
+namespace entropy
+{
+    //--------------------------------------------------------------
+    UploadRing::UploadRing()
+    : _allocator(nullptr)
+    , _regionSize(0)
+    , _numAllocations(0)
+    , _mapped(nullptr)
+    , _middle(1)
+    , _back(0)
+    , _front(2)
+    , _retiring(3)
+    {
+        for (int i = 0; i < NUM_REGIONS; ++i) {
+            _usedSize[i] = 0;
+        }
+    }
+
+    //--------------------------------------------------------------
+    UploadRing::~UploadRing()
+    {
+        clear();
+    }
+
+    //--------------------------------------------------------------
+    void UploadRing::setup(UploadAllocator* allocator, size_t regionSize)
+    {
+        if (allocator != _allocator) {
+            clear();
+            _allocator = allocator;
+        }
+        else if (regionSize == _regionSize) {
+            return;
+        }
+
+        _regionSize = regionSize;
+        _mapped = _allocator->allocate(_regionSize * NUM_REGIONS, NUM_REGIONS);
+        ++_numAllocations;
+
+        for (int i = 0; i < NUM_REGIONS; ++i) {
+            if (_mapped) {
+                _staging[i].clear();
+            }
+            else {
+                _staging[i].assign(_regionSize, 0);
+            }
+            _usedSize[i] = _regionSize;
+        }
+
+        _back = 0;
+        _middle.store(1);
+        _front = 2;
+        _retiring = 3;
+    }
+
+    //--------------------------------------------------------------
+    void UploadRing::clear()
+    {
+        if (_allocator == nullptr) return;
+
+        _allocator->release();
+        delete _allocator;
+        _allocator = nullptr;
+
+        _mapped = nullptr;
+        _regionSize = 0;
+        for (int i = 0; i < NUM_REGIONS; ++i) {
+            _staging[i].clear();
+        }
+    }
+
+    //--------------------------------------------------------------
+    float* UploadRing::getWriteRegion()
+    {
+        if (_mapped) {
+            return (float *)(_mapped + _back * _regionSize);
+        }
+        return (float *)_staging[_back].data();
+    }
+
+    //--------------------------------------------------------------
+    void UploadRing::publish()
+    {
+        publish(_regionSize);
+    }
+
+    //--------------------------------------------------------------
+    void UploadRing::publish(size_t usedSize)
+    {
+        // Written before the exchange, which releases it with the region.
+        _usedSize[_back] = MIN(usedSize, _regionSize);
+        uint8_t prev = _middle.exchange(_back | FRESH_BIT, std::memory_order_acq_rel);
+        _back = prev & INDEX_MASK;
+    }
+
+    //--------------------------------------------------------------
+    bool UploadRing::acquire()
+    {
+        if ((_middle.load(std::memory_order_relaxed) & FRESH_BIT) == 0) return false;
+
+        // The retiring region goes back to the producer, make sure the GPU is
+        // done with it. Its fence was set on the previous acquire.
+        _allocator->wait(_retiring);
+        uint8_t prev = _middle.exchange(_retiring, std::memory_order_acq_rel);
+
+        // Everything drawn from the current front has been submitted by now.
+        _allocator->fence(_front);
+        _retiring = _front;
+        _front = prev & INDEX_MASK;
+
+        if (_mapped == nullptr) {
+            _allocator->copy(_front * _regionSize, _staging[_front].data(), _usedSize[_front]);
+        }
+
+        return true;
+    }
+}
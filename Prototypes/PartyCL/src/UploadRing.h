@@ -0,0 +1,78 @@
+//
+//  UploadRing.h
+//  PartyCL
+//
+//  Ring of upload regions carved out of one buffer. The producer (the
+//  integrator, possibly on the simulation thread) writes positions straight
+//  into a region and publishes it; the consumer (the GL thread) acquires the
+//  newest published region and draws from it.
+//
+//  This is the TripleBuffer protocol with a fourth, "retiring" region on the
+//  consumer side: the previous front region keeps a fence until the next
+//  acquire, and is only handed back to the producer once that fence passed.
+//  By then the fence is a frame old, so the wait is practically free.
+//
+
+#pragma once
+
+#include <atomic>
+
+#include "UploadAllocator.h"
+
+namespace entropy
+{
+    class UploadRing
+    {
+    public:
+        static const int NUM_REGIONS = 4;
+
+        UploadRing();
+        ~UploadRing();
+
+        // Takes ownership of the allocator.
+        void setup(UploadAllocator* allocator, size_t regionSize);
+        void clear();
+
+        // Producer side.
+        float* getWriteRegion();
+        void publish();
+        // Only the first usedSize bytes of the region are valid.
+        void publish(size_t usedSize);
+
+        // Consumer side, on the thread owning the GL context.
+        // Returns true if a new region was made current.
+        bool acquire();
+
+        size_t getReadOffset() const
+        { return _front * _regionSize; }
+        size_t getReadSize() const
+        { return _usedSize[_front]; }
+
+        UploadAllocator* getAllocator()
+        { return _allocator; }
+
+        bool isPersistent() const
+        { return _mapped != nullptr; }
+
+        // Number of times the upload storage was (re)created.
+        int getNumAllocations() const
+        { return _numAllocations; }
+
+    protected:
+        static const uint8_t INDEX_MASK = 0x3;
+        static const uint8_t FRESH_BIT = 0x4;
+
+        UploadAllocator* _allocator;
+        size_t _regionSize;
+        int _numAllocations;
+
+        uint8_t* _mapped;
+        std::vector<uint8_t> _staging[NUM_REGIONS];
+        size_t _usedSize[NUM_REGIONS];
+
+        std::atomic<uint8_t> _middle;
+        uint8_t _back;
+        uint8_t _front;
+        uint8_t _retiring;
+    };
+}
@@ -1,9 +1,50 @@
 #include "ofMain.h"
 #include "PartyCLApp.h"
+#include "NBodyBenchmark.h"
+#include "NBodyReplay.h"
+#include "NBodyDomain.h"
+#include "NBodySystemCPU.h"
+#include "NBodySystemDomain.h"
+#include "ofxNuma.h"
 
 //========================================================================
-int main()
+int main(int argc, char *argv[])
 {
+    // PartyCL --replay <checkpoint> [steps] [cpu|fmm]
+    if (argc > 2 && string(argv[1]) == "--replay") {
+        int numSteps = (argc > 3) ? ofToInt(argv[3]) : 100;
+        string backend = (argc > 4) ? argv[4] : "cpu";
+        return entropy::runHeadlessReplay(argv[2], numSteps, backend);
+    }
+
+    // PartyCL --benchmark [--bodies 1024,4096 --threads 1,4 --format json ...]
+    if (argc > 1 && string(argv[1]) == "--benchmark") {
+        return entropy::runHeadlessBenchmark(argc, argv, 2);
+    }
+
+    // PartyCL --domain-worker <shm|tcp:port> <session> <rank> <ranks>
+    // Started by NBodySystemDomain, one per extra rank.
+    if (argc > 1 && string(argv[1]) == "--domain-worker") {
+        return entropy::runDomainWorker(argc, argv, 2);
+    }
+
+    // PartyCL --domain <ranks> [bodies] [steps] [shm|tcp:port]
+    if (argc > 1 && string(argv[1]) == "--domain") {
+        return entropy::runHeadlessDomain(argc, argv, 2);
+    }
+
+    // PartyCL --validate-merge
+    if (argc > 1 && string(argv[1]) == "--validate-merge") {
+        return (entropy::NBodySystemCPU::validateMerge() < 1e-4f) ? 0 : 1;
+    }
+
+    // PartyCL --numa-benchmark [megabytes] [repetitions]
+    if (argc > 1 && string(argv[1]) == "--numa-benchmark") {
+        int megabytes = (argc > 2) ? ofToInt(argv[2]) : 256;
+        int repetitions = (argc > 3) ? ofToInt(argv[3]) : 5;
+        return ofxNuma::runBandwidthBenchmark(megabytes, repetitions);
+    }
+
     ofGLWindowSettings settings;
     settings.setGLVersion(3, 2);
     settings.width = 1920;
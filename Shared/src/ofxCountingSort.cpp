@@ -0,0 +1,233 @@
+//
+//  ofxCountingSort.cpp
+//  Shared
+//
+
+#include "ofxCountingSort.h"
+
+#include <random>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace
+{
+    //--------------------------------------------------------------
+    int getNumThreads()
+    {
+#ifdef _OPENMP
+        return omp_get_max_threads();
+#else
+        return 1;
+#endif
+    }
+
+    //--------------------------------------------------------------
+    template<typename Key, typename Index>
+    void serialCountingSort(const Key* keys, size_t numItems, size_t numBins, Index* sortedIndices, vector<uint32_t>& offsets)
+    {
+        offsets.assign(numBins + 1, 0);
+        for (size_t i = 0; i < numItems; ++i) {
+            ++offsets[keys[i] + 1];
+        }
+        for (size_t b = 0; b < numBins; ++b) {
+            offsets[b + 1] += offsets[b];
+        }
+
+        vector<uint32_t> next(offsets.begin(), offsets.end() - 1);
+        for (size_t i = 0; i < numItems; ++i) {
+            sortedIndices[next[keys[i]]++] = (Index)i;
+        }
+    }
+}
+
+//--------------------------------------------------------------
+ofxCountingSort::ofxCountingSort()
+: _numItems(0)
+, _numBins(0)
+, _numChunks(1)
+{}
+
+//--------------------------------------------------------------
+void ofxCountingSort::begin(size_t numItems, size_t numBins)
+{
+    _numItems = numItems;
+    _numBins = numBins;
+
+    // Small inputs are not worth waking every thread for.
+    _numChunks = (int)MAX((size_t)1, MIN((size_t)getNumThreads(), numItems / 4096));
+
+    _histograms.resize(_numChunks * _numBins);
+    _binOffsets.resize(_numBins + 1);
+
+    // Each chunk's histogram is zeroed by the thread that will fill it.
+#pragma omp parallel for schedule(static, 1)
+    for (int chunk = 0; chunk < _numChunks; ++chunk) {
+        memset(getHistogram(chunk), 0, _numBins * sizeof(uint32_t));
+    }
+}
+
+//--------------------------------------------------------------
+template<typename Key>
+void ofxCountingSort::count(const Key* keys)
+{
+#pragma omp parallel for schedule(static, 1)
+    for (int chunk = 0; chunk < _numChunks; ++chunk) {
+        uint32_t* histogram = getHistogram(chunk);
+        const size_t end = getChunkEnd(chunk);
+        for (size_t i = getChunkBegin(chunk); i < end; ++i) {
+            ++histogram[keys[i]];
+        }
+    }
+}
+
+//--------------------------------------------------------------
+void ofxCountingSort::_prefixSum()
+{
+    const int numBins = (int)_numBins;
+
+    // Chunk counts become offsets within their bin, the bin totals are kept
+    // in the bin offsets for now.
+#pragma omp parallel for schedule(static)
+    for (int bin = 0; bin < numBins; ++bin) {
+        uint32_t total = 0;
+        for (int chunk = 0; chunk < _numChunks; ++chunk) {
+            uint32_t& count = _histograms[chunk * _numBins + bin];
+            uint32_t chunkCount = count;
+            count = total;
+            total += chunkCount;
+        }
+        _binOffsets[bin] = total;
+    }
+
+    // Exclusive scan of the totals: sum blocks of bins, scan the block sums,
+    // then scan each block from its sum.
+    const int numBlocks = _numChunks;
+    _blockSums.assign(numBlocks + 1, 0);
+
+#pragma omp parallel for schedule(static, 1)
+    for (int block = 0; block < numBlocks; ++block) {
+        const size_t end = _numBins * (block + 1) / numBlocks;
+        uint32_t sum = 0;
+        for (size_t bin = _numBins * block / numBlocks; bin < end; ++bin) {
+            sum += _binOffsets[bin];
+        }
+        _blockSums[block + 1] = sum;
+    }
+
+    for (int block = 0; block < numBlocks; ++block) {
+        _blockSums[block + 1] += _blockSums[block];
+    }
+
+#pragma omp parallel for schedule(static, 1)
+    for (int block = 0; block < numBlocks; ++block) {
+        const size_t end = _numBins * (block + 1) / numBlocks;
+        uint32_t offset = _blockSums[block];
+        for (size_t bin = _numBins * block / numBlocks; bin < end; ++bin) {
+            uint32_t total = _binOffsets[bin];
+            _binOffsets[bin] = offset;
+            offset += total;
+        }
+    }
+
+    _binOffsets[_numBins] = (uint32_t)_numItems;
+}
+
+//--------------------------------------------------------------
+template<typename Key, typename Index>
+void ofxCountingSort::scatter(const Key* keys, Index* sortedIndices)
+{
+    _prefixSum();
+
+#pragma omp parallel for schedule(static, 1)
+    for (int chunk = 0; chunk < _numChunks; ++chunk) {
+        uint32_t* next = getHistogram(chunk);
+        const size_t end = getChunkEnd(chunk);
+        for (size_t i = getChunkBegin(chunk); i < end; ++i) {
+            const Key key = keys[i];
+            sortedIndices[_binOffsets[key] + next[key]++] = (Index)i;
+        }
+    }
+}
+
+//--------------------------------------------------------------
+template<typename Key, typename Index>
+void ofxCountingSort::sort(const Key* keys, size_t numItems, size_t numBins, Index* sortedIndices)
+{
+    begin(numItems, numBins);
+    count(keys);
+    scatter(keys, sortedIndices);
+}
+
+template void ofxCountingSort::count<uint16_t>(const uint16_t*);
+template void ofxCountingSort::count<uint32_t>(const uint32_t*);
+template void ofxCountingSort::scatter<uint16_t, uint16_t>(const uint16_t*, uint16_t*);
+template void ofxCountingSort::scatter<uint16_t, uint32_t>(const uint16_t*, uint32_t*);
+template void ofxCountingSort::scatter<uint32_t, uint32_t>(const uint32_t*, uint32_t*);
+template void ofxCountingSort::sort<uint16_t, uint16_t>(const uint16_t*, size_t, size_t, uint16_t*);
+template void ofxCountingSort::sort<uint16_t, uint32_t>(const uint16_t*, size_t, size_t, uint32_t*);
+template void ofxCountingSort::sort<uint32_t, uint32_t>(const uint32_t*, size_t, size_t, uint32_t*);
+
+//--------------------------------------------------------------
+int ofxCountingSort::runBenchmark(size_t numBins, int repetitions)
+{
+    const size_t itemCounts[] = { 40000, 400000, 4000000 };
+    const int maxThreads = getNumThreads();
+
+    // Powers of two up to the core count, plus the core count itself.
+    vector<int> threadCounts;
+    for (int t = 1; t < maxThreads; t *= 2) {
+        threadCounts.push_back(t);
+    }
+    threadCounts.push_back(maxThreads);
+
+    printf("bins %zu, best of %d, up to %d threads\n", numBins, repetitions, maxThreads);
+    printf("%10s  %8s  %12s  %12s  %8s  %10s\n", "items", "threads", "serial ms", "parallel ms", "speedup", "Mitems/s");
+
+    bool bMatch = true;
+    ofxCountingSort sorter;
+    for (size_t numItems : itemCounts) {
+        // Same keys for every run.
+        std::mt19937 random(1);
+        std::uniform_int_distribution<uint32_t> distribution(0, (uint32_t)numBins - 1);
+        vector<uint32_t> keys(numItems);
+        for (auto& key : keys) {
+            key = distribution(random);
+        }
+
+        vector<uint32_t> reference(numItems), referenceOffsets;
+        double serialSeconds = DBL_MAX;
+        for (int rep = 0; rep < repetitions; ++rep) {
+            uint64_t startTime = ofGetElapsedTimeMicros();
+            serialCountingSort(keys.data(), numItems, numBins, reference.data(), referenceOffsets);
+            serialSeconds = MIN(serialSeconds, (ofGetElapsedTimeMicros() - startTime) / 1000000.0);
+        }
+
+        vector<uint32_t> sorted(numItems);
+        for (int numThreads : threadCounts) {
+#ifdef _OPENMP
+            omp_set_num_threads(numThreads);
+#endif
+            double seconds = DBL_MAX;
+            for (int rep = 0; rep < repetitions; ++rep) {
+                uint64_t startTime = ofGetElapsedTimeMicros();
+                sorter.sort(keys.data(), numItems, numBins, sorted.data());
+                seconds = MIN(seconds, (ofGetElapsedTimeMicros() - startTime) / 1000000.0);
+            }
+            seconds = MAX(seconds, 1e-6);
+
+            if (sorted != reference || memcmp(sorter.getBinOffsets(), referenceOffsets.data(), (numBins + 1) * sizeof(uint32_t)) != 0) {
+                ofLogError("ofxCountingSort::runBenchmark", "%zu items with %d threads do not match the serial sort", numItems, numThreads);
+                bMatch = false;
+            }
+
+            printf("%10zu  %8d  %12.3f  %12.3f  %8.2f  %10.1f\n", numItems, numThreads, serialSeconds * 1000.0, seconds * 1000.0, serialSeconds / seconds, numItems / seconds / 1e6);
+        }
+    }
+
+#ifdef _OPENMP
+    omp_set_num_threads(maxThreads);
+#endif
+    return bMatch ? 0 : 1;
+}
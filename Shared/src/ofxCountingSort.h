@@ -0,0 +1,86 @@
+//
+//  ofxCountingSort.h
+//  Shared
+//
+//  Parallel counting sort of item indices by bin, for building uniform grids.
+//  Items are split into one contiguous chunk per thread. Each chunk counts its
+//  bins into its own histogram, the histograms are prefix summed across chunks
+//  and bins, and each chunk then scatters its items from its own offsets. No
+//  atomics are needed and the result is the stable order, so it does not
+//  depend on the thread count.
+//
+//  The counting pass can be fused into the loop that computes the bins:
+//
+//      sorter.begin(numItems, numBins);
+//      #pragma omp parallel for schedule(static, 1)
+//      for (int chunk = 0; chunk < sorter.getNumChunks(); ++chunk) {
+//          uint32_t* histogram = sorter.getHistogram(chunk);
+//          for (size_t i = sorter.getChunkBegin(chunk); i < sorter.getChunkEnd(chunk); ++i) {
+//              keys[i] = computeBin(i);
+//              ++histogram[keys[i]];
+//          }
+//      }
+//      sorter.scatter(keys, sortedIndices);
+//
+
+#pragma once
+
+#include "ofMain.h"
+
+class ofxCountingSort
+{
+public:
+    ofxCountingSort();
+
+    // Sizes and zeroes the histograms of every chunk.
+    void begin(size_t numItems, size_t numBins);
+
+    int getNumChunks() const
+    { return _numChunks; }
+    size_t getChunkBegin(int chunk) const
+    { return _numItems * chunk / _numChunks; }
+    size_t getChunkEnd(int chunk) const
+    { return _numItems * (chunk + 1) / _numChunks; }
+
+    // Items per bin in the chunk, to be incremented by the thread that walks it.
+    uint32_t* getHistogram(int chunk)
+    { return &_histograms[chunk * _numBins]; }
+
+    // Fills the histograms from keys that were not counted as they were made.
+    template<typename Key>
+    void count(const Key* keys);
+
+    // Prefix sums the histograms and writes the item indices sorted by key,
+    // in item order within each bin. Keys must be below numBins.
+    template<typename Key, typename Index>
+    void scatter(const Key* keys, Index* sortedIndices);
+
+    // begin(), count() and scatter() in one call.
+    template<typename Key, typename Index>
+    void sort(const Key* keys, size_t numItems, size_t numBins, Index* sortedIndices);
+
+    // Where each bin starts in the sorted indices, numBins + 1 entries so the
+    // end of bin b is the start of b + 1.
+    const uint32_t* getBinOffsets() const
+    { return _binOffsets.data(); }
+    uint32_t getBinOffset(size_t bin) const
+    { return _binOffsets[bin]; }
+    uint32_t getBinCount(size_t bin) const
+    { return _binOffsets[bin + 1] - _binOffsets[bin]; }
+
+    // Times the sort at 40K, 400K and 4M items against a serial counting sort,
+    // checks the results match and prints a table. Returns the exit code.
+    static int runBenchmark(size_t numBins = 8000, int repetitions = 10);
+
+protected:
+    void _prefixSum();
+
+    size_t _numItems;
+    size_t _numBins;
+    int _numChunks;
+
+    // numChunks rows of numBins counts, turned into offsets within each bin.
+    vector<uint32_t> _histograms;
+    vector<uint32_t> _binOffsets;
+    vector<uint32_t> _blockSums;
+};
@@ -0,0 +1,118 @@
+//
+//  ofxForceAccumulator.h
+//  Shared
+//
+//  Per-body force sums for the pairwise force loops. The pair terms are always
+//  computed in float so they vectorize, only the running sum changes: plain
+//  float, float with Kahan compensation, or double. Summing N terms in float
+//  loses about log2(N) bits in the worst case, the other two keep the sum at
+//  the precision of the terms.
+//
+//  Force loops are templated on the accumulator, so each mode gets its own
+//  inner loop. Kahan compensation does not survive -ffast-math or /fp:fast.
+//
+
+#pragma once
+
+enum ofxForceAccumulation
+{
+    OFX_ACCUMULATE_FLOAT,
+    OFX_ACCUMULATE_KAHAN,
+    OFX_ACCUMULATE_DOUBLE,
+
+    OFX_NUM_FORCE_ACCUMULATIONS
+};
+
+//--------------------------------------------------------------
+struct ofxFloatAccumulator
+{
+    float sum[3];
+
+    ofxFloatAccumulator()
+    {
+        sum[0] = sum[1] = sum[2] = 0.0f;
+    }
+
+    inline void add(float x, float y, float z)
+    {
+        sum[0] += x;
+        sum[1] += y;
+        sum[2] += z;
+    }
+
+    inline void get(float out[3]) const
+    {
+        out[0] = sum[0];
+        out[1] = sum[1];
+        out[2] = sum[2];
+    }
+};
+
+//--------------------------------------------------------------
+struct ofxKahanAccumulator
+{
+    float sum[3];
+    float compensation[3];
+
+    ofxKahanAccumulator()
+    {
+        for (int k = 0; k < 3; ++k) {
+            sum[k] = compensation[k] = 0.0f;
+        }
+    }
+
+    inline void add(float x, float y, float z)
+    {
+        const float terms[3] = { x, y, z };
+        for (int k = 0; k < 3; ++k) {
+            float term = terms[k] - compensation[k];
+            float total = sum[k] + term;
+            compensation[k] = (total - sum[k]) - term;
+            sum[k] = total;
+        }
+    }
+
+    inline void get(float out[3]) const
+    {
+        out[0] = sum[0];
+        out[1] = sum[1];
+        out[2] = sum[2];
+    }
+};
+
+//--------------------------------------------------------------
+struct ofxDoubleAccumulator
+{
+    double sum[3];
+
+    ofxDoubleAccumulator()
+    {
+        sum[0] = sum[1] = sum[2] = 0.0;
+    }
+
+    inline void add(float x, float y, float z)
+    {
+        sum[0] += x;
+        sum[1] += y;
+        sum[2] += z;
+    }
+
+    inline void get(float out[3]) const
+    {
+        out[0] = (float)sum[0];
+        out[1] = (float)sum[1];
+        out[2] = (float)sum[2];
+    }
+};
+
+//--------------------------------------------------------------
+inline const char* ofxGetForceAccumulationName(ofxForceAccumulation accumulation)
+{
+    switch (accumulation)
+    {
+        case OFX_ACCUMULATE_FLOAT:  return "float";
+        case OFX_ACCUMULATE_KAHAN:  return "kahan";
+        case OFX_ACCUMULATE_DOUBLE: return "double";
+        default:                    return "unknown";
+    }
+}
@@ -0,0 +1,80 @@
+//
+//  ofxFreeList.h
+//  Shared
+//
+//  Lock-free pool of the indices 0 to capacity - 1, for handing out the slots of
+//  preallocated arrays without allocating. Free indices are kept on a stack and
+//  any number of threads can acquire at once: a batch takes its whole range of
+//  the stack with one compare and swap on the top, so spawning thousands of
+//  items costs one atomic per batch.
+//
+//  Releases go through the same top with an atomic add, so they can also run in
+//  parallel, but acquires and releases must not overlap. Keeping them in separate
+//  phases means a popped range is never refilled under a reader, so the stack
+//  needs no ABA tags.
+//
+//  The number of indices in use only grows during an acquire phase, so each
+//  batch also gets a dense range [first, first + count) of acquisition order.
+//  Arrays kept dense by their owner can put the new items in those slots.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+class ofxFreeList
+{
+public:
+    ofxFreeList()
+    : _top(0)
+    {}
+
+    // Frees every index, the lowest are acquired first.
+    void reset(uint32_t capacity)
+    {
+        _indices.resize(capacity);
+        for (uint32_t i = 0; i < capacity; ++i) {
+            _indices[i] = capacity - 1 - i;
+        }
+        _top.store(capacity, std::memory_order_relaxed);
+    }
+
+    // Takes up to count indices into indices and returns how many were taken,
+    // fewer when the pool runs out. first, if given, receives the number of
+    // indices that were in use before the batch.
+    uint32_t acquire(uint32_t count, uint32_t* indices, uint32_t* first = nullptr)
+    {
+        uint32_t top = _top.load(std::memory_order_relaxed);
+        uint32_t taken;
+        do {
+            taken = std::min(count, top);
+        } while (!_top.compare_exchange_weak(top, top - taken, std::memory_order_acquire, std::memory_order_relaxed));
+
+        for (uint32_t i = 0; i < taken; ++i) {
+            indices[i] = _indices[top - 1 - i];
+        }
+        if (first) {
+            *first = getCapacity() - top;
+        }
+        return taken;
+    }
+
+    void release(uint32_t index)
+    {
+        _indices[_top.fetch_add(1, std::memory_order_release)] = index;
+    }
+
+    uint32_t getCapacity() const
+    { return (uint32_t)_indices.size(); }
+    uint32_t getNumFree() const
+    { return _top.load(std::memory_order_acquire); }
+    uint32_t getNumUsed() const
+    { return getCapacity() - getNumFree(); }
+
+protected:
+    std::vector<uint32_t> _indices;
+    std::atomic<uint32_t> _top;
+};
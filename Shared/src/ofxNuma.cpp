@@ -0,0 +1,440 @@
+//
+//  ofxNuma.cpp
+//  Shared
+//
+
+#include "ofxNuma.h"
+
+#include <atomic>
+#include <fstream>
+#include <thread>
+
+#if defined(TARGET_LINUX)
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#elif defined(TARGET_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace
+{
+    struct Topology
+    {
+        Topology()
+        {
+#if defined(TARGET_LINUX)
+            for (int node = 0; ; ++node) {
+                ifstream file("/sys/devices/system/node/node" + ofToString(node) + "/cpulist");
+                if (!file.good()) break;
+
+                // Lists look like "0-7,16-23".
+                vector<int> cpus;
+                string list;
+                getline(file, list);
+                for (const string& range : ofSplitString(list, ",", true, true)) {
+                    vector<string> bounds = ofSplitString(range, "-");
+                    int first = ofToInt(bounds[0]);
+                    int last = (bounds.size() > 1) ? ofToInt(bounds[1]) : first;
+                    for (int cpu = first; cpu <= last; ++cpu) {
+                        cpus.push_back(cpu);
+                    }
+                }
+                if (!cpus.empty()) {
+                    nodeCpus.push_back(cpus);
+                }
+            }
+#elif defined(TARGET_WIN32)
+            ULONG highestNode = 0;
+            GetNumaHighestNodeNumber(&highestNode);
+            for (ULONG node = 0; node <= highestNode; ++node) {
+                ULONGLONG mask = 0;
+                if (!GetNumaNodeProcessorMask((UCHAR)node, &mask) || mask == 0) continue;
+
+                vector<int> cpus;
+                for (int cpu = 0; cpu < 64; ++cpu) {
+                    if (mask & (1ull << cpu)) cpus.push_back(cpu);
+                }
+                nodeCpus.push_back(cpus);
+            }
+#endif
+            if (nodeCpus.empty()) {
+                // No NUMA information, treat the machine as a single node.
+                vector<int> cpus(MAX(1, (int)std::thread::hardware_concurrency()));
+                for (int cpu = 0; cpu < (int)cpus.size(); ++cpu) {
+                    cpus[cpu] = cpu;
+                }
+                nodeCpus.push_back(cpus);
+            }
+
+            for (int node = 0; node < (int)nodeCpus.size(); ++node) {
+                for (int cpu : nodeCpus[node]) {
+                    if (cpu >= (int)cpuNodes.size()) cpuNodes.resize(cpu + 1, 0);
+                    cpuNodes[cpu] = node;
+                    compactCpus.push_back(cpu);
+                }
+            }
+        }
+
+        vector<vector<int>> nodeCpus;
+        vector<int> cpuNodes;
+        // All CPUs, grouped by node.
+        vector<int> compactCpus;
+    };
+
+    //--------------------------------------------------------------
+    const Topology& getTopology()
+    {
+        static Topology topology;
+        return topology;
+    }
+
+    std::atomic<int> pinningPolicy(OFX_THREAD_PINNING_NONE);
+    std::atomic<int> pinningGeneration(0);
+
+    // Generation of the policy last applied to the pool of this thread.
+    thread_local int appliedGeneration = 0;
+
+    //--------------------------------------------------------------
+    size_t getPageSize()
+    {
+#if defined(TARGET_WIN32)
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return info.dwPageSize;
+#else
+        return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+    }
+}
+
+//--------------------------------------------------------------
+int ofxNuma::getNumNodes()
+{
+    return (int)getTopology().nodeCpus.size();
+}
+
+//--------------------------------------------------------------
+int ofxNuma::getNumCpus()
+{
+    return (int)getTopology().compactCpus.size();
+}
+
+//--------------------------------------------------------------
+const vector<int>& ofxNuma::getNodeCpus(int node)
+{
+    const Topology& topology = getTopology();
+    return topology.nodeCpus[MIN(MAX(node, 0), (int)topology.nodeCpus.size() - 1)];
+}
+
+//--------------------------------------------------------------
+int ofxNuma::getNodeOfCpu(int cpu)
+{
+    const Topology& topology = getTopology();
+    if (cpu < 0 || cpu >= (int)topology.cpuNodes.size()) return 0;
+    return topology.cpuNodes[cpu];
+}
+
+//--------------------------------------------------------------
+int ofxNuma::getCurrentNode()
+{
+#if defined(TARGET_LINUX)
+    return getNodeOfCpu(sched_getcpu());
+#elif defined(TARGET_WIN32)
+    PROCESSOR_NUMBER processor;
+    GetCurrentProcessorNumberEx(&processor);
+    USHORT node = 0;
+    GetNumaProcessorNodeEx(&processor, &node);
+    return node;
+#else
+    return 0;
+#endif
+}
+
+//--------------------------------------------------------------
+void ofxNuma::setThreadPinning(ofxThreadPinning pinning)
+{
+    if (pinningPolicy.exchange(pinning) != pinning) {
+        ++pinningGeneration;
+    }
+}
+
+//--------------------------------------------------------------
+ofxThreadPinning ofxNuma::getThreadPinning()
+{
+    return (ofxThreadPinning)pinningPolicy.load();
+}
+
+//--------------------------------------------------------------
+void ofxNuma::applyThreadPinning()
+{
+    int generation = pinningGeneration.load();
+    if (generation == appliedGeneration) return;
+    appliedGeneration = generation;
+
+    ofxThreadPinning pinning = getThreadPinning();
+#ifdef _OPENMP
+#pragma omp parallel
+    {
+        int cpu = getPinnedCpu(pinning, omp_get_thread_num());
+        if (cpu < 0) {
+            unpinCurrentThread();
+        }
+        else {
+            pinCurrentThread(cpu);
+        }
+    }
+#else
+    // Without OpenMP the pool is not ours to pin (GCD on OS X).
+    (void)pinning;
+#endif
+}
+
+//--------------------------------------------------------------
+int ofxNuma::getPinnedCpu(ofxThreadPinning pinning, int threadIndex)
+{
+    const Topology& topology = getTopology();
+    switch (pinning)
+    {
+        case OFX_THREAD_PINNING_COMPACT:
+            return topology.compactCpus[threadIndex % topology.compactCpus.size()];
+
+        case OFX_THREAD_PINNING_SCATTER:
+        {
+            const vector<int>& cpus = topology.nodeCpus[threadIndex % topology.nodeCpus.size()];
+            return cpus[(threadIndex / topology.nodeCpus.size()) % cpus.size()];
+        }
+
+        default:
+            return -1;
+    }
+}
+
+//--------------------------------------------------------------
+bool ofxNuma::pinCurrentThread(int cpu)
+{
+#if defined(TARGET_LINUX)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#elif defined(TARGET_WIN32)
+    return SetThreadAffinityMask(GetCurrentThread(), 1ull << cpu) != 0;
+#else
+    return false;
+#endif
+}
+
+//--------------------------------------------------------------
+void ofxNuma::unpinCurrentThread()
+{
+#if defined(TARGET_LINUX)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : getTopology().compactCpus) {
+        CPU_SET(cpu, &set);
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#elif defined(TARGET_WIN32)
+    DWORD_PTR processMask, systemMask;
+    if (GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask)) {
+        SetThreadAffinityMask(GetCurrentThread(), processMask);
+    }
+#endif
+}
+
+//--------------------------------------------------------------
+void* ofxNuma::allocate(size_t bytes)
+{
+    if (bytes == 0) return nullptr;
+
+#if defined(TARGET_WIN32)
+    return VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    // Anonymous mappings are backed lazily, nothing is placed until touched.
+    void* ptr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        ofLogError("ofxNuma::allocate", "Could not map %zu bytes", bytes);
+        return nullptr;
+    }
+    return ptr;
+#endif
+}
+
+//--------------------------------------------------------------
+void ofxNuma::release(void* ptr, size_t bytes)
+{
+    if (ptr == nullptr) return;
+
+#if defined(TARGET_WIN32)
+    VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+    munmap(ptr, bytes);
+#endif
+}
+
+//--------------------------------------------------------------
+bool ofxNuma::bind(void* ptr, size_t bytes, int node)
+{
+#if defined(TARGET_LINUX) && defined(SYS_mbind)
+    // MPOL_PREFERRED, so an exhausted node spills over instead of failing.
+    static const int MPOL_PREFERRED_MODE = 1;
+    if (node < 0 || node >= 64) return false;
+
+    unsigned long mask = 1ul << node;
+    return syscall(SYS_mbind, ptr, bytes, MPOL_PREFERRED_MODE, &mask, sizeof(mask) * 8 + 1, 0) == 0;
+#else
+    return false;
+#endif
+}
+
+//--------------------------------------------------------------
+void ofxNuma::place(void* ptr, size_t numElements, size_t elementSize)
+{
+    if (ptr == nullptr || numElements == 0) return;
+
+    uint8_t* bytes = (uint8_t *)ptr;
+    const int numNodes = getNumNodes();
+
+    if (getThreadPinning() == OFX_THREAD_PINNING_NONE && numNodes > 1) {
+        // Threads wander, so just spread the array evenly over the nodes.
+        const size_t pageSize = getPageSize();
+        const size_t totalBytes = numElements * elementSize;
+        const size_t partBytes = ((totalBytes / numNodes + pageSize - 1) / pageSize) * pageSize;
+        for (int node = 0; node < numNodes; ++node) {
+            size_t begin = MIN(node * partBytes, totalBytes);
+            size_t end = MIN(begin + partBytes, totalBytes);
+            if (end > begin) {
+                bind(bytes + begin, end - begin, node);
+            }
+        }
+    }
+
+    applyThreadPinning();
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+    for (int64_t i = 0; i < (int64_t)numElements; ++i) {
+        memset(bytes + i * elementSize, 0, elementSize);
+    }
+#else
+    memset(bytes, 0, numElements * elementSize);
+#endif
+}
+
+//--------------------------------------------------------------
+int ofxNuma::runBandwidthBenchmark(size_t megabytes, int repetitions)
+{
+    const int numNodes = getNumNodes();
+    printf("nodes      %d\n", numNodes);
+    for (int node = 0; node < numNodes; ++node) {
+        printf("node %d     %d cpus\n", node, (int)getNodeCpus(node).size());
+    }
+
+#ifdef _OPENMP
+    const size_t numValues = megabytes * 1024 * 1024 / sizeof(double);
+    vector<vector<double>> readBandwidth(numNodes, vector<double>(numNodes, 0.0));
+    vector<vector<double>> writeBandwidth(numNodes, vector<double>(numNodes, 0.0));
+
+    for (int memoryNode = 0; memoryNode < numNodes; ++memoryNode) {
+        double* values = (double *)allocate(numValues * sizeof(double));
+        if (values == nullptr) return 1;
+        if (numNodes > 1 && !bind(values, numValues * sizeof(double), memoryNode)) {
+            ofLogWarning("ofxNuma::runBandwidthBenchmark", "Could not bind to node %d", memoryNode);
+        }
+        memset(values, 0, numValues * sizeof(double));
+
+        for (int cpuNode = 0; cpuNode < numNodes; ++cpuNode) {
+            const vector<int>& cpus = getNodeCpus(cpuNode);
+            double bestRead = 0.0, bestWrite = 0.0;
+            double sink = 0.0;
+
+#pragma omp parallel num_threads((int)cpus.size()) reduction(+:sink)
+            {
+                int thread = omp_get_thread_num();
+                int numThreads = omp_get_num_threads();
+                pinCurrentThread(cpus[thread % cpus.size()]);
+
+                size_t begin = numValues * thread / numThreads;
+                size_t end = numValues * (thread + 1) / numThreads;
+
+                for (int rep = 0; rep < repetitions; ++rep) {
+                    uint64_t startTime = 0;
+#pragma omp barrier
+#pragma omp master
+                    startTime = ofGetElapsedTimeMicros();
+
+                    double sum = 0.0;
+                    for (size_t i = begin; i < end; ++i) {
+                        sum += values[i];
+                    }
+                    sink += sum;
+
+#pragma omp barrier
+#pragma omp master
+                    {
+                        double seconds = MAX(ofGetElapsedTimeMicros() - startTime, (uint64_t)1) / 1000000.0;
+                        bestRead = MAX(bestRead, numValues * sizeof(double) / seconds / 1e9);
+                        startTime = ofGetElapsedTimeMicros();
+                    }
+#pragma omp barrier
+
+                    for (size_t i = begin; i < end; ++i) {
+                        values[i] = (double)rep;
+                    }
+
+#pragma omp barrier
+#pragma omp master
+                    {
+                        double seconds = MAX(ofGetElapsedTimeMicros() - startTime, (uint64_t)1) / 1000000.0;
+                        bestWrite = MAX(bestWrite, numValues * sizeof(double) / seconds / 1e9);
+                    }
+                }
+
+                unpinCurrentThread();
+            }
+
+            // Keeps the reads from being optimized away.
+            if (sink < 0.0) printf(" ");
+
+            readBandwidth[cpuNode][memoryNode] = bestRead;
+            writeBandwidth[cpuNode][memoryNode] = bestWrite;
+        }
+
+        release(values, numValues * sizeof(double));
+    }
+
+    // The pools were repinned above, make the next applyThreadPinning() restore them.
+    ++pinningGeneration;
+
+    const char* names[2] = { "read", "write" };
+    const vector<vector<double>>* tables[2] = { &readBandwidth, &writeBandwidth };
+    for (int t = 0; t < 2; ++t) {
+        printf("\n%s GB/s (rows: cpu node, columns: memory node, %zu MB)\n", names[t], megabytes);
+        printf("       ");
+        for (int memoryNode = 0; memoryNode < numNodes; ++memoryNode) {
+            printf("  %8s", ("mem " + ofToString(memoryNode)).c_str());
+        }
+        printf("\n");
+        for (int cpuNode = 0; cpuNode < numNodes; ++cpuNode) {
+            printf("%-7s", ("cpu " + ofToString(cpuNode)).c_str());
+            for (int memoryNode = 0; memoryNode < numNodes; ++memoryNode) {
+                printf("  %8.2f", (*tables[t])[cpuNode][memoryNode]);
+            }
+            printf("\n");
+        }
+    }
+    return 0;
+#else
+    printf("OpenMP is not available, nothing to measure\n");
+    return 0;
+#endif
+}
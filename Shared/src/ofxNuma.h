@@ -0,0 +1,87 @@
+//
+//  ofxNuma.h
+//  Shared
+//
+//  NUMA topology, thread pinning and memory placement for the CPU simulations.
+//  Linux allocates a page on the node of the thread that first writes to it, so
+//  arrays are allocated untouched and then placed: either touched in parallel
+//  with the same static schedule the simulation loops use (so each pinned
+//  thread owns the pages it will stream through), or split into one contiguous
+//  part per node when threads are not pinned.
+//
+//  Everything degrades to a single node on platforms without NUMA support.
+//
+
+#pragma once
+
+#include "ofMain.h"
+
+enum ofxThreadPinning
+{
+    OFX_THREAD_PINNING_NONE,     // let the OS schedule threads
+    OFX_THREAD_PINNING_COMPACT,  // fill the CPUs of one node before the next
+    OFX_THREAD_PINNING_SCATTER,  // round-robin threads across nodes
+
+    OFX_NUM_THREAD_PINNINGS
+};
+
+class ofxNuma
+{
+public:
+    static int getNumNodes();
+    static int getNumCpus();
+    static const vector<int>& getNodeCpus(int node);
+    static int getNodeOfCpu(int cpu);
+
+    // Node the calling thread is currently running on.
+    static int getCurrentNode();
+
+    // Sets the policy for the worker threads of the OpenMP pool. Pools belong
+    // to the thread that starts the parallel regions, so each simulation
+    // thread must call applyThreadPinning() before its parallel work.
+    static void setThreadPinning(ofxThreadPinning pinning);
+    static ofxThreadPinning getThreadPinning();
+
+    // Pins the calling thread's pool to the current policy if it changed.
+    static void applyThreadPinning();
+
+    // CPU that worker threadIndex is pinned to, -1 for none.
+    static int getPinnedCpu(ofxThreadPinning pinning, int threadIndex);
+    static bool pinCurrentThread(int cpu);
+    static void unpinCurrentThread();
+
+    // Page aligned memory whose pages have not been touched yet.
+    static void* allocate(size_t bytes);
+    static void release(void* ptr, size_t bytes);
+
+    // Places and zeroes numElements elements of elementSize bytes. With pinned
+    // threads the pages are first touched by the thread that processes them in
+    // a static schedule, otherwise the array is bound to one contiguous
+    // partition per node.
+    static void place(void* ptr, size_t numElements, size_t elementSize);
+
+    // Binds [ptr, ptr + bytes) to node, returns false if unsupported.
+    static bool bind(void* ptr, size_t bytes, int node);
+
+    // Streams a buffer on every node from threads pinned to every node and
+    // prints a node-by-node bandwidth table. Returns the process exit code.
+    static int runBandwidthBenchmark(size_t megabytes = 256, int repetitions = 5);
+};
+
+//--------------------------------------------------------------
+template<typename T>
+T* ofxNumaAllocArray(size_t count)
+{
+    T* data = (T *)ofxNuma::allocate(count * sizeof(T));
+    if (data) {
+        ofxNuma::place(data, count, sizeof(T));
+    }
+    return data;
+}
+
+//--------------------------------------------------------------
+template<typename T>
+void ofxNumaFreeArray(T* data, size_t count)
+{
+    ofxNuma::release(data, count * sizeof(T));
+}
@@ -0,0 +1,283 @@
+//
+//  ofxProfiler.cpp
+//  Shared
+//
+
+#include "ofxProfiler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+
+namespace
+{
+    // The timer id sits in the top bits of the duration word, so a sample is
+    // written with two stores.
+    const int TIMER_SHIFT = 48;
+    const uint64_t DURATION_MASK = (1ull << TIMER_SHIFT) - 1;
+
+    struct Sample
+    {
+        std::atomic<uint64_t> endTime;
+        std::atomic<uint64_t> timerAndDuration;
+    };
+
+    struct ThreadRing
+    {
+        int threadIndex;
+
+        // Samples written so far, the newest RING_SIZE are still in the ring.
+        std::atomic<uint64_t> head;
+        Sample samples[ofxProfiler::RING_SIZE];
+    };
+
+    struct Registry
+    {
+        // Only taken to register timers and threads, and to list them.
+        std::mutex mutex;
+        vector<string> timerNames;
+        vector<std::unique_ptr<ThreadRing>> rings;
+
+        // Samples that ended before this are ignored.
+        std::atomic<uint64_t> clearTime;
+    };
+
+    //--------------------------------------------------------------
+    Registry& getRegistry()
+    {
+        static Registry registry;
+        return registry;
+    }
+
+    thread_local ThreadRing* t_ring = nullptr;
+
+    //--------------------------------------------------------------
+    ThreadRing* createRing()
+    {
+        Registry& registry = getRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+
+        // Rings outlive their threads, the samples stay readable.
+        registry.rings.emplace_back(new ThreadRing());
+        ThreadRing* ring = registry.rings.back().get();
+        ring->threadIndex = (int)registry.rings.size() - 1;
+        ring->head.store(0, std::memory_order_relaxed);
+        return ring;
+    }
+
+    struct SnapshotSample
+    {
+        int threadIndex;
+        int timerId;
+        uint64_t endTime;
+        uint64_t duration;
+    };
+
+    //--------------------------------------------------------------
+    // Copies every sample still in the rings that ended after minEndTime.
+    void snapshot(vector<SnapshotSample>& samples, vector<string>& timerNames, uint64_t minEndTime)
+    {
+        Registry& registry = getRegistry();
+
+        vector<ThreadRing*> rings;
+        {
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            timerNames = registry.timerNames;
+            for (auto& ring : registry.rings) {
+                rings.push_back(ring.get());
+            }
+        }
+
+        minEndTime = MAX(minEndTime, registry.clearTime.load(std::memory_order_relaxed));
+
+        samples.clear();
+        for (ThreadRing* ring : rings) {
+            uint64_t head = ring->head.load(std::memory_order_acquire);
+            uint64_t first = (head > ofxProfiler::RING_SIZE) ? head - ofxProfiler::RING_SIZE : 0;
+
+            size_t begin = samples.size();
+            for (uint64_t i = first; i < head; ++i) {
+                const Sample& sample = ring->samples[i % ofxProfiler::RING_SIZE];
+                SnapshotSample copy;
+                copy.threadIndex = ring->threadIndex;
+                copy.endTime = sample.endTime.load(std::memory_order_relaxed);
+                uint64_t word = sample.timerAndDuration.load(std::memory_order_relaxed);
+                copy.timerId = (int)(word >> TIMER_SHIFT);
+                copy.duration = word & DURATION_MASK;
+                samples.push_back(copy);
+            }
+
+            // The writer kept going while we copied. Anything it may have
+            // started to overwrite since is dropped.
+            std::atomic_thread_fence(std::memory_order_acquire);
+            uint64_t headAfter = ring->head.load(std::memory_order_relaxed);
+            uint64_t firstValid = (headAfter + 1 > ofxProfiler::RING_SIZE) ? headAfter + 1 - ofxProfiler::RING_SIZE : 0;
+            size_t numDropped = (size_t)(MAX(firstValid, first) - first);
+            numDropped = MIN(numDropped, samples.size() - begin);
+            samples.erase(samples.begin() + begin, samples.begin() + begin + numDropped);
+        }
+
+        samples.erase(std::remove_if(samples.begin(), samples.end(), [&](const SnapshotSample& sample) {
+            return sample.endTime < minEndTime || sample.timerId >= (int)timerNames.size();
+        }), samples.end());
+    }
+
+    //--------------------------------------------------------------
+    uint64_t getWindowStart(float windowSeconds)
+    {
+        double window = MAX(windowSeconds, 0.0f) * 1e9;
+        uint64_t time = ofxProfiler::now();
+        return (window < (double)time) ? time - (uint64_t)window : 0;
+    }
+}
+
+std::atomic<bool> ofxProfiler::_bEnabled(true);
+
+//--------------------------------------------------------------
+int ofxProfiler::registerTimer(const string& name)
+{
+    Registry& registry = getRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    for (size_t i = 0; i < registry.timerNames.size(); ++i) {
+        if (registry.timerNames[i] == name) return (int)i;
+    }
+    registry.timerNames.push_back(name);
+    return (int)registry.timerNames.size() - 1;
+}
+
+//--------------------------------------------------------------
+void ofxProfiler::setEnabled(bool enabled)
+{
+    _bEnabled.store(enabled, std::memory_order_relaxed);
+}
+
+//--------------------------------------------------------------
+uint64_t ofxProfiler::now()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//--------------------------------------------------------------
+void ofxProfiler::record(int timerId, uint64_t startTime, uint64_t endTime)
+{
+    ThreadRing* ring = t_ring;
+    if (ring == nullptr) {
+        ring = t_ring = createRing();
+    }
+
+    uint64_t duration = MIN(endTime - startTime, DURATION_MASK);
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    Sample& sample = ring->samples[head % RING_SIZE];
+    sample.endTime.store(endTime, std::memory_order_relaxed);
+    sample.timerAndDuration.store(((uint64_t)timerId << TIMER_SHIFT) | duration, std::memory_order_relaxed);
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+//--------------------------------------------------------------
+void ofxProfiler::getStats(vector<Stats>& stats, float windowSeconds)
+{
+    vector<SnapshotSample> samples;
+    vector<string> timerNames;
+    snapshot(samples, timerNames, getWindowStart(windowSeconds));
+
+    vector<vector<uint64_t>> durations(timerNames.size());
+    for (auto& sample : samples) {
+        durations[sample.timerId].push_back(sample.duration);
+    }
+
+    stats.clear();
+    for (size_t i = 0; i < timerNames.size(); ++i) {
+        vector<uint64_t>& values = durations[i];
+        if (values.empty()) continue;
+
+        std::sort(values.begin(), values.end());
+
+        // Nearest rank.
+        auto percentile = [&](double p) {
+            size_t rank = (size_t)ceil(p * values.size());
+            return values[MIN(MAX(rank, (size_t)1), values.size()) - 1] * 1e-6;
+        };
+
+        double total = 0.0;
+        for (auto value : values) {
+            total += value;
+        }
+
+        Stats timer;
+        timer.name = timerNames[i];
+        timer.count = values.size();
+        timer.mean = total / values.size() * 1e-6;
+        timer.p50 = percentile(0.50);
+        timer.p90 = percentile(0.90);
+        timer.p99 = percentile(0.99);
+        timer.max = values.back() * 1e-6;
+        stats.push_back(timer);
+    }
+}
+
+//--------------------------------------------------------------
+void ofxProfiler::clear()
+{
+    getRegistry().clearTime.store(now(), std::memory_order_relaxed);
+}
+
+//--------------------------------------------------------------
+void ofxProfiler::writeStatsCSV(ostream& out, float windowSeconds)
+{
+    vector<Stats> stats;
+    getStats(stats, windowSeconds);
+
+    out << "timer,count,mean_ms,p50_ms,p90_ms,p99_ms,max_ms\n";
+    for (auto& timer : stats) {
+        out << timer.name << ',' << timer.count << ',' << timer.mean << ','
+            << timer.p50 << ',' << timer.p90 << ',' << timer.p99 << ',' << timer.max << '\n';
+    }
+}
+
+//--------------------------------------------------------------
+void ofxProfiler::writeSamplesCSV(ostream& out)
+{
+    vector<SnapshotSample> samples;
+    vector<string> timerNames;
+    snapshot(samples, timerNames, 0);
+
+    std::sort(samples.begin(), samples.end(), [](const SnapshotSample& a, const SnapshotSample& b) {
+        return a.endTime < b.endTime;
+    });
+
+    out << "thread,timer,start_us,duration_us\n";
+    for (auto& sample : samples) {
+        out << sample.threadIndex << ',' << timerNames[sample.timerId] << ','
+            << (sample.endTime - sample.duration) * 1e-3 << ',' << sample.duration * 1e-3 << '\n';
+    }
+}
+
+//--------------------------------------------------------------
+bool ofxProfiler::writeCSV(const string& path, bool bSamples, float windowSeconds)
+{
+    std::ofstream file(ofToDataPath(path, true).c_str());
+    if (!file) {
+        ofLogError("ofxProfiler::writeCSV", "Could not open %s", path.c_str());
+        return false;
+    }
+
+    if (bSamples) writeSamplesCSV(file);
+    else writeStatsCSV(file, windowSeconds);
+
+    return (bool)file;
+}
+
+//--------------------------------------------------------------
+void ofxProfiler::draw(float x, float y, float windowSeconds)
+{
+    vector<Stats> stats;
+    getStats(stats, windowSeconds);
+
+    ofDrawBitmapString(ofVAArgsToString("%-20s %7s %8s %8s %8s %8s", "timer (ms)", "count", "mean", "p50", "p99", "max"), x, y);
+    for (auto& timer : stats) {
+        y += 14;
+        ofDrawBitmapString(ofVAArgsToString("%-20s %7llu %8.3f %8.3f %8.3f %8.3f", timer.name.c_str(), (unsigned long long)timer.count, timer.mean, timer.p50, timer.p99, timer.max), x, y);
+    }
+}
@@ -0,0 +1,104 @@
+//
+//  ofxProfiler.h
+//  Shared
+//
+//  Scoped timers for the simulation loops. Every thread records into its own
+//  fixed size ring buffer, so recording is a couple of relaxed stores and never
+//  takes a lock. Readers snapshot the rings without stopping the writers and
+//  drop whatever was overwritten while they copied. Statistics are rolling: only
+//  samples that ended within the window count.
+//
+//      void step()
+//      {
+//          OFX_PROFILE_SCOPE("step");
+//          ...
+//      }
+//
+
+#pragma once
+
+#include "ofMain.h"
+
+#include <atomic>
+
+class ofxProfiler
+{
+public:
+    struct Stats
+    {
+        string name;
+        uint64_t count;
+
+        // Milliseconds.
+        double mean;
+        double p50;
+        double p90;
+        double p99;
+        double max;
+    };
+
+    // Samples kept per thread before the oldest are overwritten.
+    static const int RING_SIZE = 4096;
+
+    // Timers are registered once and referred to by id afterwards. Registering
+    // an existing name returns its id.
+    static int registerTimer(const string& name);
+
+    static void setEnabled(bool enabled);
+    static bool isEnabled()
+    { return _bEnabled.load(std::memory_order_relaxed); }
+
+    // Nanoseconds on a monotonic clock.
+    static uint64_t now();
+
+    static void record(int timerId, uint64_t startTime, uint64_t endTime);
+
+    // Stats of every timer with samples in the last windowSeconds, sorted by
+    // registration order.
+    static void getStats(vector<Stats>& stats, float windowSeconds = 2.0f);
+
+    // Forgets all samples, timers stay registered.
+    static void clear();
+
+    // One row per timer: name, count, mean, p50, p90, p99 and max in ms.
+    static void writeStatsCSV(ostream& out, float windowSeconds = 2.0f);
+    // One row per sample still in the rings: thread, name, start and duration.
+    static void writeSamplesCSV(ostream& out);
+    static bool writeCSV(const string& path, bool bSamples = false, float windowSeconds = 2.0f);
+
+    // Text table of getStats(), top left corner at (x, y).
+    static void draw(float x, float y, float windowSeconds = 2.0f);
+
+private:
+    static std::atomic<bool> _bEnabled;
+};
+
+//--------------------------------------------------------------
+class ofxProfilerScope
+{
+public:
+    ofxProfilerScope(int timerId)
+    : _timerId(timerId)
+    , _startTime(ofxProfiler::isEnabled() ? ofxProfiler::now() : 0)
+    {}
+
+    ~ofxProfilerScope()
+    {
+        if (_startTime) {
+            ofxProfiler::record(_timerId, _startTime, ofxProfiler::now());
+        }
+    }
+
+private:
+    int _timerId;
+    uint64_t _startTime;
+};
+
+#define OFX_PROFILE_CONCAT_(a, b) a##b
+#define OFX_PROFILE_CONCAT(a, b) OFX_PROFILE_CONCAT_(a, b)
+
+// Times the rest of the enclosing scope. The name is registered the first time
+// the line runs.
+#define OFX_PROFILE_SCOPE(name) \
+    static const int OFX_PROFILE_CONCAT(ofxProfilerTimer_, __LINE__) = ofxProfiler::registerTimer(name); \
+    ofxProfilerScope OFX_PROFILE_CONCAT(ofxProfilerScope_, __LINE__)(OFX_PROFILE_CONCAT(ofxProfilerTimer_, __LINE__))
@@ -0,0 +1,237 @@
+//
+//  ofxSpaceFillingCurve.cpp
+//  Shared
+//
+
+#include "ofxSpaceFillingCurve.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace
+{
+    //--------------------------------------------------------------
+    inline uint64_t expandBits(uint64_t v)
+    {
+        v = (v | (v << 32)) & 0x001F00000000FFFFull;
+        v = (v | (v << 16)) & 0x001F0000FF0000FFull;
+        v = (v | (v <<  8)) & 0x100F00F00F00F00Full;
+        v = (v | (v <<  4)) & 0x10C30C30C30C30C3ull;
+        v = (v | (v <<  2)) & 0x1249249249249249ull;
+        return v;
+    }
+
+    //--------------------------------------------------------------
+    int getNumThreads()
+    {
+#ifdef _OPENMP
+        return omp_get_max_threads();
+#else
+        return 1;
+#endif
+    }
+}
+
+//--------------------------------------------------------------
+uint64_t ofxMortonKey(uint32_t x, uint32_t y, uint32_t z)
+{
+    return (expandBits(x) << 2) | (expandBits(y) << 1) | expandBits(z);
+}
+
+//--------------------------------------------------------------
+uint64_t ofxHilbertKey(uint32_t x, uint32_t y, uint32_t z)
+{
+    // Skilling's transform ("Programming the Hilbert curve", 2004): turns the
+    // coordinates into the transposed Hilbert index, whose bits interleave the
+    // same way as a Morton key.
+    uint32_t axes[3] = { x, y, z };
+    const uint32_t highBit = 1u << (OFX_CURVE_BITS - 1);
+
+    for (uint32_t q = highBit; q > 1; q >>= 1) {
+        uint32_t p = q - 1;
+        for (int i = 0; i < 3; ++i) {
+            if (axes[i] & q) {
+                axes[0] ^= p;
+            }
+            else {
+                uint32_t t = (axes[0] ^ axes[i]) & p;
+                axes[0] ^= t;
+                axes[i] ^= t;
+            }
+        }
+    }
+
+    // Gray encode.
+    axes[1] ^= axes[0];
+    axes[2] ^= axes[1];
+    uint32_t t = 0;
+    for (uint32_t q = highBit; q > 1; q >>= 1) {
+        if (axes[2] & q) t ^= q - 1;
+    }
+    for (int i = 0; i < 3; ++i) {
+        axes[i] ^= t;
+    }
+
+    return ofxMortonKey(axes[0], axes[1], axes[2]);
+}
+
+//--------------------------------------------------------------
+void ofxComputeCurveKeys(const float* points, size_t stride, size_t numPoints, ofxSpaceFillingCurve curve, uint64_t* keys, uint32_t* indices)
+{
+    if (numPoints == 0) return;
+
+    // Per thread bounds, merged below.
+    const int numThreads = getNumThreads();
+    vector<float> threadBounds(numThreads * 6);
+    for (int t = 0; t < numThreads; ++t) {
+        for (int k = 0; k < 3; ++k) {
+            threadBounds[t * 6 + k] = threadBounds[t * 6 + 3 + k] = points[k];
+        }
+    }
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(numThreads)
+#endif
+    {
+#ifdef _OPENMP
+        const int thread = omp_get_thread_num();
+#else
+        const int thread = 0;
+#endif
+        float* bounds = &threadBounds[thread * 6];
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+        for (int64_t i = 0; i < (int64_t)numPoints; ++i) {
+            const float* point = &points[i * stride];
+            for (int k = 0; k < 3; ++k) {
+                bounds[k] = MIN(bounds[k], point[k]);
+                bounds[3 + k] = MAX(bounds[3 + k], point[k]);
+            }
+        }
+    }
+
+    float boundsMin[3], boundsMax[3];
+    for (int k = 0; k < 3; ++k) {
+        boundsMin[k] = threadBounds[k];
+        boundsMax[k] = threadBounds[3 + k];
+        for (int t = 1; t < numThreads; ++t) {
+            boundsMin[k] = MIN(boundsMin[k], threadBounds[t * 6 + k]);
+            boundsMax[k] = MAX(boundsMax[k], threadBounds[t * 6 + 3 + k]);
+        }
+    }
+
+    float size = 1e-6f;
+    for (int k = 0; k < 3; ++k) {
+        size = MAX(size, boundsMax[k] - boundsMin[k]);
+    }
+    const uint32_t maxCoord = (1u << OFX_CURVE_BITS) - 1;
+    const float cellsPerUnit = maxCoord / size;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (int64_t i = 0; i < (int64_t)numPoints; ++i) {
+        const float* point = &points[i * stride];
+        uint32_t coords[3];
+        for (int k = 0; k < 3; ++k) {
+            coords[k] = MIN((uint32_t)MAX((point[k] - boundsMin[k]) * cellsPerUnit, 0.0f), maxCoord);
+        }
+        keys[i] = (curve == OFX_CURVE_HILBERT) ? ofxHilbertKey(coords[0], coords[1], coords[2]) : ofxMortonKey(coords[0], coords[1], coords[2]);
+        indices[i] = (uint32_t)i;
+    }
+}
+
+//--------------------------------------------------------------
+void ofxRadixSortPairs(uint64_t* keys, uint32_t* values, size_t count, uint64_t* tempKeys, uint32_t* tempValues, int keyBits)
+{
+    static const int RADIX_BITS = 8;
+    static const int RADIX = 1 << RADIX_BITS;
+
+    if (count < 2) return;
+
+    const int numThreads = getNumThreads();
+    vector<size_t> histograms(numThreads * RADIX);
+
+    uint64_t* srcKeys = keys;
+    uint32_t* srcValues = values;
+    uint64_t* dstKeys = tempKeys;
+    uint32_t* dstValues = tempValues;
+
+    for (int shift = 0; shift < keyBits; shift += RADIX_BITS) {
+        bool bSkipPass = false;
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(numThreads)
+#endif
+        {
+#ifdef _OPENMP
+            const int thread = omp_get_thread_num();
+            const int teamSize = omp_get_num_threads();
+#else
+            const int thread = 0;
+            const int teamSize = 1;
+#endif
+            // Each thread counts and later scatters the same contiguous block,
+            // which keeps the sort stable.
+            const size_t begin = count * thread / teamSize;
+            const size_t end = count * (thread + 1) / teamSize;
+
+            size_t* histogram = &histograms[thread * RADIX];
+            std::fill(histogram, histogram + RADIX, 0);
+            for (size_t i = begin; i < end; ++i) {
+                ++histogram[(srcKeys[i] >> shift) & (RADIX - 1)];
+            }
+
+#ifdef _OPENMP
+#pragma omp barrier
+#pragma omp single
+#endif
+            {
+                // Turn the counts into scatter offsets, digit major then thread.
+                size_t offset = 0;
+                for (int digit = 0; digit < RADIX; ++digit) {
+                    size_t digitCount = 0;
+                    for (int t = 0; t < teamSize; ++t) {
+                        size_t n = histograms[t * RADIX + digit];
+                        histograms[t * RADIX + digit] = offset;
+                        offset += n;
+                        digitCount += n;
+                    }
+                    // All keys share this digit, nothing would move.
+                    if (digitCount == count) bSkipPass = true;
+                }
+            }
+
+            if (!bSkipPass) {
+                for (size_t i = begin; i < end; ++i) {
+                    size_t dst = histogram[(srcKeys[i] >> shift) & (RADIX - 1)]++;
+                    dstKeys[dst] = srcKeys[i];
+                    dstValues[dst] = srcValues[i];
+                }
+            }
+        }
+
+        if (!bSkipPass) {
+            std::swap(srcKeys, dstKeys);
+            std::swap(srcValues, dstValues);
+        }
+    }
+
+    if (srcKeys != keys) {
+        memcpy(keys, srcKeys, count * sizeof(uint64_t));
+        memcpy(values, srcValues, count * sizeof(uint32_t));
+    }
+}
+
+//--------------------------------------------------------------
+void ofxSortAlongCurve(const float* points, size_t stride, size_t numPoints, ofxSpaceFillingCurve curve, vector<uint32_t>& order)
+{
+    vector<uint64_t> keys(numPoints), tempKeys(numPoints);
+    vector<uint32_t> tempValues(numPoints);
+    order.resize(numPoints);
+
+    ofxComputeCurveKeys(points, stride, numPoints, curve, keys.data(), order.data());
+    ofxRadixSortPairs(keys.data(), order.data(), numPoints, tempKeys.data(), tempValues.data());
+}
@@ -0,0 +1,39 @@
+//
+//  ofxSpaceFillingCurve.h
+//  Shared
+//
+//  Space-filling curve keys for reordering simulation arrays, so that bodies
+//  close in space also sit close in memory. Keys use 21 bits per axis over the
+//  bounding cube of the points. Hilbert keys never jump between distant cells,
+//  Morton keys are cheaper to compute but do.
+//
+
+#pragma once
+
+#include "ofMain.h"
+
+enum ofxSpaceFillingCurve
+{
+    OFX_CURVE_MORTON,
+    OFX_CURVE_HILBERT,
+
+    OFX_NUM_CURVES
+};
+
+// Bits per axis of the keys below.
+static const int OFX_CURVE_BITS = 21;
+
+uint64_t ofxMortonKey(uint32_t x, uint32_t y, uint32_t z);
+uint64_t ofxHilbertKey(uint32_t x, uint32_t y, uint32_t z);
+
+// Keys of numPoints points, the first three floats of every stride floats,
+// computed in parallel. indices is filled with 0 to numPoints - 1, ready to be
+// sorted along with the keys.
+void ofxComputeCurveKeys(const float* points, size_t stride, size_t numPoints, ofxSpaceFillingCurve curve, uint64_t* keys, uint32_t* indices);
+
+// Stable parallel LSD radix sort of keys and their values, 8 bits per pass
+// over the low keyBits bits. The temp arrays must hold count entries.
+void ofxRadixSortPairs(uint64_t* keys, uint32_t* values, size_t count, uint64_t* tempKeys, uint32_t* tempValues, int keyBits = 3 * OFX_CURVE_BITS);
+
+// Fills order with the indices of the points sorted along the curve.
+void ofxSortAlongCurve(const float* points, size_t stride, size_t numPoints, ofxSpaceFillingCurve curve, vector<uint32_t>& order);